@@ -3,16 +3,70 @@
 #include "macros.h"
 #include "objects.h"
 
-int BVHFindNearestIntersection(const Ray ray, global Node2* node, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate) {
-
+/**
+ * With instancing, the top level leaves reference instances whose bottom level is traversed in their object space
+ * The nearest distance is shared by both levels as the transformed ray direction is not normalized
+ * instance_out is the instance of the returned object, -1 without instancing
+ * The quantized nodes are only sent for scenes without instances
+ */
+int BVHFindNearestIntersection(const Ray ray, global BVHNode* node, global Instance* instances, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate, int* instance_out) {
+
+    *instance_out = -1;
+
+#if defined(USE_QUANTIZED_BVH)
+    return TraverseQuantizedNode2(ray, node, objects, VERTEX_GEOM_DATA, t_near_candidate);
+#elif defined(USE_INSTANCING)
     FastRay fast_ray;
     fast_ray.origin = ray.origin;
     fast_ray.direction_inv = normalize(1.f / ray.direction);
 
-
     int node_idx = 0;
     int obj_index_candidate = -1;
 
+    while (node_idx != -1) {
+
+        float t_near;
+        if (IntersectBoundingBox(&node[node_idx].bbox, fast_ray, &t_near)) {
+
+            if (node[node_idx].obj_index != -1) {
+                int instance_end = node[node_idx].obj_index + node[node_idx].obj_count;
+                for (int i = node[node_idx].obj_index; i < instance_end; ++i) {
+                    Ray local_ray = TransformRay(&instances[i], ray);
+                    int obj_index = TraverseNode2(local_ray, node, instances[i].root_node, objects, VERTEX_GEOM_DATA, t_near_candidate);
+                    if (obj_index != -1) {
+                        obj_index_candidate = obj_index;
+                        *instance_out = i;
+                    }
+                }
+                node_idx = node[node_idx].bbox.max.w;
+            }
+            else {
+                node_idx = node[node_idx].left_child;
+            }
+        }
+        else {
+            node_idx = node[node_idx].bbox.max.w;
+        }
+    }
+
+    return obj_index_candidate;
+#else
+    return TraverseNode2(ray, node, 0, objects, VERTEX_GEOM_DATA, t_near_candidate);
+#endif
+}
+
+/**
+ * Stackless traversal from node_idx, each node stores in bbox.max.w the node to go to once it's done with
+ * @return The index of the nearest object hit closer than t_near_candidate, -1 if none
+ */
+int TraverseNode2(const Ray ray, global Node2* node, int node_idx, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate) {
+
+    FastRay fast_ray;
+    fast_ray.origin = ray.origin;
+    fast_ray.direction_inv = normalize(1.f / ray.direction);
+
+    int obj_index_candidate = -1;
+
 //    int count = 0;
 
     while (node_idx != -1) {
@@ -29,17 +83,20 @@ int BVHFindNearestIntersection(const Ray ray, global Node2* node, global Object3
 
             // If node is a leaf
             if (node[node_idx].obj_index != -1) {
-                // Intersect the contained object
-                if (IntersectObj(objects[node[node_idx].obj_index], VERTEX_GEOM_DATA, ray, &t_near) && (t_near < *t_near_candidate)) {
-                    *t_near_candidate = t_near;
-                    obj_index_candidate = node[node_idx].obj_index;
+                // Intersect the contained objects
+                int obj_end = node[node_idx].obj_index + node[node_idx].obj_count;
+                for (int i = node[node_idx].obj_index; i < obj_end; ++i) {
+                    if (IntersectObj(objects[i], VERTEX_GEOM_DATA, ray, &t_near) && (t_near < *t_near_candidate)) {
+                        *t_near_candidate = t_near;
+                        obj_index_candidate = i;
+                    }
                 }
                 // Whatever the result, go to this node, can be sibling or uncle
                 node_idx = node[node_idx].bbox.max.w;
             }
             // Else advance to next node in memory, guaranteed to be the first child
             else {
-                node_idx++;
+                node_idx = node[node_idx].left_child;
             }
         }
         // We didn't hit this node, so go to this node, can be sibling or uncle
@@ -51,6 +108,263 @@ int BVHFindNearestIntersection(const Ray ray, global Node2* node, global Object3
     return obj_index_candidate;
 }
 
+// Defined by the host from the depth of the encoded tree, its leaf splits can make it deeper than the BVH2
+#ifndef QUANTIZED_STACK_SIZE
+#define QUANTIZED_STACK_SIZE 88
+#endif
+
+/**
+ * Both children bounds of a node are decoded and tested together, the nearest one hit is visited first and the other pushed
+ * The leaf children are intersected right away as they have no node of their own
+ * @return The index of the nearest object hit closer than t_near_candidate, -1 if none
+ */
+int TraverseQuantizedNode2(const Ray ray, global QuantizedNode2* nodes, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate) {
+
+    // Not normalized, the children distances are compared to the nearest hit distance
+    FastRay fast_ray;
+    fast_ray.origin = ray.origin;
+    fast_ray.direction_inv = 1.f / ray.direction;
+
+    int stack[QUANTIZED_STACK_SIZE];
+    int stack_size = 0;
+    int node_idx = 0;
+
+    int obj_index_candidate = -1;
+
+    while (true) {
+
+        global QuantizedNode2* node = &nodes[node_idx];
+
+        float3 origin = vload3(0, node->origin);
+        // 2^exponent built from its bits
+        float3 scale = (float3)(as_float((node->exponent[0] + 127) << 23),
+                                as_float((node->exponent[1] + 127) << 23),
+                                as_float((node->exponent[2] + 127) << 23));
+
+        // Lanes: min of child 0 and 1, then max of child 0 and 1
+        float4 t_x = (DecodeQuantizedAxis(node->child_bounds[0], origin.x, scale.x) - fast_ray.origin.x) * fast_ray.direction_inv.x;
+        float4 t_y = (DecodeQuantizedAxis(node->child_bounds[1], origin.y, scale.y) - fast_ray.origin.y) * fast_ray.direction_inv.y;
+        float4 t_z = (DecodeQuantizedAxis(node->child_bounds[2], origin.z, scale.z) - fast_ray.origin.z) * fast_ray.direction_inv.z;
+
+        float2 t_nearest = fmax(fmax(fmin(t_x.lo, t_x.hi), fmin(t_y.lo, t_y.hi)), fmin(t_z.lo, t_z.hi));
+        float2 t_farthest = fmin(fmin(fmax(t_x.lo, t_x.hi), fmax(t_y.lo, t_y.hi)), fmax(t_z.lo, t_z.hi));
+
+        float child_dist[2] = {t_nearest.x, t_nearest.y};
+        bool child_hit[2] = {
+                (t_nearest.x <= t_farthest.x) && (t_farthest.x > 0) && (t_nearest.x < *t_near_candidate),
+                (t_nearest.y <= t_farthest.y) && (t_farthest.y > 0) && (t_nearest.y < *t_near_candidate)
+        };
+
+        for (int i = 0; i < 2; ++i) {
+
+            if (child_hit[i] && node->object_count[i] > 0) {
+                int obj_end = node->child[i] + node->object_count[i];
+                for (int j = node->child[i]; j < obj_end; ++j) {
+                    float t_near;
+                    if (IntersectObj(objects[j], VERTEX_GEOM_DATA, ray, &t_near) && (t_near < *t_near_candidate)) {
+                        *t_near_candidate = t_near;
+                        obj_index_candidate = j;
+                    }
+                }
+                child_hit[i] = false;
+            }
+        }
+
+        if (child_hit[0] && child_hit[1]) {
+            int nearest_child = (child_dist[1] < child_dist[0]) ? 1 : 0;
+            stack[stack_size++] = node->child[1 - nearest_child];
+            node_idx = node->child[nearest_child];
+        }
+        else if (child_hit[0] || child_hit[1]) {
+            node_idx = node->child[child_hit[0] ? 0 : 1];
+        }
+        else if (stack_size > 0) {
+            node_idx = stack[--stack_size];
+        }
+        else {
+            break;
+        }
+    }
+
+    return obj_index_candidate;
+}
+
+/**
+ * Any-hit query for shadow and visibility rays, true as soon as an object is hit closer than t_max
+ * Same node buffers as BVHFindNearestIntersection, the instance hit and the object index are not needed
+ */
+bool BVHOccluded(const Ray ray, global BVHNode* node, global Instance* instances, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max) {
+
+#if defined(USE_QUANTIZED_BVH)
+    return OccludedQuantizedNode2(ray, node, objects, VERTEX_GEOM_DATA, t_max);
+#elif defined(USE_INSTANCING)
+    FastRay fast_ray;
+    fast_ray.origin = ray.origin;
+    fast_ray.direction_inv = normalize(1.f / ray.direction);
+
+    int node_idx = 0;
+
+    while (node_idx != -1) {
+
+        float t_near;
+        if (IntersectBoundingBox(&node[node_idx].bbox, fast_ray, &t_near)) {
+
+            if (node[node_idx].obj_index != -1) {
+                int instance_end = node[node_idx].obj_index + node[node_idx].obj_count;
+                for (int i = node[node_idx].obj_index; i < instance_end; ++i) {
+                    Ray local_ray = TransformRay(&instances[i], ray);
+                    if (OccludedNode2(local_ray, node, instances[i].root_node, objects, VERTEX_GEOM_DATA, t_max))
+                        return true;
+                }
+                node_idx = node[node_idx].bbox.max.w;
+            }
+            else {
+                node_idx = node[node_idx].left_child;
+            }
+        }
+        else {
+            node_idx = node[node_idx].bbox.max.w;
+        }
+    }
+
+    return false;
+#else
+    return OccludedNode2(ray, node, 0, objects, VERTEX_GEOM_DATA, t_max);
+#endif
+}
+
+/**
+ * Stackless any-hit traversal from node_idx, it leaves at the first object hit closer than t_max
+ */
+bool OccludedNode2(const Ray ray, global Node2* node, int node_idx, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max) {
+
+    FastRay fast_ray;
+    fast_ray.origin = ray.origin;
+    fast_ray.direction_inv = normalize(1.f / ray.direction);
+
+    while (node_idx != -1) {
+
+        float t_near;
+        if (IntersectBoundingBox(&node[node_idx].bbox, fast_ray, &t_near)) {
+
+            if (node[node_idx].obj_index != -1) {
+                int obj_end = node[node_idx].obj_index + node[node_idx].obj_count;
+                for (int i = node[node_idx].obj_index; i < obj_end; ++i) {
+                    if (IntersectObj(objects[i], VERTEX_GEOM_DATA, ray, &t_near) && (t_near < t_max))
+                        return true;
+                }
+                node_idx = node[node_idx].bbox.max.w;
+            }
+            else {
+                node_idx = node[node_idx].left_child;
+            }
+        }
+        else {
+            node_idx = node[node_idx].bbox.max.w;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Any-hit traversal of the quantized nodes, the children hit are culled by t_max and visited in child order
+ */
+bool OccludedQuantizedNode2(const Ray ray, global QuantizedNode2* nodes, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max) {
+
+    // Not normalized, the children distances are compared to t_max
+    FastRay fast_ray;
+    fast_ray.origin = ray.origin;
+    fast_ray.direction_inv = 1.f / ray.direction;
+
+    int stack[QUANTIZED_STACK_SIZE];
+    int stack_size = 0;
+    int node_idx = 0;
+
+    while (true) {
+
+        global QuantizedNode2* node = &nodes[node_idx];
+
+        float3 origin = vload3(0, node->origin);
+        float3 scale = (float3)(as_float((node->exponent[0] + 127) << 23),
+                                as_float((node->exponent[1] + 127) << 23),
+                                as_float((node->exponent[2] + 127) << 23));
+
+        float4 t_x = (DecodeQuantizedAxis(node->child_bounds[0], origin.x, scale.x) - fast_ray.origin.x) * fast_ray.direction_inv.x;
+        float4 t_y = (DecodeQuantizedAxis(node->child_bounds[1], origin.y, scale.y) - fast_ray.origin.y) * fast_ray.direction_inv.y;
+        float4 t_z = (DecodeQuantizedAxis(node->child_bounds[2], origin.z, scale.z) - fast_ray.origin.z) * fast_ray.direction_inv.z;
+
+        float2 t_nearest = fmax(fmax(fmin(t_x.lo, t_x.hi), fmin(t_y.lo, t_y.hi)), fmin(t_z.lo, t_z.hi));
+        float2 t_farthest = fmin(fmin(fmax(t_x.lo, t_x.hi), fmax(t_y.lo, t_y.hi)), fmax(t_z.lo, t_z.hi));
+
+        bool child_hit[2] = {
+                (t_nearest.x <= t_farthest.x) && (t_farthest.x > 0) && (t_nearest.x < t_max),
+                (t_nearest.y <= t_farthest.y) && (t_farthest.y > 0) && (t_nearest.y < t_max)
+        };
+
+        for (int i = 0; i < 2; ++i) {
+
+            if (child_hit[i] && node->object_count[i] > 0) {
+                int obj_end = node->child[i] + node->object_count[i];
+                for (int j = node->child[i]; j < obj_end; ++j) {
+                    float t_near;
+                    if (IntersectObj(objects[j], VERTEX_GEOM_DATA, ray, &t_near) && (t_near < t_max))
+                        return true;
+                }
+                child_hit[i] = false;
+            }
+        }
+
+        if (child_hit[0] && child_hit[1]) {
+            stack[stack_size++] = node->child[1];
+            node_idx = node->child[0];
+        }
+        else if (child_hit[0] || child_hit[1]) {
+            node_idx = node->child[child_hit[0] ? 0 : 1];
+        }
+        else if (stack_size > 0) {
+            node_idx = stack[--stack_size];
+        }
+        else {
+            break;
+        }
+    }
+
+    return false;
+}
+
+// fma rounds like the host encoding, which relies on it to be conservative, where the relaxed math mad may not
+float4 DecodeQuantizedAxis(const global uchar* quantized, float origin, float scale) {
+    return fma(convert_float4(vload4(0, quantized)), (float4)(scale), (float4)(origin));
+}
+
+Ray TransformRay(const global Instance* instance, const Ray ray) {
+
+    Ray local_ray;
+    local_ray.origin = TransformPoint(instance, ray.origin);
+    local_ray.direction = (float3)(dot(instance->world_to_object[0].xyz, ray.direction),
+                                   dot(instance->world_to_object[1].xyz, ray.direction),
+                                   dot(instance->world_to_object[2].xyz, ray.direction));
+    return local_ray;
+}
+
+float3 TransformPoint(const global Instance* instance, const float3 point) {
+
+    float4 p = (float4)(point, 1.f);
+
+    return (float3)(dot(instance->world_to_object[0], p),
+                    dot(instance->world_to_object[1], p),
+                    dot(instance->world_to_object[2], p));
+}
+
+// Object space normal to world space, multiplied by the transpose of the world to object matrix
+float3 TransformNormal(const global Instance* instance, const float3 normal) {
+
+    return instance->world_to_object[0].xyz * normal.x
+         + instance->world_to_object[1].xyz * normal.y
+         + instance->world_to_object[2].xyz * normal.z;
+}
+
 #if 1
 bool IntersectBoundingBox(const global BoundingBox* this, const FastRay ray, float* dist_out) {
 
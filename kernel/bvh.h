@@ -17,14 +17,50 @@ typedef struct Node {
 typedef struct Node2 {
     BoundingBox bbox;
     int obj_index;
+    int obj_count;
+    int left_child;     // The right child follows it, their place depends on the node layout
+    int right_child;
 } Node2;
 
+// Bounds of the two children quantized in the frame of the node, see QuantizedNode2 in BVHCommons.h
+typedef struct QuantizedNode2 {
+    float origin[3];            // Min corner of the node bounds
+    char exponent[3];           // Quantization step of each axis, as a power of 2
+    char pad;
+    uchar child_bounds[3][4];   // Per axis: min of child 0 and 1, then max of child 0 and 1
+    uchar object_count[2];      // 0 for an internal child
+    char pad2[2];
+    int child[2];               // Internal child: node index, Leaf child: index of its first object
+} QuantizedNode2;
+
+// Node type of the buffer sent by the host
+#ifdef USE_QUANTIZED_BVH
+typedef QuantizedNode2 BVHNode;
+#else
+typedef Node2 BVHNode;
+#endif
+
+// Placement of a bottom level BVH, the rays are moved to its object space
+typedef struct Instance {
+    float4 world_to_object[3];  // First 3 rows of the matrix
+    int root_node;              // Root of the bottom level in the node array
+} Instance;
+
 typedef struct QueueNode {
     global Node* node;
     float t_near;
 } QueueNode;
 
-int BVHFindNearestIntersection(const Ray ray, global Node2* root_node, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate);
+int BVHFindNearestIntersection(const Ray ray, global BVHNode* root_node, global Instance* instances, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate, int* instance_out);
+int TraverseNode2(const Ray ray, global Node2* node, int node_idx, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate);
+int TraverseQuantizedNode2(const Ray ray, global QuantizedNode2* nodes, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* t_near_candidate);
+bool BVHOccluded(const Ray ray, global BVHNode* root_node, global Instance* instances, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max);
+bool OccludedNode2(const Ray ray, global Node2* node, int node_idx, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max);
+bool OccludedQuantizedNode2(const Ray ray, global QuantizedNode2* nodes, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float t_max);
+float4 DecodeQuantizedAxis(const global uchar* quantized, float origin, float scale);
+Ray TransformRay(const global Instance* instance, const Ray ray);
+float3 TransformPoint(const global Instance* instance, const float3 point);
+float3 TransformNormal(const global Instance* instance, const float3 normal);
 bool IntersectBoundingBox(const global BoundingBox* this, const FastRay ray, float* dist_out);
 
 #endif
\ No newline at end of file
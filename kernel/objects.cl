@@ -72,34 +72,31 @@ bool IntersectPlane(const Object3D obj, const Ray ray, float* dist_out) {
     return dist_to_plane_origin <= 4;
 }
 
-#define _origin A
+// Möller-Trumbore, two-sided, same test as the C++ TriangleRecord
 bool IntersectTriangle(const Object3D obj, VERTEX_GEOM_DATA_ARGS, const Ray ray, float* dist_out) {
 
     float3 A = pos_array[obj.A_index];
-    float3 B = pos_array[obj.B_index];
-    float3 C = pos_array[obj.C_index];
+    float3 edge1 = pos_array[obj.B_index] - A;
+    float3 edge2 = pos_array[obj.C_index] - A;
 
-    float3 normal = normalize(cross(B - A, C - A));
-//    float3 _origin = A;
-    // Using the opposite of the plane normal
-    float denominator = 1.f / dot(-normal, ray.direction);
+    float3 p = cross(ray.direction, edge2);
+    float determinant = dot(edge1, p);
 
-    // For single-sided intersection: don't intersect if normal is pointing away from the ray
-//    if (denominator <= 0)
-//        return false;
+    // The ray is parallel to the triangle plane
+    if (determinant == 0)
+        return false;
 
-    *dist_out = dot(-normal, _origin - ray.origin) * denominator;
+    float inv_determinant = 1.f / determinant;
 
-    if (*dist_out <= 0.000001f)
-        return false;
+    float3 origin_to_vertex = ray.origin - A;
+    float u = dot(origin_to_vertex, p) * inv_determinant;
 
-    float3 hit_pos = ray.origin + ray.direction * *dist_out;
+    float3 q = cross(origin_to_vertex, edge1);
+    float v = dot(ray.direction, q) * inv_determinant;
 
-    bool is_left_of_AB = dot(cross(B - A, hit_pos - A), normal) > 0;
-    bool is_left_of_BC = dot(cross(C - B, hit_pos - B), normal) > 0;
-    bool is_left_of_CA = dot(cross(A - C, hit_pos - C), normal) > 0;
+    *dist_out = dot(edge2, q) * inv_determinant;
 
-    return is_left_of_AB && is_left_of_BC && is_left_of_CA;
+    return (u >= 0) && (v >= 0) && (u + v <= 1) && (*dist_out > 0.000001f);
 }
 
 void GetTriangleData(const Object3D obj, const float3 hit_pos, float3* normal_out, float2* uv_out, VERTEX_DATA_ARGS) {
@@ -121,14 +118,38 @@ void GetTriangleData(const Object3D obj, const float3 hit_pos, float3* normal_ou
     float V = ABP_area / ABC_area; // C
     float W = BCP_area / ABC_area; // A
 
+#ifdef USE_COMPACT_VERTICES
+    *normal_out = (U * DecodeOctahedral(normal_array[obj.B_index])) + (V * DecodeOctahedral(normal_array[obj.C_index])) + (W * DecodeOctahedral(normal_array[obj.A_index]));
+#else
     *normal_out = ((U * normal_array[obj.B_index]) + (V * normal_array[obj.C_index]) + (W * normal_array[obj.A_index])).xyz;
+#endif
     *normal_out = normalize(*normal_out);
 
     if (obj.has_uv) {
+#ifdef USE_COMPACT_VERTICES
+        *uv_out = ((U * vload_half2(obj.B_index, uv_array)) + (V * vload_half2(obj.C_index, uv_array)) + (W * vload_half2(obj.A_index, uv_array)));
+#else
         *uv_out = ((U * uv_array[obj.B_index]) + (V * uv_array[obj.C_index]) + (W * uv_array[obj.A_index]));
+#endif
     }
 }
 
+#ifdef USE_COMPACT_VERTICES
+// Same layout as the host side EncodeOctahedral, x in the low 16 bits
+float3 DecodeOctahedral(uint packed) {
+
+    float x = (short)(packed & 0xFFFF) / 32767.f;
+    float y = (short)(packed >> 16) / 32767.f;
+    float z = 1 - fabs(x) - fabs(y);
+
+    float t = max(-z, 0.f);
+    x += (x >= 0) ? -t : t;
+    y += (y >= 0) ? -t : t;
+
+    return normalize((float3)(x, y, z));
+}
+#endif
+
 bool IntersectObj(const Object3D obj, VERTEX_GEOM_DATA_ARGS, const Ray ray, float* t_near) {
 
     switch (obj.type) {
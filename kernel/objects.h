@@ -25,10 +25,17 @@ typedef struct FastRay {
     float3 direction_inv;
 } FastRay;
 
+#ifdef USE_COMPACT_VERTICES
+// Octahedral normals as two snorm16 and half precision uvs
+#define VERTEX_DATA_ARGS const global float3* pos_array, const global uint* normal_array, const global half* uv_array
+#define VERTEX_GEOM_DATA_ARGS const global float3* pos_array, const global uint* normal_array
+#else
 #define VERTEX_DATA_ARGS const global float3* pos_array, const global float4* normal_array, const global float2* uv_array
+#define VERTEX_GEOM_DATA_ARGS const global float3* pos_array, const global float4* normal_array
+#endif
+
 #define VERTEX_DATA pos_array, normal_array, uv_array
 
-#define VERTEX_GEOM_DATA_ARGS const global float3* pos_array, const global float4* normal_array
 #define VERTEX_GEOM_DATA pos_array, normal_array
 
 bool IntersectSphere(const Object3D obj, const Ray ray, float* t_near);
@@ -38,5 +45,8 @@ bool IntersectObj(const Object3D obj, VERTEX_GEOM_DATA_ARGS, const Ray ray, floa
 
 void GetSurfaceData(float3* normal_out, float2* uv_out, float3 hit_pos, const Ray ray, int index, global Object3D* objects, VERTEX_DATA_ARGS);
 void GetTriangleData(const Object3D obj, const float3 hit_pos, float3* normal_out, float2* uv_out, VERTEX_DATA_ARGS);
+#ifdef USE_COMPACT_VERTICES
+float3 DecodeOctahedral(uint packed);
+#endif
 
 #endif
\ No newline at end of file
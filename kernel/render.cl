@@ -7,15 +7,18 @@
 
 #include "macros.h"
 
+// Rays traced at most by a path, camera ray included
+#define PATH_MAX_RAY_COUNT 8
+
 Ray PrimaryRay(float x, float y, int width, int height, constant Options* options);
-float3 Trace(Ray ray, global Node2* bvh_root, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array, RNG_SEED_ARGS);
+float3 Trace(Ray ray, global BVHNode* bvh_root, global Instance* instances, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array, RNG_SEED_ARGS);
 int FindNearestObject(const Ray ray, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, float* nearest_dist, constant Options* options);
 
 //kernel __attribute__((reqd_work_group_size(8, 4, 1)))
 kernel __attribute__((work_group_size_hint(8, 4, 1)))
 //kernel __attribute__((work_group_size_hint(8, 8, 1)))
 //kernel
-void render(global uchar4* framebuffer, global float4* accum_buffer, global Node2* bvh_root, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array) {
+void render(global uchar4* framebuffer, global float4* accum_buffer, global BVHNode* bvh_root, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array, global Instance* instances) {
 
     int x = get_global_id(0);
     int y = get_global_id(1);
@@ -51,7 +54,7 @@ void render(global uchar4* framebuffer, global float4* accum_buffer, global Node
     float3 pixel = 0;
 
     for (int i = 0; i < options->sample_count; ++i) {
-        pixel += Trace(ray, bvh_root, objects, VERTEX_DATA, brdfs, options, env_map, texture_array, info_array, &seed_x, &seed_y) * (1.f / options->sample_count);
+        pixel += Trace(ray, bvh_root, instances, objects, VERTEX_DATA, brdfs, options, env_map, texture_array, info_array, &seed_x, &seed_y) * (1.f / options->sample_count);
     }
 
     accum_buffer[x + y * w] *= options->accum_clear_bit;
@@ -75,17 +78,26 @@ void render(global uchar4* framebuffer, global float4* accum_buffer, global Node
     framebuffer[x + y * w].w = 255;
 }
 
-float3 Trace(Ray ray, global Node2* bvh_root, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array, RNG_SEED_ARGS) {
+float3 Trace(Ray ray, global BVHNode* bvh_root, global Instance* instances, global Object3D* objects, VERTEX_DATA_ARGS, global Brdf* brdfs, constant Options* options, read_only image2d_t env_map, global char* texture_array, global TextureInfo* info_array, RNG_SEED_ARGS) {
 
     float3 material = 1;
 //    for (int i = 0; i < options->bounce_count + 1; i++) {
 //    for (int i = 0; i < 1; i++) {
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < PATH_MAX_RAY_COUNT; i++) {
 
         float dist = 999999.9f;
+        int instance_index = -1;
 
 #ifdef USE_BVH
-        int index = BVHFindNearestIntersection(ray, bvh_root, objects, VERTEX_GEOM_DATA, &dist);
+        // Any-hit query, a blocked environment ends the path as a non emissive hit would
+        if (i == PATH_MAX_RAY_COUNT - 1 && options->trace_last_ray_as_occlusion) {
+            if (!options->use_distant_env_lighting || BVHOccluded(ray, bvh_root, instances, objects, VERTEX_GEOM_DATA, dist))
+                return (float3)(0);
+
+            return material * Sample_Envmap(env_map, ray.direction);
+        }
+
+        int index = BVHFindNearestIntersection(ray, bvh_root, instances, objects, VERTEX_GEOM_DATA, &dist, &instance_index);
 #else
         int index = FindNearestObject(ray, objects, VERTEX_GEOM_DATA, &dist, options);
 #endif
@@ -106,7 +118,15 @@ float3 Trace(Ray ray, global Node2* bvh_root, global Object3D* objects, VERTEX_D
         {
         float2 uv;
 
-        GetSurfaceData(&normal, &uv, hit_pos, ray, index, objects, VERTEX_DATA);
+        if (instance_index == -1) {
+            GetSurfaceData(&normal, &uv, hit_pos, ray, index, objects, VERTEX_DATA);
+        }
+        else {
+            // The vertex data of an instance is in its object space
+            const global Instance* instance = &instances[instance_index];
+            GetSurfaceData(&normal, &uv, TransformPoint(instance, hit_pos), TransformRay(instance, ray), index, objects, VERTEX_DATA);
+            normal = normalize(TransformNormal(instance, normal));
+        }
         short material_index = objects[index].material_index;
 
         float3 shading_normal = EvaluateNormalParameter(normal, brdfs[material_index].normal_map_index, normal, uv, texture_array, info_array);
@@ -140,7 +160,7 @@ float3 Trace(Ray ray, global Node2* bvh_root, global Object3D* objects, VERTEX_D
     return (float3)(0);
 }
 
-void kernel Intersect(global int* hit_object_index, constant float2* coord, global Node2* bvh_root, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, constant Options* options) {
+void kernel Intersect(global int* hit_object_index, constant float2* coord, global BVHNode* bvh_root, global Instance* instances, global Object3D* objects, VERTEX_GEOM_DATA_ARGS, constant Options* options) {
 
     int w = get_global_size(0);
     int h = get_global_size(1);
@@ -149,9 +169,10 @@ void kernel Intersect(global int* hit_object_index, constant float2* coord, glob
 
     float dist = 9999999.f;
     int index;
+    int instance_index;
 
 #ifdef USE_BVH
-    index = BVHFindNearestIntersection(ray, bvh_root, objects, VERTEX_GEOM_DATA, &dist);
+    index = BVHFindNearestIntersection(ray, bvh_root, instances, objects, VERTEX_GEOM_DATA, &dist, &instance_index);
 #else
     index = FindNearestObject(ray, objects, VERTEX_GEOM_DATA, &dist, options);
 #endif
@@ -32,7 +32,8 @@ typedef struct Options {
     char sphere_count;                  // [107]
     char plane_count;                   // [108]
     char debug;                         // [109]
-//    char pad14[2];                    // [110 - 111]
+    char trace_last_ray_as_occlusion;   // [110]
+//    char pad15;                       // [111]
     // 112 bytes = 16 * 7
 } Options;
 
@@ -0,0 +1,437 @@
+#include "Chronometer.h"
+#include "core/BVH.h"
+#include "core/BVH2.h"
+#include "core/Random.h"
+#include "objects/Object3D.h"
+#include "objects/TriMesh.h"
+#include "math/TrigoLut.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+/**
+ * Headless benchmark of the BVH builders, no window, OpenGL or OpenCL context is created
+ *
+ * Usage: ParalightBenchmark [--csv file] [--label name] [--models-dir directory] [--size pixels] [--passes count] [--no-octree]
+ *                           [--synthetic] [model...]
+ * The models are relative to the models directory, like the scene files
+ * --synthetic adds a generated mesh of 180k triangles, measured without any model file
+ * Each row of the CSV file is one builder on one model, the file is appended to so runs of different commits can be compared,
+ * the label column tells them apart (a commit hash for instance)
+ * The diffuse rays are also traced as any-hit occlusion queries, the last rays of the paths of the renderers without emitters
+ */
+
+struct BenchmarkOptions {
+    string csv_file = "bvh_benchmark.csv";
+    string label = "";
+    string model_dir = "../../models/";
+    int image_size = 512;       // Primary rays are traced for a square image of this many pixels on each side
+    int timed_passes = 3;       // The fastest pass is kept, after a warm up pass
+    bool octree = true;         // The octree BVH builds and traverses slowly on big models
+    vector<string> models;
+};
+
+struct BuilderResult {
+    string builder;
+    float build_time = 0;
+    int node_count = 0;
+    int max_depth = 0;
+    float sah_cost = -1;        // Negative when the structure has no SAH cost
+    size_t memory = 0;
+    float primary_mrays = 0;
+    float diffuse_mrays = 0;
+    float occlusion_mrays = 0;  // Zero when the structure has no any-hit query
+};
+
+// Model name of the generated mesh in the results
+static const char* SYNTHETIC_MODEL = "synthetic";
+
+struct BVH2Builder {
+    const char* name;
+    BVHBuildOptions options;
+};
+
+static bool ParseArguments(int argc, char* argv[], BenchmarkOptions& options);
+static vector<BVH2Builder> GetBVH2Builders();
+static void BenchmarkModel(const BenchmarkOptions& options, const string& model, std::ofstream& csv);
+static Object3D* CreateSyntheticMesh();
+static vector<Ray> CreatePrimaryRays(const BoundingBox& bounds, int image_size);
+static vector<Ray> CreateDiffuseRays(const BVH2& bvh, const vector<Ray>& primary_rays, float scene_size);
+static void WriteResult(std::ofstream& csv, const BenchmarkOptions& options, const string& model, int triangle_count,
+                        size_t primary_ray_count, size_t diffuse_ray_count, const BuilderResult& result);
+
+/**
+ * Single threaded, the fastest of the timed passes is kept as the timings are noisy
+ */
+template <class Traversal>
+static float MeasureMraysPerSecond(const vector<Ray>& rays, int timed_passes, Traversal traversal) {
+
+    if (rays.empty())
+        return 0;
+
+    float best_seconds = std::numeric_limits<float>::max();
+
+    for (int pass = 0; pass <= timed_passes; ++pass) {
+
+        Chronometer chrono;
+        for (const Ray& ray : rays) {
+            HitRecord hit;
+            traversal(ray, hit);
+        }
+        float seconds = chrono.GetSeconds();
+
+        // The first pass only warms up the caches
+        if (pass > 0)
+            best_seconds = std::min(best_seconds, seconds);
+    }
+
+    return rays.size() / (std::max(best_seconds, 1e-6f) * 1e6f);
+}
+
+int main(int argc, char* argv[]) {
+
+    BenchmarkOptions options;
+
+    if (ParseArguments(argc, argv, options) == false)
+        return EXIT_FAILURE;
+
+    // Write the header only once, the results of the next runs are appended
+    bool csv_is_new = std::ifstream {options.csv_file}.good() == false;
+
+    std::ofstream csv {options.csv_file, std::ios::app};
+    if (csv.good() == false) {
+        std::cerr << "Could not open " << options.csv_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (csv_is_new) {
+        csv << "label,model,triangles,builder,build_s,nodes,max_depth,sah_cost,memory_ko,"
+            << "primary_rays,primary_mrays_s,diffuse_rays,diffuse_mrays_s,occlusion_mrays_s" << endl;
+    }
+
+    try {
+        for (const string& model : options.models) {
+            BenchmarkModel(options, model, csv);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Exception catched in main: " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "Results appended to " << options.csv_file << endl;
+
+    return 0;
+}
+
+static bool ParseArguments(int argc, char* argv[], BenchmarkOptions& options) {
+
+    for (int i = 1; i < argc; ++i) {
+
+        string argument = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (argument == "--csv" && has_value)
+            options.csv_file = argv[++i];
+        else if (argument == "--label" && has_value)
+            options.label = argv[++i];
+        else if (argument == "--models-dir" && has_value)
+            options.model_dir = argv[++i];
+        else if (argument == "--size" && has_value)
+            options.image_size = std::max(1, std::atoi(argv[++i]));
+        else if (argument == "--passes" && has_value)
+            options.timed_passes = std::max(1, std::atoi(argv[++i]));
+        else if (argument == "--no-octree")
+            options.octree = false;
+        else if (argument == "--synthetic")
+            options.models.push_back(SYNTHETIC_MODEL);
+        else if (argument.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option " << argument << endl;
+            std::cerr << "Usage: " << argv[0] << " [--csv file] [--label name] [--models-dir directory] [--size pixels]"
+                      << " [--passes count] [--no-octree] [--synthetic] [model...]" << endl;
+            return false;
+        }
+        else
+            options.models.push_back(argument);
+    }
+
+    if (options.models.empty()) {
+        options.models = {
+                "dragon/dragon.obj",
+                "blender_tests/crytek_sponza_cl.obj",
+                "sibenik_cathedral/sibenik.obj",
+                "san_miguel/san-miguel.obj"
+        };
+    }
+
+    return true;
+}
+
+/**
+ * Every BVH2 configuration compared, a new builder only needs to be added here
+ */
+static vector<BVH2Builder> GetBVH2Builders() {
+
+    BVHBuildOptions sah;
+    sah.builder = SAH_BUILDER;
+
+    BVHBuildOptions sah_spatial = sah;
+    sah_spatial.spatial_splits = true;
+
+    // The blocks only pay off on leaves of several triangles
+    BVHBuildOptions sah_blocks = sah;
+    sah_blocks.max_leaf_size = 8;
+    sah_blocks.intersection_cost = 0.5f;
+    sah_blocks.triangle_blocks = true;
+
+    BVHBuildOptions lbvh;
+    lbvh.builder = LBVH_BUILDER;
+
+    BVHBuildOptions lbvh_treelets = lbvh;
+    lbvh_treelets.treelet_optimization = true;
+
+    return {
+            {"BVH2 SAH",                 sah},
+            {"BVH2 SAH spatial splits",  sah_spatial},
+            {"BVH2 SAH triangle blocks", sah_blocks},
+            {"BVH2 LBVH",                lbvh},
+            {"BVH2 LBVH treelets",       lbvh_treelets}
+    };
+}
+
+static void BenchmarkModel(const BenchmarkOptions& options, const string& model, std::ofstream& csv) {
+
+    cout << "Loading " << model << "..." << endl;
+
+    std::unique_ptr<Object3D> mesh {model == SYNTHETIC_MODEL ? CreateSyntheticMesh() : Object3D::CreateTriMesh(options.model_dir + model)};
+    std::unique_ptr<TriMesh> trimesh {mesh->trimesh};
+
+    if (trimesh->GetTriangleCount() == 0) {
+        std::cerr << "Error: no triangle loaded from " << model << ", skipped" << endl;
+        return;
+    }
+
+    vector<Primitive> primitives;
+    mesh->AppendPrimitives(primitives);
+
+    int triangle_count = (int) primitives.size();
+
+    vector<BVH2Builder> builders = GetBVH2Builders();
+
+    // The rays are the same for every builder, the diffuse bounces start from the primary hits of the first one
+    BVH2 reference_bvh {primitives, builders[0].options, false};
+    BoundingBox bounds = reference_bvh.GetBounds();
+
+    vector<Ray> primary_rays = CreatePrimaryRays(bounds, options.image_size);
+    vector<Ray> diffuse_rays = CreateDiffuseRays(reference_bvh, primary_rays, (bounds.max - bounds.min).length());
+
+    cout << triangle_count << " triangles, " << primary_rays.size() << " primary rays, "
+         << diffuse_rays.size() << " diffuse rays" << endl;
+
+    vector<BuilderResult> results;
+
+    for (const BVH2Builder& builder : builders) {
+
+        BVH2 bvh {primitives, builder.options, false};
+
+        BuilderResult result;
+        result.builder = builder.name;
+        result.build_time = bvh.GetBuildTime();
+        result.node_count = bvh.GetNodeCount();
+        result.max_depth = bvh.GetMaxDepth();
+        result.sah_cost = bvh.GetSAHCost();
+        result.memory = bvh.GetNodeMemory() + bvh.GetPrimitiveCount() * (sizeof(Primitive) + sizeof(TriangleRecord))
+                      + bvh.GetTriangleBlocks().GetMemory();
+
+        auto traversal = [&bvh] (const Ray& ray, HitRecord& hit) {
+            bvh.FindNearestIntersectionOpti(ray, hit);
+        };
+        result.primary_mrays = MeasureMraysPerSecond(primary_rays, options.timed_passes, traversal);
+        result.diffuse_mrays = MeasureMraysPerSecond(diffuse_rays, options.timed_passes, traversal);
+
+        auto occlusion = [&bvh] (const Ray& ray, HitRecord& hit) {
+            bvh.Occluded(ray, hit.dist);
+        };
+        result.occlusion_mrays = MeasureMraysPerSecond(diffuse_rays, options.timed_passes, occlusion);
+
+        results.push_back(result);
+    }
+
+    if (options.octree) {
+
+        Chronometer chrono;
+        BVH octree {primitives, false};
+
+        BuilderResult result;
+        result.builder = "Octree BVH";
+        result.build_time = chrono.GetSeconds();
+        result.node_count = octree.GetNodeCount();
+        result.max_depth = octree.GetMaxDepth();
+        // Every node but the root is also referenced by its parent
+        result.memory = octree.GetNodeCount() * (sizeof(Node) + sizeof(std::unique_ptr<Node>));
+
+        auto traversal = [&octree] (const Ray& ray, HitRecord& hit) {
+            octree.FindNearestIntersection(ray, hit.dist, hit.primitive);
+        };
+        result.primary_mrays = MeasureMraysPerSecond(primary_rays, options.timed_passes, traversal);
+        result.diffuse_mrays = MeasureMraysPerSecond(diffuse_rays, options.timed_passes, traversal);
+
+        results.push_back(result);
+    }
+
+    for (const BuilderResult& result : results) {
+
+        cout << "  " << result.builder << ": built in " << result.build_time << " s, "
+             << result.node_count << " nodes, depth " << result.max_depth << ", ";
+        if (result.sah_cost >= 0)
+            cout << "SAH cost " << result.sah_cost << ", ";
+        cout << result.memory / 1024 << " Ko, " << result.primary_mrays << " Mrays/s primary, "
+             << result.diffuse_mrays << " Mrays/s diffuse";
+        if (result.occlusion_mrays > 0)
+            cout << ", " << result.occlusion_mrays << " Mrays/s diffuse occlusion";
+        cout << endl;
+
+        WriteResult(csv, options, model, triangle_count, primary_rays.size(), diffuse_rays.size(), result);
+    }
+}
+
+/**
+ * Sphere of 300 x 300 quads with bumps along both angles, so the BVH has some depth to sort out
+ */
+static Object3D* CreateSyntheticMesh() {
+
+    const int grid_size = 300;
+
+    vector<Vec3> positions;
+    vector<Vec3> normals;
+    vector<unsigned int> indices;
+    positions.reserve((grid_size + 1) * (grid_size + 1));
+    normals.reserve((grid_size + 1) * (grid_size + 1));
+    indices.reserve(6 * grid_size * grid_size);
+
+    for (int i = 0; i <= grid_size; ++i) {
+        for (int j = 0; j <= grid_size; ++j) {
+
+            float theta = float(M_PI) * i / grid_size;
+            float phi = 2 * float(M_PI) * j / grid_size;
+            float radius = 30 + 3 * sinf(7 * theta) * cosf(5 * phi);
+
+            // The normal of the unbumped sphere is enough to shade the diffuse bounces
+            Vec3 direction {sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)};
+            positions.push_back(direction * radius);
+            normals.push_back(direction);
+        }
+    }
+
+    for (int i = 0; i < grid_size; ++i) {
+        for (int j = 0; j < grid_size; ++j) {
+
+            unsigned int a = i * (grid_size + 1) + j;
+            unsigned int b = a + 1;
+            unsigned int c = a + grid_size + 1;
+            unsigned int d = c + 1;
+
+            unsigned int quad[6] = {a, b, c, b, d, c};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    Object3D* object = new Object3D;
+    object->trimesh = new TriMesh {std::move(positions), std::move(normals), std::move(indices)};
+
+    return object;
+}
+
+/**
+ * Pinhole camera looking at the center of the bounds from above and in front, the whole bounds are in view
+ */
+static vector<Ray> CreatePrimaryRays(const BoundingBox& bounds, int image_size) {
+
+    const float fov = 60;
+    float fov_factor = tanf(DEG_TO_RAD(fov / 2.f));
+
+    Vec3 center = bounds.GetCenter();
+    float radius = (bounds.max - bounds.min).length() / 2;
+
+    Vec3 back = Vec3 {0.5f, 0.4f, 1.f}.normalize();
+    Vec3 right = Vec3 {0, 1, 0}.cross(back).normalize();
+    Vec3 up = back.cross(right);
+    Vec3 position = center + back * (radius / fov_factor);
+
+    vector<Ray> rays;
+    rays.reserve(size_t(image_size) * image_size);
+
+    for (int y = 0; y < image_size; ++y) {
+        for (int x = 0; x < image_size; ++x) {
+            // Camera space to world space, the camera looks down -z
+            Ray ray {position, x, y, image_size, image_size, 1.f, fov_factor};
+            ray.direction = right * ray.direction.x + up * ray.direction.y + back * ray.direction.z;
+            rays.push_back(ray);
+        }
+    }
+
+    return rays;
+}
+
+/**
+ * One cosine distributed bounce around the shading normal of each primary hit, the incoherent rays of a path tracer
+ */
+static vector<Ray> CreateDiffuseRays(const BVH2& bvh, const vector<Ray>& primary_rays, float scene_size) {
+
+    // Offset from the surface so the bounce doesn't hit its own triangle
+    float epsilon = scene_size * 1e-5f;
+
+    vector<Ray> rays;
+    rays.reserve(primary_rays.size());
+
+    for (const Ray& ray : primary_rays) {
+
+        HitRecord hit;
+
+        if (bvh.FindNearestIntersectionOpti(ray, hit) == false)
+            continue;
+
+        Vec3 hit_point = ray.origin + ray.direction * hit.dist;
+        Vec3 normal = hit.GetSurfaceData(ray).normal;
+
+        if (normal.dot(ray.direction) > 0)
+            normal = -normal;
+
+        Vec3 direction = Random::GetInstance().GetWorldRandomHemishpereDirectionCosine(normal);
+
+        rays.push_back(Ray {hit_point + normal * epsilon, direction});
+    }
+
+    return rays;
+}
+
+static void WriteResult(std::ofstream& csv, const BenchmarkOptions& options, const string& model, int triangle_count,
+                        size_t primary_ray_count, size_t diffuse_ray_count, const BuilderResult& result) {
+
+    csv << options.label << ',' << model << ',' << triangle_count << ',' << result.builder << ','
+        << result.build_time << ',' << result.node_count << ',' << result.max_depth << ',';
+
+    // Left empty for the structures without SAH cost
+    if (result.sah_cost >= 0)
+        csv << result.sah_cost;
+
+    csv << ',' << result.memory / 1024 << ','
+        << primary_ray_count << ',' << result.primary_mrays << ','
+        << diffuse_ray_count << ',' << result.diffuse_mrays << ',';
+
+    // Left empty for the structures without any-hit query
+    if (result.occlusion_mrays > 0)
+        csv << result.occlusion_mrays;
+
+    csv << endl;
+}
@@ -12,26 +12,48 @@ using std::cout;
 using std::endl;
 using std::vector;
 
-BVH::BVH(const Scene* scene) {
+static vector<Primitive> GetScenePrimitives(const Scene* scene);
 
-    BoundingBox bbox = scene->ComputeBBox();
+BVH::BVH(const Scene* scene)
+        : BVH(GetScenePrimitives(scene)) {
+}
+
+BVH::BVH(const vector<Primitive>& primitives, bool log_statistics) {
+
+    BoundingBox bbox;
+    for (const Primitive& primitive : primitives) {
+        bbox.ExtendsBy(primitive.ComputeBBox());
+    }
 
     root = std::unique_ptr<Node>{new Node};
     root->bbox = bbox;
     node_count++;
 
-    for (const auto& object : scene->objects) {
-        Insert(object.get(), root);
+    for (const Primitive& primitive : primitives) {
+        Insert(primitive, root);
     }
 
     ComputeBoundingBoxes(root);
 
+    if (log_statistics == false)
+        return;
+
     cout << "BVH max depth: " << max_depth << endl;
     cout << "BVH node count: " << node_count << endl;
 
 }
 
-void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short depth) {
+static vector<Primitive> GetScenePrimitives(const Scene* scene) {
+
+    vector<Primitive> primitives;
+    for (const auto& object : scene->objects) {
+        object->AppendPrimitives(primitives);
+    }
+
+    return primitives;
+}
+
+void BVH::Insert(Primitive primitive, const std::unique_ptr<Node>& node, short depth) {
 
     max_depth = std::max(depth, max_depth);
 
@@ -41,7 +63,7 @@ void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short dept
         return;
     }
 //    {
-//        cout << "Center of object to insert: " << object->GetCenter() << endl;
+//        cout << "Center of object to insert: " << primitive.GetCenter() << endl;
 //        cout << "Bbox of current node: min [" << node->bbox.min << "] - max [" << node->bbox.max << "]" << endl;
 //        cout << endl;
 //    }
@@ -50,38 +72,38 @@ void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short dept
     if (node->children.empty())
     {
         // This node has no assigned object (only case is the root node)
-        if (node->object == nullptr) {
-            node->object = object;
+        if (node->primitive.object == nullptr) {
+            node->primitive = primitive;
         }
         // Node already has object, so we have to partition it into children nodes
         // Important: Not all 8 childs will be created here, only the necessary ones
         else {
 
             // Insert the object into a child
-//            AddChildNode(node, object);
-            Vec3 obj_center = object->GetCenter();
-//            Vec3 obj_center = object->ComputeBBox().GetCenter();
+//            AddChildNode(node, primitive);
+            Vec3 obj_center = primitive.GetCenter();
+//            Vec3 obj_center = primitive.ComputeBBox().GetCenter();
             auto bbox = GetChildOctreeBoundingBox(node->bbox, obj_center);
             if (bbox.max == bbox.min) {
                 cout << "tiny bbox" << endl;
                 return;
             }
-            node->children.emplace_back(new Node {bbox, object});
+            node->children.emplace_back(new Node {bbox, primitive});
 
             // Reinsert the object into the bvh
-            Insert(node->object, node, depth + 1);
+            Insert(node->primitive, node, depth + 1);
 
             // Detach this node object
-            node->object = nullptr;
+            node->primitive = Primitive {};
         }
     }
     else {
 //        cout << "Not a leaf, searching for existing enclosing child..." << endl;
 
         // Find the child which enclose this object center
-        Vec3 obj_center = object->GetCenter();
-//        Vec3 obj_center = object->ComputeBBox().GetCenter();
-//        BoundingBox obj_bbox = object->ComputeBBox();
+        Vec3 obj_center = primitive.GetCenter();
+//        Vec3 obj_center = primitive.ComputeBBox().GetCenter();
+//        BoundingBox obj_bbox = primitive.ComputeBBox();
 
         auto blabla = GetChildOctreeBoundingBox(node->bbox, obj_center);
         if (blabla.min == blabla.max) {
@@ -90,11 +112,11 @@ void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short dept
         }
         for (const auto& child : node->children) {
             if (child->bbox == blabla) {
-                Insert(object, child, depth + 1);
+                Insert(primitive, child, depth + 1);
                 return;
             }
         }
-        AddChildNode(node, object);
+        AddChildNode(node, primitive);
 #if 0
 
         for (const auto& child : node->children) {
@@ -102,7 +124,7 @@ void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short dept
 //            if (child->bbox.EnclosesInclusive(obj_center)) {
             if (child->bbox.EnclosesInclusive(obj_center)) {
 //                cout << "Found enclosing bbox: min [" << child->bbox.min << "] - max [" << child->bbox.max << "]" << endl << endl;
-                Insert(object, child, ++depth);
+                Insert(primitive, child, ++depth);
                 return;
             }
         }
@@ -135,19 +157,19 @@ void BVH::Insert(Object3D* object, const std::unique_ptr<Node>& node, short dept
             }
         }
         // If there's currently no child to enclose this object, then we have to create it
-        AddChildNode(node, object);
+        AddChildNode(node, primitive);
 #endif
     }
 }
 
-void BVH::AddChildNode(const std::unique_ptr<Node>& node, Object3D* object) {
+void BVH::AddChildNode(const std::unique_ptr<Node>& node, Primitive primitive) {
 
     node_count++;
     Node* child = new Node();
-    Vec3 obj_center = object->GetCenter();
-//    Vec3 obj_center = object->ComputeBBox().GetCenter();
+    Vec3 obj_center = primitive.GetCenter();
+//    Vec3 obj_center = primitive.ComputeBBox().GetCenter();
     child->bbox = GetChildOctreeBoundingBox(node->bbox, obj_center);
-    child->object = object;
+    child->primitive = primitive;
 //    node->children.emplace_back(std::unique_ptr<Node>(child));
 
     node->children.emplace_back(child);
@@ -179,8 +201,8 @@ BoundingBox BVH::GetChildOctreeBoundingBox(BoundingBox bbox, Vec3 point) {
 void BVH::ComputeBoundingBoxes(const std::unique_ptr<Node>& node) {
 
     if (node->children.empty())
-        node->bbox = node->bbox.ExtendsBy(node->object->ComputeBBox());
-//        node->bbox = node->object->ComputeBBox();
+        node->bbox = node->bbox.ExtendsBy(node->primitive.ComputeBBox());
+//        node->bbox = node->primitive.ComputeBBox();
     else {
         for (const auto& child : node->children) {
             ComputeBoundingBoxes(child);
@@ -190,16 +212,16 @@ void BVH::ComputeBoundingBoxes(const std::unique_ptr<Node>& node) {
 }
 
 
-bool BVH::FindNearestIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object) {
+bool BVH::FindNearestIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive) {
 
     FastRay fast_ray {ray};
 
-    return IntersectNode(fast_ray, dist_out, hit_object, root);
-//    return IntersectNodeFast(fast_ray, dist_out, hit_object, root);
+    return IntersectNode(fast_ray, dist_out, hit_primitive, root);
+//    return IntersectNodeFast(fast_ray, dist_out, hit_primitive, root);
 
 }
 
-bool BVH::IntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, const std::unique_ptr<Node>& node) {
+bool BVH::IntersectNode(const FastRay& ray, float& dist_out, Primitive& hit_primitive, const std::unique_ptr<Node>& node) {
 
     float dist;
 //    ray_bbox_test_count++;
@@ -210,24 +232,24 @@ bool BVH::IntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_obje
         // If no children, this node is a leaf so intersect the object it contains
         if (node->children.empty()) {
 //            ray_obj_test_count++;
-            if (node->object->Intersect(ray, dist) && (dist < dist_out)) {
+            if (node->primitive.Intersect(ray, dist) && (dist < dist_out)) {
 //                ray_obj_hit_count++;
                 dist_out = dist;
-                hit_object = node->object;
+                hit_primitive = node->primitive;
             }
         }
         else {
             for (const auto& child : node->children) {
-                IntersectNode(ray, dist_out, hit_object, child);
+                IntersectNode(ray, dist_out, hit_primitive, child);
             }
         }
 
     }
 
-    return (hit_object != nullptr);
+    return (hit_primitive.object != nullptr);
 }
 
-bool BVH::IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Object3D*& hit_object, const std::unique_ptr<Node>& node) {
+bool BVH::IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Primitive& hit_primitive, const std::unique_ptr<Node>& node) {
 
 //    ray_bbox_test_count++;
 
@@ -256,10 +278,10 @@ bool BVH::IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Object3
         if (current_node->children.empty()) {
 //            ray_obj_test_count++;
 
-            if (current_node->object->Intersect(ray, dist) && (dist < t_near_candidate)) {
+            if (current_node->primitive.Intersect(ray, dist) && (dist < t_near_candidate)) {
 //                ray_obj_hit_count++;
                 t_near_candidate = dist;
-                hit_object = current_node->object;
+                hit_primitive = current_node->primitive;
             }
         }
         else {
@@ -277,7 +299,7 @@ bool BVH::IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Object3
 //    if (max > 12)
 //    cout << int(max) << endl;
 
-    return (hit_object != nullptr);
+    return (hit_primitive.object != nullptr);
 }
 
 void BVH::ResetCounters() {
@@ -287,13 +309,13 @@ void BVH::ResetCounters() {
     ray_obj_hit_count = 0;
 }
 
-bool BVH::DebugIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object, int depth_target) {
+bool BVH::DebugIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive, int depth_target) {
     FastRay fast_ray {ray};
 
-    return DebugIntersectNode(ray, dist_out, hit_object, 0, depth_target, root);
+    return DebugIntersectNode(ray, dist_out, hit_primitive, 0, depth_target, root);
 }
 
-bool BVH::DebugIntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, int depth, int debug_depth, const std::unique_ptr<Node>& node) {
+bool BVH::DebugIntersectNode(const FastRay& ray, float& dist_out, Primitive& hit_primitive, int depth, int debug_depth, const std::unique_ptr<Node>& node) {
 
     float dist = 99999999.f;
     // We intersect this node
@@ -302,15 +324,15 @@ bool BVH::DebugIntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit
         // If no children, this node is a leaf so intersect the object it contains
         if (depth == debug_depth) {
             dist_out = dist;
-//            hit_object = &(node->bbox); //FIXME: if needed make bbox visualisation work again
+//            hit_primitive = &(node->bbox); //FIXME: if needed make bbox visualisation work again
         }
         else {
             for (const auto& child : node->children) {
-                DebugIntersectNode(ray, dist_out, hit_object, depth + 1, debug_depth, child);
+                DebugIntersectNode(ray, dist_out, hit_primitive, depth + 1, debug_depth, child);
             }
         }
 
     }
 
-    return (hit_object != nullptr);
+    return (hit_primitive.object != nullptr);
 }
@@ -11,7 +11,6 @@
 #include <vector>
 #include <memory>
 
-typedef struct Object3D Object3D;
 typedef struct Scene Scene;
 
 class BVH {
@@ -44,9 +43,11 @@ public:
 
     BVH(const Scene* scene);
 
-    void Insert(Object3D* object, const std::unique_ptr<Node>& node, short depth = 0);
+    BVH(const std::vector<Primitive>& primitives, bool log_statistics = true);
 
-    bool FindNearestIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object);
+    void Insert(Primitive primitive, const std::unique_ptr<Node>& node, short depth = 0);
+
+    bool FindNearestIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive);
 
     static int ray_bbox_test_count;
     static int ray_bbox_hit_count;
@@ -55,7 +56,7 @@ public:
 
     static void ResetCounters();
 
-    bool DebugIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object, int depth_target);
+    bool DebugIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive, int depth_target);
 
     Node* GetRoot() const {
         return root.get();
@@ -65,19 +66,23 @@ public:
         return node_count;
     }
 
+    int GetMaxDepth() const {
+        return max_depth;
+    }
+
     static BoundingBox GetChildOctreeBoundingBox(BoundingBox bbox, Vec3 point);
 
 private:
 
-    void AddChildNode(const std::unique_ptr<Node>& node, Object3D* object);
+    void AddChildNode(const std::unique_ptr<Node>& node, Primitive primitive);
 
     void ComputeBoundingBoxes(const std::unique_ptr<Node>& node);
 
-    bool IntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, const std::unique_ptr<Node>& node);
+    bool IntersectNode(const FastRay& ray, float& dist_out, Primitive& hit_primitive, const std::unique_ptr<Node>& node);
 
-    bool IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Object3D*& hit_object, const std::unique_ptr<Node>& node);
+    bool IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Primitive& hit_primitive, const std::unique_ptr<Node>& node);
 
-    bool DebugIntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, int depth, int debug_depth, const std::unique_ptr<Node>& node);
+    bool DebugIntersectNode(const FastRay& ray, float& dist_out, Primitive& hit_primitive, int depth, int debug_depth, const std::unique_ptr<Node>& node);
 
     short max_depth = 0;
     int node_count = 0;
@@ -1,13 +1,23 @@
 #include "BVH2.h"
 
 #include "Scene.h"
+#include "LBVH.h"
+#include "BVHLayout.h"
+#include "Instance.h"
+#include "RayPacket.h"
 #include "objects/TriMesh.h"
 
 #include <SDL_timer.h>
+#include <immintrin.h>
 #include <algorithm>
 #include <array>
+#include <limits>
 #include "app/Chronometer.h"
 
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
 int BVH2::ray_bbox_test_count;
 int BVH2::ray_bbox_hit_count;
 int BVH2::ray_obj_test_count;
@@ -18,152 +28,794 @@ using std::endl;
 using std::vector;
 using std::unique_ptr;
 
-struct BuildInfo {
+// Number of bins the centroid bounds are divided in along each axis
+static const int SAH_BIN_COUNT = 16;
+
+struct SAHBin {
+    BoundingBox bbox;
+    int count = 0;
+};
+
+struct SAHSplit {
+    float cost = std::numeric_limits<float>::max(); // In number of object intersections
+    char axis = -1;
+    int bin = 0;    // Objects binned in [0, bin] go to the left child
+    BoundingBox left_bbox;
+    BoundingBox right_bbox;
+    int left_count = 0;
+    int right_count = 0;
+};
+
+// Spatial splits are only tried when the children of the best object split overlap by more than this ratio of the root surface area
+static const float SPATIAL_SPLIT_ALPHA = 1e-5f;
+// Deeper nodes only use object splits, the clipped references could keep being split otherwise
+static const int SPATIAL_SPLIT_MAX_DEPTH = 48;
+
+struct SpatialBin {
     BoundingBox bbox;
-    Object3D* object;
-    Vec3 bbox_center;
+    int entry_count = 0;    // References starting in this bin
+    int exit_count = 0;     // References ending in this bin
 };
 
-int SplitSAH      (vector<BuildInfo>& objects, int first, int last, BoundingBox box);
+SAHSplit FindSplitBinnedSAH(const vector<BuildInfo>& objects, int first, int last, const BoundingBox& bbox, const BoundingBox& centroid_bbox);
+int SplitAtBin    (vector<BuildInfo>& objects, int first, int last, const SAHSplit& split, const BoundingBox& centroid_bbox);
 int SplitAtPoint  (vector<BuildInfo>& objects, int first, int last, char axis, float split_point);
 int SplitEqualSets(vector<BuildInfo>& objects, int first, int last, char axis);
 
-BoundingBox GetBoundingBoxForObjects(const vector<BuildInfo>& objects, int i, int i1);
+SAHSplit FindSpatialSplitSAH(const vector<BuildInfo>& references, const BoundingBox& bbox);
+void SplitSpatially(const vector<BuildInfo>& references, const SAHSplit& split, const BoundingBox& bbox, int& budget,
+                    vector<BuildInfo>& left, vector<BuildInfo>& right);
+
+void ComputeBounds(const vector<BuildInfo>& objects, int first, int last, BoundingBox& bbox, BoundingBox& centroid_bbox);
+void BinObjects   (const vector<BuildInfo>& objects, int first, int last, const BoundingBox& centroid_bbox, std::array<SAHBin, SAH_BIN_COUNT>* bins);
+
+// Nodes with more objects than this build their children as separate OpenMP tasks
+static const int PARALLEL_BUILD_MIN_OBJECTS = 4096;
+// Nodes with more objects than this are split in chunks binned by separate tasks, only the top levels are concerned
+static const int PARALLEL_CHUNK_MIN_OBJECTS = 16384;
+
+int GetChunkCount(int obj_count);
+
+static vector<Primitive> GetScenePrimitives(const Scene* scene);
+
+static void LimitDepth(unique_ptr<Node2>& node, int depth, int max_depth);
+static Node2* BuildBalanced(vector<unique_ptr<Node2>>& leaves, int first, int last);
+
+static inline bool IsEmpty(const BoundingBox& bbox) {
+    return bbox.min.x > bbox.max.x || bbox.min.y > bbox.max.y || bbox.min.z > bbox.max.z;
+}
 
-void ComputeBoundingBoxes(const unique_ptr<Node2>& node);
+static inline BoundingBox ClipBBox(const BoundingBox& bbox, const BoundingBox& clip) {
+    return BoundingBox {
+            Vec3 {std::max(bbox.min.x, clip.min.x), std::max(bbox.min.y, clip.min.y), std::max(bbox.min.z, clip.min.z)},
+            Vec3 {std::min(bbox.max.x, clip.max.x), std::min(bbox.max.y, clip.max.y), std::min(bbox.max.z, clip.max.z)}
+    };
+}
 
 #define SAH
 //#define MID_POINT
 
-BVH2::BVH2(const Scene* scene) {
+BVH2::BVH2(const Scene* scene, const BVHBuildOptions& build_options)
+        : BVH2(GetScenePrimitives(scene), build_options) {
+}
+
+/**
+ * @param log_statistics False for the bottom levels of an instanced scene, there can be hundreds of them
+ */
+BVH2::BVH2(const vector<Primitive>& primitives, const BVHBuildOptions& build_options, bool log_statistics)
+        : build_options(build_options) {
 
-    std::vector<BuildInfo> build_info_array;
+    int object_count = (int) primitives.size();
 
-    build_info_array.reserve(scene->objects.size());
+    std::vector<BuildInfo> build_info_array(primitives.size());
 
-    for (const auto& object : scene->objects) {
-        build_info_array.push_back( BuildInfo { object->ComputeBBox(), object.get(), object->ComputeBBox().GetCenter() });
-    }
-    
     Chronometer chrono;
 
-    cout << "Building BVH..." << endl;
+    if (log_statistics)
+        cout << "Building BVH..." << endl;
+
+#pragma omp parallel for
+    for (int i = 0; i < object_count; ++i) {
+        const Primitive& primitive = primitives[i];
+        build_info_array[i].primitive = primitive;
+        build_info_array[i].bbox = primitive.ComputeBBox();
+        build_info_array[i].bbox_center = build_info_array[i].bbox.GetCenter();
+    }
+
+    unique_ptr<Node2> root;
 
-    root = unique_ptr<Node2>(RecursiveBuild(build_info_array, 0, (int) scene->objects.size()));
+    // Only the SAH builder can split spatially
+    bool spatial_splits = build_options.spatial_splits && build_options.builder == SAH_BUILDER;
+    int budget = spatial_splits ? int(object_count * build_options.spatial_split_budget) : 0;
+    size_t max_reference_count = (size_t) (object_count + budget);
 
-    cout << "BVH built in " << chrono.GetSeconds() << " s" << endl;
-    
-//    ComputeBoundingBoxes(root);
+    if (build_options.builder == LBVH_BUILDER) {
+        // Also sorts the objects so each leaf references a contiguous range of them
+        root = unique_ptr<Node2>(BuildLBVH(build_info_array, build_options));
+    }
+    else {
+        // A single thread starts the build, the big nodes spawn tasks picked up by the rest of the team
+        // The split decisions don't depend on the tasks scheduling so the tree is the same whatever the thread count
+#pragma omp parallel
+#pragma omp single
+        {
+            if (spatial_splits)
+                root = unique_ptr<Node2>(RecursiveBuildSpatial(build_info_array, budget, 0, 0));
+            else
+                root = unique_ptr<Node2>(RecursiveBuild(build_info_array, 0, object_count));
+        }
+    }
 
+    if (spatial_splits == false) {
+        // The build partitioned the objects so each leaf references a contiguous range of them
+        ordered_primitives.reserve(build_info_array.size());
+        for (const BuildInfo& info : build_info_array) {
+            ordered_primitives.push_back(info.primitive);
+        }
+    }
+    else {
+        // Filled by the leaves while flattening
+        ordered_primitives.reserve(max_reference_count);
+    }
+
+    // Whatever the builder, the traversal stacks must hold every pending node
+    LimitDepth(root, 0, MAX_DEPTH);
+
+    // The pointer tree is only kept during the build, traversal uses the node array
+    // A binary tree with at most one reference per leaf bounds the node count
+    nodes.reserve(std::max<size_t>(2 * max_reference_count, 1) - 1);
+    nodes.emplace_back();
+    Flatten(root.get(), 0, 0);
+    nodes.shrink_to_fit();
+
+    primitive_set = ClassifyPrimitives(ordered_primitives);
+    if (primitive_set == MIXED_PRIMITIVES)
+        SortLeafPrimitives();
+
+    triangle_records = CreateTriangleRecords(ordered_primitives);
+    if (build_options.triangle_blocks)
+        triangle_blocks.Create(triangle_records, nodes);
+
+    if (build_options.node_layout != DEPTH_FIRST_LAYOUT)
+        ApplyLayout(build_options.node_layout);
+
+    build_time = chrono.GetSeconds();
+    sah_cost = ComputeSAHCost();
+    build_sah_cost = sah_cost;
+
+    if (log_statistics == false)
+        return;
+
+    cout << "BVH built in " << build_time << " s, SAH cost: " << sah_cost << endl;
     cout << "BVH2 max depth: " << max_depth << endl;
     cout << "BVH2 node count: " << node_count << endl;
+    cout << "BVH2 leaf count: " << leaf_count << " (" << float(ordered_primitives.size()) / leaf_count << " objects per leaf)" << endl;
+    cout << "BVH2 node memory: " << (nodes.size() * sizeof(LinearNode2)) / 1024 << " Ko" << endl;
+    if (build_options.triangle_blocks) {
+        cout << "BVH2 triangle blocks: " << triangle_blocks.GetBlockCount() << " of " << TRIANGLE_BLOCK_WIDTH << " triangles ("
+             << triangle_blocks.GetMemory() / 1024 << " Ko)" << endl;
+    }
+    if (spatial_splits) {
+        int duplicate_count = (int) ordered_primitives.size() - object_count;
+        cout << "BVH2 references: " << ordered_primitives.size() << " (" << duplicate_count << " duplicated, "
+             << 100.f * duplicate_count / std::max(object_count, 1) << "%)" << endl;
+    }
 }
 
 /**
- * Split all objects in 2 sets separated by the provided split_point along the axis
+ * The scene objects expanded to one primitive per mesh triangle
  */
-int SplitAtPoint(vector<unique_ptr<Object3D>>& objects, int first, int last, char axis, float split_point) ;
+static vector<Primitive> GetScenePrimitives(const Scene* scene) {
 
-Node2* BVH2::RecursiveBuild(vector<BuildInfo>& objects, int first, int last, int depth) {
+    size_t primitive_count = 0;
+    for (const auto& object : scene->objects) {
+        primitive_count += object->GetPrimitiveCount();
+    }
 
-    max_depth = std::max(max_depth, short(depth));
+    vector<Primitive> primitives;
+    primitives.reserve(primitive_count);
+    for (const auto& object : scene->objects) {
+        object->AppendPrimitives(primitives);
+    }
+
+    return primitives;
+}
+
+static int GetHeight(const Node2* node) {
+    if (node->object_count > 0)
+        return 0;
+    return 1 + std::max(GetHeight(node->left_child.get()), GetHeight(node->right_child.get()));
+}
+
+static int GetLeafCount(const Node2* node) {
+    if (node->object_count > 0)
+        return 1;
+    return GetLeafCount(node->left_child.get()) + GetLeafCount(node->right_child.get());
+}
+
+static void CollectLeaves(unique_ptr<Node2>& node, vector<unique_ptr<Node2>>& leaves) {
+    if (node->object_count > 0) {
+        leaves.push_back(std::move(node));
+        return;
+    }
+    CollectLeaves(node->left_child, leaves);
+    CollectLeaves(node->right_child, leaves);
+}
+
+/**
+ * Bring the leaves of the subtree within max_depth of the root, the subtree being at depth
+ * A subtree too deep is kept as is if its children can be fixed on their own, otherwise its leaves are rebuilt
+ * into a balanced tree, which any subtree reaching this far fits in as its parent checked it
+ * The leaves themselves are untouched, so their object ranges stay valid whatever the builder
+ */
+static void LimitDepth(unique_ptr<Node2>& node, int depth, int max_depth) {
+
+    if (node->object_count > 0 || depth + GetHeight(node.get()) <= max_depth)
+        return;
+
+    if (depth + 1 + BVH2::GetBalancedHeight(GetLeafCount(node->left_child.get())) > max_depth ||
+        depth + 1 + BVH2::GetBalancedHeight(GetLeafCount(node->right_child.get())) > max_depth) {
+
+        vector<unique_ptr<Node2>> leaves;
+        CollectLeaves(node, leaves);
+        node = unique_ptr<Node2>(BuildBalanced(leaves, 0, (int) leaves.size()));
+        return;
+    }
+
+    LimitDepth(node->left_child, depth + 1, max_depth);
+    LimitDepth(node->right_child, depth + 1, max_depth);
+}
+
+/**
+ * Median split of the leaves along the largest axis of their centers
+ */
+static Node2* BuildBalanced(vector<unique_ptr<Node2>>& leaves, int first, int last) {
+
+    if (last - first == 1)
+        return leaves[first].release();
 
     Node2* node = new Node2;
+
+    BoundingBox center_bbox;
+    for (int i = first; i < last; ++i) {
+        node->bbox.ExtendsBy(leaves[i]->bbox);
+        center_bbox.ExtendsBy(leaves[i]->bbox.GetCenter());
+    }
+
+    char axis = center_bbox.GetLargestAxis();
+    int middle = (first + last) / 2;
+
+    std::nth_element(leaves.begin() + first, leaves.begin() + middle, leaves.begin() + last,
+                     [axis] (const unique_ptr<Node2>& a, const unique_ptr<Node2>& b) {
+                         return a->bbox.GetCenter()[axis] < b->bbox.GetCenter()[axis];
+                     });
+
+    node->split_axis = axis;
+    node->left_child = unique_ptr<Node2>(BuildBalanced(leaves, first, middle));
+    node->right_child = unique_ptr<Node2>(BuildBalanced(leaves, middle, last));
+
+    return node;
+}
+
+/**
+ * Write the node at its already allocated index, then append its two children next to each other and flatten them,
+ * so the sibling pairs are in depth-first order
+ * The tree statistics are gathered here rather than during the build, which can run on several threads
+ */
+void BVH2::Flatten(const Node2* node, int index, int depth) {
+
+    max_depth = std::max(max_depth, short(depth));
     node_count++;
 
-    int obj_count = last - first;
-    if (obj_count == 1) {
-        node->object = objects[first].object;
-        node->bbox = objects[first].bbox;
+    nodes[index].min = node->bbox.min;
+    nodes[index].max = node->bbox.max;
+    nodes[index].split_axis = node->split_axis;
+
+    if (node->object_count > 0) {
+        if (node->spatial_objects.empty()) {
+            nodes[index].object_index = node->first_object;
+        }
+        else {
+            nodes[index].object_index = (int) ordered_primitives.size();
+            ordered_primitives.insert(ordered_primitives.end(), node->spatial_objects.begin(), node->spatial_objects.end());
+        }
+        nodes[index].object_count = (unsigned short) node->object_count;
+        leaf_count++;
     }
     else {
+        int first_child = (int) nodes.size();
+        nodes.resize(nodes.size() + 2);
+        nodes[index].object_count = 0;
+        nodes[index].first_child = first_child;
+        Flatten(node->left_child.get(), first_child, depth + 1);
+        Flatten(node->right_child.get(), first_child + 1, depth + 1);
+    }
+}
 
-        BoundingBox bbox = GetBoundingBoxForObjects(objects, first, last);
-        if (bbox == BoundingBox()) {
-            node->object = objects[first].object;
-            node->bbox = objects[first].bbox;
-            return node;
-        }
+Node2* BVH2::RecursiveBuild(vector<BuildInfo>& objects, int first, int last) {
 
-        char axis = bbox.GetLargestAxis();
-        int middle;
+    Node2* node = new Node2;
+
+    int obj_count = last - first;
+
+    BoundingBox bbox;
+    BoundingBox centroid_bbox;
+    ComputeBounds(objects, first, last, bbox, centroid_bbox);
+    node->bbox = bbox;
+
+    if (obj_count == 1 || (bbox == BoundingBox() && obj_count <= build_options.max_leaf_size)) {
+        node->first_object = first;
+        node->object_count = obj_count;
+        return node;
+    }
+
+    char axis = bbox.GetLargestAxis();
+    int middle;
 
 #if MID_POINT
-        middle = SplitAtPoint(objects, first, last, axis, bbox.GetCenter()[axis]);
+    middle = SplitAtPoint(objects, first, last, axis, bbox.GetCenter()[axis]);
 #elif defined EQUAL
-        middle = SplitEqualSets(objects, first, last, axis);
+    middle = SplitEqualSets(objects, first, last, axis);
 #elif defined SAH
-        middle = SplitSAH(objects, first, last, bbox);
+    SAHSplit split = FindSplitBinnedSAH(objects, first, last, bbox, centroid_bbox);
+
+    // Intersecting every object of a leaf vs one more traversal step then the objects of each child,
+    // weighted by the probability of a ray hitting the child knowing it hit the parent
+    float leaf_cost = obj_count * build_options.intersection_cost;
+    float split_cost = build_options.traversal_cost + split.cost * build_options.intersection_cost;
+
+    if (obj_count <= build_options.max_leaf_size && leaf_cost <= split_cost) {
+        node->first_object = first;
+        node->object_count = obj_count;
+        return node;
+    }
+
+    // All the centroids are at the same point, nothing to bin
+    if (split.axis == -1) {
+        middle = SplitEqualSets(objects, first, last, axis);
+    }
+    else {
+        axis = split.axis;
+        middle = SplitAtBin(objects, first, last, split, centroid_bbox);
+    }
 #endif
 
-        node->bbox = bbox;
-        node->split_axis = axis;
-        node->left_child = std::unique_ptr<Node2>(RecursiveBuild(objects, first, middle, depth + 1));
-        node->right_child = std::unique_ptr<Node2>(RecursiveBuild(objects, middle, last, depth + 1));
+    node->split_axis = axis;
+
+    // The children work on disjoint ranges of the objects
+    if (obj_count > PARALLEL_BUILD_MIN_OBJECTS) {
+#pragma omp task shared(objects) firstprivate(node, first, middle)
+        node->left_child = std::unique_ptr<Node2>(RecursiveBuild(objects, first, middle));
+
+        node->right_child = std::unique_ptr<Node2>(RecursiveBuild(objects, middle, last));
+#pragma omp taskwait
+    }
+    else {
+        node->left_child = std::unique_ptr<Node2>(RecursiveBuild(objects, first, middle));
+        node->right_child = std::unique_ptr<Node2>(RecursiveBuild(objects, middle, last));
     }
 
     return node;
 }
-/*
- * Compute the surface area of the bbox
- * Subdivide the largest axis at N split points, creating N + 1 sub-bboxes
- * For each side of each split,
- *      get every object whose bbox center falls inside the sub-bbox and compute their enclosing bbox
- *      compute the ratio of the parent bbox and this sub-bbox SA
- * Find the split for which the sum of each side SA ratio is minimal
+
+/**
+ * SBVH build, each node owns its references as the spatial splits can duplicate some of them in both children
+ * The duplication budget is shared between the children in proportion of their reference count
  */
-int SplitSAH(vector<BuildInfo>& objects, int first, int last, BoundingBox box) {
+Node2* BVH2::RecursiveBuildSpatial(vector<BuildInfo>& references, int budget, int depth, float root_surface_area) {
 
-    char axis = box.GetLargestAxis();
+    Node2* node = new Node2;
 
-    const int split_count = 20;
-    std::array<float, split_count> split_point_array;
+    int obj_count = (int) references.size();
 
-    float start = box.min[axis];
-    float end = box.max[axis];
+    BoundingBox bbox;
+    BoundingBox centroid_bbox;
+    ComputeBounds(references, 0, obj_count, bbox, centroid_bbox);
+    node->bbox = bbox;
+
+    if (depth == 0)
+        root_surface_area = bbox.GetSurfaceArea();
+
+    SAHSplit object_split;
+    SAHSplit spatial_split;
+
+    if (obj_count > 1 && !(bbox == BoundingBox())) {
+
+        object_split = FindSplitBinnedSAH(references, 0, obj_count, bbox, centroid_bbox);
+
+        // Spatial splits only help when the object split children overlap
+        if (budget > 0 && depth < SPATIAL_SPLIT_MAX_DEPTH) {
+            BoundingBox overlap = (object_split.axis == -1) ? bbox : ClipBBox(object_split.left_bbox, object_split.right_bbox);
+            if (!IsEmpty(overlap) && overlap.GetSurfaceArea() > SPATIAL_SPLIT_ALPHA * root_surface_area) {
+                spatial_split = FindSpatialSplitSAH(references, bbox);
+            }
+        }
 
-    float step = std::abs(start - end) / (split_count + 1);
+        float leaf_cost = obj_count * build_options.intersection_cost;
+        float split_cost = build_options.traversal_cost + std::min(object_split.cost, spatial_split.cost) * build_options.intersection_cost;
 
-    for (int i = 0; i < split_count; ++i) {
-        split_point_array[i] = start + step * (i + 1);
+        if (obj_count > build_options.max_leaf_size || leaf_cost > split_cost)
+            node->object_count = 0;
+        else
+            node->object_count = obj_count;
+    }
+    else if (obj_count <= build_options.max_leaf_size) {
+        node->object_count = obj_count;
     }
 
-    float parent_surface_area = box.GetSurfaceArea();
+    if (node->object_count > 0) {
+        node->spatial_objects.reserve(references.size());
+        for (const BuildInfo& reference : references) {
+            node->spatial_objects.push_back(reference.primitive);
+        }
+        return node;
+    }
 
-    std::array<float, split_count> sah_costs;
+    vector<BuildInfo> left;
+    vector<BuildInfo> right;
+
+    char axis = bbox.GetLargestAxis();
+
+    if (spatial_split.cost < object_split.cost) {
+        SplitSpatially(references, spatial_split, bbox, budget, left, right);
+        axis = spatial_split.axis;
+    }
+
+    // Fallback to the object split if every reference ended on the same side
+    if (left.empty() || right.empty()) {
+        int middle;
+        if (object_split.axis == -1) {
+            middle = SplitEqualSets(references, 0, obj_count, axis);
+        }
+        else {
+            axis = object_split.axis;
+            middle = SplitAtBin(references, 0, obj_count, object_split, centroid_bbox);
+        }
+        left.assign(references.begin(), references.begin() + middle);
+        right.assign(references.begin() + middle, references.end());
+    }
+
+    // The children have their own copies
+    vector<BuildInfo>().swap(references);
+
+    int left_budget = int((long long) budget * left.size() / (left.size() + right.size()));
+    int right_budget = budget - left_budget;
+
+    node->split_axis = axis;
+
+    if (obj_count > PARALLEL_BUILD_MIN_OBJECTS) {
+#pragma omp task shared(left) firstprivate(node, left_budget, depth, root_surface_area)
+        node->left_child = std::unique_ptr<Node2>(RecursiveBuildSpatial(left, left_budget, depth + 1, root_surface_area));
+
+        node->right_child = std::unique_ptr<Node2>(RecursiveBuildSpatial(right, right_budget, depth + 1, root_surface_area));
+#pragma omp taskwait
+    }
+    else {
+        node->left_child = std::unique_ptr<Node2>(RecursiveBuildSpatial(left, left_budget, depth + 1, root_surface_area));
+        node->right_child = std::unique_ptr<Node2>(RecursiveBuildSpatial(right, right_budget, depth + 1, root_surface_area));
+    }
+
+    return node;
+}
+
+static inline int ComputeBinIndex(float centroid, float axis_min, float bin_scale) {
+    int bin = static_cast<int>((centroid - axis_min) * bin_scale);
+    return std::min(std::max(bin, 0), SAH_BIN_COUNT - 1);
+}
+
+/**
+ * Binned SAH, for each axis:
+ *      put every object in one of SAH_BIN_COUNT bins spread over the centroid bounds, extending the bin bbox
+ *      sweep the bins from the right to get the bbox and object count right of each bin boundary
+ *      sweep the bins from the left and evaluate the SAH at each boundary
+ * So finding the split is O(N) per node instead of O(N * split_count)
+ * @return The split of minimal SAH cost, the cost is in number of object intersections
+ *         and its axis is -1 if the objects could not be separated
+ */
+SAHSplit FindSplitBinnedSAH(const vector<BuildInfo>& objects, int first, int last, const BoundingBox& bbox, const BoundingBox& centroid_bbox) {
+
+    SAHSplit best_split;
+
+    float parent_surface_area = bbox.GetSurfaceArea();
+
+    std::array<SAHBin, SAH_BIN_COUNT> axis_bins[3];
+
+    int chunk_count = GetChunkCount(last - first);
+
+    if (chunk_count == 1) {
+        BinObjects(objects, first, last, centroid_bbox, axis_bins);
+    }
+    else {
+        // Each chunk fills its own bins, merged afterwards
+        // Merging bboxes and counts gives the same bins whatever the chunk count so the split stays deterministic
+        vector<std::array<SAHBin, SAH_BIN_COUNT>> chunk_bins((size_t) chunk_count * 3);
+
+        for (int chunk = 0; chunk < chunk_count; ++chunk) {
+#pragma omp task shared(objects, centroid_bbox, chunk_bins) firstprivate(chunk)
+            {
+                int chunk_first = first + (int) ((long long) (last - first) * chunk / chunk_count);
+                int chunk_last = first + (int) ((long long) (last - first) * (chunk + 1) / chunk_count);
+                BinObjects(objects, chunk_first, chunk_last, centroid_bbox, &chunk_bins[chunk * 3]);
+            }
+        }
+#pragma omp taskwait
+
+        for (int chunk = 0; chunk < chunk_count; ++chunk) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < SAH_BIN_COUNT; ++i) {
+                    const SAHBin& bin = chunk_bins[chunk * 3 + axis][i];
+                    if (bin.count > 0) {
+                        axis_bins[axis][i].bbox.ExtendsBy(bin.bbox);
+                        axis_bins[axis][i].count += bin.count;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+
+        float extent = centroid_bbox.max[axis] - centroid_bbox.min[axis];
+
+        if (extent <= 0)
+            continue;
+
+        const std::array<SAHBin, SAH_BIN_COUNT>& bins = axis_bins[axis];
+
+        // Boundary i separates bins [0, i] from bins [i + 1, SAH_BIN_COUNT - 1]
+        std::array<BoundingBox, SAH_BIN_COUNT - 1> right_bbox;
+        std::array<int, SAH_BIN_COUNT - 1> right_count;
 
-    for (int i = 0; i < split_count; ++i) {
-        BoundingBox left;
         BoundingBox right;
-        int left_count = 0;
-        int right_count = 0;
-        for (int j = first; j < last; ++j) {
-            const BuildInfo& object = objects[j];
-            float obj_center = object.bbox_center[axis];
-//            float obj_center = object->GetCenter()[axis];
-            if (obj_center <= split_point_array[i]) {
-                left.ExtendsBy(object.bbox);
-                left_count++;
+        int count = 0;
+        for (int i = SAH_BIN_COUNT - 1; i > 0; --i) {
+            // Extending by an empty bbox would make it infinite
+            if (bins[i].count > 0) {
+                right.ExtendsBy(bins[i].bbox);
+                count += bins[i].count;
             }
-            else {
-                right.ExtendsBy(object.bbox);
-                right_count++;
+            right_bbox[i - 1] = right;
+            right_count[i - 1] = count;
+        }
+
+        BoundingBox left;
+        count = 0;
+        for (int i = 0; i < SAH_BIN_COUNT - 1; ++i) {
+            if (bins[i].count > 0) {
+                left.ExtendsBy(bins[i].bbox);
+                count += bins[i].count;
+            }
+            if (count == 0 || right_count[i] == 0)
+                continue;
+
+            float cost = count * left.GetSurfaceArea() + right_count[i] * right_bbox[i].GetSurfaceArea();
+            if (cost < best_split.cost) {
+                best_split.cost = cost;
+                best_split.axis = (char) axis;
+                best_split.bin = i;
+                best_split.left_bbox = left;
+                best_split.right_bbox = right_bbox[i];
+                best_split.left_count = count;
+                best_split.right_count = right_count[i];
             }
         }
-        sah_costs[i] = ((left_count * left.GetSurfaceArea()) + (right_count * right.GetSurfaceArea())) / parent_surface_area;
     }
 
-    int min_cost_index = 0;
+    if (best_split.axis != -1) {
+        // A flat bbox gives no information on the hit probabilities, consider every child always hit
+        best_split.cost = (parent_surface_area > 0) ? best_split.cost / parent_surface_area : (last - first);
+    }
+
+    return best_split;
+}
+
+/**
+ * Put each object in its bin along each axis, the bins must be empty
+ */
+void BinObjects(const vector<BuildInfo>& objects, int first, int last, const BoundingBox& centroid_bbox, std::array<SAHBin, SAH_BIN_COUNT>* bins) {
+
+    for (int axis = 0; axis < 3; ++axis) {
+
+        float axis_min = centroid_bbox.min[axis];
+        float extent = centroid_bbox.max[axis] - axis_min;
+
+        if (extent <= 0)
+            continue;
+
+        float bin_scale = SAH_BIN_COUNT / extent;
+
+        for (int i = first; i < last; ++i) {
+            SAHBin& bin = bins[axis][ComputeBinIndex(objects[i].bbox_center[axis], axis_min, bin_scale)];
+            bin.bbox.ExtendsBy(objects[i].bbox);
+            bin.count++;
+        }
+    }
+}
+
+/**
+ * Split all objects in 2 sets in place, the ones binned left of the split boundary first
+ */
+int SplitAtBin(vector<BuildInfo>& objects, int first, int last, const SAHSplit& split, const BoundingBox& centroid_bbox) {
+
+    char axis = split.axis;
+    float axis_min = centroid_bbox.min[axis];
+    float bin_scale = SAH_BIN_COUNT / (centroid_bbox.max[axis] - axis_min);
+
+    const auto& middle_it = std::partition(&objects[first], &objects[last], [=] (const BuildInfo& i) {
+        return ComputeBinIndex(i.bbox_center[axis], axis_min, bin_scale) <= split.bin;
+    });
+
+    int middle = static_cast<int>(middle_it - &objects.front());
+
+    if (middle == first || middle == last) {
+        middle = SplitEqualSets(objects, first, last, axis);
+    }
+
+    return middle;
+}
+
+/**
+ * Spatial binned SAH, for each axis:
+ *      the node bbox is divided in SAH_BIN_COUNT bins of equal width
+ *      each reference is clipped to every bin it overlaps, extending the bin bbox by its clipped bbox,
+ *      and counted as entering its first bin and exiting its last bin
+ *      the bins are then swept as for the object split, the references straddling a boundary being counted on both sides
+ * @return The split of minimal SAH cost, the cost is in number of object intersections
+ *         and its axis is -1 if no split separates the references
+ */
+SAHSplit FindSpatialSplitSAH(const vector<BuildInfo>& references, const BoundingBox& bbox) {
+
+    SAHSplit best_split;
+
+    float parent_surface_area = bbox.GetSurfaceArea();
+
+    for (char axis = 0; axis < 3; ++axis) {
+
+        float axis_min = bbox.min[axis];
+        float extent = bbox.max[axis] - axis_min;
+
+        if (extent <= 0)
+            continue;
+
+        float bin_scale = SAH_BIN_COUNT / extent;
+        float bin_width = extent / SAH_BIN_COUNT;
+
+        std::array<SpatialBin, SAH_BIN_COUNT> bins;
+
+        for (const BuildInfo& reference : references) {
+
+            int first_bin = ComputeBinIndex(reference.bbox.min[axis], axis_min, bin_scale);
+            int last_bin = ComputeBinIndex(reference.bbox.max[axis], axis_min, bin_scale);
+
+            if (first_bin == last_bin) {
+                bins[first_bin].bbox.ExtendsBy(reference.bbox);
+            }
+            else {
+                for (int i = first_bin; i <= last_bin; ++i) {
+                    float bin_min = axis_min + i * bin_width;
+                    float bin_max = (i == SAH_BIN_COUNT - 1) ? bbox.max[axis] : bin_min + bin_width;
+                    BoundingBox clipped = ClipBBox(reference.primitive.ComputeClippedBBox(axis, bin_min, bin_max), reference.bbox);
+                    if (!IsEmpty(clipped))
+                        bins[i].bbox.ExtendsBy(clipped);
+                }
+            }
+
+            bins[first_bin].entry_count++;
+            bins[last_bin].exit_count++;
+        }
+
+        // Boundary i separates bins [0, i] from bins [i + 1, SAH_BIN_COUNT - 1]
+        std::array<BoundingBox, SAH_BIN_COUNT - 1> right_bbox;
+        std::array<int, SAH_BIN_COUNT - 1> right_count;
+
+        BoundingBox right;
+        int count = 0;
+        for (int i = SAH_BIN_COUNT - 1; i > 0; --i) {
+            // A bin crossed by references can have a bbox without entry or exit
+            if (!IsEmpty(bins[i].bbox))
+                right.ExtendsBy(bins[i].bbox);
+            count += bins[i].exit_count;
+            right_bbox[i - 1] = right;
+            right_count[i - 1] = count;
+        }
 
-    for (int i = 0; i < split_count; ++i) {
-        if (sah_costs[i] < sah_costs[min_cost_index]) {
-            min_cost_index = i;
+        BoundingBox left;
+        count = 0;
+        for (int i = 0; i < SAH_BIN_COUNT - 1; ++i) {
+            if (!IsEmpty(bins[i].bbox))
+                left.ExtendsBy(bins[i].bbox);
+            count += bins[i].entry_count;
+
+            if (count == 0 || right_count[i] == 0)
+                continue;
+
+            float cost = count * left.GetSurfaceArea() + right_count[i] * right_bbox[i].GetSurfaceArea();
+            if (cost < best_split.cost) {
+                best_split.cost = cost;
+                best_split.axis = axis;
+                best_split.bin = i;
+                best_split.left_bbox = left;
+                best_split.right_bbox = right_bbox[i];
+                best_split.left_count = count;
+                best_split.right_count = right_count[i];
+            }
         }
     }
 
-    float split_point = split_point_array[min_cost_index];
+    if (best_split.axis != -1) {
+        best_split.cost = (parent_surface_area > 0) ? best_split.cost / parent_surface_area : references.size();
+    }
 
-    return SplitAtPoint(objects, first, last, axis, split_point);
+    return best_split;
+}
+
+/**
+ * Distribute the references on each side of the spatial split plane
+ * A reference straddling the plane is clipped and duplicated on both sides while the budget allows it,
+ * unless moving it entirely to one side is cheaper (reference unsplitting)
+ */
+void SplitSpatially(const vector<BuildInfo>& references, const SAHSplit& split, const BoundingBox& bbox, int& budget,
+                    vector<BuildInfo>& left, vector<BuildInfo>& right) {
+
+    char axis = split.axis;
+    float axis_min = bbox.min[axis];
+    float extent = bbox.max[axis] - axis_min;
+    float bin_scale = SAH_BIN_COUNT / extent;
+    float position = axis_min + (split.bin + 1) * (extent / SAH_BIN_COUNT);
+
+    float left_area = split.left_bbox.GetSurfaceArea();
+    float right_area = split.right_bbox.GetSurfaceArea();
+
+    for (const BuildInfo& reference : references) {
+
+        // Same classification as the binning
+        int first_bin = ComputeBinIndex(reference.bbox.min[axis], axis_min, bin_scale);
+        int last_bin = ComputeBinIndex(reference.bbox.max[axis], axis_min, bin_scale);
+
+        if (last_bin <= split.bin) {
+            left.push_back(reference);
+            continue;
+        }
+        if (first_bin > split.bin) {
+            right.push_back(reference);
+            continue;
+        }
+
+        float split_cost = left_area * split.left_count + right_area * split.right_count;
+        float left_only_cost = BoundingBox {split.left_bbox}.ExtendsBy(reference.bbox).GetSurfaceArea() * split.left_count
+                             + right_area * (split.right_count - 1);
+        float right_only_cost = left_area * (split.left_count - 1)
+                              + BoundingBox {split.right_bbox}.ExtendsBy(reference.bbox).GetSurfaceArea() * split.right_count;
+
+        if (budget > 0 && split_cost < left_only_cost && split_cost < right_only_cost) {
+
+            BuildInfo left_reference = reference;
+            BuildInfo right_reference = reference;
+            left_reference.bbox = ClipBBox(reference.primitive.ComputeClippedBBox(axis, reference.bbox.min[axis], position), reference.bbox);
+            right_reference.bbox = ClipBBox(reference.primitive.ComputeClippedBBox(axis, position, reference.bbox.max[axis]), reference.bbox);
+
+            // The primitive can just touch the plane
+            if (IsEmpty(left_reference.bbox)) {
+                right.push_back(reference);
+            }
+            else if (IsEmpty(right_reference.bbox)) {
+                left.push_back(reference);
+            }
+            else {
+                left_reference.bbox_center = left_reference.bbox.GetCenter();
+                right_reference.bbox_center = right_reference.bbox.GetCenter();
+                left.push_back(left_reference);
+                right.push_back(right_reference);
+                budget--;
+            }
+        }
+        else if (left_only_cost <= right_only_cost) {
+            left.push_back(reference);
+        }
+        else {
+            right.push_back(reference);
+        }
+    }
 }
 
 /**
@@ -192,100 +844,662 @@ int SplitEqualSets(vector<BuildInfo>& objects, int first, int last, char axis) {
     // Slit all objects in 2 sets of equal sizes
     int middle = (last + first) / 2;
     std::nth_element(&objects[first], &objects[middle], &objects[last], [=] (BuildInfo& a, BuildInfo& b) {
-        return a.object->GetCenter()[axis] < b.object->GetCenter()[axis];
+        return a.bbox_center[axis] < b.bbox_center[axis];
     });
 
     return middle;
 }
 
-BoundingBox GetBoundingBoxForObjects(const vector<BuildInfo>& objects, int start, int end) {
+/**
+ * Bounds of the objects and of their centers, in a single pass
+ */
+void ComputeBounds(const vector<BuildInfo>& objects, int first, int last, BoundingBox& bbox, BoundingBox& centroid_bbox) {
 
-    BoundingBox bbox;
-    for (int i = start; i < end; ++i) {
-        bbox.ExtendsBy(objects[i].bbox);
+    int chunk_count = GetChunkCount(last - first);
+
+    if (chunk_count == 1) {
+        for (int i = first; i < last; ++i) {
+            bbox.ExtendsBy(objects[i].bbox);
+            centroid_bbox.ExtendsBy(objects[i].bbox_center);
+        }
+        return;
+    }
+
+    vector<BoundingBox> chunk_bbox((size_t) chunk_count);
+    vector<BoundingBox> chunk_centroid_bbox((size_t) chunk_count);
+
+    for (int chunk = 0; chunk < chunk_count; ++chunk) {
+#pragma omp task shared(objects, chunk_bbox, chunk_centroid_bbox) firstprivate(chunk)
+        {
+            int chunk_first = first + (int) ((long long) (last - first) * chunk / chunk_count);
+            int chunk_last = first + (int) ((long long) (last - first) * (chunk + 1) / chunk_count);
+            for (int i = chunk_first; i < chunk_last; ++i) {
+                chunk_bbox[chunk].ExtendsBy(objects[i].bbox);
+                chunk_centroid_bbox[chunk].ExtendsBy(objects[i].bbox_center);
+            }
+        }
+    }
+#pragma omp taskwait
+
+    for (int chunk = 0; chunk < chunk_count; ++chunk) {
+        bbox.ExtendsBy(chunk_bbox[chunk]);
+        centroid_bbox.ExtendsBy(chunk_centroid_bbox[chunk]);
     }
-    return bbox;
 }
 
-bool BVH2::FindNearestIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object) {
+/**
+ * Number of chunks a range of objects is split in to be processed by parallel tasks
+ * @return 1 when the range is too small to be worth it or when OpenMP is disabled
+ */
+int GetChunkCount(int obj_count) {
 
-    FastRay fast_ray {ray};
+#ifdef USE_OPENMP
+    if (obj_count > PARALLEL_CHUNK_MIN_OBJECTS) {
+        int max_chunk_count = obj_count / (PARALLEL_CHUNK_MIN_OBJECTS / 2);
+        return std::min(omp_get_num_threads(), max_chunk_count);
+    }
+#endif
+    return 1;
+}
 
-    return IntersectNode(fast_ray, dist_out, hit_object, root);
-//    return IntersectNodeFast(fast_ray, dist_out, hit_object, root);
+/**
+ * The order of the primitives inside a leaf doesn't matter to the nearest hit, the triangles are moved first
+ * so the mixed traversals test them without a type check until the first other primitive
+ */
+void BVH2::SortLeafPrimitives() {
 
+    for (const LinearNode2& node : nodes) {
+        if (node.object_count > 0) {
+            auto first = ordered_primitives.begin() + node.object_index;
+            std::stable_partition(first, first + node.object_count, [] (const Primitive& primitive) { return primitive.IsTriangle(); });
+        }
+    }
 }
 
-bool BVH2::FindNearestIntersectionOpti(const Ray& ray, float& dist_out, Object3D*& hit_object) {
+/**
+ * Update the node bounds to the current object bounds while keeping the tree topology, for objects that moved or were resized
+ * Children are always stored after their parent so a single reverse pass over the node array is a bottom-up traversal
+ * The leaves of a spatial split build take the full bounds of their references, looser than the clipped ones but still conservative
+ * @param rebuild_ratio Max ratio between the SAH cost of the refitted tree and the one it was built with
+ * @return False if the refitted tree degraded past this ratio, it should be rebuilt then
+ */
+bool BVH2::Refit(float rebuild_ratio) {
 
-    const FastRay fast_ray {ray};
+    if (nodes.empty())
+        return true;
 
-    char direction_sign = static_cast<char>((ray.direction.x > 0) + 2 * (ray.direction.y > 0) + 4 * (ray.direction.z > 0));
+    Chronometer chrono;
 
-    return IntersectNodeOpti(fast_ray, dist_out, hit_object, root, direction_sign);
-//    return IntersectNodeFast(fast_ray, dist_out, hit_object, root);
+    // The triangles moved too
+    triangle_records = CreateTriangleRecords(ordered_primitives);
+    triangle_blocks.Refit(triangle_records);
 
-}
+    for (int i = (int) nodes.size() - 1; i >= 0; --i) {
 
-bool BVH2::IntersectNodeOpti(const FastRay& ray, float& dist_out, Object3D*& hit_object, const unique_ptr<Node2>& node, char direction_sign) {
+        LinearNode2& node = nodes[i];
 
-    float dist;
-//    ray_bbox_test_count++;
-    // We intersect this node
-//    if (node->bbox.IntersectBranched(ray, dist) && (dist < dist_out)) {
-    if (node->bbox.IntersectFast(ray, dist) && (dist < dist_out)) {
-//        ray_bbox_hit_count++;
+        BoundingBox bbox;
 
-        // If no children, this node is a leaf so intersect the object it contains
-        if (node->object != nullptr) {
-//            ray_obj_test_count++;
-            if (node->object->Intersect(ray, dist) && (dist < dist_out)) {
-//                ray_obj_hit_count++;
-                dist_out = dist;
-                hit_object = node->object;
+        if (node.object_count > 0) {
+            bbox = ordered_primitives[node.object_index].ComputeBBox();
+            for (int j = node.object_index + 1; j < node.object_index + node.object_count; ++j) {
+                bbox.ExtendsBy(ordered_primitives[j].ComputeBBox());
             }
         }
         else {
-            if (direction_sign & (1 << node->split_axis)) {
-                IntersectNodeOpti(ray, dist_out, hit_object, node->left_child, direction_sign);
-                IntersectNodeOpti(ray, dist_out, hit_object, node->right_child, direction_sign);
+            const LinearNode2& left = nodes[node.first_child];
+            const LinearNode2& right = nodes[node.first_child + 1];
+            bbox = BoundingBox {left.min, left.max};
+            bbox.ExtendsBy(BoundingBox {right.min, right.max});
+        }
+
+        node.min = bbox.min;
+        node.max = bbox.max;
+    }
+
+    sah_cost = ComputeSAHCost();
+
+    cout << "BVH refitted in " << chrono.GetMilliseconds() << " ms, SAH cost: " << sah_cost << " (built at " << build_sah_cost << ")" << endl;
+
+    return sah_cost <= build_sah_cost * rebuild_ratio;
+}
+
+/**
+ * Move the sibling pairs to the order of the layout, the root stays at index 0
+ * Only the child indices change, as the pairs keep the same leaves the object order is untouched
+ */
+void BVH2::ApplyLayout(int layout) {
+
+    vector<int> pair_order = ComputeSiblingPairOrder(nodes, layout);
+
+    if (pair_order.empty())
+        return;
+
+    // Destination of each pair, by the index of its left node
+    vector<int> new_pair_index(nodes.size(), -1);
+    for (size_t i = 0; i < pair_order.size(); ++i) {
+        new_pair_index[pair_order[i]] = 1 + 2 * int(i);
+    }
+
+    vector<LinearNode2> ordered_nodes(nodes.size());
+    ordered_nodes[0] = nodes[0];
+
+    for (size_t i = 0; i < pair_order.size(); ++i) {
+        ordered_nodes[1 + 2 * i] = nodes[pair_order[i]];
+        ordered_nodes[2 + 2 * i] = nodes[pair_order[i] + 1];
+    }
+
+    for (LinearNode2& node : ordered_nodes) {
+        if (node.object_count == 0)
+            node.first_child = new_pair_index[node.first_child];
+    }
+
+    nodes = std::move(ordered_nodes);
+    build_options.node_layout = layout;
+}
+
+/**
+ * Sum over all nodes of their cost weighted by the probability of a ray hitting them knowing it hit the root
+ * @return The expected cost of a ray traversal, in number of object intersections
+ */
+float BVH2::ComputeSAHCost() const {
+
+    float root_surface_area = GetBounds().GetSurfaceArea();
+    if (root_surface_area <= 0)
+        return 0;
+
+    float cost = 0;
+
+    for (const LinearNode2& node : nodes) {
+        float area_ratio = BoundingBox {node.min, node.max}.GetSurfaceArea() / root_surface_area;
+        if (node.object_count == 0)
+            cost += area_ratio * build_options.traversal_cost;
+        else
+            cost += area_ratio * node.object_count * build_options.intersection_cost;
+    }
+
+    return cost / build_options.intersection_cost;
+}
+
+/**
+ * Same slab test as BoundingBox::IntersectFast but on the raw node bounds so it can be inlined in the traversal loops
+ */
+static inline bool IntersectNodeBounds(const LinearNode2& node, const FastRay& ray, float& distance) {
+
+    float t_nearest;
+    float t_farthest;
+
+    float t_nearest_axis = (node.min.x - ray.origin.x) * ray.direction_inv.x;
+    float t_farthest_axis = (node.max.x - ray.origin.x) * ray.direction_inv.x;
+
+    t_nearest = std::min(t_nearest_axis, t_farthest_axis);
+    t_farthest = std::max(t_nearest_axis, t_farthest_axis);
+
+    t_nearest_axis = (node.min.y - ray.origin.y) * ray.direction_inv.y;
+    t_farthest_axis = (node.max.y - ray.origin.y) * ray.direction_inv.y;
+
+    t_nearest = std::max(t_nearest, std::min(t_nearest_axis, t_farthest_axis));
+    t_farthest = std::min(t_farthest, std::max(t_nearest_axis, t_farthest_axis));
+
+    t_nearest_axis = (node.min.z - ray.origin.z) * ray.direction_inv.z;
+    t_farthest_axis = (node.max.z - ray.origin.z) * ray.direction_inv.z;
+
+    t_nearest = std::max(t_nearest, std::min(t_nearest_axis, t_farthest_axis));
+    t_farthest = std::min(t_farthest, std::max(t_nearest_axis, t_farthest_axis));
+
+    distance = t_nearest;
+
+    return (t_nearest <= t_farthest) && ((t_nearest > 0) || (t_farthest > 0));
+}
+
+/**
+ * Bounds of the origins and inverse directions of a packet whose rays all go the same way on each axis, one axis per lane
+ * The entry and exit distances of every ray of the packet are within the interval products of these bounds
+ */
+struct PacketFrustum {
+    __m128 positive;    // All bits set for the axes the rays go up
+    __m128 origin_min;
+    __m128 origin_max;
+    __m128 direction_inv_min;
+    __m128 direction_inv_max;
+};
+
+static inline __m128 IntervalProductMin(__m128 a_min, __m128 a_max, __m128 b_min, __m128 b_max) {
+    return _mm_min_ps(_mm_min_ps(_mm_mul_ps(a_min, b_min), _mm_mul_ps(a_min, b_max)), _mm_min_ps(_mm_mul_ps(a_max, b_min), _mm_mul_ps(a_max, b_max)));
+}
+
+static inline __m128 IntervalProductMax(__m128 a_min, __m128 a_max, __m128 b_min, __m128 b_max) {
+    return _mm_max_ps(_mm_max_ps(_mm_mul_ps(a_min, b_min), _mm_mul_ps(a_min, b_max)), _mm_max_ps(_mm_mul_ps(a_max, b_min), _mm_mul_ps(a_max, b_max)));
+}
+
+/**
+ * Conservative test of the whole packet, when the latest entry of the packet is after its earliest exit no ray can hit the node
+ */
+static inline bool FrustumMissesNode(const LinearNode2& node, const PacketFrustum& frustum) {
+
+    __m128 node_min = _mm_setr_ps(node.min.x, node.min.y, node.min.z, 0.f);
+    __m128 node_max = _mm_setr_ps(node.max.x, node.max.y, node.max.z, 0.f);
+
+    __m128 near_plane = _mm_or_ps(_mm_and_ps(frustum.positive, node_min), _mm_andnot_ps(frustum.positive, node_max));
+    __m128 far_plane = _mm_or_ps(_mm_and_ps(frustum.positive, node_max), _mm_andnot_ps(frustum.positive, node_min));
+
+    __m128 t_near = IntervalProductMin(_mm_sub_ps(near_plane, frustum.origin_max), _mm_sub_ps(near_plane, frustum.origin_min),
+                                       frustum.direction_inv_min, frustum.direction_inv_max);
+    __m128 t_far = IntervalProductMax(_mm_sub_ps(far_plane, frustum.origin_max), _mm_sub_ps(far_plane, frustum.origin_min),
+                                      frustum.direction_inv_min, frustum.direction_inv_max);
+
+    alignas(16) float t_near_axis[4];
+    alignas(16) float t_far_axis[4];
+    _mm_store_ps(t_near_axis, t_near);
+    _mm_store_ps(t_far_axis, t_far);
+
+    float t_nearest = std::max(std::max(t_near_axis[0], t_near_axis[1]), t_near_axis[2]);
+    float t_farthest = std::min(std::min(t_far_axis[0], t_far_axis[1]), t_far_axis[2]);
+
+    return (t_nearest > t_farthest) || (t_farthest < 0);
+}
+
+/**
+ * Slab test of 4 rays of the packet, from lane first_lane
+ * @return The mask of the rays hitting the node before their nearest hit so far
+ */
+static inline int IntersectNodeBounds(const LinearNode2& node, const RayPacket& packet, int first_lane) {
+
+    __m128 t_nearest = _mm_set1_ps(-std::numeric_limits<float>::max());
+    __m128 t_farthest = _mm_set1_ps(std::numeric_limits<float>::max());
+
+    for (int axis = 0; axis < 3; ++axis) {
+
+        __m128 origin = _mm_load_ps(&packet.origin[axis][first_lane]);
+        __m128 direction_inv = _mm_load_ps(&packet.direction_inv[axis][first_lane]);
+
+        __m128 t_min = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min[axis]), origin), direction_inv);
+        __m128 t_max = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max[axis]), origin), direction_inv);
+
+        t_nearest = _mm_max_ps(t_nearest, _mm_min_ps(t_min, t_max));
+        t_farthest = _mm_min_ps(t_farthest, _mm_max_ps(t_min, t_max));
+    }
+
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(t_nearest, t_farthest), _mm_cmpgt_ps(t_farthest, _mm_setzero_ps()));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(t_nearest, _mm_load_ps(&packet.dist[first_lane])));
+
+    return _mm_movemask_ps(hit);
+}
+
+/**
+ * Unordered traversal, children are always visited left then right
+ */
+bool BVH2::FindNearestIntersection(const Ray& ray, HitRecord& hit) const {
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseNearest<TRIANGLE_PRIMITIVES>(FastRay {ray}, hit);
+        case SPHERE_PRIMITIVES:   return TraverseNearest<SPHERE_PRIMITIVES>(FastRay {ray}, hit);
+        default:                  return TraverseNearest<MIXED_PRIMITIVES>(FastRay {ray}, hit);
+    }
+}
+
+template <int PRIMITIVE_SET>
+bool BVH2::TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const {
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < hit.dist)) {
+
+            if (node.object_count == 0) {
+                stack[stack_size++] = node.first_child + 1;
+                node_index = node.first_child;
+                continue;
+            }
+
+            LeafIntersector<PRIMITIVE_SET>::FindNearest(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                        node.object_index, node.object_index + node.object_count, fast_ray, hit);
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+
+    return (hit.primitive.object != nullptr);
+}
+
+/**
+ * Ordered traversal, the child on the side the ray comes from along the node split axis is visited first
+ * so the far child is often culled by the closer hit distance
+ */
+bool BVH2::FindNearestIntersectionOpti(const Ray& ray, HitRecord& hit) const {
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseNearestOrdered<TRIANGLE_PRIMITIVES>(0, FastRay {ray}, hit);
+        case SPHERE_PRIMITIVES:   return TraverseNearestOrdered<SPHERE_PRIMITIVES>(0, FastRay {ray}, hit);
+        default:                  return TraverseNearestOrdered<MIXED_PRIMITIVES>(0, FastRay {ray}, hit);
+    }
+}
+
+/**
+ * Ordered traversal of the subtree of node_index, the child on the side the ray comes from is visited first
+ * The packet traversal also ends with it once a single ray is left
+ */
+template <int PRIMITIVE_SET>
+bool BVH2::TraverseNearestOrdered(int node_index, const FastRay& fast_ray, HitRecord& hit) const {
+
+    char direction_sign = static_cast<char>((fast_ray.direction.x > 0) + 2 * (fast_ray.direction.y > 0) + 4 * (fast_ray.direction.z > 0));
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+//        ray_bbox_test_count++;
+
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < hit.dist)) {
+//            ray_bbox_hit_count++;
+
+            if (node.object_count == 0) {
+                if (direction_sign & (1 << node.split_axis)) {
+                    stack[stack_size++] = node.first_child + 1;
+                    node_index = node.first_child;
+                }
+                else {
+                    stack[stack_size++] = node.first_child;
+                    node_index = node.first_child + 1;
+                }
+                continue;
+            }
+
+//            ray_obj_test_count += node.object_count;
+            LeafIntersector<PRIMITIVE_SET>::FindNearest(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                        node.object_index, node.object_index + node.object_count, fast_ray, hit);
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+
+    return (hit.primitive.object != nullptr);
+}
+
+/**
+ * Ordered traversal of a packet of coherent rays, a node is visited once for all the rays still hitting it
+ * The rays missing a node are masked out in its subtree, a packet left with a single ray goes on with the single ray traversal,
+ * as does a packet whose rays don't share the direction signs the children order and the frustum test rely on
+ * The frustum test rejects the nodes missed by the whole packet before testing its rays one by one
+ */
+void BVH2::FindNearestIntersection(RayPacket& packet) const {
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: TraversePacket<TRIANGLE_PRIMITIVES>(packet); break;
+        case SPHERE_PRIMITIVES:   TraversePacket<SPHERE_PRIMITIVES>(packet); break;
+        default:                  TraversePacket<MIXED_PRIMITIVES>(packet); break;
+    }
+}
+
+template <int PRIMITIVE_SET>
+void BVH2::TraversePacket(RayPacket& packet) const {
+
+    FastRay fast_rays[RayPacket::SIZE];
+    PacketFrustum frustum;
+
+    bool coherent = true;
+    bool use_frustum = true;
+    int direction_sign = -1;
+
+    Vec3 origin_min {std::numeric_limits<float>::max()};
+    Vec3 origin_max {-std::numeric_limits<float>::max()};
+    Vec3 direction_inv_min {std::numeric_limits<float>::max()};
+    Vec3 direction_inv_max {-std::numeric_limits<float>::max()};
+
+    for (int lane = 0; lane < RayPacket::SIZE; ++lane) {
+
+        if ((packet.active_mask & (1 << lane)) == 0)
+            continue;
+
+        FastRay& fast_ray = fast_rays[lane];
+
+        for (int axis = 0; axis < 3; ++axis) {
+            fast_ray.origin[axis] = packet.origin[axis][lane];
+            fast_ray.direction[axis] = packet.direction[axis][lane];
+            fast_ray.direction_inv[axis] = packet.direction_inv[axis][lane];
+
+            origin_min[axis] = std::min(origin_min[axis], fast_ray.origin[axis]);
+            origin_max[axis] = std::max(origin_max[axis], fast_ray.origin[axis]);
+            direction_inv_min[axis] = std::min(direction_inv_min[axis], fast_ray.direction_inv[axis]);
+            direction_inv_max[axis] = std::max(direction_inv_max[axis], fast_ray.direction_inv[axis]);
+
+            // An axis parallel ray has an infinite inverse direction, the interval products could be NaN
+            use_frustum &= std::abs(fast_ray.direction_inv[axis]) <= std::numeric_limits<float>::max();
+        }
+
+        int lane_sign = (fast_ray.direction.x > 0) + 2 * (fast_ray.direction.y > 0) + 4 * (fast_ray.direction.z > 0);
+        coherent &= (direction_sign == -1) || (lane_sign == direction_sign);
+        direction_sign = lane_sign;
+    }
+
+    if (coherent == false) {
+        for (int lane = 0; lane < RayPacket::SIZE; ++lane) {
+            if ((packet.active_mask & (1 << lane)) == 0)
+                continue;
+
+            HitRecord hit = packet.GetHit(lane);
+            TraverseNearestOrdered<PRIMITIVE_SET>(0, fast_rays[lane], hit);
+            packet.SetHit(lane, hit);
+        }
+        return;
+    }
+
+    // The unused fourth lane can't reject anything
+    frustum.positive = _mm_castsi128_ps(_mm_setr_epi32(-(direction_sign & 1), -((direction_sign >> 1) & 1), -((direction_sign >> 2) & 1), 0));
+    frustum.origin_min = _mm_setr_ps(origin_min.x, origin_min.y, origin_min.z, 0.f);
+    frustum.origin_max = _mm_setr_ps(origin_max.x, origin_max.y, origin_max.z, 0.f);
+    frustum.direction_inv_min = _mm_setr_ps(direction_inv_min.x, direction_inv_min.y, direction_inv_min.z, 0.f);
+    frustum.direction_inv_max = _mm_setr_ps(direction_inv_max.x, direction_inv_max.y, direction_inv_max.z, 0.f);
+
+    // Node index and the rays that hit its parent
+    struct StackEntry {
+        int node_index;
+        int mask;
+    };
+
+    StackEntry stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+    int mask = packet.active_mask;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        int hit_mask = 0;
+
+        if (use_frustum == false || FrustumMissesNode(node, frustum) == false) {
+            for (int first_lane = 0; first_lane < RayPacket::SIZE; first_lane += 4) {
+                hit_mask |= IntersectNodeBounds(node, packet, first_lane) << first_lane;
+            }
+            hit_mask &= mask;
+        }
+
+        if (hit_mask != 0) {
+
+            // A single ray left
+            if ((hit_mask & (hit_mask - 1)) == 0) {
+                int lane = __builtin_ctz(hit_mask);
+                HitRecord hit = packet.GetHit(lane);
+                TraverseNearestOrdered<PRIMITIVE_SET>(node_index, fast_rays[lane], hit);
+                packet.SetHit(lane, hit);
+            }
+            else if (node.object_count == 0) {
+                bool left_first = (direction_sign & (1 << node.split_axis)) != 0;
+                stack[stack_size++] = StackEntry {left_first ? node.first_child + 1 : node.first_child, hit_mask};
+                node_index = left_first ? node.first_child : node.first_child + 1;
+                mask = hit_mask;
+                continue;
             }
             else {
-                IntersectNodeOpti(ray, dist_out, hit_object, node->right_child, direction_sign);
-                IntersectNodeOpti(ray, dist_out, hit_object, node->left_child, direction_sign);
+                for (int lanes = hit_mask; lanes != 0; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    HitRecord hit = packet.GetHit(lane);
+                    LeafIntersector<PRIMITIVE_SET>::FindNearest(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                                node.object_index, node.object_index + node.object_count, fast_rays[lane], hit);
+                    packet.SetHit(lane, hit);
+                }
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+
+        stack_size--;
+        node_index = stack[stack_size].node_index;
+        mask = stack[stack_size].mask;
+    }
+}
+
+/**
+ * Ordered traversal of a top-level BVH whose objects are instances, each instance leaf traverses its bottom level
+ * The nearest hit distance is shared by both levels so a close hit in one instance culls the others
+ */
+bool BVH2::FindNearestInstanceIntersection(const Ray& ray, HitRecord& hit, const Instance*& hit_instance) const {
+
+    const FastRay fast_ray {ray};
+
+    char direction_sign = static_cast<char>((ray.direction.x > 0) + 2 * (ray.direction.y > 0) + 4 * (ray.direction.z > 0));
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < hit.dist)) {
+
+            if (node.object_count == 0) {
+                if (direction_sign & (1 << node.split_axis)) {
+                    stack[stack_size++] = node.first_child + 1;
+                    node_index = node.first_child;
+                }
+                else {
+                    stack[stack_size++] = node.first_child;
+                    node_index = node.first_child + 1;
+                }
+                continue;
+            }
+
+            for (int i = node.object_index; i < node.object_index + node.object_count; ++i) {
+                const Instance* instance = static_cast<const Instance*>(ordered_primitives[i].object->shape);
+                if (instance->FindNearestIntersection(ray, hit)) {
+                    hit_instance = instance;
+                }
             }
         }
 
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
     }
 
-    return (hit_object != nullptr);
+    return (hit.primitive.object != nullptr);
+}
+
+/**
+ * Any-hit traversal, it returns at the first object hit closer than t_max
+ * As any hit will do there is no nearest distance to update and the children are visited in memory order
+ */
+bool BVH2::Occluded(const Ray& ray, float t_max) const {
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseOccluded<TRIANGLE_PRIMITIVES>(FastRay {ray}, t_max);
+        case SPHERE_PRIMITIVES:   return TraverseOccluded<SPHERE_PRIMITIVES>(FastRay {ray}, t_max);
+        default:                  return TraverseOccluded<MIXED_PRIMITIVES>(FastRay {ray}, t_max);
+    }
 }
 
-bool BVH2::IntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, const unique_ptr<Node2>& node) {
+template <int PRIMITIVE_SET>
+bool BVH2::TraverseOccluded(const FastRay& fast_ray, float t_max) const {
 
-    float dist;
-//    ray_bbox_test_count++;
-    // We intersect this node
-    if (node->bbox.IntersectBranched(ray, dist) && (dist < dist_out)) {
-//        ray_bbox_hit_count++;
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
 
-        // If no children, this node is a leaf so intersect the object it contains
-        if (node->object != nullptr) {
-//            ray_obj_test_count++;
-            if (node->object->Intersect(ray, dist) && (dist < dist_out)) {
-//                ray_obj_hit_count++;
-                dist_out = dist;
-                hit_object = node->object;
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < t_max)) {
+
+            if (node.object_count == 0) {
+                stack[stack_size++] = node.first_child + 1;
+                node_index = node.first_child;
+                continue;
             }
+
+            if (LeafIntersector<PRIMITIVE_SET>::Occluded(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                         node.object_index, node.object_index + node.object_count, fast_ray, t_max))
+                return true;
         }
-        else {
-            IntersectNode(ray, dist_out, hit_object, node->left_child);
-            IntersectNode(ray, dist_out, hit_object, node->right_child);
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+
+    return false;
+}
+
+/**
+ * Any-hit traversal of a top-level BVH whose objects are instances, the first bottom level hit ends both traversals
+ */
+bool BVH2::InstanceOccluded(const Ray& ray, float t_max) const {
+
+    const FastRay fast_ray {ray};
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < t_max)) {
+
+            if (node.object_count == 0) {
+                stack[stack_size++] = node.first_child + 1;
+                node_index = node.first_child;
+                continue;
+            }
+
+            for (int i = node.object_index; i < node.object_index + node.object_count; ++i) {
+                const Instance* instance = static_cast<const Instance*>(ordered_primitives[i].object->shape);
+                if (instance->Occluded(ray, t_max))
+                    return true;
+            }
         }
 
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
     }
 
-    return (hit_object != nullptr);
+    return false;
 }
 
 void BVH2::ResetCounters() {
@@ -295,42 +1509,37 @@ void BVH2::ResetCounters() {
     ray_obj_hit_count = 0;
 }
 
-bool BVH2::DebugIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object, int depth_target) {
-    FastRay fast_ray {ray};
+bool BVH2::DebugIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive, int depth_target) const {
 
-    return DebugIntersectNode(ray, dist_out, hit_object, 0, depth_target, root);
-}
+    const FastRay fast_ray {ray};
 
-bool BVH2::DebugIntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, int depth, int debug_depth, const unique_ptr<Node2>& node) {
+    // Node index and its depth
+    std::pair<int, int> stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
 
-    float dist = 99999999.f;
-    // We intersect this node
-    if (node->bbox.IntersectBranched(ray, dist) && (dist < dist_out)) {
+    stack[stack_size++] = {0, 0};
 
-        // If no children, this node is a leaf so intersect the object it contains
-        if (depth == debug_depth) {
-            dist_out = dist;
-//            hit_object = &(node->bbox); //FIXME: if needed make bbox visualisation work again
-        }
-        else {
-            DebugIntersectNode(ray, dist_out, hit_object, depth + 1, debug_depth, node->left_child);
-            DebugIntersectNode(ray, dist_out, hit_object, depth + 1, debug_depth, node->right_child);
-        }
+    while (stack_size > 0) {
 
-    }
+        int node_index = stack[stack_size - 1].first;
+        int depth = stack[stack_size - 1].second;
+        stack_size--;
 
-    return (hit_object != nullptr);
-}
+        const LinearNode2& node = nodes[node_index];
+        float dist = 99999999.f;
 
-void ComputeBoundingBoxes(const unique_ptr<Node2>& node) {
+        if (IntersectNodeBounds(node, fast_ray, dist) && (dist < dist_out)) {
 
-    if (node->object != nullptr)
-//        node->bbox = node->bbox.ExtendsBy(node->object->ComputeBBox());
-        node->bbox = node->object->ComputeBBox();
-    else {
-        ComputeBoundingBoxes(node->left_child);
-        ComputeBoundingBoxes(node->right_child);
-        node->bbox = node->bbox.ExtendsBy(node->left_child->bbox);
-        node->bbox = node->bbox.ExtendsBy(node->right_child->bbox);
+            if (depth == depth_target) {
+                dist_out = dist;
+//                hit_primitive = &(node->bbox); //FIXME: if needed make bbox visualisation work again
+            }
+            else if (node.object_count == 0) {
+                stack[stack_size++] = {node.first_child + 1, depth + 1};
+                stack[stack_size++] = {node.first_child, depth + 1};
+            }
+        }
     }
-}
\ No newline at end of file
+
+    return (hit_primitive.object != nullptr);
+}
@@ -5,59 +5,165 @@
 #include "objects/BoundingBox.h"
 #include "Ray.h"
 #include "BVHCommons.h"
+#include "TriangleRecord.h"
+#include "HitRecord.h"
 
 #include <queue>
 #include <vector>
 #include <memory>
 
-typedef struct Object3D Object3D;
 typedef struct Scene Scene;
-typedef struct BuildInfo BuildInfo;
+typedef struct RayPacket RayPacket;
+class Instance;
 
 class BVH2 {
 
-    std::unique_ptr<Node2> root;
+    std::vector<LinearNode2> nodes;
+    std::vector<Primitive> ordered_primitives;
+    std::vector<TriangleRecord> triangle_records;   // One per primitive reference, in the same order
+    TriangleBlocks triangle_blocks;                 // The leaf triangles repacked for the SIMD tests
+    PrimitiveSet primitive_set = MIXED_PRIMITIVES;  // Selects the instantiation of the traversals
+    BVHBuildOptions build_options;
     short max_depth = 0;
     int node_count = 0;
+    int leaf_count = 0;
+    float build_time = 0;
+    float sah_cost = 0;
+    float build_sah_cost = 0;   // SAH cost right after the build, refits are compared to it
 
 public:
 
+    friend class BVHCache;
+
     static int ray_bbox_test_count;
     static int ray_bbox_hit_count;
     static int ray_obj_test_count;
     static int ray_obj_hit_count;
 
+    // Max number of nodes pending on the traversal stack, a 64 levels deep tree is already far beyond our scenes
+    static const int TRAVERSAL_STACK_SIZE = 64;
+    // The traversals push at most one node per level, the builds are limited to this depth so the stacks never overflow
+    static const int MAX_DEPTH = TRAVERSAL_STACK_SIZE - 1;
+
+    // Depth of a balanced tree over this number of leaves, the bound the builders keep within MAX_DEPTH
+    static int GetBalancedHeight(int leaf_count) {
+        int height = 0;
+        while ((1 << height) < leaf_count)
+            height++;
+        return height;
+    }
+
     BVH2() = default;
 
-    BVH2(const Scene* scene);
+    BVH2(const Scene* scene, const BVHBuildOptions& build_options = BVHBuildOptions());
+
+    BVH2(const std::vector<Primitive>& primitives, const BVHBuildOptions& build_options, bool log_statistics = true);
+
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit) const;
+
+    bool FindNearestIntersectionOpti(const Ray& ray, HitRecord& hit) const;
+
+    void FindNearestIntersection(RayPacket& packet) const;
+
+    bool FindNearestInstanceIntersection(const Ray& ray, HitRecord& hit, const Instance*& hit_instance) const;
+
+    // Any-hit queries for shadow and visibility rays, true as soon as an object is hit closer than t_max
+    bool Occluded(const Ray& ray, float t_max) const;
+
+    bool InstanceOccluded(const Ray& ray, float t_max) const;
 
-    bool FindNearestIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object);
+    bool Refit(float rebuild_ratio);
 
-    bool FindNearestIntersectionOpti(const Ray& ray, float& dist_out, Object3D*& hit_object);
+    // Reorder the sibling pairs in memory, the tree itself is unchanged
+    void ApplyLayout(int layout);
 
     static void ResetCounters();
 
-    bool DebugIntersection(const Ray& ray, float& dist_out, Object3D*& hit_object, int depth_target);
+    bool DebugIntersection(const Ray& ray, float& dist_out, Primitive& hit_primitive, int depth_target) const;
+
+    const std::vector<LinearNode2>& GetNodes() const {
+        return nodes;
+    }
+
+    const Primitive& GetPrimitive(int index) const {
+        return ordered_primitives[index];
+    }
+
+    // Primitive references in leaf order, the same primitive can be referenced by several leaves with spatial splits
+    const std::vector<Primitive>& GetPrimitives() const {
+        return ordered_primitives;
+    }
+
+    const std::vector<TriangleRecord>& GetTriangleRecords() const {
+        return triangle_records;
+    }
+
+    const TriangleBlocks& GetTriangleBlocks() const {
+        return triangle_blocks;
+    }
 
-    Node2* GetRoot() const {
-        return root.get();
+    PrimitiveSet GetPrimitiveSet() const {
+        return primitive_set;
+    }
+
+    int GetPrimitiveCount() const {
+        return (int) ordered_primitives.size();
+    }
+
+    BoundingBox GetBounds() const {
+        return BoundingBox {nodes[0].min, nodes[0].max};
     }
 
     int GetNodeCount() const {
         return node_count;
     }
 
+    int GetMaxDepth() const {
+        return max_depth;
+    }
+
+    size_t GetNodeMemory() const {
+        return nodes.size() * sizeof(LinearNode2);
+    }
+
+    const BVHBuildOptions& GetBuildOptions() const {
+        return build_options;
+    }
+
+    float GetBuildTime() const {
+        return build_time;
+    }
+
+    float GetSAHCost() const {
+        return sah_cost;
+    }
+
 private:
 
-    Node2* RecursiveBuild(std::vector<BuildInfo>& objects, int first, int last, int depth = 0);
+    Node2* RecursiveBuild(std::vector<BuildInfo>& objects, int first, int last);
+
+    Node2* RecursiveBuildSpatial(std::vector<BuildInfo>& references, int budget, int depth, float root_surface_area);
+
+    void Flatten(const Node2* node, int index, int depth);
+
+    // Sorts the primitives of each leaf by type, for the mixed traversals
+    void SortLeafPrimitives();
+
+    // The traversals, instantiated for each PrimitiveSet
+
+    template <int PRIMITIVE_SET>
+    bool TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const;
 
-    bool IntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, const std::unique_ptr<Node2>& node);
+    template <int PRIMITIVE_SET>
+    bool TraverseNearestOrdered(int node_index, const FastRay& fast_ray, HitRecord& hit) const;
 
-    bool IntersectNodeFast(const FastRay& ray, float& t_near_candidate, Object3D*& hit_object, const std::unique_ptr<Node2>& node);
+    template <int PRIMITIVE_SET>
+    void TraversePacket(RayPacket& packet) const;
 
-    bool DebugIntersectNode(const FastRay& ray, float& dist_out, Object3D*& hit_object, int depth, int debug_depth, const std::unique_ptr<Node2>& node);
+    template <int PRIMITIVE_SET>
+    bool TraverseOccluded(const FastRay& fast_ray, float t_max) const;
 
-    bool IntersectNodeOpti(const FastRay& ray, float& dist_out, Object3D*& hit_object, const std::unique_ptr<Node2>& node, const char direction_sign);
+    float ComputeSAHCost() const;
 };
 
 #endif //PATHTRACER_BVH2_H
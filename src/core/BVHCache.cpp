@@ -0,0 +1,306 @@
+#include "BVHCache.h"
+
+#include "MappedFile.h"
+#include "app/Chronometer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+static const uint64_t HASH_PRIME = 1099511628211ULL;
+
+static const char CACHE_MAGIC[4] = {'P', 'L', 'B', 'V'};
+
+// Followed by node_count LinearNode2 then reference_count primitive indices
+struct BVHCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t primitive_count;
+    uint32_t node_count;
+    uint32_t reference_count;
+    uint32_t leaf_count;
+    uint32_t node_size;
+    int32_t max_depth;
+    float sah_cost;
+    float build_time;
+};
+
+// Primitives of a mesh share their object, the triangle index tells them apart
+struct PrimitiveHash {
+    size_t operator()(const Primitive& primitive) const {
+        return std::hash<const Object3D*>()(primitive.object) ^ (size_t(primitive.index + 1) * HASH_PRIME);
+    }
+};
+
+static void MakeDirectory(const string& directory);
+static bool IsValidTree(const LinearNode2* nodes, uint32_t node_count, uint32_t reference_count);
+
+BVHCache::BVHCache(const string& directory)
+        : directory(directory) {
+}
+
+/**
+ * FNV-1a over 8 bytes words, the tail bytes are hashed one by one
+ */
+uint64_t BVHCache::HashBytes(const void* data, size_t size, uint64_t hash) {
+
+    const char* bytes = static_cast<const char*>(data);
+    size_t word_count = size / sizeof(uint64_t);
+
+    for (size_t i = 0; i < word_count; ++i) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+        hash = (hash ^ word) * HASH_PRIME;
+    }
+
+    for (size_t i = word_count * sizeof(uint64_t); i < size; ++i) {
+        hash = (hash ^ (unsigned char) bytes[i]) * HASH_PRIME;
+    }
+
+    return hash;
+}
+
+uint64_t BVHCache::HashFile(const string& filename) {
+
+    MappedFile file {filename};
+
+    if (file.IsValid() == false)
+        return 0;
+
+    return HashBytes(file.GetData(), file.GetSize());
+}
+
+/**
+ * The options are hashed field by field as the struct padding is not initialized
+ */
+uint64_t BVHCache::ComputeKey(uint64_t model_hash, const BVHBuildOptions& build_options, size_t primitive_count) {
+
+    uint32_t version = FORMAT_VERSION;
+    uint64_t hash = HashBytes(&version, sizeof(version), model_hash);
+
+    uint64_t count = primitive_count;
+    hash = HashBytes(&count, sizeof(count), hash);
+    hash = HashBytes(&build_options.builder, sizeof(build_options.builder), hash);
+    hash = HashBytes(&build_options.max_leaf_size, sizeof(build_options.max_leaf_size), hash);
+    hash = HashBytes(&build_options.traversal_cost, sizeof(build_options.traversal_cost), hash);
+    hash = HashBytes(&build_options.intersection_cost, sizeof(build_options.intersection_cost), hash);
+    hash = HashBytes(&build_options.spatial_splits, sizeof(build_options.spatial_splits), hash);
+    hash = HashBytes(&build_options.spatial_split_budget, sizeof(build_options.spatial_split_budget), hash);
+    hash = HashBytes(&build_options.morton_63_bits, sizeof(build_options.morton_63_bits), hash);
+    hash = HashBytes(&build_options.treelet_optimization, sizeof(build_options.treelet_optimization), hash);
+    hash = HashBytes(&build_options.node_layout, sizeof(build_options.node_layout), hash);
+
+    return hash;
+}
+
+string BVHCache::GetFilename(uint64_t key) const {
+
+    std::ostringstream filename;
+    filename << directory << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+
+    return filename.str();
+}
+
+/**
+ * @return The BVH2 of the cache file matching the key, nullptr if there is none or if it doesn't fit the primitives
+ */
+BVH2* BVHCache::Load(uint64_t key, const vector<Primitive>& primitives, const BVHBuildOptions& build_options) const {
+
+    Chronometer chrono;
+
+    MappedFile file {GetFilename(key)};
+
+    if (file.IsValid() == false || file.GetSize() < sizeof(BVHCacheHeader))
+        return nullptr;
+
+    BVHCacheHeader header;
+    memcpy(&header, file.GetData(), sizeof(BVHCacheHeader));
+
+    size_t expected_size = sizeof(BVHCacheHeader) + header.node_count * sizeof(LinearNode2) + header.reference_count * sizeof(int32_t);
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != FORMAT_VERSION || header.key != key
+        || header.node_size != sizeof(LinearNode2) || header.primitive_count != primitives.size()
+        || header.node_count == 0 || file.GetSize() != expected_size) {
+        cout << "Ignoring invalid BVH cache file " << GetFilename(key) << endl;
+        return nullptr;
+    }
+
+    const LinearNode2* nodes = reinterpret_cast<const LinearNode2*>(file.GetData() + sizeof(BVHCacheHeader));
+    const char* references = file.GetData() + sizeof(BVHCacheHeader) + header.node_count * sizeof(LinearNode2);
+
+    // A truncated or corrupted file must not send the traversal out of the arrays
+    if (IsValidTree(nodes, header.node_count, header.reference_count) == false) {
+        cout << "Ignoring invalid BVH cache file " << GetFilename(key) << endl;
+        return nullptr;
+    }
+
+    BVH2* bvh = new BVH2;
+    bvh->build_options = build_options;
+    bvh->nodes.assign(nodes, nodes + header.node_count);
+    bvh->ordered_primitives.resize(header.reference_count);
+
+    for (uint32_t i = 0; i < header.reference_count; ++i) {
+
+        int32_t index;
+        memcpy(&index, references + i * sizeof(int32_t), sizeof(int32_t));
+
+        if (index < 0 || uint32_t(index) >= header.primitive_count) {
+            cout << "Ignoring invalid BVH cache file " << GetFilename(key) << endl;
+            delete bvh;
+            return nullptr;
+        }
+        bvh->ordered_primitives[i] = primitives[index];
+    }
+
+    // The leaves were saved sorted by type
+    bvh->primitive_set = ClassifyPrimitives(bvh->ordered_primitives);
+    bvh->triangle_records = CreateTriangleRecords(bvh->ordered_primitives);
+    if (build_options.triangle_blocks)
+        bvh->triangle_blocks.Create(bvh->triangle_records, bvh->nodes);
+    bvh->node_count = (int) header.node_count;
+    bvh->leaf_count = (int) header.leaf_count;
+    bvh->max_depth = (short) header.max_depth;
+    bvh->sah_cost = header.sah_cost;
+    bvh->build_sah_cost = header.sah_cost;
+    bvh->build_time = chrono.GetSeconds();
+
+    return bvh;
+}
+
+/**
+ * Written to a temporary file first so an interrupted save never leaves a partial file under the final name
+ */
+bool BVHCache::Save(uint64_t key, const BVH2& bvh, const vector<Primitive>& primitives) const {
+
+    std::unordered_map<Primitive, int32_t, PrimitiveHash> primitive_indices;
+    primitive_indices.reserve(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        primitive_indices[primitives[i]] = (int32_t) i;
+    }
+
+    vector<int32_t> references;
+    references.reserve(bvh.ordered_primitives.size());
+    for (const Primitive& primitive : bvh.ordered_primitives) {
+        references.push_back(primitive_indices[primitive]);
+    }
+
+    BVHCacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = FORMAT_VERSION;
+    header.key = key;
+    header.primitive_count = (uint32_t) primitives.size();
+    header.node_count = (uint32_t) bvh.nodes.size();
+    header.reference_count = (uint32_t) references.size();
+    header.leaf_count = (uint32_t) bvh.leaf_count;
+    header.node_size = sizeof(LinearNode2);
+    header.max_depth = bvh.max_depth;
+    header.sah_cost = bvh.build_sah_cost;
+    header.build_time = bvh.build_time;
+
+    MakeDirectory(directory);
+
+    string filename = GetFilename(key);
+    string temp_filename = filename + ".tmp";
+
+    {
+        std::ofstream file {temp_filename, std::ios::binary | std::ios::trunc};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(bvh.nodes.data()), bvh.nodes.size() * sizeof(LinearNode2));
+        file.write(reinterpret_cast<const char*>(references.data()), references.size() * sizeof(int32_t));
+
+        if (!file) {
+            std::cerr << "Could not write the BVH cache file " << temp_filename << endl;
+            file.close();
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+
+    std::remove(filename.c_str());
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Load the BVH2 of the primitives from the cache, or build it and add it to the cache
+ * @param model_hash Hash of what the primitives were created from, 0 to bypass the cache
+ */
+BVH2* BVHCache::LoadOrBuild(uint64_t model_hash, const vector<Primitive>& primitives, const BVHBuildOptions& build_options, bool log_statistics) const {
+
+    if (model_hash == 0 || primitives.empty())
+        return new BVH2 {primitives, build_options, log_statistics};
+
+    uint64_t key = ComputeKey(model_hash, build_options, primitives.size());
+
+    BVH2* bvh = Load(key, primitives, build_options);
+
+    if (bvh != nullptr) {
+        if (log_statistics) {
+            cout << "BVH loaded from cache in " << bvh->GetBuildTime() * 1000 << " ms, SAH cost: " << bvh->GetSAHCost() << endl;
+            cout << "BVH2 node count: " << bvh->GetNodeCount() << endl;
+        }
+        return bvh;
+    }
+
+    bvh = new BVH2 {primitives, build_options, log_statistics};
+
+    Save(key, *bvh, primitives);
+
+    return bvh;
+}
+
+static void MakeDirectory(const string& directory) {
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
+
+static bool IsValidTree(const LinearNode2* nodes, uint32_t node_count, uint32_t reference_count) {
+
+    // The children are stored after their parent, so a single pass sees each node's depth before its children
+    vector<int> depths(node_count, 0);
+
+    for (uint32_t i = 0; i < node_count; ++i) {
+
+        const LinearNode2& node = nodes[i];
+
+        if (depths[i] > BVH2::MAX_DEPTH)
+            return false;
+
+        if (node.object_count > 0) {
+            if (node.object_index < 0 || uint32_t(node.object_index) + node.object_count > reference_count)
+                return false;
+        }
+        else {
+            if (node.first_child <= int(i) || uint32_t(node.first_child) + 1 >= node_count)
+                return false;
+            depths[node.first_child] = std::max(depths[node.first_child], depths[i] + 1);
+            depths[node.first_child + 1] = std::max(depths[node.first_child + 1], depths[i] + 1);
+        }
+    }
+
+    return true;
+}
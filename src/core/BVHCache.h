@@ -0,0 +1,47 @@
+#ifndef PATHTRACER_BVHCACHE_H
+#define PATHTRACER_BVHCACHE_H
+
+#include "BVH2.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * On-disk cache of built BVH2s, read back through a memory mapping
+ * A file holds the flattened nodes and the primitive references as indices in the array the tree was built from
+ * The files are named after a key hashing everything the tree depends on,
+ * so a changed model, build option or format gives another key and the stale file is simply never read again
+ */
+class BVHCache {
+
+    std::string directory;
+
+public:
+
+    // Bump when the node layout or a builder changes, the trees of the previous versions are ignored then
+    static const uint32_t FORMAT_VERSION = 3;
+
+    static const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+    explicit BVHCache(const std::string& directory);
+
+    static uint64_t HashBytes(const void* data, size_t size, uint64_t hash = HASH_SEED);
+
+    // Hash of the file content, 0 if it can't be read
+    static uint64_t HashFile(const std::string& filename);
+
+    static uint64_t ComputeKey(uint64_t model_hash, const BVHBuildOptions& build_options, size_t primitive_count);
+
+    BVH2* Load(uint64_t key, const std::vector<Primitive>& primitives, const BVHBuildOptions& build_options) const;
+
+    bool Save(uint64_t key, const BVH2& bvh, const std::vector<Primitive>& primitives) const;
+
+    BVH2* LoadOrBuild(uint64_t model_hash, const std::vector<Primitive>& primitives, const BVHBuildOptions& build_options, bool log_statistics = true) const;
+
+private:
+
+    std::string GetFilename(uint64_t key) const;
+};
+
+#endif //PATHTRACER_BVHCACHE_H
@@ -2,9 +2,9 @@
 #define PATHTRACER_BVHCOMMONS_H
 
 #include <objects/BoundingBox.h>
+#include <objects/Primitive.h>
 #include <vector>
-
-typedef struct Object3D Object3D;
+#include <memory>
 
 struct CLNode {
 
@@ -16,6 +16,7 @@ struct CLNode2 {
 
     CLBoundingBox bbox;
     int obj_index;
+    int obj_count;
     int left_child;
     int right_child;
 };
@@ -23,28 +24,121 @@ struct CLNode2 {
 struct Node {
 
     BoundingBox bbox;
-    Object3D* object = nullptr;
+    Primitive primitive;
     std::vector<std::unique_ptr<Node>> children;
     char split_axis = -1;
 
     Node() = default;
-    Node(const BoundingBox& bbox, Object3D* object)
-            : bbox(bbox), object(object)
+    Node(const BoundingBox& bbox, const Primitive& primitive)
+            : bbox(bbox), primitive(primitive)
     { }
 };
 
 struct Node2 {
 
     BoundingBox bbox;
-    Object3D* object = nullptr;
+    int first_object = 0;   // Leaf objects range in the build order
+    int object_count = 0;   // 0 for internal nodes
+    std::vector<Primitive> spatial_objects; // Leaf primitives of a spatial split build, its references have no global order
     std::unique_ptr<Node2> left_child;
     std::unique_ptr<Node2> right_child;
     char split_axis = -1;
+    float cost = 0;         // SAH cost of the subtree, only kept by the LBVH builder for its treelet optimization
 
     Node2() = default;
-    Node2(const BoundingBox& bbox, Object3D* object)
-            : bbox(bbox), object(object)
-    { }
+};
+
+// Primitive data gathered once before a build
+struct BuildInfo {
+    BoundingBox bbox;
+    Primitive primitive;
+    Vec3 bbox_center;
+};
+
+// Builder of the BVH2 tree
+enum BVHBuilder : int {
+    SAH_BUILDER,
+    LBVH_BUILDER
+};
+
+// Order of the BVH2 nodes in memory, applied after the build so it's shared by the CPU traversal and the OpenCL node buffer
+enum BVHNodeLayout : int {
+    DEPTH_FIRST_LAYOUT,     // Sibling pairs in depth-first order, as flattened
+    TREELET_LAYOUT,         // Clusters grown from their root by adding the children most likely to be hit, one page each
+    VAN_EMDE_BOAS_LAYOUT    // Cache-oblivious, the top half of the tree levels then each subtree below them, recursively
+};
+
+struct BVHBuildOptions {
+
+    // The LBVH builds much faster than the SAH builder but its trees are slower to traverse
+    int builder = SAH_BUILDER;
+
+    // A node with at most this number of objects can become a leaf if the SAH says it's cheaper than splitting it
+    int max_leaf_size = 4;
+    // SAH costs of a node traversal step and of an object intersection
+    float traversal_cost = 1.f;
+    float intersection_cost = 1.f;
+    // SBVH: also consider splitting the nodes in space, duplicating the references of the objects straddling the split
+    bool spatial_splits = false;
+    // Max number of duplicated references, relative to the object count
+    float spatial_split_budget = 0.3f;
+    // LBVH: 63 bits Morton codes instead of 30, for scenes too detailed for a 1024^3 grid
+    bool morton_63_bits = false;
+    // LBVH: restructure each treelet of up to 7 leaves to the topology of lowest SAH cost
+    bool treelet_optimization = false;
+    // A refitted BVH is rebuilt once its SAH cost exceeds the cost it was built with by this ratio
+    float refit_rebuild_ratio = 1.5f;
+    // Memory order of the nodes, placing the nodes a ray is likely to visit together on the same cache lines and pages
+    int node_layout = DEPTH_FIRST_LAYOUT;
+    // Also store the leaf triangles as SIMD blocks, for the leaves of several triangles (larger max_leaf_size)
+    bool triangle_blocks = false;
+};
+
+// BVH traversed by the CPU renderer
+enum BVHTraversal : int {
+    BVH2_TRAVERSAL,
+    BVH2_ORDERED_TRAVERSAL,
+    BVH4_TRAVERSAL,
+    BVH8_TRAVERSAL,
+    QUANTIZED_BVH2_TRAVERSAL
+};
+
+// Primitive types referenced by a BVH, its traversals are instantiated for each set
+// so the leaves of a single type test their primitives without a type check or a virtual call
+enum PrimitiveSet : int {
+    MIXED_PRIMITIVES,       // The leaves are sorted by type, their triangles first
+    TRIANGLE_PRIMITIVES,
+    SPHERE_PRIMITIVES
+};
+
+// Node2 tree flattened with the two children of an internal node next to each other, the left one first
+// A node is always stored before its children, their order is otherwise chosen by the node layout
+// Raw Vec3 bounds instead of a BoundingBox to avoid its vtable pointer, so two nodes fit in a cache line
+struct LinearNode2 {
+
+    Vec3 min;
+    Vec3 max;
+    union {
+        int object_index;   // Leaf: index of the first object in the BVH object array
+        int first_child;    // Internal node: index of the left child in the node array, the right child follows it
+    };
+    unsigned short object_count;  // 0 for internal nodes
+    char split_axis;
+    char pad;
+};
+
+// Compressed BVH2 node holding the bounds of its two children as 8 bits offsets from the node min corner
+// Child bounds on an axis are origin + q * 2^exponent, rounded outward when encoded so they always contain the exact ones
+// Shared as is by the CPU traversal and the OpenCL kernel, only made of 4 bytes aligned scalars so both agree on its layout
+struct QuantizedNode2 {
+
+    float origin[3];                    // Min corner of the node bounds
+    signed char exponent[3];            // Quantization step of each axis, as a power of 2
+    char pad;
+    unsigned char child_bounds[3][4];   // Per axis: min of child 0 and 1, then max of child 0 and 1
+    unsigned char object_count[2];      // 0 for an internal child
+    char pad2[2];
+    int child[2];                       // Internal child: index in the node array, Leaf child: index of its first object
 };
 
 #endif //PATHTRACER_BVHCOMMONS_H
@@ -0,0 +1,338 @@
+#include "BVHLayout.h"
+
+#include "BVH2.h"
+#include "objects/Object3D.h"
+#include "app/Chronometer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <queue>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+// A treelet fills a page
+static const int TREELET_BYTES = 4096;
+
+static void AppendChildPairs(const vector<LinearNode2>& nodes, int pair, vector<int>& child_pairs);
+static void DepthFirstOrder(const vector<LinearNode2>& nodes, int pair, vector<int>& order);
+static void TreeletOrder(const vector<LinearNode2>& nodes, int root_pair, vector<int>& order);
+static void VanEmdeBoasOrder(const vector<LinearNode2>& nodes, int pair, int height, vector<int>& order, vector<int>& frontier);
+static int ComputePairHeight(const vector<LinearNode2>& nodes, int pair);
+
+/**
+ * Set associative cache of LRU replacement, only counting the hits and misses of the addresses accessed
+ */
+class SimulatedCache {
+
+    int line_shift;
+    int set_count;
+    int way_count;
+    vector<uint64_t> tags;
+    vector<uint64_t> last_use;
+    uint64_t clock = 0;
+
+public:
+
+    uint64_t miss_count = 0;
+
+    SimulatedCache(int line_size, int size, int way_count)
+            : way_count(way_count) {
+
+        line_shift = 0;
+        while ((1 << line_shift) < line_size)
+            line_shift++;
+
+        set_count = std::max(1, size / (line_size * way_count));
+        tags.assign(size_t(set_count * way_count), UINT64_MAX);
+        last_use.assign(size_t(set_count * way_count), 0);
+    }
+
+    void Access(uintptr_t address) {
+
+        uint64_t line = uint64_t(address) >> line_shift;
+        size_t first_way = size_t(line % set_count) * way_count;
+        size_t oldest = first_way;
+
+        clock++;
+
+        for (size_t way = first_way; way < first_way + way_count; ++way) {
+            if (tags[way] == line) {
+                last_use[way] = clock;
+                return;
+            }
+            if (last_use[way] < last_use[oldest])
+                oldest = way;
+        }
+
+        miss_count++;
+        tags[oldest] = line;
+        last_use[oldest] = clock;
+    }
+
+    // A node can straddle two lines
+    void Access(const void* data, size_t size) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(data);
+        Access(address);
+        if (((address + size - 1) >> line_shift) != (address >> line_shift))
+            Access(address + size - 1);
+    }
+};
+
+vector<int> ComputeSiblingPairOrder(const vector<LinearNode2>& nodes, int layout) {
+
+    vector<int> order;
+
+    if (nodes.empty() || nodes[0].object_count > 0)
+        return order;
+
+    order.reserve(nodes.size() / 2);
+
+    int root_pair = nodes[0].first_child;
+
+    switch (layout) {
+        case TREELET_LAYOUT:
+            TreeletOrder(nodes, root_pair, order);
+            break;
+        case VAN_EMDE_BOAS_LAYOUT: {
+            vector<int> frontier;
+            VanEmdeBoasOrder(nodes, root_pair, ComputePairHeight(nodes, root_pair), order, frontier);
+            break;
+        }
+        case DEPTH_FIRST_LAYOUT:
+        default:
+            DepthFirstOrder(nodes, root_pair, order);
+            break;
+    }
+
+    return order;
+}
+
+static void AppendChildPairs(const vector<LinearNode2>& nodes, int pair, vector<int>& child_pairs) {
+
+    for (int i = pair; i < pair + 2; ++i) {
+        if (nodes[i].object_count == 0)
+            child_pairs.push_back(nodes[i].first_child);
+    }
+}
+
+static void DepthFirstOrder(const vector<LinearNode2>& nodes, int pair, vector<int>& order) {
+
+    order.push_back(pair);
+
+    for (int i = pair; i < pair + 2; ++i) {
+        if (nodes[i].object_count == 0)
+            DepthFirstOrder(nodes, nodes[i].first_child, order);
+    }
+}
+
+/**
+ * Each treelet grows from its root pair by adding the candidate pair whose parent has the largest surface area,
+ * the most likely to be tested by a ray that reached the treelet, until it fills a page
+ * Inside a treelet the pairs are stored depth-first so a pair and the next one visited tend to share cache lines too
+ * The candidates left over become the roots of the next treelets, laid out in breadth-first order
+ */
+static void TreeletOrder(const vector<LinearNode2>& nodes, int root_pair, vector<int>& order) {
+
+    const size_t pairs_per_treelet = std::max<size_t>(1, TREELET_BYTES / (2 * sizeof(LinearNode2)));
+
+    // Surface area of the parent, pair
+    typedef std::pair<float, int> Candidate;
+
+    std::queue<int> treelet_roots;
+    treelet_roots.push(root_pair);
+
+    vector<bool> in_treelet(nodes.size(), false);
+    vector<int> treelet;
+    vector<int> stack;
+
+    while (treelet_roots.empty() == false) {
+
+        int treelet_root = treelet_roots.front();
+        treelet_roots.pop();
+
+        std::priority_queue<Candidate> candidates;
+        candidates.push(Candidate {0.f, treelet_root});
+
+        treelet.clear();
+
+        while (candidates.empty() == false && treelet.size() < pairs_per_treelet) {
+
+            int pair = candidates.top().second;
+            candidates.pop();
+
+            treelet.push_back(pair);
+            in_treelet[pair] = true;
+
+            for (int i = pair; i < pair + 2; ++i) {
+                if (nodes[i].object_count == 0) {
+                    float area = BoundingBox {nodes[i].min, nodes[i].max}.GetSurfaceArea();
+                    candidates.push(Candidate {area, nodes[i].first_child});
+                }
+            }
+        }
+
+        stack.push_back(treelet_root);
+        while (stack.empty() == false) {
+
+            int pair = stack.back();
+            stack.pop_back();
+
+            order.push_back(pair);
+            in_treelet[pair] = false;
+
+            for (int i = pair + 1; i >= pair; --i) {
+                if (nodes[i].object_count == 0 && in_treelet[nodes[i].first_child])
+                    stack.push_back(nodes[i].first_child);
+            }
+        }
+
+        while (candidates.empty() == false) {
+            treelet_roots.push(candidates.top().second);
+            candidates.pop();
+        }
+    }
+}
+
+/**
+ * The tree of sibling pairs is cut at half its height, the top part is laid out first then each subtree hanging below it,
+ * both recursively, so any subtree of a given height is contiguous whatever the cache line or page size
+ * @param frontier Receives the pairs right below the laid out levels
+ */
+static void VanEmdeBoasOrder(const vector<LinearNode2>& nodes, int pair, int height, vector<int>& order, vector<int>& frontier) {
+
+    if (height <= 1) {
+        order.push_back(pair);
+        AppendChildPairs(nodes, pair, frontier);
+        return;
+    }
+
+    int top_height = height / 2;
+
+    vector<int> middle;
+    VanEmdeBoasOrder(nodes, pair, top_height, order, middle);
+
+    for (int bottom_pair : middle) {
+        VanEmdeBoasOrder(nodes, bottom_pair, height - top_height, order, frontier);
+    }
+}
+
+// Number of pair levels of the subtree
+static int ComputePairHeight(const vector<LinearNode2>& nodes, int pair) {
+
+    int height = 0;
+
+    for (int i = pair; i < pair + 2; ++i) {
+        if (nodes[i].object_count == 0)
+            height = std::max(height, ComputePairHeight(nodes, nodes[i].first_child));
+    }
+
+    return height + 1;
+}
+
+/**
+ * Same ordered traversal as BVH2::FindNearestIntersectionOpti, every node read goes through the simulated caches
+ */
+static void TraceSimulated(const BVH2& bvh, const Ray& ray, vector<SimulatedCache>& caches, uint64_t& node_access_count) {
+
+    const vector<LinearNode2>& nodes = bvh.GetNodes();
+    const FastRay fast_ray {ray};
+
+    char direction_sign = static_cast<char>((ray.direction.x > 0) + 2 * (ray.direction.y > 0) + 4 * (ray.direction.z > 0));
+
+    float dist_out = std::numeric_limits<float>::max();
+
+    int stack[BVH2::TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+
+        const LinearNode2& node = nodes[node_index];
+        float dist;
+
+        node_access_count++;
+        for (SimulatedCache& cache : caches) {
+            cache.Access(&node, sizeof(LinearNode2));
+        }
+
+        if (BoundingBox {node.min, node.max}.IntersectFast(fast_ray, dist) && (dist < dist_out)) {
+
+            if (node.object_count == 0) {
+                if (direction_sign & (1 << node.split_axis)) {
+                    stack[stack_size++] = node.first_child + 1;
+                    node_index = node.first_child;
+                }
+                else {
+                    stack[stack_size++] = node.first_child;
+                    node_index = node.first_child + 1;
+                }
+                continue;
+            }
+
+            for (int i = node.object_index; i < node.object_index + node.object_count; ++i) {
+                if (IntersectLeafPrimitive(bvh.GetTriangleRecords()[i], bvh.GetPrimitive(i), fast_ray, dist) && (dist < dist_out))
+                    dist_out = dist;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+}
+
+void BenchmarkNodeLayouts(const BVH2& bvh, const vector<Ray>& rays) {
+
+    const char* layout_names[] = {"Depth-first", "Treelets", "van Emde Boas"};
+
+    if (rays.empty())
+        return;
+
+    cout << "Node layout benchmark, " << rays.size() << " rays, " << bvh.GetNodeCount() << " nodes" << endl;
+    cout << std::left << std::setw(16) << "Layout" << std::right
+         << std::setw(10) << "Mrays/s" << std::setw(12) << "Nodes/ray"
+         << std::setw(14) << "L1 miss/ray" << std::setw(14) << "L2 miss/ray" << std::setw(14) << "Page miss/ray" << endl;
+
+    for (int layout = DEPTH_FIRST_LAYOUT; layout <= VAN_EMDE_BOAS_LAYOUT; ++layout) {
+
+        BVH2 layout_bvh = bvh;
+        layout_bvh.ApplyLayout(layout);
+
+        // Warm up then timed pass
+        Chronometer chrono;
+        for (int pass = 0; pass < 2; ++pass) {
+            chrono.Restart();
+            for (const Ray& ray : rays) {
+                HitRecord hit;
+                layout_bvh.FindNearestIntersectionOpti(ray, hit);
+            }
+        }
+        float seconds = chrono.GetSeconds();
+
+        // 32 Ko L1 and 1 Mo L2 of 64 bytes lines, 64 entries TLB of 4 Ko pages
+        vector<SimulatedCache> caches = {
+                SimulatedCache {64, 32 * 1024, 8},
+                SimulatedCache {64, 1024 * 1024, 16},
+                SimulatedCache {4096, 64 * 4096, 64}
+        };
+        uint64_t node_access_count = 0;
+
+        for (const Ray& ray : rays) {
+            TraceSimulated(layout_bvh, ray, caches, node_access_count);
+        }
+
+        float ray_count = rays.size();
+
+        cout << std::left << std::setw(16) << layout_names[layout] << std::right << std::fixed << std::setprecision(2)
+             << std::setw(10) << ray_count / (seconds * 1e6f)
+             << std::setw(12) << node_access_count / ray_count
+             << std::setw(14) << caches[0].miss_count / ray_count
+             << std::setw(14) << caches[1].miss_count / ray_count
+             << std::setw(14) << caches[2].miss_count / ray_count << endl;
+        cout.unsetf(std::ios::fixed);
+    }
+}
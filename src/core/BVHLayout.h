@@ -0,0 +1,24 @@
+#ifndef PATHTRACER_BVHLAYOUT_H
+#define PATHTRACER_BVHLAYOUT_H
+
+#include "BVHCommons.h"
+#include "Ray.h"
+
+#include <vector>
+
+class BVH2;
+
+/**
+ * Order in which the sibling pairs of a BVH2 should be stored for a node layout, the root node always stays first
+ * A pair is identified by the index of its left node in the given array, its parent pair always comes before it
+ */
+std::vector<int> ComputeSiblingPairOrder(const std::vector<LinearNode2>& nodes, int layout);
+
+/**
+ * Trace the rays through a copy of the BVH2 in each node layout, single threaded,
+ * and replay the node accesses of the same traversal in a simulated cache to count the misses of each layout
+ * The results are printed, the layout of the given BVH2 is not changed
+ */
+void BenchmarkNodeLayouts(const BVH2& bvh, const std::vector<Ray>& rays);
+
+#endif //PATHTRACER_BVHLAYOUT_H
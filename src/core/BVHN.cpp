@@ -0,0 +1,377 @@
+#include "BVHN.h"
+
+#include "objects/Object3D.h"
+#include "app/Chronometer.h"
+
+#include <immintrin.h>
+#include <algorithm>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+/**
+ * Ray data splatted once per traversal for the SIMD slab tests
+ * The near and far planes of each axis are selected from the direction sign, so an empty child (min > max) is never hit
+ */
+struct TraversalRay {
+
+    __m128 origin4[3];
+    __m128 direction_inv4[3];
+#ifdef __AVX__
+    __m256 origin8[3];
+    __m256 direction_inv8[3];
+#endif
+    int near_row[3];
+    int far_row[3];
+
+    explicit TraversalRay(const FastRay& ray) {
+        for (int axis = 0; axis < 3; ++axis) {
+            origin4[axis] = _mm_set1_ps(ray.origin[axis]);
+            direction_inv4[axis] = _mm_set1_ps(ray.direction_inv[axis]);
+#ifdef __AVX__
+            origin8[axis] = _mm256_set1_ps(ray.origin[axis]);
+            direction_inv8[axis] = _mm256_set1_ps(ray.direction_inv[axis]);
+#endif
+            bool negative = ray.direction[axis] < 0;
+            near_row[axis] = axis + (negative ? 3 : 0);
+            far_row[axis] = axis + (negative ? 0 : 3);
+        }
+    }
+};
+
+/**
+ * Slab test of the 4 children starting at offset, the distances are clamped to [0, t_max]
+ * Unaligned loads as std::vector doesn't honor the node alignment before C++17
+ * The new value is the first operand of min/max so a NaN from a ray parallel to a slab doesn't reject the child
+ * @return The mask of the children hit
+ */
+template <int WIDTH>
+static inline int SlabTest4(const float (&bounds)[6][WIDTH], int offset, const TraversalRay& ray, float t_max, float* t_near_out) {
+
+    __m128 t_near = _mm_setzero_ps();
+    __m128 t_far = _mm_set1_ps(t_max);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 near = _mm_loadu_ps(&bounds[ray.near_row[axis]][offset]);
+        __m128 far = _mm_loadu_ps(&bounds[ray.far_row[axis]][offset]);
+        near = _mm_mul_ps(_mm_sub_ps(near, ray.origin4[axis]), ray.direction_inv4[axis]);
+        far = _mm_mul_ps(_mm_sub_ps(far, ray.origin4[axis]), ray.direction_inv4[axis]);
+        t_near = _mm_max_ps(near, t_near);
+        t_far = _mm_min_ps(far, t_far);
+    }
+
+    _mm_store_ps(t_near_out + offset, t_near);
+
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+}
+
+static inline int IntersectChildren(const WideNode<4>& node, const TraversalRay& ray, float t_max, float* t_near_out) {
+    return SlabTest4(node.bounds, 0, ray, t_max, t_near_out);
+}
+
+static inline int IntersectChildren(const WideNode<8>& node, const TraversalRay& ray, float t_max, float* t_near_out) {
+#ifdef __AVX__
+    __m256 t_near = _mm256_setzero_ps();
+    __m256 t_far = _mm256_set1_ps(t_max);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        __m256 near = _mm256_loadu_ps(node.bounds[ray.near_row[axis]]);
+        __m256 far = _mm256_loadu_ps(node.bounds[ray.far_row[axis]]);
+        near = _mm256_mul_ps(_mm256_sub_ps(near, ray.origin8[axis]), ray.direction_inv8[axis]);
+        far = _mm256_mul_ps(_mm256_sub_ps(far, ray.origin8[axis]), ray.direction_inv8[axis]);
+        t_near = _mm256_max_ps(near, t_near);
+        t_far = _mm256_min_ps(far, t_far);
+    }
+
+    _mm256_store_ps(t_near_out, t_near);
+
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+#else
+    // Without AVX the 8 children are tested as 2 SSE halves
+    return SlabTest4(node.bounds, 0, ray, t_max, t_near_out) | (SlabTest4(node.bounds, 4, ray, t_max, t_near_out) << 4);
+#endif
+}
+
+template <int WIDTH>
+BVHN<WIDTH>::BVHN(const BVH2& bvh2) {
+
+    Chronometer chrono;
+
+    ordered_primitives.reserve((size_t) bvh2.GetPrimitiveCount());
+    for (int i = 0; i < bvh2.GetPrimitiveCount(); ++i) {
+        ordered_primitives.push_back(bvh2.GetPrimitive(i));
+    }
+    triangle_records = bvh2.GetTriangleRecords();
+    triangle_blocks = bvh2.GetTriangleBlocks();
+    primitive_set = bvh2.GetPrimitiveSet();
+
+    if (bvh2.GetNodes().empty())
+        return;
+
+    Collapse(bvh2.GetNodes(), 0, 0);
+
+    cout << "BVH" << WIDTH << " collapsed in " << chrono.GetMilliseconds() << " ms" << endl;
+    cout << "BVH" << WIDTH << " max depth: " << max_depth << endl;
+    cout << "BVH" << WIDTH << " node count: " << nodes.size() << endl;
+    cout << "BVH" << WIDTH << " leaf count: " << leaf_count << endl;
+    cout << "BVH" << WIDTH << " node memory: " << (nodes.size() * sizeof(WideNode<WIDTH>)) / 1024 << " Ko" << endl;
+}
+
+/**
+ * Create the wide node of a BVH2 node, its children are found by opening the internal child of largest surface area,
+ * which is the most likely to be hit, until there are WIDTH of them or only leaves are left
+ * @return The index of the node in the node array
+ */
+template <int WIDTH>
+int BVHN<WIDTH>::Collapse(const vector<LinearNode2>& bvh2_nodes, int bvh2_index, int depth) {
+
+    max_depth = std::max(max_depth, short(depth));
+
+    int children[WIDTH];
+    int child_count = 0;
+
+    const LinearNode2& bvh2_node = bvh2_nodes[bvh2_index];
+
+    // Only happens for a BVH2 made of a single leaf
+    if (bvh2_node.object_count > 0) {
+        children[child_count++] = bvh2_index;
+    }
+    else {
+        children[child_count++] = bvh2_node.first_child;
+        children[child_count++] = bvh2_node.first_child + 1;
+    }
+
+    while (child_count < WIDTH) {
+
+        int largest = -1;
+        float largest_area = -1;
+
+        for (int i = 0; i < child_count; ++i) {
+            const LinearNode2& child = bvh2_nodes[children[i]];
+            if (child.object_count > 0)
+                continue;
+            float area = BoundingBox {child.min, child.max}.GetSurfaceArea();
+            if (area > largest_area) {
+                largest_area = area;
+                largest = i;
+            }
+        }
+
+        if (largest == -1)
+            break;
+
+        int opened = children[largest];
+        children[largest] = bvh2_nodes[opened].first_child;
+        children[child_count++] = bvh2_nodes[opened].first_child + 1;
+    }
+
+    int index = (int) nodes.size();
+    nodes.emplace_back();
+
+    for (int i = 0; i < WIDTH; ++i) {
+
+        // Empty child, its inverted bounds fail the slab test
+        if (i >= child_count) {
+            for (int axis = 0; axis < 3; ++axis) {
+                nodes[index].bounds[axis][i] = HUGE_NUMBER;
+                nodes[index].bounds[axis + 3][i] = -HUGE_NUMBER;
+            }
+            nodes[index].child[i] = -1;
+            nodes[index].object_count[i] = 0;
+            continue;
+        }
+
+        const LinearNode2& child = bvh2_nodes[children[i]];
+
+        for (int axis = 0; axis < 3; ++axis) {
+            nodes[index].bounds[axis][i] = child.min[axis];
+            nodes[index].bounds[axis + 3][i] = child.max[axis];
+        }
+
+        if (child.object_count > 0) {
+            nodes[index].child[i] = child.object_index;
+            nodes[index].object_count[i] = child.object_count;
+            leaf_count++;
+        }
+        else {
+            // The recursion can reallocate the node array
+            int child_index = Collapse(bvh2_nodes, children[i], depth + 1);
+            nodes[index].child[i] = child_index;
+            nodes[index].object_count[i] = 0;
+        }
+    }
+
+    return index;
+}
+
+/**
+ * Update the children bounds to the current object bounds while keeping the collapsed topology
+ * Internal children are always stored after their parent so a reverse pass sees them refitted before their parent
+ */
+template <int WIDTH>
+void BVHN<WIDTH>::Refit() {
+
+    triangle_records = CreateTriangleRecords(ordered_primitives);
+    triangle_blocks.Refit(triangle_records);
+
+    for (int index = (int) nodes.size() - 1; index >= 0; --index) {
+
+        WideNode<WIDTH>& node = nodes[index];
+
+        for (int i = 0; i < WIDTH; ++i) {
+
+            // Empty child
+            if (node.child[i] == -1)
+                continue;
+
+            BoundingBox bbox;
+
+            if (node.object_count[i] > 0) {
+                for (int j = node.child[i]; j < node.child[i] + node.object_count[i]; ++j) {
+                    bbox.ExtendsBy(ordered_primitives[j].ComputeBBox());
+                }
+            }
+            else {
+                const WideNode<WIDTH>& child = nodes[node.child[i]];
+                for (int k = 0; k < WIDTH && child.child[k] != -1; ++k) {
+                    bbox.ExtendsBy(Vec3 {child.bounds[0][k], child.bounds[1][k], child.bounds[2][k]});
+                    bbox.ExtendsBy(Vec3 {child.bounds[3][k], child.bounds[4][k], child.bounds[5][k]});
+                }
+            }
+
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = bbox.min[axis];
+                node.bounds[axis + 3][i] = bbox.max[axis];
+            }
+        }
+    }
+}
+
+/**
+ * Ordered traversal, the children hit are pushed farthest first so the nearest one is visited next
+ * Each stack entry keeps its entry distance so it is skipped if a closer hit was found in the meantime
+ */
+template <int WIDTH>
+bool BVHN<WIDTH>::FindNearestIntersection(const Ray& ray, HitRecord& hit) const {
+
+    if (nodes.empty())
+        return false;
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseNearest<TRIANGLE_PRIMITIVES>(FastRay {ray}, hit);
+        case SPHERE_PRIMITIVES:   return TraverseNearest<SPHERE_PRIMITIVES>(FastRay {ray}, hit);
+        default:                  return TraverseNearest<MIXED_PRIMITIVES>(FastRay {ray}, hit);
+    }
+}
+
+template <int WIDTH>
+template <int PRIMITIVE_SET>
+bool BVHN<WIDTH>::TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const {
+
+    const TraversalRay traversal_ray {fast_ray};
+
+    struct StackEntry {
+        int index;          // Node index, or first object index for a leaf
+        int object_count;   // 0 for a node
+        float dist;
+    };
+
+    StackEntry stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+
+    stack[stack_size++] = StackEntry {0, 0, 0.f};
+
+    while (stack_size > 0) {
+
+        const StackEntry entry = stack[--stack_size];
+
+        if (entry.dist >= hit.dist)
+            continue;
+
+        if (entry.object_count > 0) {
+            LeafIntersector<PRIMITIVE_SET>::FindNearest(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                        entry.index, entry.index + entry.object_count, fast_ray, hit);
+            continue;
+        }
+
+        const WideNode<WIDTH>& node = nodes[entry.index];
+
+        alignas(32) float t_near[WIDTH];
+        int hit_mask = IntersectChildren(node, traversal_ray, hit.dist, t_near);
+
+        // Insertion sort of the pushed children by decreasing distance
+        int first_pushed = stack_size;
+
+        while (hit_mask != 0) {
+            int i = __builtin_ctz(hit_mask);
+            hit_mask &= hit_mask - 1;
+
+            StackEntry child {node.child[i], node.object_count[i], t_near[i]};
+
+            int j = stack_size++;
+            while (j > first_pushed && stack[j - 1].dist < child.dist) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return (hit.primitive.object != nullptr);
+}
+
+/**
+ * Any-hit traversal, the leaf children hit are intersected right away and the node children pushed unsorted
+ */
+template <int WIDTH>
+bool BVHN<WIDTH>::Occluded(const Ray& ray, float t_max) const {
+
+    if (nodes.empty())
+        return false;
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseOccluded<TRIANGLE_PRIMITIVES>(FastRay {ray}, t_max);
+        case SPHERE_PRIMITIVES:   return TraverseOccluded<SPHERE_PRIMITIVES>(FastRay {ray}, t_max);
+        default:                  return TraverseOccluded<MIXED_PRIMITIVES>(FastRay {ray}, t_max);
+    }
+}
+
+template <int WIDTH>
+template <int PRIMITIVE_SET>
+bool BVHN<WIDTH>::TraverseOccluded(const FastRay& fast_ray, float t_max) const {
+
+    const TraversalRay traversal_ray {fast_ray};
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+
+        const WideNode<WIDTH>& node = nodes[stack[--stack_size]];
+
+        alignas(32) float t_near[WIDTH];
+        int hit_mask = IntersectChildren(node, traversal_ray, t_max, t_near);
+
+        while (hit_mask != 0) {
+            int i = __builtin_ctz(hit_mask);
+            hit_mask &= hit_mask - 1;
+
+            if (node.object_count[i] == 0) {
+                stack[stack_size++] = node.child[i];
+                continue;
+            }
+
+            if (LeafIntersector<PRIMITIVE_SET>::Occluded(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                         node.child[i], node.child[i] + node.object_count[i], fast_ray, t_max))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+template class BVHN<4>;
+template class BVHN<8>;
@@ -0,0 +1,71 @@
+#ifndef PATHTRACER_BVHN_H
+#define PATHTRACER_BVHN_H
+
+#include "BVH2.h"
+
+#include <vector>
+
+
+/**
+ * Node of a WIDTH-ary BVH, the bounds of all the children are stored as SoA so they can be tested in one SIMD slab test
+ * bounds[0..2] are the min x, y, z of each child and bounds[3..5] their max x, y, z
+ */
+template <int WIDTH>
+struct alignas(32) WideNode {
+
+    float bounds[6][WIDTH];
+    int child[WIDTH];                    // Internal child: index in the node array, Leaf child: index of its first object
+    unsigned short object_count[WIDTH];  // 0 for internal or empty children
+};
+
+/**
+ * BVH of 4 or 8 children per node, collapsed from a BVH2 so it shares its leaves and object order
+ * The traversal intersects all the children of a node at once (SSE for 4, AVX for 8) and visits them front to back
+ */
+template <int WIDTH>
+class BVHN {
+
+    std::vector<WideNode<WIDTH>> nodes;
+    std::vector<Primitive> ordered_primitives;
+    std::vector<TriangleRecord> triangle_records;
+    TriangleBlocks triangle_blocks;
+    PrimitiveSet primitive_set = MIXED_PRIMITIVES;
+    short max_depth = 0;
+    int leaf_count = 0;
+
+public:
+
+    // A node pushes at most WIDTH - 1 children and the collapsed tree is never deeper than the BVH2
+    static const int TRAVERSAL_STACK_SIZE = (WIDTH - 1) * BVH2::TRAVERSAL_STACK_SIZE + 1;
+
+    BVHN() = default;
+
+    explicit BVHN(const BVH2& bvh2);
+
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit) const;
+
+    bool Occluded(const Ray& ray, float t_max) const;
+
+    void Refit();
+
+    int GetNodeCount() const {
+        return (int) nodes.size();
+    }
+
+private:
+
+    int Collapse(const std::vector<LinearNode2>& bvh2_nodes, int bvh2_index, int depth);
+
+    // The traversals, instantiated for each PrimitiveSet
+
+    template <int PRIMITIVE_SET>
+    bool TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const;
+
+    template <int PRIMITIVE_SET>
+    bool TraverseOccluded(const FastRay& fast_ray, float t_max) const;
+};
+
+typedef BVHN<4> BVH4;
+typedef BVHN<8> BVH8;
+
+#endif //PATHTRACER_BVHN_H
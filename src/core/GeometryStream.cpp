@@ -0,0 +1,480 @@
+#include "GeometryStream.h"
+
+#include "objects/TriMesh.h"
+#include "app/Chronometer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::unique_ptr;
+
+static const char STREAM_MAGIC[4] = {'P', 'L', 'G', 'S'};
+
+// Followed by the triangle locations, the cluster table, then the clusters
+// A cluster holds its vertex indices, its corners, then the attribute arrays of the mesh layout
+struct GeometryStreamHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t triangle_count;
+    uint32_t vertex_count;
+    uint32_t cluster_count;
+    uint32_t vec3_size;
+    uint8_t compact_attributes;
+    uint8_t has_uv;
+    uint8_t has_tangents;
+    uint8_t pad;
+};
+
+static void MakeDirectory(const string& directory);
+
+template <typename T>
+static void WriteGathered(std::ofstream& file, const vector<T>& array, const vector<unsigned int>& indices, vector<T>& scratch);
+
+template <typename T>
+static void ReadArray(const char*& data, vector<T>& array, size_t count);
+
+size_t GeometryCluster::GetMemory() const {
+
+    return sizeof(GeometryCluster)
+           + vertex_indices.size() * sizeof(unsigned int) + corner_array.size() * sizeof(uint16_t)
+           + (normal_array.size() + uv_array.size() + tangent_array.size() + bitangent_array.size()) * sizeof(Vec3)
+           + (packed_normal_array.size() + packed_tangent_array.size() + packed_uv_array.size()) * sizeof(uint32_t)
+           + bitangent_sign_array.size() * sizeof(int8_t);
+}
+
+/**
+ * Only the triangle locations and the cluster table are read here, the clusters are read when first acquired
+ * An invalid file gives a stream without clusters
+ */
+GeometryStream::GeometryStream(const string& filename, size_t memory_budget)
+        : file(filename), memory_budget(memory_budget) {
+
+    if (file.IsValid() == false || file.GetSize() < sizeof(GeometryStreamHeader))
+        return;
+
+    GeometryStreamHeader header;
+    memcpy(&header, file.GetData(), sizeof(GeometryStreamHeader));
+
+    if (memcmp(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC)) != 0 || header.version != FORMAT_VERSION || header.vec3_size != sizeof(Vec3))
+        return;
+
+    size_t tables_size = size_t(header.triangle_count) * sizeof(uint32_t) + size_t(header.cluster_count) * sizeof(ClusterEntry);
+    if (tables_size > file.GetSize() - sizeof(GeometryStreamHeader))
+        return;
+
+    vertex_count = header.vertex_count;
+    compact_attributes = header.compact_attributes != 0;
+    has_uv = header.has_uv != 0;
+    has_tangents = header.has_tangents != 0;
+
+    const char* data = file.GetData() + sizeof(GeometryStreamHeader);
+    ReadArray(data, triangle_locations, header.triangle_count);
+    ReadArray(data, cluster_table, header.cluster_count);
+
+    // A truncated or corrupted file must not be read out of bounds later
+    bool valid = true;
+    for (const ClusterEntry& entry : cluster_table) {
+        if (entry.offset > file.GetSize() || GetClusterSize(entry) > file.GetSize() - entry.offset || entry.triangle_count > CLUSTER_CAPACITY)
+            valid = false;
+    }
+    for (uint32_t location : triangle_locations) {
+        uint32_t cluster = location >> SLOT_BITS;
+        if (cluster >= cluster_table.size() || (location & (CLUSTER_CAPACITY - 1)) >= cluster_table[cluster].triangle_count)
+            valid = false;
+    }
+
+    if (valid == false) {
+        cout << "Ignoring invalid geometry stream file " << filename << endl;
+        triangle_locations.clear();
+        cluster_table.clear();
+        return;
+    }
+
+    slots.reset(new ClusterSlot[cluster_table.size()]);
+}
+
+/**
+ * The clusters are filled leaf by leaf and cut before the leaf that would overflow them,
+ * so the triangles of a leaf and of its neighbours in the tree share a cluster
+ * The triangles no leaf references are appended in the last clusters
+ */
+bool GeometryStream::Write(const string& filename, const TriMesh& trimesh, const vector<int>& leaf_triangles, const vector<int>& leaf_offsets) {
+
+    Chronometer chrono;
+
+    const int triangle_count = trimesh.GetTriangleCount();
+    const uint32_t UNASSIGNED = 0xFFFFFFFF;
+
+    vector<uint32_t> triangle_locations((size_t) triangle_count, UNASSIGNED);
+    vector<int> cluster_triangles;
+    vector<int> cluster_offsets;
+    cluster_triangles.reserve((size_t) triangle_count);
+
+    int current_count = CLUSTER_CAPACITY;   // Forces a new cluster for the first triangle
+
+    auto AddTriangle = [&] (int triangle) {
+        if (current_count == CLUSTER_CAPACITY) {
+            cluster_offsets.push_back((int) cluster_triangles.size());
+            current_count = 0;
+        }
+        triangle_locations[triangle] = uint32_t(cluster_offsets.size() - 1) << SLOT_BITS | uint32_t(current_count);
+        cluster_triangles.push_back(triangle);
+        current_count++;
+    };
+
+    for (size_t i = 0; i < leaf_offsets.size(); ++i) {
+
+        int leaf_start = leaf_offsets[i];
+        int leaf_end = (i + 1 < leaf_offsets.size()) ? leaf_offsets[i + 1] : (int) leaf_triangles.size();
+
+        int new_count = 0;
+        for (int j = leaf_start; j < leaf_end; ++j) {
+            if (triangle_locations[leaf_triangles[j]] == UNASSIGNED)
+                new_count++;
+        }
+
+        if (new_count == 0)
+            continue;
+
+        // A leaf bigger than a cluster still starts a new one
+        if (current_count + new_count > CLUSTER_CAPACITY)
+            current_count = CLUSTER_CAPACITY;
+
+        for (int j = leaf_start; j < leaf_end; ++j) {
+            // Also skips a triangle referenced twice by the leaf
+            if (triangle_locations[leaf_triangles[j]] == UNASSIGNED)
+                AddTriangle(leaf_triangles[j]);
+        }
+    }
+
+    for (int i = 0; i < triangle_count; ++i) {
+        if (triangle_locations[i] == UNASSIGNED)
+            AddTriangle(i);
+    }
+
+    GeometryStreamHeader header = {};
+    memcpy(header.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC));
+    header.version = FORMAT_VERSION;
+    header.triangle_count = (uint32_t) triangle_count;
+    header.vertex_count = trimesh.GetVertexCount();
+    header.cluster_count = (uint32_t) cluster_offsets.size();
+    header.vec3_size = sizeof(Vec3);
+    header.compact_attributes = (uint8_t) trimesh.HasCompactAttributes();
+    header.has_uv = (uint8_t) trimesh.HasUV();
+    header.has_tangents = (uint8_t) trimesh.HasTangents();
+
+    vector<ClusterEntry> cluster_table(cluster_offsets.size());
+
+    MakeDirectory(filename.substr(0, filename.find_last_of('/') + 1));
+
+    string temp_filename = filename + ".tmp";
+    std::ofstream file {temp_filename, std::ios::binary | std::ios::trunc};
+
+    // The cluster table is written again once the cluster offsets are known
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(triangle_locations.data()), triangle_locations.size() * sizeof(uint32_t));
+    std::streamoff table_offset = file.tellp();
+    file.write(reinterpret_cast<const char*>(cluster_table.data()), cluster_table.size() * sizeof(ClusterEntry));
+
+    const vector<unsigned int>& index_array = trimesh.index_array;
+
+    // Cluster vertex of each mesh vertex, reset after each cluster
+    vector<int> cluster_vertex(trimesh.GetVertexCount(), -1);
+    vector<unsigned int> vertex_indices;
+    vector<uint16_t> corner_array;
+    vector<Vec3> vec3_scratch;
+    vector<uint32_t> uint32_scratch;
+    vector<int8_t> int8_scratch;
+
+    for (size_t i = 0; i < cluster_offsets.size(); ++i) {
+
+        int start = cluster_offsets[i];
+        int end = (i + 1 < cluster_offsets.size()) ? cluster_offsets[i + 1] : (int) cluster_triangles.size();
+
+        vertex_indices.clear();
+        corner_array.clear();
+
+        for (int j = start; j < end; ++j) {
+            for (int k = 0; k < 3; ++k) {
+                unsigned int vertex = index_array[3 * cluster_triangles[j] + k];
+                if (cluster_vertex[vertex] == -1) {
+                    cluster_vertex[vertex] = (int) vertex_indices.size();
+                    vertex_indices.push_back(vertex);
+                }
+                corner_array.push_back((uint16_t) cluster_vertex[vertex]);
+            }
+        }
+
+        for (unsigned int vertex : vertex_indices) {
+            cluster_vertex[vertex] = -1;
+        }
+
+        cluster_table[i].offset = (uint64_t) file.tellp();
+        cluster_table[i].vertex_count = (uint32_t) vertex_indices.size();
+        cluster_table[i].triangle_count = uint32_t(end - start);
+
+        file.write(reinterpret_cast<const char*>(vertex_indices.data()), vertex_indices.size() * sizeof(unsigned int));
+        file.write(reinterpret_cast<const char*>(corner_array.data()), corner_array.size() * sizeof(uint16_t));
+
+        if (trimesh.HasCompactAttributes()) {
+            WriteGathered(file, trimesh.packed_normal_array, vertex_indices, uint32_scratch);
+            if (header.has_uv)
+                WriteGathered(file, trimesh.packed_uv_array, vertex_indices, uint32_scratch);
+            if (header.has_tangents) {
+                WriteGathered(file, trimesh.packed_tangent_array, vertex_indices, uint32_scratch);
+                WriteGathered(file, trimesh.bitangent_sign_array, vertex_indices, int8_scratch);
+            }
+        }
+        else {
+            WriteGathered(file, trimesh.normal_array, vertex_indices, vec3_scratch);
+            if (header.has_uv)
+                WriteGathered(file, trimesh.uv_array, vertex_indices, vec3_scratch);
+            if (header.has_tangents) {
+                WriteGathered(file, trimesh.tangent_array, vertex_indices, vec3_scratch);
+                WriteGathered(file, trimesh.bitangent_array, vertex_indices, vec3_scratch);
+            }
+        }
+    }
+
+    size_t file_size = (size_t) file.tellp();
+    file.seekp(table_offset);
+    file.write(reinterpret_cast<const char*>(cluster_table.data()), cluster_table.size() * sizeof(ClusterEntry));
+
+    if (!file) {
+        std::cerr << "Could not write the geometry stream file " << temp_filename << endl;
+        file.close();
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+
+    file.close();
+
+    std::remove(filename.c_str());
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+
+    cout << "Geometry stream written in " << chrono.GetMilliseconds() << " ms: " << cluster_table.size() << " clusters, "
+         << file_size / 1024 << " Ko" << endl;
+
+    return true;
+}
+
+bool GeometryStream::IsValidFor(const TriMesh& trimesh) const {
+
+    return cluster_table.empty() == false
+           && triangle_locations.size() == (size_t) trimesh.GetTriangleCount()
+           && vertex_count == trimesh.GetVertexCount()
+           && compact_attributes == trimesh.HasCompactAttributes();
+}
+
+/**
+ * A resident cluster only costs a striped lock, a page fault is served under the fault mutex
+ * so that the residency is only changed by one thread at a time
+ */
+shared_ptr<const GeometryCluster> GeometryStream::Acquire(int triangle, unsigned int& slot) {
+
+    uint32_t location = triangle_locations[triangle];
+    int cluster = int(location >> SLOT_BITS);
+    slot = location & (CLUSTER_CAPACITY - 1);
+
+    ClusterSlot& cluster_slot = slots[cluster];
+    if (cluster_slot.invalid)
+        return nullptr;
+
+    cluster_slot.last_use.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock {GetSlotMutex(cluster)};
+        if (cluster_slot.data != nullptr)
+            return cluster_slot.data;
+    }
+
+    std::lock_guard<std::mutex> fault_lock {fault_mutex};
+
+    // Another thread may have paged it in, or found it corrupted, while we were waiting
+    {
+        std::lock_guard<std::mutex> lock {GetSlotMutex(cluster)};
+        if (cluster_slot.data != nullptr || cluster_slot.invalid)
+            return cluster_slot.data;
+    }
+
+    shared_ptr<const GeometryCluster> data {ReadCluster(cluster).release()};
+    if (data == nullptr) {
+        cluster_slot.invalid = true;
+        return nullptr;
+    }
+
+    size_t memory = data->GetMemory();
+
+    EvictUntilFits(memory);
+
+    {
+        std::lock_guard<std::mutex> lock {GetSlotMutex(cluster)};
+        cluster_slot.data = data;
+    }
+    cluster_slot.memory = memory;
+    resident_clusters.push_back(cluster);
+
+    resident_memory += memory;
+    resident_count++;
+    page_fault_count++;
+
+    return data;
+}
+
+unique_ptr<GeometryCluster> GeometryStream::ReadCluster(int cluster) const {
+
+    const ClusterEntry& entry = cluster_table[cluster];
+    const char* data = file.GetData() + entry.offset;
+
+    unique_ptr<GeometryCluster> geometry {new GeometryCluster};
+    geometry->compact_attributes = compact_attributes;
+
+    ReadArray(data, geometry->vertex_indices, entry.vertex_count);
+    ReadArray(data, geometry->corner_array, size_t(entry.triangle_count) * 3);
+
+    if (compact_attributes) {
+        ReadArray(data, geometry->packed_normal_array, entry.vertex_count);
+        if (has_uv)
+            ReadArray(data, geometry->packed_uv_array, entry.vertex_count);
+        if (has_tangents) {
+            ReadArray(data, geometry->packed_tangent_array, entry.vertex_count);
+            ReadArray(data, geometry->bitangent_sign_array, entry.vertex_count);
+        }
+    }
+    else {
+        ReadArray(data, geometry->normal_array, entry.vertex_count);
+        if (has_uv)
+            ReadArray(data, geometry->uv_array, entry.vertex_count);
+        if (has_tangents) {
+            ReadArray(data, geometry->tangent_array, entry.vertex_count);
+            ReadArray(data, geometry->bitangent_array, entry.vertex_count);
+        }
+    }
+
+    // The array bounds were checked against the file when it was opened, the indices they hold are checked here
+    bool valid = true;
+    for (unsigned int vertex : geometry->vertex_indices) {
+        if (vertex >= vertex_count)
+            valid = false;
+    }
+    for (uint16_t corner : geometry->corner_array) {
+        if (corner >= entry.vertex_count)
+            valid = false;
+    }
+
+    if (valid == false) {
+        std::cerr << "Ignoring the corrupted cluster " << cluster << " of the geometry stream file" << endl;
+        return nullptr;
+    }
+
+    return geometry;
+}
+
+void GeometryStream::SetMemoryBudget(size_t budget) {
+
+    std::lock_guard<std::mutex> fault_lock {fault_mutex};
+
+    memory_budget = budget;
+    EvictUntilFits(0);
+}
+
+size_t GeometryStream::GetClusterSize(const ClusterEntry& entry) const {
+
+    size_t vertex_size = sizeof(unsigned int);
+
+    if (compact_attributes)
+        vertex_size += sizeof(uint32_t) + (has_uv ? sizeof(uint32_t) : 0) + (has_tangents ? sizeof(uint32_t) + sizeof(int8_t) : 0);
+    else
+        vertex_size += sizeof(Vec3) + (has_uv ? sizeof(Vec3) : 0) + (has_tangents ? 2 * sizeof(Vec3) : 0);
+
+    return size_t(entry.vertex_count) * vertex_size + size_t(entry.triangle_count) * 3 * sizeof(uint16_t);
+}
+
+/**
+ * Called under the fault mutex
+ * Once over the budget, the clusters are evicted down to 7/8 of it so the sort by age is done once for many page faults
+ */
+void GeometryStream::EvictUntilFits(size_t incoming_memory) {
+
+    if (resident_memory + incoming_memory <= memory_budget)
+        return;
+
+    size_t target = memory_budget - memory_budget / 8;
+
+    // The last uses are read once, the other threads keep updating them
+    vector<std::pair<uint64_t, int>> clusters_by_age;
+    clusters_by_age.reserve(resident_clusters.size());
+    for (int cluster : resident_clusters) {
+        clusters_by_age.emplace_back(slots[cluster].last_use.load(std::memory_order_relaxed), cluster);
+    }
+    std::sort(clusters_by_age.begin(), clusters_by_age.end());
+
+    size_t evicted = 0;
+    while (evicted < clusters_by_age.size() && resident_memory + incoming_memory > target) {
+
+        int cluster = clusters_by_age[evicted].second;
+
+        // Released out of the lock, the clusters still acquired by other threads are only released by them
+        shared_ptr<const GeometryCluster> data;
+        {
+            std::lock_guard<std::mutex> lock {GetSlotMutex(cluster)};
+            data.swap(slots[cluster].data);
+        }
+
+        resident_memory -= slots[cluster].memory;
+        resident_count--;
+        eviction_count++;
+        evicted++;
+    }
+
+    resident_clusters.clear();
+    for (size_t i = evicted; i < clusters_by_age.size(); ++i) {
+        resident_clusters.push_back(clusters_by_age[i].second);
+    }
+}
+
+static void MakeDirectory(const string& directory) {
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
+
+template <typename T>
+static void WriteGathered(std::ofstream& file, const vector<T>& array, const vector<unsigned int>& indices, vector<T>& scratch) {
+
+    scratch.clear();
+    for (unsigned int index : indices) {
+        scratch.push_back(array[index]);
+    }
+
+    file.write(reinterpret_cast<const char*>(scratch.data()), scratch.size() * sizeof(T));
+}
+
+// The bounds were checked against the file size when it was opened
+template <typename T>
+static void ReadArray(const char*& data, vector<T>& array, size_t count) {
+
+    array.resize(count);
+    if (count > 0)
+        memcpy(array.data(), data, count * sizeof(T));
+    data += count * sizeof(T);
+}
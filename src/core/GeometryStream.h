@@ -0,0 +1,206 @@
+#ifndef PATHTRACER_GEOMETRYSTREAM_H
+#define PATHTRACER_GEOMETRYSTREAM_H
+
+#include "MappedFile.h"
+#include "math/Vec3.h"
+#include "math/Quantization.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class TriMesh;
+
+/**
+ * Vertex attributes of the triangles of one cluster, the vertices are only shared inside the cluster
+ * The arrays follow the layout of the mesh they were written from, full precision or compact, the others are empty
+ */
+struct GeometryCluster {
+
+    std::vector<unsigned int> vertex_indices;   // Mesh vertex of each cluster vertex
+    std::vector<uint16_t> corner_array;         // 3 cluster vertices per triangle, in the slot order
+
+    bool compact_attributes = false;
+    std::vector<Vec3> normal_array;
+    std::vector<Vec3> uv_array;
+    std::vector<Vec3> tangent_array;
+    std::vector<Vec3> bitangent_array;
+    std::vector<uint32_t> packed_normal_array;
+    std::vector<uint32_t> packed_tangent_array;
+    std::vector<int8_t> bitangent_sign_array;
+    std::vector<uint32_t> packed_uv_array;
+
+    size_t GetMemory() const;
+
+    bool HasUV() const {
+        return compact_attributes ? !packed_uv_array.empty() : !uv_array.empty();
+    }
+
+    bool HasTangents() const {
+        return compact_attributes ? !packed_tangent_array.empty() : !tangent_array.empty();
+    }
+
+    Vec3 GetNormal(unsigned int vertex) const {
+        return compact_attributes ? DecodeOctahedral(packed_normal_array[vertex]) : normal_array[vertex];
+    }
+
+    Vec3 GetUV(unsigned int vertex) const {
+        return compact_attributes ? DecodeHalfUV(packed_uv_array[vertex]) : uv_array[vertex];
+    }
+
+    void GetTangentFrame(unsigned int vertex, Vec3& tangent, Vec3& bitangent) const {
+        if (compact_attributes) {
+            tangent = DecodeOctahedral(packed_tangent_array[vertex]);
+            bitangent = GetNormal(vertex).cross(tangent) * bitangent_sign_array[vertex];
+        }
+        else {
+            tangent = tangent_array[vertex];
+            bitangent = bitangent_array[vertex];
+        }
+    }
+};
+
+/**
+ * Out-of-core storage of the vertex attributes of a mesh: normals, uvs and tangent frames
+ * They are cut into clusters of the triangles of neighbour BVH leaves, written to a file read back through a memory mapping,
+ * and only the clusters hit by the rays are copied out of it, the least recently used ones being evicted to stay under the memory budget
+ * The positions and the indices stay resident, the BVH builds and the intersection tests read all of them
+ * The cluster of a hit is pinned by the shared_ptr the caller holds, an eviction only drops the stream reference
+ * Only the CPU renderer pages the clusters in, the OpenCL device gets the whole attribute arrays
+ */
+class GeometryStream {
+
+    // Entry of the cluster table of the file
+    struct ClusterEntry {
+        uint64_t offset;
+        uint32_t vertex_count;
+        uint32_t triangle_count;
+    };
+
+    struct ClusterSlot {
+        std::shared_ptr<const GeometryCluster> data;    // nullptr when not resident
+        std::atomic<uint64_t> last_use {0};
+        std::atomic<bool> invalid {false};              // Set once its indices were found corrupted, it's not read again
+        size_t memory = 0;
+    };
+
+    static const int SLOT_BITS = 10;
+    static const int MUTEX_STRIPE_COUNT = 64;
+
+    MappedFile file;
+    std::vector<uint32_t> triangle_locations;   // Cluster index << SLOT_BITS | slot of each mesh triangle
+    std::vector<ClusterEntry> cluster_table;
+    std::unique_ptr<ClusterSlot[]> slots;
+    std::vector<int> resident_clusters;         // Only modified under the fault mutex
+    unsigned int vertex_count = 0;
+    bool compact_attributes = false;
+    bool has_uv = false;
+    bool has_tangents = false;
+
+    mutable std::mutex slot_mutexes[MUTEX_STRIPE_COUNT];
+    std::mutex fault_mutex;
+    size_t memory_budget;
+
+    std::atomic<uint64_t> clock {0};
+    std::atomic<size_t> resident_memory {0};
+    std::atomic<int> resident_count {0};
+    std::atomic<int64_t> page_fault_count {0};
+    std::atomic<int64_t> eviction_count {0};
+
+public:
+
+    // Bump when the file layout changes, the files of the previous versions are written again then
+    static const uint32_t FORMAT_VERSION = 1;
+
+    // Max number of triangles of a cluster, a cluster is cut at a leaf boundary before reaching it
+    static const int CLUSTER_CAPACITY = 1 << SLOT_BITS;
+
+    GeometryStream(const std::string& filename, size_t memory_budget);
+
+    /**
+     * Write the vertex attributes of the mesh cut into clusters
+     * @param leaf_triangles Mesh triangles in BVH leaf order, a triangle referenced by several leaves goes to the cluster of its first one
+     * @param leaf_offsets Start of each leaf in leaf_triangles
+     */
+    static bool Write(const std::string& filename, const TriMesh& trimesh,
+                      const std::vector<int>& leaf_triangles, const std::vector<int>& leaf_offsets);
+
+    // False if the file couldn't be mapped or doesn't hold the attributes of this mesh
+    bool IsValidFor(const TriMesh& trimesh) const;
+
+    /**
+     * Cluster holding the attributes of a triangle, paged in if it isn't resident
+     * @param slot Set to the slot of the triangle in the cluster, its corners are at 3 * slot in the corner array
+     * @return nullptr if the cluster is corrupted
+     */
+    std::shared_ptr<const GeometryCluster> Acquire(int triangle, unsigned int& slot);
+
+    /**
+     * Page a cluster in without touching the counters or the residency, for the bulk copies to the OpenCL device
+     * @return nullptr if its vertex indices or its corners are out of the mesh or of the cluster vertices
+     */
+    std::unique_ptr<GeometryCluster> ReadCluster(int cluster) const;
+
+    // Evicts right away the clusters over a lowered budget
+    void SetMemoryBudget(size_t budget);
+
+    void ResetCounters() {
+        page_fault_count = 0;
+        eviction_count = 0;
+    }
+
+    bool HasUV() const {
+        return has_uv;
+    }
+
+    bool HasTangents() const {
+        return has_tangents;
+    }
+
+    bool HasCompactAttributes() const {
+        return compact_attributes;
+    }
+
+    int GetClusterCount() const {
+        return (int) cluster_table.size();
+    }
+
+    size_t GetFileSize() const {
+        return file.GetSize();
+    }
+
+    size_t GetMemoryBudget() const {
+        return memory_budget;
+    }
+
+    size_t GetResidentMemory() const {
+        return resident_memory;
+    }
+
+    int GetResidentCount() const {
+        return resident_count;
+    }
+
+    int64_t GetPageFaultCount() const {
+        return page_fault_count;
+    }
+
+    int64_t GetEvictionCount() const {
+        return eviction_count;
+    }
+
+private:
+
+    size_t GetClusterSize(const ClusterEntry& entry) const;
+
+    void EvictUntilFits(size_t incoming_memory);
+
+    std::mutex& GetSlotMutex(int cluster) const {
+        return slot_mutexes[cluster % MUTEX_STRIPE_COUNT];
+    }
+};
+
+#endif //PATHTRACER_GEOMETRYSTREAM_H
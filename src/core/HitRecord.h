@@ -0,0 +1,32 @@
+#ifndef PATHTRACER_HITRECORD_H
+#define PATHTRACER_HITRECORD_H
+
+#include "Ray.h"
+#include "objects/Primitive.h"
+
+#include <limits>
+
+/**
+ * Nearest hit of a traversal, the surface attributes are only interpolated afterwards from u and v
+ * when the material of the hit primitive needs them
+ */
+struct HitRecord {
+
+    float dist = std::numeric_limits<float>::max();
+    Primitive primitive;
+    float u = 0;    // Barycentric weights of the second and third vertex, only for a triangle
+    float v = 0;
+
+    HitRecord() = default;
+
+    HitRecord(float dist, const Primitive& primitive, float u = 0, float v = 0)
+            : dist(dist), primitive(primitive), u(u), v(v) {
+    }
+
+    // The ray that found the hit, in the space of the primitive
+    SurfaceData GetSurfaceData(const Ray& ray) const {
+        return primitive.GetSurfaceData(u, v, ray.origin + ray.direction * dist, ray.direction);
+    }
+};
+
+#endif //PATHTRACER_HITRECORD_H
@@ -0,0 +1,184 @@
+#include "Instance.h"
+
+#include "BVHCache.h"
+#include "Material.h"
+#include "objects/Object3D.h"
+#include "objects/TriMesh.h"
+#include "app/Chronometer.h"
+
+#include <limits>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using std::unique_ptr;
+
+Instance::Instance(const BVH2* bottom_level, unsigned int submesh, const Matrix& object_to_world)
+        : bottom_level(bottom_level), submesh(submesh), object_to_world(object_to_world)
+{
+    world_to_object = object_to_world.AffineInverse();
+    normal_to_world = world_to_object.Transpose();
+}
+
+/**
+ * The ray direction is transformed but not normalized so the hit distances of both spaces are the same
+ * and the distance of the nearest hit so far can still cull the bottom-level traversal
+ */
+bool Instance::FindNearestIntersection(const Ray& ray, HitRecord& hit) const {
+
+    Ray local_ray {world_to_object.TransformPoint(ray.origin), world_to_object * ray.direction};
+
+    // Only true for a hit in this instance, not for one found before in another
+    HitRecord local_hit;
+    local_hit.dist = hit.dist;
+
+    if (bottom_level->FindNearestIntersectionOpti(local_ray, local_hit) == false)
+        return false;
+
+    hit = local_hit;
+    return true;
+}
+
+// Same unnormalized transform, t_max keeps its meaning in object space
+bool Instance::Occluded(const Ray& ray, float t_max) const {
+
+    Ray local_ray {world_to_object.TransformPoint(ray.origin), world_to_object * ray.direction};
+
+    return bottom_level->Occluded(local_ray, t_max);
+}
+
+bool Instance::Intersect(const Ray& ray, float& dist_out) const {
+
+    HitRecord hit;
+
+    if (FindNearestIntersection(ray, hit) == false)
+        return false;
+
+    dist_out = hit.dist;
+    return true;
+}
+
+SurfaceData Instance::GetSurfaceData(Vec3 pos, Vec3 ray_direction) const {
+    return SurfaceData {};
+}
+
+/**
+ * The hit primitive computes its surface data in object space, the vectors are then brought back to world space
+ * The barycentrics and the hit distance are the same in both spaces
+ */
+SurfaceData Instance::GetSurfaceData(const HitRecord& hit, const Ray& ray) const {
+
+    Ray local_ray {world_to_object.TransformPoint(ray.origin), world_to_object * ray.direction};
+
+    SurfaceData surface_data = hit.GetSurfaceData(local_ray);
+
+    surface_data.normal = (normal_to_world * surface_data.normal).normalize();
+
+    if (surface_data.material == nullptr || (surface_data.material->GetSurfaceAttributes() & SURFACE_TANGENT_FRAME)) {
+        surface_data.tangent = (object_to_world * surface_data.tangent).normalize();
+        surface_data.bitangent = (object_to_world * surface_data.bitangent).normalize();
+    }
+
+    return surface_data;
+}
+
+/**
+ * Bounds of the 8 transformed corners of the bottom level bounds
+ */
+BoundingBox Instance::ComputeBBox() const {
+
+    BoundingBox local_bbox = bottom_level->GetBounds();
+    BoundingBox bbox;
+
+    for (int corner = 0; corner < 8; ++corner) {
+        Vec3 point {
+                (corner & 1) ? local_bbox.max.x : local_bbox.min.x,
+                (corner & 2) ? local_bbox.max.y : local_bbox.min.y,
+                (corner & 4) ? local_bbox.max.z : local_bbox.min.z
+        };
+        bbox.ExtendsBy(object_to_world.TransformPoint(point));
+    }
+
+    return bbox;
+}
+
+/**
+ * Each submesh owns a contiguous range of the TriMesh triangles
+ * A TriMesh imported without its instances gets one identity instance per submesh
+ */
+InstanceSet::InstanceSet(Object3D* mesh_object) {
+
+    const TriMesh* trimesh = mesh_object->trimesh;
+    const vector<SubMesh>& submeshes = trimesh->GetSubMeshes();
+
+    submesh_primitives.resize(submeshes.size());
+    for (size_t i = 0; i < submeshes.size(); ++i) {
+        submesh_primitives[i].reserve(submeshes[i].triangle_count);
+        for (unsigned int tri = 0; tri < submeshes[i].triangle_count; ++tri) {
+            submesh_primitives[i].push_back(Primitive {mesh_object, int(submeshes[i].first_triangle + tri)});
+        }
+    }
+
+    vector<SubMeshInstance> placements = trimesh->GetInstances();
+    if (placements.empty()) {
+        for (unsigned int i = 0; i < submeshes.size(); ++i) {
+            placements.push_back(SubMeshInstance {i, Matrix {}});
+        }
+    }
+
+    for (const SubMeshInstance& placement : placements) {
+
+        if (submesh_primitives[placement.submesh].empty())
+            continue;
+
+        Instance* instance = new Instance {nullptr, placement.submesh, placement.transform};
+        instances.push_back(unique_ptr<Instance>(instance));
+
+        Object3D* object = new Object3D;
+        object->shape = instance;
+        instance_objects.push_back(unique_ptr<Object3D>(object));
+        instance_primitives.push_back(Primitive {object});
+    }
+}
+
+/**
+ * (Re)build every bottom level, the top level has to be rebuilt afterwards as the instance bounds depend on them
+ * @param model_hash Key of the cached bottom levels, each one salted with its submesh index, 0 to bypass the cache
+ */
+void InstanceSet::Build(const BVHBuildOptions& build_options, const BVHCache& cache, uint64_t model_hash) {
+
+    Chronometer chrono;
+
+    bottom_levels.clear();
+    bottom_levels.resize(submesh_primitives.size());
+    bottom_level_primitives.clear();
+    bottom_level_object_offsets.assign(submesh_primitives.size(), 0);
+
+    size_t instanced_triangle_count = 0;
+    size_t node_memory = 0;
+
+    for (size_t i = 0; i < submesh_primitives.size(); ++i) {
+
+        bottom_level_object_offsets[i] = (int) bottom_level_primitives.size();
+
+        if (submesh_primitives[i].empty())
+            continue;
+
+        uint64_t submesh_hash = (model_hash != 0) ? BVHCache::HashBytes(&i, sizeof(i), model_hash) : 0;
+        bottom_levels[i] = unique_ptr<BVH2>(cache.LoadOrBuild(submesh_hash, submesh_primitives[i], build_options, false));
+
+        const vector<Primitive>& primitives = bottom_levels[i]->GetPrimitives();
+        bottom_level_primitives.insert(bottom_level_primitives.end(), primitives.begin(), primitives.end());
+        node_memory += bottom_levels[i]->GetNodeCount() * sizeof(LinearNode2);
+    }
+
+    for (auto& instance : instances) {
+        instance->SetBottomLevel(bottom_levels[instance->GetSubMesh()].get());
+        instanced_triangle_count += submesh_primitives[instance->GetSubMesh()].size();
+    }
+
+    cout << "Bottom-level BVHs built in " << chrono.GetSeconds() << " s" << endl;
+    cout << instances.size() << " instances of " << submesh_primitives.size() << " meshes, "
+         << bottom_level_primitives.size() << " unique triangles for " << instanced_triangle_count << " instanced ones" << endl;
+    cout << "Bottom-level BVH node memory: " << node_memory / 1024 << " Ko" << endl;
+}
@@ -0,0 +1,112 @@
+#ifndef PATHTRACER_INSTANCE_H
+#define PATHTRACER_INSTANCE_H
+
+#include "BVH2.h"
+#include "math/Matrix.h"
+#include "objects/Intersectable.h"
+
+#include <memory>
+#include <vector>
+
+typedef struct Object3D Object3D;
+class BVHCache;
+
+/**
+ * Placement of a bottom-level BVH in the scene, the leaves of the top-level BVH
+ * The rays are moved to the object space of the bottom level instead of transforming its triangles
+ */
+class Instance : public Intersectable {
+
+    const BVH2* bottom_level;
+    unsigned int submesh;
+    Matrix object_to_world;
+    Matrix world_to_object;
+    Matrix normal_to_world;   // Inverse transpose, keeps the normals perpendicular to non-uniformly scaled surfaces
+
+public:
+
+    Instance(const BVH2* bottom_level, unsigned int submesh, const Matrix& object_to_world);
+
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit) const;
+
+    bool Occluded(const Ray& ray, float t_max) const;
+
+    bool Intersect(const Ray& ray, float& dist_out) const override;
+
+    // An instance has no surface of its own, use the overload taking the hit record of the bottom level
+    SurfaceData GetSurfaceData(Vec3 pos, Vec3 ray_direction) const override;
+
+    SurfaceData GetSurfaceData(const HitRecord& hit, const Ray& ray) const;
+
+    BoundingBox ComputeBBox() const override;
+
+    void SetBottomLevel(const BVH2* bvh) {
+        bottom_level = bvh;
+    }
+
+    const BVH2* GetBottomLevel() const {
+        return bottom_level;
+    }
+
+    unsigned int GetSubMesh() const {
+        return submesh;
+    }
+
+    const Matrix& GetWorldToObject() const {
+        return world_to_object;
+    }
+};
+
+/**
+ * Two-level acceleration structure of an instanced TriMesh
+ * Each submesh gets a single bottom-level BVH over its triangle primitives, shared by all its instances
+ * The top-level BVH is the scene BVH2, built over the instance objects
+ */
+class InstanceSet {
+
+    std::vector<std::vector<Primitive>> submesh_primitives;
+    std::vector<std::unique_ptr<BVH2>> bottom_levels;     // nullptr for the empty submeshes
+    std::vector<std::unique_ptr<Instance>> instances;
+    std::vector<std::unique_ptr<Object3D>> instance_objects;
+    std::vector<Primitive> instance_primitives;
+    std::vector<Primitive> bottom_level_primitives;          // Primitive references of every bottom level, in bottom level order
+    std::vector<int> bottom_level_object_offsets;
+
+public:
+
+    // The mesh object keeps owning the triangles, the bottom levels reference them
+    explicit InstanceSet(Object3D* mesh_object);
+
+    void Build(const BVHBuildOptions& build_options, const BVHCache& cache, uint64_t model_hash);
+
+    // Primitives the top-level BVH is built over, the shape of their object is an Instance
+    const std::vector<Primitive>& GetInstancePrimitives() const {
+        return instance_primitives;
+    }
+
+    const std::vector<std::unique_ptr<BVH2>>& GetBottomLevels() const {
+        return bottom_levels;
+    }
+
+    const std::vector<Primitive>& GetBottomLevelPrimitives() const {
+        return bottom_level_primitives;
+    }
+
+    // Index of the first primitive of the bottom level in the bottom level primitive array
+    int GetBottomLevelObjectOffset(int bottom_level) const {
+        return bottom_level_object_offsets[bottom_level];
+    }
+
+    int GetInstanceCount() const {
+        return (int) instances.size();
+    }
+};
+
+// See bvh.h for layout
+struct alignas(16) CLInstance {
+    CLVec4 world_to_object[3];  // First 3 rows of the matrix
+    int root_node;              // Root of the bottom level in the node array
+    int pad[3];
+};
+
+#endif //PATHTRACER_INSTANCE_H
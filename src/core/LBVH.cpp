@@ -0,0 +1,477 @@
+#include "LBVH.h"
+#include "BVH2.h"
+
+#include "app/Chronometer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::vector;
+using std::unique_ptr;
+
+// The radix sort processes the codes by digits of this many bits
+static const int RADIX_BITS = 8;
+static const int RADIX_SIZE = 1 << RADIX_BITS;
+// Min number of codes sorted by each thread, smaller arrays are sorted by less threads
+static const int RADIX_SORT_MIN_CHUNK = 16384;
+
+// Ranges with more objects than this emit their children as separate OpenMP tasks
+static const int LBVH_PARALLEL_MIN_OBJECTS = 4096;
+
+// A treelet is a node and its descendants up to this number of leaves, whose optimal topology is searched among all their subsets
+static const int TREELET_LEAF_COUNT = 7;
+static const int TREELET_PASS_COUNT = 3;
+// Nodes above this depth optimize their two subtrees as separate OpenMP tasks
+static const int TREELET_PARALLEL_MAX_DEPTH = 8;
+
+// 30 bits codes for 32 bits integers, 63 bits for 64 bits ones
+template <typename MortonCode>
+struct MortonPrimitive {
+
+    static const int BITS_PER_AXIS = (sizeof(MortonCode) * 8) / 3;
+
+    MortonCode code;
+    int index;
+};
+
+/**
+ * Spread the bits of v so that two zero bits separate them, the three axes can then be interleaved with shifts
+ */
+static inline uint32_t ExpandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static inline uint64_t ExpandBits(uint64_t v) {
+    v = (v | v << 32) & 0x001F00000000FFFFull;
+    v = (v | v << 16) & 0x001F0000FF0000FFull;
+    v = (v | v << 8)  & 0x100F00F00F00F00Full;
+    v = (v | v << 4)  & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
+}
+
+static inline int HighestBit(uint32_t v) {
+    return 31 - __builtin_clz(v);
+}
+
+static inline int HighestBit(uint64_t v) {
+    return 63 - __builtin_clzll(v);
+}
+
+template <typename MortonCode>
+static void ComputeMortonCodes(const vector<BuildInfo>& objects, vector<MortonPrimitive<MortonCode>>& primitives);
+
+template <typename MortonCode>
+static void RadixSort(vector<MortonPrimitive<MortonCode>>& primitives);
+
+template <typename MortonCode>
+static Node2* EmitHierarchy(const vector<MortonPrimitive<MortonCode>>& primitives, const vector<BuildInfo>& objects,
+                            int first, int last, int depth, const BVHBuildOptions& build_options);
+
+static void OptimizeTreelets(Node2* node, int depth, const BVHBuildOptions& build_options);
+
+static void SetSplitAxis(Node2* node);
+
+template <typename MortonCode>
+static Node2* BuildLBVH(vector<BuildInfo>& objects, const BVHBuildOptions& build_options) {
+
+    if (objects.empty())
+        return new Node2;
+
+    Chronometer chrono;
+
+    vector<MortonPrimitive<MortonCode>> primitives(objects.size());
+    ComputeMortonCodes(objects, primitives);
+    RadixSort(primitives);
+
+    // The leaves reference ranges of the objects in the Morton order
+    vector<BuildInfo> sorted_objects(objects.size());
+#pragma omp parallel for
+    for (int i = 0; i < int(primitives.size()); ++i) {
+        sorted_objects[i] = objects[primitives[i].index];
+    }
+    objects.swap(sorted_objects);
+
+    cout << "LBVH: " << MortonPrimitive<MortonCode>::BITS_PER_AXIS * 3 << " bits Morton codes sorted in " << chrono.GetMilliseconds() << " ms" << endl;
+    chrono.Restart();
+
+    Node2* root;
+
+#pragma omp parallel
+#pragma omp single
+    root = EmitHierarchy(primitives, objects, 0, (int) objects.size(), 0, build_options);
+
+    cout << "LBVH: hierarchy emitted in " << chrono.GetMilliseconds() << " ms" << endl;
+
+    if (build_options.treelet_optimization) {
+        chrono.Restart();
+
+        for (int pass = 0; pass < TREELET_PASS_COUNT; ++pass) {
+#pragma omp parallel
+#pragma omp single
+            OptimizeTreelets(root, 0, build_options);
+        }
+
+        cout << "LBVH: treelets optimized in " << chrono.GetMilliseconds() << " ms" << endl;
+    }
+
+    return root;
+}
+
+Node2* BuildLBVH(vector<BuildInfo>& objects, const BVHBuildOptions& build_options) {
+
+    if (build_options.morton_63_bits)
+        return BuildLBVH<uint64_t>(objects, build_options);
+    else
+        return BuildLBVH<uint32_t>(objects, build_options);
+}
+
+/**
+ * Quantize the object centroids on a grid over their bounds, 10 bits per axis for 30 bits codes and 21 for 63 bits ones
+ * The axes are interleaved as ...xyzxyz so bit b of a code splits along the axis 2 - b % 3
+ */
+template <typename MortonCode>
+void ComputeMortonCodes(const vector<BuildInfo>& objects, vector<MortonPrimitive<MortonCode>>& primitives) {
+
+    const float grid_size = float(1 << MortonPrimitive<MortonCode>::BITS_PER_AXIS);
+
+    BoundingBox centroid_bbox;
+    for (const BuildInfo& object : objects) {
+        centroid_bbox.ExtendsBy(object.bbox_center);
+    }
+
+    Vec3 extent = centroid_bbox.max - centroid_bbox.min;
+    Vec3 scale;
+    for (int axis = 0; axis < 3; ++axis) {
+        scale[axis] = (extent[axis] > 0) ? grid_size / extent[axis] : 0;
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < int(objects.size()); ++i) {
+        Vec3 grid_position = (objects[i].bbox_center - centroid_bbox.min) * scale;
+
+        MortonCode code = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            MortonCode cell = (MortonCode) std::min(std::max(grid_position[axis], 0.f), grid_size - 1);
+            code |= ExpandBits(cell) << (2 - axis);
+        }
+
+        primitives[i].code = code;
+        primitives[i].index = i;
+    }
+}
+
+/**
+ * Stable LSD radix sort of the codes, each pass counts the digits of contiguous chunks in parallel
+ * then scatters each chunk to the offsets given by the prefix sum of the counts in (digit, chunk) order
+ */
+template <typename MortonCode>
+void RadixSort(vector<MortonPrimitive<MortonCode>>& primitives) {
+
+    const int count = (int) primitives.size();
+    const int code_bits = MortonPrimitive<MortonCode>::BITS_PER_AXIS * 3;
+
+    int chunk_count = 1;
+#ifdef USE_OPENMP
+    chunk_count = omp_get_max_threads();
+#endif
+    chunk_count = std::max(1, std::min(chunk_count, count / RADIX_SORT_MIN_CHUNK));
+
+    vector<MortonPrimitive<MortonCode>> sorted(primitives.size());
+    vector<std::array<int, RADIX_SIZE>> offsets((size_t) chunk_count);
+
+    for (int shift = 0; shift < code_bits; shift += RADIX_BITS) {
+
+#pragma omp parallel for
+        for (int chunk = 0; chunk < chunk_count; ++chunk) {
+            std::array<int, RADIX_SIZE>& chunk_offsets = offsets[chunk];
+            chunk_offsets.fill(0);
+            for (int i = chunk * count / chunk_count; i < (chunk + 1) * count / chunk_count; ++i) {
+                chunk_offsets[(primitives[i].code >> shift) & (RADIX_SIZE - 1)]++;
+            }
+        }
+
+        int offset = 0;
+        for (int digit = 0; digit < RADIX_SIZE; ++digit) {
+            for (int chunk = 0; chunk < chunk_count; ++chunk) {
+                int digit_count = offsets[chunk][digit];
+                offsets[chunk][digit] = offset;
+                offset += digit_count;
+            }
+        }
+
+#pragma omp parallel for
+        for (int chunk = 0; chunk < chunk_count; ++chunk) {
+            std::array<int, RADIX_SIZE>& chunk_offsets = offsets[chunk];
+            for (int i = chunk * count / chunk_count; i < (chunk + 1) * count / chunk_count; ++i) {
+                sorted[chunk_offsets[(primitives[i].code >> shift) & (RADIX_SIZE - 1)]++] = primitives[i];
+            }
+        }
+
+        primitives.swap(sorted);
+    }
+}
+
+/**
+ * Split the range where its highest differing bit changes, the codes being sorted it is found by a binary search
+ * A range of identical codes is split in its middle, as is any range whose bit split would go deeper than BVH2::MAX_DEPTH:
+ * the bits add up to 63 levels and each run of identical codes adds its own, a middle split keeps the subtree balanced
+ * The node is collapsed back into a leaf when it is small enough and the SAH says it's cheaper, like RecursiveBuild does
+ */
+template <typename MortonCode>
+Node2* EmitHierarchy(const vector<MortonPrimitive<MortonCode>>& primitives, const vector<BuildInfo>& objects,
+                     int first, int last, int depth, const BVHBuildOptions& build_options) {
+
+    Node2* node = new Node2;
+
+    int obj_count = last - first;
+
+    if (obj_count == 1) {
+        node->bbox = objects[first].bbox;
+        node->first_object = first;
+        node->object_count = 1;
+        node->cost = build_options.intersection_cost * node->bbox.GetSurfaceArea();
+        return node;
+    }
+
+    MortonCode first_code = primitives[first].code;
+    MortonCode last_code = primitives[last - 1].code;
+
+    int middle;
+
+    if (first_code == last_code) {
+        middle = (first + last) / 2;
+    }
+    else {
+        int bit = HighestBit(first_code ^ last_code);
+        auto split = std::partition_point(primitives.begin() + first, primitives.begin() + last,
+                                          [bit](const MortonPrimitive<MortonCode>& primitive) {
+                                              return ((primitive.code >> bit) & 1) == 0;
+                                          });
+        middle = int(split - primitives.begin());
+        node->split_axis = char(2 - bit % 3);
+    }
+
+    bool middle_split = first_code == last_code;
+
+    if (!middle_split && depth + 1 + BVH2::GetBalancedHeight(std::max(middle - first, last - middle)) > BVH2::MAX_DEPTH) {
+        middle = (first + last) / 2;
+        middle_split = true;
+    }
+
+    if (obj_count > LBVH_PARALLEL_MIN_OBJECTS) {
+#pragma omp task shared(primitives, objects, build_options) firstprivate(node, first, middle, depth)
+        node->left_child = unique_ptr<Node2>(EmitHierarchy(primitives, objects, first, middle, depth + 1, build_options));
+
+        node->right_child = unique_ptr<Node2>(EmitHierarchy(primitives, objects, middle, last, depth + 1, build_options));
+#pragma omp taskwait
+    }
+    else {
+        node->left_child = unique_ptr<Node2>(EmitHierarchy(primitives, objects, first, middle, depth + 1, build_options));
+        node->right_child = unique_ptr<Node2>(EmitHierarchy(primitives, objects, middle, last, depth + 1, build_options));
+    }
+
+    node->bbox = node->left_child->bbox;
+    node->bbox.ExtendsBy(node->right_child->bbox);
+
+    if (middle_split)
+        SetSplitAxis(node);
+
+    float surface_area = node->bbox.GetSurfaceArea();
+    float leaf_cost = obj_count * build_options.intersection_cost * surface_area;
+    float split_cost = build_options.traversal_cost * surface_area + node->left_child->cost + node->right_child->cost;
+
+    if (obj_count <= build_options.max_leaf_size && leaf_cost <= split_cost) {
+        node->left_child.reset();
+        node->right_child.reset();
+        node->first_object = first;
+        node->object_count = obj_count;
+        node->split_axis = -1;
+        node->cost = leaf_cost;
+    }
+    else {
+        node->cost = split_cost;
+    }
+
+    return node;
+}
+
+/**
+ * Leaves and internal nodes of a treelet, and the optimal topology of each subset of its leaves
+ * Subset s is a bitmask of the leaves, it is split in best_left[s] and s ^ best_left[s] for a cost of best_cost[s]
+ */
+struct Treelet {
+
+    unique_ptr<Node2> leaves[TREELET_LEAF_COUNT];
+    unique_ptr<Node2> internal_nodes[TREELET_LEAF_COUNT - 2];
+    int leaf_count = 0;
+    int internal_count = 0;
+    int next_internal = 0;
+
+    BoundingBox bbox[1 << TREELET_LEAF_COUNT];
+    float best_cost[1 << TREELET_LEAF_COUNT];
+    int best_left[1 << TREELET_LEAF_COUNT];
+
+    void Form(Node2* root);
+    void FindOptimalTopology(const BVHBuildOptions& build_options);
+    void Rebuild(Node2* node, int subset);
+    unique_ptr<Node2> TakeNode(int subset);
+};
+
+/**
+ * Take the children of the root as the treelet leaves, then repeatedly open the internal leaf of largest surface area
+ */
+void Treelet::Form(Node2* root) {
+
+    leaves[leaf_count++] = std::move(root->left_child);
+    leaves[leaf_count++] = std::move(root->right_child);
+
+    while (leaf_count < TREELET_LEAF_COUNT) {
+
+        int largest = -1;
+        float largest_area = -1;
+
+        for (int i = 0; i < leaf_count; ++i) {
+            if (leaves[i]->object_count > 0)
+                continue;
+            float area = leaves[i]->bbox.GetSurfaceArea();
+            if (area > largest_area) {
+                largest_area = area;
+                largest = i;
+            }
+        }
+
+        if (largest == -1)
+            break;
+
+        internal_nodes[internal_count] = std::move(leaves[largest]);
+        Node2* opened = internal_nodes[internal_count++].get();
+        leaves[largest] = std::move(opened->left_child);
+        leaves[leaf_count++] = std::move(opened->right_child);
+    }
+}
+
+/**
+ * Dynamic programming over the subsets by increasing value, the subsets of a subset being smaller they are already solved
+ * Only the partitions whose left part holds the lowest leaf are tried as the two halves are interchangeable
+ */
+void Treelet::FindOptimalTopology(const BVHBuildOptions& build_options) {
+
+    const int subset_count = 1 << leaf_count;
+
+    for (int subset = 1; subset < subset_count; ++subset) {
+
+        int lowest = subset & -subset;
+
+        if (subset == lowest) {
+            int leaf = __builtin_ctz(subset);
+            bbox[subset] = leaves[leaf]->bbox;
+            best_cost[subset] = leaves[leaf]->cost;
+            continue;
+        }
+
+        bbox[subset] = bbox[lowest];
+        bbox[subset].ExtendsBy(bbox[subset ^ lowest]);
+
+        float best = std::numeric_limits<float>::max();
+        int best_partition = lowest;
+
+        for (int left = (subset - 1) & subset; left > 0; left = (left - 1) & subset) {
+            if ((left & lowest) == 0)
+                continue;
+            float cost = best_cost[left] + best_cost[subset ^ left];
+            if (cost < best) {
+                best = cost;
+                best_partition = left;
+            }
+        }
+
+        best_cost[subset] = build_options.traversal_cost * bbox[subset].GetSurfaceArea() + best;
+        best_left[subset] = best_partition;
+    }
+}
+
+void Treelet::Rebuild(Node2* node, int subset) {
+
+    node->left_child = TakeNode(best_left[subset]);
+    node->right_child = TakeNode(subset ^ best_left[subset]);
+    node->bbox = bbox[subset];
+    node->cost = best_cost[subset];
+    SetSplitAxis(node);
+}
+
+unique_ptr<Node2> Treelet::TakeNode(int subset) {
+
+    if ((subset & (subset - 1)) == 0)
+        return std::move(leaves[__builtin_ctz(subset)]);
+
+    unique_ptr<Node2> node = std::move(internal_nodes[next_internal++]);
+    Rebuild(node.get(), subset);
+    return node;
+}
+
+/**
+ * Bottom-up pass restructuring the treelet of each internal node, the optimal topology is never worse than the current one
+ */
+void OptimizeTreelets(Node2* node, int depth, const BVHBuildOptions& build_options) {
+
+    if (node->object_count > 0)
+        return;
+
+    if (depth < TREELET_PARALLEL_MAX_DEPTH) {
+#pragma omp task shared(build_options) firstprivate(node, depth)
+        OptimizeTreelets(node->left_child.get(), depth + 1, build_options);
+
+        OptimizeTreelets(node->right_child.get(), depth + 1, build_options);
+#pragma omp taskwait
+    }
+    else {
+        OptimizeTreelets(node->left_child.get(), depth + 1, build_options);
+        OptimizeTreelets(node->right_child.get(), depth + 1, build_options);
+    }
+
+    Treelet treelet;
+    treelet.Form(node);
+
+    // Two leaves only have one topology
+    if (treelet.leaf_count == 2) {
+        node->left_child = std::move(treelet.leaves[0]);
+        node->right_child = std::move(treelet.leaves[1]);
+        return;
+    }
+
+    treelet.FindOptimalTopology(build_options);
+    treelet.Rebuild(node, (1 << treelet.leaf_count) - 1);
+}
+
+/**
+ * Split along the axis separating the most the children centers, with the left child first on it for the ordered traversal
+ */
+void SetSplitAxis(Node2* node) {
+
+    Vec3 delta = node->right_child->bbox.GetCenter() - node->left_child->bbox.GetCenter();
+
+    char axis = 0;
+    for (char i = 1; i < 3; ++i) {
+        if (std::fabs(delta[i]) > std::fabs(delta[axis]))
+            axis = i;
+    }
+
+    if (delta[axis] < 0)
+        std::swap(node->left_child, node->right_child);
+
+    node->split_axis = axis;
+}
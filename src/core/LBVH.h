@@ -0,0 +1,17 @@
+#ifndef PATHTRACER_LBVH_H
+#define PATHTRACER_LBVH_H
+
+#include "BVHCommons.h"
+
+#include <vector>
+
+/**
+ * Linear BVH builder: the objects are sorted along a Morton curve of their centroids
+ * and the hierarchy is emitted from the highest differing bits of the sorted codes
+ * Much faster than the SAH builder, at the cost of a lower tree quality that the optional treelet optimization partly recovers
+ * The objects are reordered so each leaf references a contiguous range of them, like RecursiveBuild
+ * @return The root of the tree
+ */
+Node2* BuildLBVH(std::vector<BuildInfo>& objects, const BVHBuildOptions& build_options);
+
+#endif //PATHTRACER_LBVH_H
@@ -0,0 +1,76 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN 1
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) {
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    file_handle = file;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+        return;
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return;
+
+    mapping_handle = mapping;
+
+    data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (data != nullptr)
+        size = (size_t) file_size.QuadPart;
+}
+
+MappedFile::~MappedFile() {
+
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping_handle != nullptr)
+        CloseHandle(mapping_handle);
+    if (file_handle != nullptr)
+        CloseHandle(file_handle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) {
+
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file == -1)
+        return;
+
+    struct stat file_stat = {};
+    if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0) {
+
+        void* mapping = mmap(nullptr, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping != MAP_FAILED) {
+            data = static_cast<const char*>(mapping);
+            size = (size_t) file_stat.st_size;
+        }
+    }
+
+    // The mapping stays valid once the file is closed
+    close(file);
+}
+
+MappedFile::~MappedFile() {
+
+    if (data != nullptr)
+        munmap(const_cast<char*>(data), size);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef PATHTRACER_MAPPEDFILE_H
+#define PATHTRACER_MAPPEDFILE_H
+
+#include <string>
+
+/**
+ * Read-only memory mapping of a whole file, the pages are only read from the disk when first touched
+ * An unreadable or empty file gives an invalid mapping
+ */
+class MappedFile {
+
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+
+public:
+
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsValid() const {
+        return data != nullptr;
+    }
+
+    const char* GetData() const {
+        return data;
+    }
+
+    size_t GetSize() const {
+        return size;
+    }
+};
+
+#endif //PATHTRACER_MAPPEDFILE_H
@@ -9,6 +9,7 @@
 using std::string;
 
 void MakePathAbsolute(string& path, const string& directory);
+std::shared_ptr<Texture> GetImageTexture(const string& path, bool store_in_linear, const TextureMap& textures);
 
 string GetPathAssimp(aiTextureType tex_type, aiMaterial* ai_material);
 string GetPathAssimp(string key, aiTextureType type, aiMaterial* ai_material);
@@ -17,76 +18,77 @@ float GetNumberFactorAssimp(string key, unsigned int type, unsigned int slot, fl
 Vec3 GetVecFactorAssimp(string key, unsigned int type, unsigned int slot, Vec3 default_value, aiMaterial* ai_material);
 
 OldMaterial::OldMaterial(aiMaterial* ai_material, const std::string& directory)
+    : OldMaterial{MaterialDescriptor::FromAssimp(ai_material, MaterialDescriptor::LEGACY_WORKFLOW), directory}
+{
+}
+
+OldMaterial::OldMaterial(const MaterialDescriptor& descriptor, const std::string& directory, const TextureMap& textures)
     : Material{new StandardStack(0, 0, 0)}
 {
-    aiString name;
-    ai_material->Get(AI_MATKEY_NAME, name);
-    cout << "Material: [" << name.C_Str() << "]" << endl;
+    cout << "Material: [" << descriptor.name << "]" << endl;
     
-    auto albedo_path = GetPathAssimp(aiTextureType_DIFFUSE, ai_material);
-    auto reflectance_path = GetPathAssimp(aiTextureType_SPECULAR, ai_material);
-    auto normal_path = GetPathAssimp(aiTextureType_HEIGHT, ai_material);
-    
-    Vec3 albedo_value = GetVecFactorAssimp(AI_MATKEY_COLOR_DIFFUSE, 1, ai_material);
-    Vec3 reflectance_value = GetVecFactorAssimp(AI_MATKEY_COLOR_SPECULAR, 0.04, ai_material);
+    auto albedo_path = descriptor.albedo_path;
+    auto reflectance_path = descriptor.specular_path;
+    auto normal_path = descriptor.normal_path;
     
     MakePathAbsolute(albedo_path, directory);
     MakePathAbsolute(reflectance_path, directory);
     MakePathAbsolute(normal_path, directory);
     
-    LoadLegacyMaterial(albedo_path, reflectance_path, normal_path, albedo_value, reflectance_value);
+    LoadLegacyMaterial(albedo_path, reflectance_path, normal_path, descriptor.albedo_value, descriptor.reflectance_value, textures);
     
     roughness_map = std::make_shared<ValueTex1f>(0.1f);
     
 }
 
-void OldMaterial::LoadLegacyMaterial(string albedo_path, string reflectance_path, string normal_path, Vec3 albedo_value, Vec3 reflectance_value) {
+void OldMaterial::LoadLegacyMaterial(string albedo_path, string reflectance_path, string normal_path, Vec3 albedo_value, Vec3 reflectance_value,
+                                     const TextureMap& textures) {
     
     if (albedo_path.empty() == false)
-        albedo_map = std::make_shared<TextureUbyte>(albedo_path);
+        albedo_map = GetImageTexture(albedo_path, true, textures);
     else
         albedo_map = std::make_shared<ValueTex3f>(albedo_value);
     
     if (reflectance_path.empty() == false)
-        reflectance_map = std::make_shared<TextureUbyte>(reflectance_path);
+        reflectance_map = GetImageTexture(reflectance_path, true, textures);
     else
         reflectance_map = std::make_shared<ValueTex3f>(reflectance_value);
     
     if (normal_path.empty() == false) {
-        normal_map = std::make_shared<TextureUbyte>(normal_path, false);
+        normal_map = GetImageTexture(normal_path, false, textures);
     }
 }
 
 MetallicWorkflow::MetallicWorkflow(aiMaterial* ai_material, const std::string& directory)
+    : MetallicWorkflow{MaterialDescriptor::FromAssimp(ai_material, MaterialDescriptor::METALLIC_WORKFLOW), directory}
+{
+}
+
+MetallicWorkflow::MetallicWorkflow(const MaterialDescriptor& descriptor, const std::string& directory, const TextureMap& textures)
     : Material{new StandardStack(0, 0, 0)}
 {
-    aiString name;
-    ai_material->Get(AI_MATKEY_NAME, name);
-    cout << "Material: [" << name.C_Str() << "]" << endl;
+    cout << "Material: [" << descriptor.name << "]" << endl;
     
     packed_metal_roughness = true;
     
-    auto albedo_path = GetPathAssimp(aiTextureType_DIFFUSE, ai_material);
-    auto metallic_path = GetPathAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_METALLICROUGHNESS_TEXTURE, ai_material);
-    auto normal_path = GetPathAssimp(aiTextureType_NORMALS, ai_material);
-    
-    Vec3 base_color_factor = GetVecFactorAssimp(AI_MATKEY_COLOR_DIFFUSE, 1, ai_material);
-    float metallic_factor = GetNumberFactorAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_METALLIC_FACTOR, 1, ai_material);
-    float roughness_factor = GetNumberFactorAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_ROUGHNESS_FACTOR, 1, ai_material);
+    auto albedo_path = descriptor.albedo_path;
+    auto metallic_path = descriptor.specular_path;
+    auto normal_path = descriptor.normal_path;
     
     MakePathAbsolute(albedo_path, directory);
     MakePathAbsolute(metallic_path, directory);
     MakePathAbsolute(normal_path, directory);
     
-    LoadMaterial(albedo_path, metallic_path, normal_path, base_color_factor, metallic_factor, roughness_factor);
+    LoadMaterial(albedo_path, metallic_path, normal_path, descriptor.albedo_value, descriptor.metallic_factor, descriptor.roughness_factor, textures);
     
 }
 
-void MetallicWorkflow::LoadMaterial(string albedo_path, string metallic_path, string normal_path, Vec3 base_color_factor, float metallic_factor, float roughness_factor) {
+void MetallicWorkflow::LoadMaterial(string albedo_path, string metallic_path, string normal_path, Vec3 base_color_factor, float metallic_factor, float roughness_factor,
+                                    const TextureMap& textures) {
     
     if (albedo_path.empty() == false) {
         
-        albedo_map = std::make_shared<TextureUbyte>(albedo_path);
+        albedo_map = GetImageTexture(albedo_path, true, textures);
         if (base_color_factor != 1) {
             cout << "Multiplication of base_color texture not implemented" << endl;
         }
@@ -97,7 +99,7 @@ void MetallicWorkflow::LoadMaterial(string albedo_path, string metallic_path, st
     
     if (metallic_path.empty() == false) {
         
-        metallic_map = std::make_shared<TextureUbyte>(metallic_path);
+        metallic_map = GetImageTexture(metallic_path, true, textures);
         if (metallic_factor != 1) {
             cout << "Multiplication of metallic texture not implemented" << endl;
         }
@@ -111,10 +113,63 @@ void MetallicWorkflow::LoadMaterial(string albedo_path, string metallic_path, st
     }
     
     if (normal_path.empty() == false) {
-        normal_map = std::make_shared<TextureUbyte>(normal_path, false);
+        normal_map = GetImageTexture(normal_path, false, textures);
     }
 }
 
+/**
+ * Only the values the workflow reads are fetched, the others keep their defaults
+ */
+MaterialDescriptor MaterialDescriptor::FromAssimp(aiMaterial* ai_material, int32_t workflow) {
+    
+    MaterialDescriptor descriptor;
+    descriptor.workflow = workflow;
+    
+    aiString name;
+    ai_material->Get(AI_MATKEY_NAME, name);
+    descriptor.name = name.C_Str();
+    
+    descriptor.albedo_path = GetPathAssimp(aiTextureType_DIFFUSE, ai_material);
+    descriptor.albedo_value = GetVecFactorAssimp(AI_MATKEY_COLOR_DIFFUSE, 1, ai_material);
+    
+    if (workflow == METALLIC_WORKFLOW) {
+        descriptor.specular_path = GetPathAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_METALLICROUGHNESS_TEXTURE, ai_material);
+        descriptor.normal_path = GetPathAssimp(aiTextureType_NORMALS, ai_material);
+        descriptor.metallic_factor = GetNumberFactorAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_METALLIC_FACTOR, 1, ai_material);
+        descriptor.roughness_factor = GetNumberFactorAssimp(AI_MATKEY_GLTF_PBRMETALLICROUGHNESS_ROUGHNESS_FACTOR, 1, ai_material);
+    }
+    else {
+        descriptor.specular_path = GetPathAssimp(aiTextureType_SPECULAR, ai_material);
+        descriptor.normal_path = GetPathAssimp(aiTextureType_HEIGHT, ai_material);
+        descriptor.reflectance_value = GetVecFactorAssimp(AI_MATKEY_COLOR_SPECULAR, 0.04, ai_material);
+    }
+    
+    return descriptor;
+}
+
+/**
+ * Both workflows store the albedo and the specular maps in linear space, and the normal map as is
+ */
+void MaterialDescriptor::GetTextureKeys(const std::string& directory, std::set<std::pair<string, bool>>& keys) const {
+    
+    const std::pair<string, bool> textures[] = {{albedo_path, true}, {specular_path, true}, {normal_path, false}};
+    
+    for (auto texture : textures) {
+        if (texture.first.empty())
+            continue;
+        MakePathAbsolute(texture.first, directory);
+        keys.insert(texture);
+    }
+}
+
+Material* MaterialDescriptor::CreateMaterial(const std::string& directory, const TextureMap& textures) const {
+    
+    if (workflow == METALLIC_WORKFLOW)
+        return new MetallicWorkflow(*this, directory, textures);
+    else
+        return new OldMaterial(*this, directory, textures);
+}
+
 Vec3 GetVecFactorAssimp(string key, unsigned int type, unsigned int slot, Vec3 default_value, aiMaterial* ai_material) {
     
     aiColor4D ai_color;
@@ -245,9 +300,23 @@ float GetNumberFactorGLTF(string factor_name, float _default, tinygltf::Paramete
 
 void MakePathAbsolute(string& path, const string& directory) {
     
-    if (path.empty())
+    if (path.empty() || MaterialDescriptor::IsEmbedded(path))
         return;
     
     if (path.find(':') == std::string::npos)
         path = directory + path;
-}
\ No newline at end of file
+}
+
+std::shared_ptr<Texture> GetImageTexture(const string& path, bool store_in_linear, const TextureMap& textures) {
+    
+    auto iter = textures.find({path, store_in_linear});
+    if (iter != textures.end())
+        return iter->second;
+    
+    if (MaterialDescriptor::IsEmbedded(path)) {
+        std::cerr << "Embedded texture [" << path << "] not decoded" << endl;
+        throw std::bad_exception();
+    }
+    
+    return std::make_shared<TextureUbyte>(path, store_in_linear);
+}
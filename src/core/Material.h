@@ -4,6 +4,7 @@
 #include <memory>
 #include <iostream>
 #include <map>
+#include <set>
 #include <math/Vec3.h>
 #include <material/BrdfStack.h>
 #include <objects/SurfaceData.h>
@@ -47,11 +48,58 @@ public:
         return nullptr;
     }
 
+    // The SurfaceAttributes CreateBSDF reads, the others are not interpolated at the hit point
+    virtual int GetSurfaceAttributes() const {
+        return ALL_SURFACE_ATTRIBUTES;
+    }
+
     std::unique_ptr<BrdfStack>::pointer GetBrdfStack() {
         return brdf_stack.get();
     }
 };
 
+// Decoded image textures by absolute path and linear storage, shared by the materials referencing them
+typedef std::map<std::pair<std::string, bool>, std::shared_ptr<Texture>> TextureMap;
+
+/**
+ * What an imported material is made of, enough to create it again without the importer
+ * The texture paths are kept as written in the model file, relative to its directory
+ * The images embedded in the model file are named "*<image index>" like the Assimp embedded textures
+ */
+struct MaterialDescriptor {
+
+    enum Workflow : int32_t {
+        LEGACY_WORKFLOW,
+        METALLIC_WORKFLOW
+    };
+
+    int32_t workflow = LEGACY_WORKFLOW;
+    std::string name;
+    std::string albedo_path;
+    std::string specular_path;          // Reflectance map of the legacy workflow, packed metallic roughness map of the metallic one
+    std::string normal_path;
+    Vec3 albedo_value {1};              // Diffuse color or base color factor
+    Vec3 reflectance_value {0.04f};
+    float metallic_factor = 1;
+    float roughness_factor = 1;
+
+    static MaterialDescriptor FromAssimp(aiMaterial* ai_material, int32_t workflow);
+
+    static bool IsEmbedded(const std::string& path) {
+        return path.empty() == false && path[0] == '*';
+    }
+
+    bool HasEmbeddedTextures() const {
+        return IsEmbedded(albedo_path) || IsEmbedded(specular_path) || IsEmbedded(normal_path);
+    }
+
+    // Add the keys of the image textures the material loads, so they can be decoded beforehand
+    void GetTextureKeys(const std::string& directory, std::set<std::pair<std::string, bool>>& keys) const;
+
+    // The textures not found in the map are loaded from their file
+    Material* CreateMaterial(const std::string& directory, const TextureMap& textures = TextureMap {}) const;
+};
+
 // TODO: Decoupling of asset workflow and material representation
 
 class OldMaterial : public Material {
@@ -67,6 +115,8 @@ public:
     
     OldMaterial(aiMaterial* ai_material, const std::string& directory);
 
+    OldMaterial(const MaterialDescriptor& descriptor, const std::string& directory, const TextureMap& textures = TextureMap {});
+
     OldMaterial(const std::shared_ptr<Texture>& albedo_map, const std::shared_ptr<Texture>& roughness_map, const std::shared_ptr<Texture>& reflectance_map, const std::shared_ptr<Texture> normal_map = nullptr)
             : Material{new StandardStack(0, 0, 0)}, albedo_map(albedo_map), roughness_map(roughness_map), reflectance_map(reflectance_map), normal_map{normal_map}
     { }
@@ -118,6 +168,10 @@ public:
 
         return stack;
     }
+
+    int GetSurfaceAttributes() const override {
+        return (normal_map != nullptr) ? ALL_SURFACE_ATTRIBUTES : SURFACE_UV;
+    }
     
 
     std::shared_ptr<Texture> GetAlbedo() const {
@@ -137,7 +191,8 @@ public:
     }
     
 private:
-    void LoadLegacyMaterial(std::string albedo_path, std::string reflectance_path, std::string normal_path, Vec3 albedo_value, Vec3 reflectance_value);
+    void LoadLegacyMaterial(std::string albedo_path, std::string reflectance_path, std::string normal_path, Vec3 albedo_value, Vec3 reflectance_value,
+                            const TextureMap& textures = TextureMap {});
 };
 
 
@@ -155,6 +210,8 @@ public:
     
     MetallicWorkflow(aiMaterial* ai_material, const std::string& directory);
 
+    MetallicWorkflow(const MaterialDescriptor& descriptor, const std::string& directory, const TextureMap& textures = TextureMap {});
+
 #ifdef USE_GLTF_LIB
     MetallicWorkflow(int index, tinygltf::Model& model, const std::string& directory);
 #endif
@@ -228,6 +285,11 @@ public:
         return stack;
     }
 
+    // The normal map tangent space is built from the normal alone
+    int GetSurfaceAttributes() const override {
+        return SURFACE_UV;
+    }
+
     std::shared_ptr<Texture> GetAlbedo() const {
         return albedo_map;
     }
@@ -250,7 +312,7 @@ public:
     
 private:
     void LoadMaterial(std::string albedo_path, std::string metallic_path, std::string normal_path,
-                      Vec3 base_color_factor, float metallic_factor, float roughness_factor);
+                      Vec3 base_color_factor, float metallic_factor, float roughness_factor, const TextureMap& textures = TextureMap {});
 };
 
 
@@ -278,6 +340,10 @@ public:
         return stack;
     }
 
+    int GetSurfaceAttributes() const override {
+        return 0;
+    }
+
     std::shared_ptr<Texture> GetAlbedo() const {
         return albedo_map;
     }
@@ -288,6 +354,10 @@ public:
 class MirrorMaterial : public Material {
 public:
     MirrorMaterial() : Material(new SingleBrdf(new Mirror())) {}
+
+    int GetSurfaceAttributes() const override {
+        return 0;
+    }
 };
 
 #endif //PATHTRACER_MATERIAL_H
@@ -0,0 +1,340 @@
+#include "MeshCache.h"
+
+#include "MappedFile.h"
+#include "BVHCache.h"
+#include "objects/TriMesh.h"
+#include "app/Chronometer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+static const char CACHE_MAGIC[4] = {'P', 'L', 'M', 'C'};
+
+// Followed by the arrays in the order of the counts, then the material descriptors
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t pos_count;
+    uint32_t normal_count;
+    uint32_t uv_count;
+    uint32_t tangent_count;     // Also the bitangent count
+    uint32_t index_count;
+    uint32_t submesh_count;
+    uint32_t instance_count;
+    uint32_t material_count;
+    uint32_t vec3_size;
+    float bound_radius;
+};
+
+// Bounds checked reads from the mapping, a failed read leaves the reader failed
+struct MeshCacheReader {
+
+    const MappedFile& file;
+    size_t offset;
+    bool failed;
+
+    template <typename T>
+    void ReadArray(vector<T>& array, uint32_t count) {
+
+        size_t size = size_t(count) * sizeof(T);
+
+        if (failed || size > file.GetSize() - offset) {
+            failed = true;
+            return;
+        }
+
+        array.resize(count);
+        if (size > 0)
+            memcpy(array.data(), file.GetData() + offset, size);
+        offset += size;
+    }
+
+    template <typename T>
+    void Read(T& value) {
+
+        if (failed || sizeof(T) > file.GetSize() - offset) {
+            failed = true;
+            return;
+        }
+
+        memcpy(&value, file.GetData() + offset, sizeof(T));
+        offset += sizeof(T);
+    }
+
+    void Read(string& value) {
+
+        uint32_t length = 0;
+        Read(length);
+
+        if (failed || length > file.GetSize() - offset) {
+            failed = true;
+            return;
+        }
+
+        value.assign(file.GetData() + offset, length);
+        offset += length;
+    }
+};
+
+static void MakeDirectory(const string& directory);
+static void WriteString(std::ofstream& file, const string& value);
+
+MeshCache::MeshCache(const string& directory)
+        : directory(directory) {
+}
+
+uint64_t MeshCache::ComputeKey(uint64_t file_hash, bool import_instances) {
+
+    uint32_t version = FORMAT_VERSION;
+    uint64_t hash = BVHCache::HashBytes(&version, sizeof(version), file_hash);
+
+    return BVHCache::HashBytes(&import_instances, sizeof(import_instances), hash);
+}
+
+string MeshCache::GetFilename(uint64_t key) const {
+
+    std::ostringstream filename;
+    filename << directory << std::hex << std::setw(16) << std::setfill('0') << key << ".mesh";
+
+    return filename.str();
+}
+
+/**
+ * @param model_directory Directory of the model file, the texture paths of its materials are relative to it
+ * @return The TriMesh of the cache file matching the key, nullptr if there is none or if it is invalid
+ */
+TriMesh* MeshCache::Load(uint64_t key, const string& model_directory) const {
+
+    MappedFile file {GetFilename(key)};
+
+    if (file.IsValid() == false || file.GetSize() < sizeof(MeshCacheHeader))
+        return nullptr;
+
+    MeshCacheHeader header;
+    memcpy(&header, file.GetData(), sizeof(MeshCacheHeader));
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != FORMAT_VERSION || header.key != key
+        || header.vec3_size != sizeof(Vec3) || header.index_count == 0 || header.index_count % 3 != 0) {
+        cout << "Ignoring invalid mesh cache file " << GetFilename(key) << endl;
+        return nullptr;
+    }
+
+    TriMesh* trimesh = new TriMesh;
+    MeshCacheReader reader {file, sizeof(MeshCacheHeader), false};
+
+    reader.ReadArray(trimesh->pos_array, header.pos_count);
+    reader.ReadArray(trimesh->normal_array, header.normal_count);
+    reader.ReadArray(trimesh->uv_array, header.uv_count);
+    reader.ReadArray(trimesh->tangent_array, header.tangent_count);
+    reader.ReadArray(trimesh->bitangent_array, header.tangent_count);
+    reader.ReadArray(trimesh->index_array, header.index_count);
+    reader.ReadArray(trimesh->triangle_to_material, header.index_count / 3);
+    reader.ReadArray(trimesh->submeshes, header.submesh_count);
+
+    trimesh->instances.resize(reader.failed ? 0 : header.instance_count);
+    for (SubMeshInstance& instance : trimesh->instances) {
+        reader.Read(instance.submesh);
+        reader.Read(instance.transform.values);
+    }
+
+    trimesh->material_descriptors.resize(reader.failed ? 0 : header.material_count);
+    for (MaterialDescriptor& descriptor : trimesh->material_descriptors) {
+        reader.Read(descriptor.workflow);
+        reader.Read(descriptor.name);
+        reader.Read(descriptor.albedo_path);
+        reader.Read(descriptor.specular_path);
+        reader.Read(descriptor.normal_path);
+        reader.Read(descriptor.albedo_value);
+        reader.Read(descriptor.reflectance_value);
+        reader.Read(descriptor.metallic_factor);
+        reader.Read(descriptor.roughness_factor);
+    }
+
+    // A truncated or corrupted file must not index out of the arrays
+    if (reader.failed || reader.offset != file.GetSize() || IsValidMesh(*trimesh) == false) {
+        cout << "Ignoring invalid mesh cache file " << GetFilename(key) << endl;
+        delete trimesh;
+        return nullptr;
+    }
+
+    trimesh->vertex_count = header.pos_count;
+    trimesh->sphere_bounds = Sphere {0, 0, 0, header.bound_radius};
+    trimesh->CreateMaterials(model_directory);
+
+    return trimesh;
+}
+
+/**
+ * Written to a temporary file first so an interrupted save never leaves a partial file under the final name
+ */
+bool MeshCache::Save(uint64_t key, const TriMesh& trimesh) const {
+
+    // The compact layout replaces the arrays the cache holds
+    if (trimesh.HasCompactAttributes())
+        return false;
+
+    // The embedded images are only in the model file
+    for (const MaterialDescriptor& descriptor : trimesh.material_descriptors) {
+        if (descriptor.HasEmbeddedTextures())
+            return false;
+    }
+
+    MeshCacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = FORMAT_VERSION;
+    header.key = key;
+    header.pos_count = (uint32_t) trimesh.pos_array.size();
+    header.normal_count = (uint32_t) trimesh.normal_array.size();
+    header.uv_count = (uint32_t) trimesh.uv_array.size();
+    header.tangent_count = (uint32_t) trimesh.tangent_array.size();
+    header.index_count = (uint32_t) trimesh.index_array.size();
+    header.submesh_count = (uint32_t) trimesh.submeshes.size();
+    header.instance_count = (uint32_t) trimesh.instances.size();
+    header.material_count = (uint32_t) trimesh.material_descriptors.size();
+    header.vec3_size = sizeof(Vec3);
+    header.bound_radius = trimesh.sphere_bounds.radius;
+
+    MakeDirectory(directory);
+
+    string filename = GetFilename(key);
+    string temp_filename = filename + ".tmp";
+
+    {
+        std::ofstream file {temp_filename, std::ios::binary | std::ios::trunc};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(trimesh.pos_array.data()), trimesh.pos_array.size() * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(trimesh.normal_array.data()), trimesh.normal_array.size() * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(trimesh.uv_array.data()), trimesh.uv_array.size() * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(trimesh.tangent_array.data()), trimesh.tangent_array.size() * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(trimesh.bitangent_array.data()), trimesh.bitangent_array.size() * sizeof(Vec3));
+        file.write(reinterpret_cast<const char*>(trimesh.index_array.data()), trimesh.index_array.size() * sizeof(unsigned int));
+        file.write(reinterpret_cast<const char*>(trimesh.triangle_to_material.data()), trimesh.triangle_to_material.size() * sizeof(unsigned int));
+        file.write(reinterpret_cast<const char*>(trimesh.submeshes.data()), trimesh.submeshes.size() * sizeof(SubMesh));
+
+        for (const SubMeshInstance& instance : trimesh.instances) {
+            file.write(reinterpret_cast<const char*>(&instance.submesh), sizeof(instance.submesh));
+            file.write(reinterpret_cast<const char*>(instance.transform.values), sizeof(instance.transform.values));
+        }
+
+        for (const MaterialDescriptor& descriptor : trimesh.material_descriptors) {
+            file.write(reinterpret_cast<const char*>(&descriptor.workflow), sizeof(descriptor.workflow));
+            WriteString(file, descriptor.name);
+            WriteString(file, descriptor.albedo_path);
+            WriteString(file, descriptor.specular_path);
+            WriteString(file, descriptor.normal_path);
+            file.write(reinterpret_cast<const char*>(&descriptor.albedo_value), sizeof(descriptor.albedo_value));
+            file.write(reinterpret_cast<const char*>(&descriptor.reflectance_value), sizeof(descriptor.reflectance_value));
+            file.write(reinterpret_cast<const char*>(&descriptor.metallic_factor), sizeof(descriptor.metallic_factor));
+            file.write(reinterpret_cast<const char*>(&descriptor.roughness_factor), sizeof(descriptor.roughness_factor));
+        }
+
+        if (!file) {
+            std::cerr << "Could not write the mesh cache file " << temp_filename << endl;
+            file.close();
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+
+    std::remove(filename.c_str());
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(temp_filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Load the mesh of the model file from the cache, or import it and add it to the cache
+ * @param file_hash Hash of the model file content, 0 to bypass the cache
+ */
+TriMesh* MeshCache::LoadOrImport(uint64_t file_hash, const string& filename, bool import_instances) const {
+
+    if (file_hash == 0)
+        return new TriMesh {filename, "", import_instances};
+
+    uint64_t key = ComputeKey(file_hash, import_instances);
+    string model_directory = filename.substr(0, filename.find_last_of('/')) + "/";
+
+    Chronometer chrono;
+
+    TriMesh* trimesh = Load(key, model_directory);
+
+    if (trimesh != nullptr) {
+        cout << "Mesh [" << filename << "] loaded from cache in " << chrono.GetMilliseconds() << " ms: "
+             << trimesh->GetTriangleCount() << " triangles, " << trimesh->GetVertexCount() << " vertices" << endl;
+        return trimesh;
+    }
+
+    trimesh = new TriMesh {filename, "", import_instances};
+
+    if (trimesh->GetTriangleCount() > 0)
+        Save(key, *trimesh);
+
+    return trimesh;
+}
+
+static void MakeDirectory(const string& directory) {
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
+
+static void WriteString(std::ofstream& file, const string& value) {
+
+    uint32_t length = (uint32_t) value.size();
+    file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    file.write(value.data(), length);
+}
+
+bool MeshCache::IsValidMesh(const TriMesh& trimesh) {
+
+    size_t vertex_count = trimesh.pos_array.size();
+    size_t triangle_count = trimesh.index_array.size() / 3;
+
+    if ((trimesh.normal_array.empty() == false && trimesh.normal_array.size() != vertex_count)
+        || (trimesh.uv_array.empty() == false && trimesh.uv_array.size() != vertex_count)
+        || (trimesh.tangent_array.empty() == false && trimesh.tangent_array.size() != vertex_count))
+        return false;
+
+    for (unsigned int index : trimesh.index_array) {
+        if (index >= vertex_count)
+            return false;
+    }
+
+    for (unsigned int material : trimesh.triangle_to_material) {
+        if (material >= trimesh.material_descriptors.size())
+            return false;
+    }
+
+    for (const SubMesh& submesh : trimesh.submeshes) {
+        if (size_t(submesh.first_triangle) + submesh.triangle_count > triangle_count)
+            return false;
+    }
+
+    for (const SubMeshInstance& instance : trimesh.instances) {
+        if (instance.submesh >= trimesh.submeshes.size())
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef PATHTRACER_MESHCACHE_H
+#define PATHTRACER_MESHCACHE_H
+
+#include <cstdint>
+#include <string>
+
+class TriMesh;
+
+/**
+ * On-disk cache of imported meshes, read back through a memory mapping
+ * A file holds the flattened vertex, index and material arrays of a TriMesh as the importer left them,
+ * so a warm load is one bulk copy per array instead of a full import with its post-processing
+ * The files are named after a key hashing the model file and the import settings, like the BVHCache ones
+ * The external files of a model (.mtl, .bin) are not hashed, changing only them needs the cache file to be deleted
+ */
+class MeshCache {
+
+    std::string directory;
+
+public:
+
+    // Bump when the TriMesh arrays or the material descriptors change, the meshes of the previous versions are ignored then
+    static const uint32_t FORMAT_VERSION = 1;
+
+    explicit MeshCache(const std::string& directory);
+
+    static uint64_t ComputeKey(uint64_t file_hash, bool import_instances);
+
+    TriMesh* Load(uint64_t key, const std::string& model_directory) const;
+
+    bool Save(uint64_t key, const TriMesh& trimesh) const;
+
+    TriMesh* LoadOrImport(uint64_t file_hash, const std::string& filename, bool import_instances) const;
+
+private:
+
+    std::string GetFilename(uint64_t key) const;
+
+    static bool IsValidMesh(const TriMesh& trimesh);
+};
+
+#endif //PATHTRACER_MESHCACHE_H
@@ -22,6 +22,7 @@ public:
     int fov = 70;
     bool debug = false;
     bool use_bvh = true;
+    bool use_ray_packets = true;    // Camera rays of the C++ renderer traced as packets
 
     void KeyEvent(SDL_Keysym keysym, SDL_EventType param);
 
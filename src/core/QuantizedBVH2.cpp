@@ -0,0 +1,373 @@
+#include "QuantizedBVH2.h"
+
+#include "objects/Object3D.h"
+#include "app/Chronometer.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+static const int QUANTIZED_MAX = 255;
+
+static inline float ExponentToScale(int exponent);
+static int ComputeExponent(float origin, float max);
+static void DecodeChildBounds(const QuantizedNode2& node, int child, const float (&scale)[3], Vec3& min, Vec3& max);
+
+/**
+ * Ray data splatted once per traversal, as the BVHN one, the near and far bounds of each axis are selected from the direction sign
+ */
+struct QuantizedTraversalRay {
+
+    __m128 origin[3];
+    __m128 direction_inv[3];
+    bool negative[3];
+
+    explicit QuantizedTraversalRay(const FastRay& ray) {
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis] = _mm_set1_ps(ray.origin[axis]);
+            direction_inv[axis] = _mm_set1_ps(ray.direction_inv[axis]);
+            negative[axis] = ray.direction[axis] < 0;
+        }
+    }
+};
+
+/**
+ * Decode the bounds of both children and slab test them at once, the lanes are the min of child 0 and 1 then their max
+ * The decoding is the same float expression as the encoding so its conservative rounding is reproduced exactly
+ * The distances are clamped to [0, t_max], the new value is the first operand of min/max so a NaN doesn't reject a child
+ * @return The mask of the children hit
+ */
+static inline int IntersectChildren(const QuantizedNode2& node, const QuantizedTraversalRay& ray, float t_max, float* t_near_out) {
+
+    __m128i quantized = _mm_loadu_si128(reinterpret_cast<const __m128i*>(node.child_bounds));
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128 t_near = _mm_setzero_ps();
+    __m128 t_far = _mm_set1_ps(t_max);
+
+    for (int axis = 0; axis < 3; ++axis) {
+
+        // Zero extension of the 4 bytes of the axis, SSE2 only
+        __m128 q = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(quantized, zero), zero));
+        quantized = _mm_srli_si128(quantized, 4);
+
+        __m128 bounds = _mm_add_ps(_mm_set1_ps(node.origin[axis]), _mm_mul_ps(q, _mm_set1_ps(ExponentToScale(node.exponent[axis]))));
+        __m128 t = _mm_mul_ps(_mm_sub_ps(bounds, ray.origin[axis]), ray.direction_inv[axis]);
+        __m128 t_max_bounds = _mm_movehl_ps(t, t);
+
+        __m128 near = ray.negative[axis] ? t_max_bounds : t;
+        __m128 far = ray.negative[axis] ? t : t_max_bounds;
+        t_near = _mm_max_ps(near, t_near);
+        t_far = _mm_min_ps(far, t_far);
+    }
+
+    _mm_storel_pi(reinterpret_cast<__m64*>(t_near_out), t_near);
+
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & 3;
+}
+
+QuantizedBVH2::QuantizedBVH2(const BVH2& bvh2, bool log_statistics) {
+
+    Chronometer chrono;
+
+    ordered_primitives = bvh2.GetPrimitives();
+    triangle_records = bvh2.GetTriangleRecords();
+    triangle_blocks = bvh2.GetTriangleBlocks();
+    primitive_set = bvh2.GetPrimitiveSet();
+    traversal_cost = bvh2.GetBuildOptions().traversal_cost;
+    intersection_cost = bvh2.GetBuildOptions().intersection_cost;
+
+    const vector<LinearNode2>& bvh2_nodes = bvh2.GetNodes();
+
+    if (bvh2_nodes.empty())
+        return;
+
+    EncodedChild children[2];
+
+    // A BVH2 made of a single leaf gets a root whose two children are that leaf, intersecting it twice can't change the hit
+    if (bvh2_nodes[0].object_count > 0) {
+        children[0] = GetChild(bvh2_nodes, 0);
+        children[1] = children[0];
+    }
+    else {
+        children[0] = GetChild(bvh2_nodes, bvh2_nodes[0].first_child);
+        children[1] = GetChild(bvh2_nodes, bvh2_nodes[0].first_child + 1);
+    }
+
+    nodes.reserve(bvh2_nodes.size() / 2 + 1);
+
+    // The root bounds are not stored, a ray hitting none of its children misses the tree anyway
+    float root_surface_area = bvh2.GetBounds().GetSurfaceArea();
+    float cost = root_surface_area * traversal_cost;
+    Encode(bvh2_nodes, children, 0, cost);
+
+    sah_cost = (root_surface_area > 0) ? cost / (root_surface_area * intersection_cost) : 0;
+
+    if (log_statistics == false)
+        return;
+
+    size_t bvh2_memory = bvh2_nodes.size() * sizeof(LinearNode2);
+    size_t cl_memory = bvh2_nodes.size() * sizeof(CLNode2);
+
+    cout << "Quantized BVH2 encoded in " << chrono.GetMilliseconds() << " ms, SAH cost: " << sah_cost
+         << " (" << bvh2.GetSAHCost() << " at full precision)" << endl;
+    cout << "Quantized BVH2 max depth: " << max_depth << endl;
+    cout << "Quantized BVH2 node count: " << nodes.size() << " (" << sizeof(QuantizedNode2) << " bytes per node)" << endl;
+    cout << "Quantized BVH2 node memory: " << GetNodeMemory() / 1024 << " Ko, "
+         << float(GetNodeMemory()) / bvh2_nodes.size() << " bytes per BVH2 node instead of "
+         << sizeof(LinearNode2) << " (" << bvh2_memory / 1024 << " Ko) on the CPU and "
+         << sizeof(CLNode2) << " (" << cl_memory / 1024 << " Ko) on the OpenCL device" << endl;
+}
+
+QuantizedBVH2::EncodedChild QuantizedBVH2::GetChild(const vector<LinearNode2>& bvh2_nodes, int bvh2_index) const {
+
+    const LinearNode2& node = bvh2_nodes[bvh2_index];
+
+    if (node.object_count > 0)
+        return EncodedChild {node.min, node.max, -1, node.object_index, node.object_count};
+
+    return EncodedChild {node.min, node.max, bvh2_index, 0, 0};
+}
+
+/**
+ * Create the node of the two children, in the frame of their common bounds, then recursively those of the internal children
+ * A leaf too large for its 8 bits object count is split into a subtree of smaller ranges under the same bounds
+ * @param cost Accumulates the surface area weighted SAH cost of the decoded children bounds
+ * @return The index of the node in the node array
+ */
+int QuantizedBVH2::Encode(const vector<LinearNode2>& bvh2_nodes, const EncodedChild (&children)[2], int depth, float& cost) {
+
+    max_depth = std::max(max_depth, short(depth));
+
+    int index = (int) nodes.size();
+    nodes.emplace_back();
+
+    QuantizedNode2 node {};
+    float scale[3];
+
+    for (int axis = 0; axis < 3; ++axis) {
+
+        float min = std::min(children[0].min[axis], children[1].min[axis]);
+        float max = std::max(children[0].max[axis], children[1].max[axis]);
+
+        node.origin[axis] = min;
+        node.exponent[axis] = (signed char) ComputeExponent(min, max);
+        scale[axis] = ExponentToScale(node.exponent[axis]);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+
+        const EncodedChild& child = children[i];
+
+        // Rounded outward, then moved by one step while the rounding of the decoding still cuts into the exact bounds
+        for (int axis = 0; axis < 3; ++axis) {
+
+            float origin = node.origin[axis];
+
+            float q_min = std::floor((child.min[axis] - origin) / scale[axis]);
+            q_min = std::max(0.f, std::min(q_min, float(QUANTIZED_MAX)));
+            while (q_min > 0 && origin + q_min * scale[axis] > child.min[axis])
+                q_min--;
+
+            float q_max = std::ceil((child.max[axis] - origin) / scale[axis]);
+            q_max = std::max(0.f, std::min(q_max, float(QUANTIZED_MAX)));
+            while (q_max < QUANTIZED_MAX && origin + q_max * scale[axis] < child.max[axis])
+                q_max++;
+
+            node.child_bounds[axis][i] = (unsigned char) q_min;
+            node.child_bounds[axis][2 + i] = (unsigned char) q_max;
+        }
+
+        Vec3 min, max;
+        DecodeChildBounds(node, i, scale, min, max);
+        float area = BoundingBox {min, max}.GetSurfaceArea();
+
+        if (child.bvh2_index == -1 && child.object_count <= QUANTIZED_MAX) {
+            node.child[i] = child.first_object;
+            node.object_count[i] = (unsigned char) child.object_count;
+            cost += area * child.object_count * intersection_cost;
+            leaf_count++;
+            continue;
+        }
+
+        EncodedChild grand_children[2];
+
+        if (child.bvh2_index == -1) {
+            int half = child.object_count / 2;
+            grand_children[0] = EncodedChild {child.min, child.max, -1, child.first_object, half};
+            grand_children[1] = EncodedChild {child.min, child.max, -1, child.first_object + half, child.object_count - half};
+        }
+        else {
+            grand_children[0] = GetChild(bvh2_nodes, bvh2_nodes[child.bvh2_index].first_child);
+            grand_children[1] = GetChild(bvh2_nodes, bvh2_nodes[child.bvh2_index].first_child + 1);
+        }
+
+        cost += area * traversal_cost;
+
+        // The recursion can reallocate the node array
+        node.child[i] = Encode(bvh2_nodes, grand_children, depth + 1, cost);
+        node.object_count[i] = 0;
+    }
+
+    nodes[index] = node;
+
+    return index;
+}
+
+/**
+ * Ordered traversal, both children bounds are decoded and tested together, then the nearest one hit is visited first
+ * The leaf children are intersected right away as they have no node of their own
+ */
+bool QuantizedBVH2::FindNearestIntersection(const Ray& ray, HitRecord& hit) const {
+
+    if (nodes.empty())
+        return false;
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseNearest<TRIANGLE_PRIMITIVES>(FastRay {ray}, hit);
+        case SPHERE_PRIMITIVES:   return TraverseNearest<SPHERE_PRIMITIVES>(FastRay {ray}, hit);
+        default:                  return TraverseNearest<MIXED_PRIMITIVES>(FastRay {ray}, hit);
+    }
+}
+
+template <int PRIMITIVE_SET>
+bool QuantizedBVH2::TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const {
+
+    const QuantizedTraversalRay traversal_ray {fast_ray};
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+
+        const QuantizedNode2& node = nodes[node_index];
+
+        float child_dist[2];
+        int hit_mask = IntersectChildren(node, traversal_ray, hit.dist, child_dist);
+
+        bool child_hit[2];
+
+        for (int i = 0; i < 2; ++i) {
+
+            child_hit[i] = (hit_mask & (1 << i)) != 0;
+
+            if (child_hit[i] && node.object_count[i] > 0) {
+                LeafIntersector<PRIMITIVE_SET>::FindNearest(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                            node.child[i], node.child[i] + node.object_count[i], fast_ray, hit);
+                child_hit[i] = false;
+            }
+        }
+
+        if (child_hit[0] && child_hit[1]) {
+            int nearest_child = (child_dist[1] < child_dist[0]) ? 1 : 0;
+            stack[stack_size++] = node.child[1 - nearest_child];
+            node_index = node.child[nearest_child];
+            continue;
+        }
+
+        if (child_hit[0] || child_hit[1]) {
+            node_index = node.child[child_hit[0] ? 0 : 1];
+            continue;
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node_index = stack[--stack_size];
+    }
+
+    return (hit.primitive.object != nullptr);
+}
+
+/**
+ * Any-hit traversal, the leaf children hit are intersected right away and the internal ones visited in child order
+ */
+bool QuantizedBVH2::Occluded(const Ray& ray, float t_max) const {
+
+    if (nodes.empty())
+        return false;
+
+    switch (primitive_set) {
+        case TRIANGLE_PRIMITIVES: return TraverseOccluded<TRIANGLE_PRIMITIVES>(FastRay {ray}, t_max);
+        case SPHERE_PRIMITIVES:   return TraverseOccluded<SPHERE_PRIMITIVES>(FastRay {ray}, t_max);
+        default:                  return TraverseOccluded<MIXED_PRIMITIVES>(FastRay {ray}, t_max);
+    }
+}
+
+template <int PRIMITIVE_SET>
+bool QuantizedBVH2::TraverseOccluded(const FastRay& fast_ray, float t_max) const {
+
+    const QuantizedTraversalRay traversal_ray {fast_ray};
+
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+
+        const QuantizedNode2& node = nodes[stack[--stack_size]];
+
+        float child_dist[2];
+        int hit_mask = IntersectChildren(node, traversal_ray, t_max, child_dist);
+
+        for (int i = 1; i >= 0; --i) {
+
+            if ((hit_mask & (1 << i)) == 0)
+                continue;
+
+            if (node.object_count[i] == 0) {
+                stack[stack_size++] = node.child[i];
+                continue;
+            }
+
+            if (LeafIntersector<PRIMITIVE_SET>::Occluded(triangle_blocks, triangle_records.data(), ordered_primitives.data(),
+                                                         node.child[i], node.child[i] + node.object_count[i], fast_ray, t_max))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// 2^exponent built from its bits, the exponent is kept in the normalized float range
+static inline float ExponentToScale(int exponent) {
+
+    uint32_t bits = uint32_t(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+
+    return scale;
+}
+
+/**
+ * Smallest power of 2 step whose 255 steps from the origin reach max, once rounded to float
+ */
+static int ComputeExponent(float origin, float max) {
+
+    int exponent;
+    std::frexp((max - origin) / QUANTIZED_MAX, &exponent);
+
+    exponent = std::max(-126, std::min(exponent - 1, 127));
+
+    while (exponent < 127 && origin + QUANTIZED_MAX * ExponentToScale(exponent) < max)
+        exponent++;
+
+    return exponent;
+}
+
+// Same expression as IntersectChildren
+static void DecodeChildBounds(const QuantizedNode2& node, int child, const float (&scale)[3], Vec3& min, Vec3& max) {
+
+    for (int axis = 0; axis < 3; ++axis) {
+        min[axis] = node.origin[axis] + node.child_bounds[axis][child] * scale[axis];
+        max[axis] = node.origin[axis] + node.child_bounds[axis][2 + child] * scale[axis];
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef PATHTRACER_QUANTIZEDBVH2_H
+#define PATHTRACER_QUANTIZEDBVH2_H
+
+#include "BVH2.h"
+
+#include <vector>
+
+
+/**
+ * BVH2 compressed from a full precision one, it shares its leaves and object order
+ * A node holds the quantized bounds of its two children so the leaves don't need nodes of their own,
+ * which roughly halves the node count on top of the smaller nodes
+ * The decoded bounds are slightly larger than the exact ones, so more nodes are visited, see the SAH cost of both trees
+ */
+class QuantizedBVH2 {
+
+    std::vector<QuantizedNode2> nodes;
+    std::vector<Primitive> ordered_primitives;
+    std::vector<TriangleRecord> triangle_records;
+    TriangleBlocks triangle_blocks;
+    PrimitiveSet primitive_set = MIXED_PRIMITIVES;
+    float traversal_cost = 1.f;
+    float intersection_cost = 1.f;
+    short max_depth = 0;
+    int leaf_count = 0;
+    float sah_cost = 0;
+
+    // Child of a node being encoded, either a BVH2 internal node or a range of objects
+    struct EncodedChild {
+        Vec3 min;
+        Vec3 max;
+        int bvh2_index;     // -1 for a range of objects
+        int first_object;
+        int object_count;
+    };
+
+public:
+
+    // A leaf of more than 255 objects is split into a subtree of smaller ranges, halving an int object count takes at most 24 levels
+    static const int MAX_LEAF_SPLIT_DEPTH = 24;
+
+    // Each node pushes at most one child, the leaf splits can make the quantized tree deeper than the BVH2
+    static const int TRAVERSAL_STACK_SIZE = BVH2::TRAVERSAL_STACK_SIZE + MAX_LEAF_SPLIT_DEPTH;
+
+    QuantizedBVH2() = default;
+
+    explicit QuantizedBVH2(const BVH2& bvh2, bool log_statistics = true);
+
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit) const;
+
+    bool Occluded(const Ray& ray, float t_max) const;
+
+    const std::vector<QuantizedNode2>& GetNodes() const {
+        return nodes;
+    }
+
+    int GetNodeCount() const {
+        return (int) nodes.size();
+    }
+
+    size_t GetNodeMemory() const {
+        return nodes.size() * sizeof(QuantizedNode2);
+    }
+
+    float GetSAHCost() const {
+        return sah_cost;
+    }
+
+    int GetMaxDepth() const {
+        return max_depth;
+    }
+
+    // Enough for the traversals of this tree only, the OpenCL kernels are built with it
+    int GetTraversalStackSize() const {
+        return max_depth + 1;
+    }
+
+private:
+
+    int Encode(const std::vector<LinearNode2>& bvh2_nodes, const EncodedChild (&children)[2], int depth, float& cost);
+
+    EncodedChild GetChild(const std::vector<LinearNode2>& bvh2_nodes, int bvh2_index) const;
+
+    // The traversals, instantiated for each PrimitiveSet
+
+    template <int PRIMITIVE_SET>
+    bool TraverseNearest(const FastRay& fast_ray, HitRecord& hit) const;
+
+    template <int PRIMITIVE_SET>
+    bool TraverseOccluded(const FastRay& fast_ray, float t_max) const;
+};
+
+#endif //PATHTRACER_QUANTIZEDBVH2_H
@@ -40,6 +40,7 @@ struct alignas(16) CLRay {
 
 class FastRay : public Ray {
 public:
+    FastRay() = default;
     FastRay(const Ray& ray) : Ray{ray} {
         direction_inv = Vec3{1.f} / ray.direction;
     }
@@ -0,0 +1,62 @@
+#ifndef PATHTRACER_RAYPACKET_H
+#define PATHTRACER_RAYPACKET_H
+
+#include "Ray.h"
+#include "HitRecord.h"
+
+#include <limits>
+
+/**
+ * Coherent rays traced together, stored as structure of arrays so each SSE register holds one component of 4 rays
+ * The lanes cover a 4 x 2 pixel tile, the lanes of the tile outside the film are left inactive
+ * The nearest hit of each lane is written back in dist, hit_primitive and its barycentrics u and v
+ */
+struct alignas(16) RayPacket {
+
+    static const int SIZE = 8;
+    static const int WIDTH = 4;
+    static const int HEIGHT = SIZE / WIDTH;
+
+    float origin[3][SIZE];
+    float direction[3][SIZE];
+    float direction_inv[3][SIZE];
+    float dist[SIZE];
+    Primitive hit_primitive[SIZE];
+    float u[SIZE];
+    float v[SIZE];
+    int active_mask = 0;
+
+    void SetRay(int lane, const Ray& ray, float max_dist = std::numeric_limits<float>::max()) {
+
+        FastRay fast_ray {ray};
+
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis][lane] = fast_ray.origin[axis];
+            direction[axis][lane] = fast_ray.direction[axis];
+            direction_inv[axis][lane] = fast_ray.direction_inv[axis];
+        }
+        dist[lane] = max_dist;
+        hit_primitive[lane] = Primitive {};
+        u[lane] = 0;
+        v[lane] = 0;
+        active_mask |= 1 << lane;
+    }
+
+    HitRecord GetHit(int lane) const {
+        return HitRecord {dist[lane], hit_primitive[lane], u[lane], v[lane]};
+    }
+
+    void SetHit(int lane, const HitRecord& hit) {
+        dist[lane] = hit.dist;
+        hit_primitive[lane] = hit.primitive;
+        u[lane] = hit.u;
+        v[lane] = hit.v;
+    }
+
+    Ray GetRay(int lane) const {
+        return Ray {Vec3 {origin[0][lane], origin[1][lane], origin[2][lane]},
+                    Vec3 {direction[0][lane], direction[1][lane], direction[2][lane]}};
+    }
+};
+
+#endif //PATHTRACER_RAYPACKET_H
@@ -5,11 +5,16 @@
 #include "objects/Plane.h"
 #include "objects/Triangle.h"
 #include "objects/BoundingBox.h"
+#include "BVHCache.h"
+#include "MeshCache.h"
+#include "GeometryStream.h"
 
 #include <algorithm>
 #include <map>
 #include <set>
 #include <array>
+#include <iomanip>
+#include <sstream>
 
 using std::unique_ptr;
 using std::shared_ptr;
@@ -17,6 +22,8 @@ using std::vector;
 using std::set;
 using std::string;
 
+static void AppendLeafTriangles(const BVH2& bvh, const TriMesh* trimesh, vector<int>& leaf_triangles, vector<int>& leaf_offsets);
+
 Scene::Scene(string model_file) {
 
 //    cam_pos = {36.2491, 1.09842, -5.07885};
@@ -98,7 +105,11 @@ void Scene::LoadObjects(const string& file) {
         throw std::exception();
     }
     
-    bvh2 = new BVH2 {this};
+    BuildBVH();
+
+    // The clusters follow the leaves of the BVH just built, a later rebuild only loosens their locality
+    if (use_out_of_core)
+        StreamGeometry();
 
 //    exit(0);
 
@@ -107,8 +118,99 @@ void Scene::LoadObjects(const string& file) {
     PostProcess();
 }
 
+/**
+ * (Re)build the BVH with the current build options
+ * The OpenCL object array follows the BVH primitive references so each leaf references a contiguous range of it
+ */
+void Scene::BuildBVH() {
+
+    BVHCache cache {bvh_cache_dir};
+    uint64_t cache_hash = use_bvh_cache ? model_hash : 0;
+
+    delete bvh2;
+    if (instance_set != nullptr) {
+        // The top level is built over the instances, whose bounds depend on the bottom levels
+        instance_set->Build(bvh_build_options, cache, cache_hash);
+        bvh2 = cache.LoadOrBuild(cache_hash, instance_set->GetInstancePrimitives(), bvh_build_options);
+    }
+    else {
+        vector<Primitive> primitives;
+        for (const auto& object : objects) {
+            object->AppendPrimitives(primitives);
+        }
+        bvh2 = cache.LoadOrBuild(cache_hash, primitives, bvh_build_options);
+    }
+
+    delete bvh4;
+    delete bvh8;
+    delete quantized_bvh2;
+    bvh4 = nullptr;
+    bvh8 = nullptr;
+    quantized_bvh2 = nullptr;
+    BuildWideBVH();
+}
+
+/**
+ * Collapse the BVH2 into the wide BVH used by the CPU traversal, if not already done
+ * The quantized BVH2 is also encoded here, for the CPU traversal or the OpenCL renderer
+ */
+void Scene::BuildWideBVH() {
+
+    // The wide traversals don't descend into the instances, the BVH2 is always used for them
+    if (instance_set != nullptr)
+        return;
+
+    if (cpu_traversal == BVH4_TRAVERSAL && bvh4 == nullptr)
+        bvh4 = new BVH4 {*bvh2};
+
+    if (cpu_traversal == BVH8_TRAVERSAL && bvh8 == nullptr)
+        bvh8 = new BVH8 {*bvh2};
+
+    if ((cpu_traversal == QUANTIZED_BVH2_TRAVERSAL || use_quantized_bvh) && quantized_bvh2 == nullptr)
+        quantized_bvh2 = new QuantizedBVH2 {*bvh2};
+}
+
+/**
+ * Update the BVHs after objects were moved or resized, the BVH2 is only rebuilt when refitting degraded it too much
+ * @return True if the BVH was rebuilt, its topology and object order changed then
+ */
+bool Scene::RefitBVH() {
+
+    // The objects moved away from the model file, its cached BVHs don't fit them anymore
+    model_hash = 0;
+
+    if (bvh2->Refit(bvh_build_options.refit_rebuild_ratio) == false) {
+        BuildBVH();
+        return true;
+    }
+
+    if (bvh4 != nullptr)
+        bvh4->Refit();
+
+    if (bvh8 != nullptr)
+        bvh8->Refit();
+
+    // The children bounds are encoded relative to their parent bounds, so the whole tree is encoded again
+    if (quantized_bvh2 != nullptr) {
+        delete quantized_bvh2;
+        quantized_bvh2 = new QuantizedBVH2 {*bvh2, false};
+    }
+
+    return false;
+}
+
 void Scene::Clear() {
     delete bvh2;
+    delete bvh4;
+    delete bvh8;
+    delete quantized_bvh2;
+    delete instance_set;
+    bvh2 = nullptr;
+    bvh4 = nullptr;
+    bvh8 = nullptr;
+    quantized_bvh2 = nullptr;
+    instance_set = nullptr;
+    model_hash = 0;
     set<const TriMesh*> trimeshes = GetTriMeshes();
     for (const auto& trimesh : trimeshes) {
         delete trimesh;
@@ -119,6 +221,10 @@ void Scene::Clear() {
 
 Scene::~Scene() {
     delete bvh2;
+    delete bvh4;
+    delete bvh8;
+    delete quantized_bvh2;
+    delete instance_set;
 //    GetTriMeshes().clear();
 }
 
@@ -126,8 +232,58 @@ void Scene::LoadModel(const string& file) {
     
     cam_pos = {0, 0, 5};
     
-    std::vector<std::unique_ptr<Object3D>> triangles = Object3D::CreateTriMesh(file);
-    std::move(triangles.begin(), triangles.end(), std::back_inserter(objects));
+    // Hashed once, the key of the mesh and BVH caches and of the geometry stream files
+    // The whole file is read for it, so it's skipped when none of them is used
+    uint64_t file_hash = 0;
+    if (use_mesh_cache || use_bvh_cache || use_out_of_core)
+        file_hash = BVHCache::HashFile(file);
+
+    MeshCache mesh_cache {mesh_cache_dir};
+    Object3D* mesh = new Object3D;
+    mesh->trimesh = mesh_cache.LoadOrImport(use_mesh_cache ? file_hash : 0, file, use_instancing);
+
+    // Nothing could be imported
+    if (mesh->trimesh->GetTriangleCount() == 0) {
+        delete mesh->trimesh;
+        delete mesh;
+        return;
+    }
+
+    if (use_compact_vertices)
+        mesh->trimesh->CompressVertexAttributes();
+
+    if (use_instancing)
+        instance_set = new InstanceSet {mesh};
+
+    model_hash = ComputeModelHash(file_hash, mesh->trimesh);
+
+    objects.push_back(unique_ptr<Object3D>(mesh));
+}
+
+/**
+ * The model file alone misses the external geometry buffers of some formats and the importer settings,
+ * so the imported geometry is hashed too
+ */
+uint64_t Scene::ComputeModelHash(uint64_t file_hash, const TriMesh* trimesh) const {
+
+    uint64_t hash = file_hash;
+
+    if (hash == 0)
+        return 0;
+
+    const vector<Vec3>& pos_array = trimesh->GetPosArray();
+    const vector<unsigned int>& index_array = trimesh->GetIndexArray();
+
+    hash = BVHCache::HashBytes(pos_array.data(), pos_array.size() * sizeof(Vec3), hash);
+    hash = BVHCache::HashBytes(index_array.data(), index_array.size() * sizeof(unsigned int), hash);
+    hash = BVHCache::HashBytes(&use_instancing, sizeof(use_instancing), hash);
+
+    for (const SubMeshInstance& instance : trimesh->GetInstances()) {
+        hash = BVHCache::HashBytes(&instance.submesh, sizeof(instance.submesh), hash);
+        hash = BVHCache::HashBytes(instance.transform.values, sizeof(instance.transform.values), hash);
+    }
+
+    return hash;
 }
 
 void Scene::LoadSomeLights() {
@@ -374,6 +530,89 @@ void Scene::Load_TexturedSphere() {
 //    Load_Floor();
 }
 
+/**
+ * Move the vertex attributes of the meshes to their stream files, written unless the file of the same model,
+ * layout and BVH is already there
+ * The meshes were imported with their attributes, so only the memory held after the load is lowered, not its peak
+ */
+void Scene::StreamGeometry() {
+
+    size_t budget = size_t(geometry_budget_mb) * 1024 * 1024;
+    uint64_t stream_key = 0;
+    if (model_hash != 0)
+        stream_key = BVHCache::ComputeKey(model_hash, bvh_build_options, GetBVHPrimitives().size());
+
+    // A mesh is numbered by its first object so its file keeps its name from one run to the next
+    set<const TriMesh*> numbered_trimeshes;
+    int mesh_number = -1;
+
+    for (const auto& object : objects) {
+
+        if (object->trimesh == nullptr || numbered_trimeshes.insert(object->trimesh).second == false)
+            continue;
+
+        TriMesh* trimesh = object->trimesh;
+        mesh_number++;
+
+        if (trimesh->IsStreamed())
+            continue;
+
+        uint32_t version = GeometryStream::FORMAT_VERSION;
+        bool compact_attributes = trimesh->HasCompactAttributes();
+        uint64_t key = BVHCache::HashBytes(&version, sizeof(version), stream_key);
+        key = BVHCache::HashBytes(&compact_attributes, sizeof(compact_attributes), key);
+        key = BVHCache::HashBytes(&mesh_number, sizeof(mesh_number), key);
+
+        std::ostringstream filename;
+        filename << geometry_stream_dir << std::hex << std::setw(16) << std::setfill('0') << key << ".geom";
+
+        unique_ptr<GeometryStream> stream;
+
+        // Without a model hash the file can't be matched to the mesh, it is written again
+        if (model_hash != 0) {
+            stream.reset(new GeometryStream {filename.str(), budget});
+            if (stream->IsValidFor(*trimesh) == false)
+                stream.reset();
+        }
+
+        if (stream == nullptr) {
+
+            vector<int> leaf_triangles;
+            vector<int> leaf_offsets;
+
+            if (instance_set != nullptr) {
+                for (const auto& bottom_level : instance_set->GetBottomLevels()) {
+                    if (bottom_level != nullptr)
+                        AppendLeafTriangles(*bottom_level, trimesh, leaf_triangles, leaf_offsets);
+                }
+            }
+            else {
+                AppendLeafTriangles(*bvh2, trimesh, leaf_triangles, leaf_offsets);
+            }
+
+            if (GeometryStream::Write(filename.str(), *trimesh, leaf_triangles, leaf_offsets))
+                stream.reset(new GeometryStream {filename.str(), budget});
+        }
+
+        if (stream == nullptr || stream->IsValidFor(*trimesh) == false) {
+            std::cerr << "Could not stream the geometry, the vertex attributes stay in memory" << endl;
+            continue;
+        }
+
+        trimesh->StreamVertexAttributes(std::move(stream));
+    }
+}
+
+void Scene::SetGeometryBudget(int budget_mb) {
+
+    geometry_budget_mb = budget_mb;
+
+    for (const TriMesh* trimesh : GetTriMeshes()) {
+        if (trimesh->IsStreamed())
+            trimesh->GetStream()->SetMemoryBudget(size_t(budget_mb) * 1024 * 1024);
+    }
+}
+
 BoundingBox Scene::ComputeBBox() const {
 
     BoundingBox bbox;
@@ -385,14 +624,24 @@ BoundingBox Scene::ComputeBBox() const {
     return bbox;
 }
 
+bool Scene::HasEmissiveObjects() const {
+
+    for (const auto& object : objects) {
+        if (object->getEmissionIntensity() != -1)
+            return true;
+    }
+
+    return false;
+}
+
 set<const TriMesh*> Scene::GetTriMeshes() const {
 
     set<const TriMesh*> trimeshes;
 
     for (const auto& object : objects) {
 
-        if (typeid(*object->shape) == typeid(Triangle)) {
-            trimeshes.insert((static_cast<Triangle*>(object->shape))->trimesh_ptr);
+        if (object->trimesh != nullptr) {
+            trimeshes.insert(object->trimesh);
         }
     }
 
@@ -411,7 +660,13 @@ void Scene::CheckObjectsOrder() {
     std::array<int, 3> order = {-1, -1, -1};
 
     for (const auto& object : objects) {
-        if (typeid(*object->shape) == typeid(Sphere)) {
+        if (object->trimesh != nullptr) {
+            if (triangle_appeared == false) {
+                triangle_appeared = true;
+                order[2] = 1;
+            }
+        }
+        else if (typeid(*object->shape) == typeid(Sphere)) {
             // First sphere
             if (sphere_appeared == false) {
                 sphere_appeared = true;
@@ -438,12 +693,6 @@ void Scene::CheckObjectsOrder() {
                     order[1] = 0;
             }
         }
-        else if (typeid(*object->shape) == typeid(Triangle)) {
-            if (triangle_appeared == false) {
-                triangle_appeared = true;
-                order[2] = 1;
-            }
-        }
     }
 
     for (const auto& item : order) {
@@ -456,8 +705,8 @@ void Scene::CheckObjectsOrder() {
 
 void Scene::PostProcess() {
 
-    Vec3 min = bvh2->GetRoot()->bbox.min;
-    Vec3 max = bvh2->GetRoot()->bbox.max;
+    Vec3 min = bvh2->GetBounds().min;
+    Vec3 max = bvh2->GetBounds().max;
     debug_scale = std::sqrt((max * max).max() + (min * min).max());
     debug_scale = ((max - min) / 2.f).max();
     cout << "BVH scale: " << debug_scale << endl;
@@ -472,8 +721,8 @@ void Scene::PostProcess() {
 
     triangle_count = 0;
     for (const auto& object : objects) {
-        if (typeid(*object->shape) == typeid(Triangle))
-            triangle_count++;
+        if (object->trimesh != nullptr)
+            triangle_count += object->trimesh->GetTriangleCount();
     }
 
     vertex_count = 0;
@@ -483,10 +732,18 @@ void Scene::PostProcess() {
     }
 
     for (const auto& object : objects) {
-        material_set.insert(object->material);
+        if (object->trimesh != nullptr) {
+            vector<Material*> materials = object->trimesh->GetMaterials();
+            material_set.insert(materials.begin(), materials.end());
+        }
+        else {
+            material_set.insert(object->material);
+        }
     }
 
     cout << triangle_count << " triangles" << endl;
+    if (instance_set != nullptr)
+        cout << instance_set->GetInstanceCount() << " instances" << endl;
     cout << vertex_count << " vertices" << endl;
     cout << material_set.size() << " materials" << endl;
 
@@ -502,3 +759,26 @@ void Scene::CreateLightArray() {
     }
 }
 
+/**
+ * The leaves are visited in the order of their primitives, which is the depth-first order of the tree
+ */
+static void AppendLeafTriangles(const BVH2& bvh, const TriMesh* trimesh, vector<int>& leaf_triangles, vector<int>& leaf_offsets) {
+
+    vector<std::pair<int, int>> leaves;
+    for (const LinearNode2& node : bvh.GetNodes()) {
+        if (node.object_count > 0)
+            leaves.emplace_back(node.object_index, node.object_count);
+    }
+    std::sort(leaves.begin(), leaves.end());
+
+    for (const auto& leaf : leaves) {
+
+        leaf_offsets.push_back((int) leaf_triangles.size());
+
+        for (int i = leaf.first; i < leaf.first + leaf.second; ++i) {
+            const Primitive& primitive = bvh.GetPrimitive(i);
+            if (primitive.IsTriangle() && primitive.object->trimesh == trimesh)
+                leaf_triangles.push_back(primitive.index);
+        }
+    }
+}
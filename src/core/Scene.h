@@ -3,9 +3,13 @@
 
 #include "Texture.h"
 //#include "BVH.h"
+#include "Instance.h"
 #include "BVH2.h"
+#include "BVHN.h"
+#include "QuantizedBVH2.h"
 #include "BVH.h"
 
+#include <cstdint>
 #include <memory>
 #include <set>
 
@@ -19,10 +23,38 @@ private:
     int triangle_count = 0;
     int vertex_count = 0;
     std::string prefix = "../../models/";
+    std::string bvh_cache_dir = "../../bvh_cache/";
+    std::string mesh_cache_dir = "../../mesh_cache/";
+    std::string geometry_stream_dir = "../../geometry_stream/";
+    // Hash of the loaded model file and geometry, the key of its cached BVHs, 0 when the objects don't match a model anymore
+    uint64_t model_hash = 0;
 
 public:
 
-    BVH2* bvh2;
+    BVH2* bvh2 = nullptr;
+    BVHBuildOptions bvh_build_options;
+    // The wide BVHs are collapsed from bvh2, only the one used by the CPU traversal is built
+    BVH4* bvh4 = nullptr;
+    BVH8* bvh8 = nullptr;
+    // Compressed copy of bvh2, built for the CPU traversal or the OpenCL renderer when one of them uses it
+    QuantizedBVH2* quantized_bvh2 = nullptr;
+    int cpu_traversal = BVH2_ORDERED_TRAVERSAL;    // The wide BVHs are opted into from the GUI
+    // Send the quantized nodes to the OpenCL device instead of the full precision ones, ignored by instanced scenes
+    bool use_quantized_bvh = false;
+    // Load the meshes as instances of shared bottom-level BVHs instead of pre-transforming every instance
+    bool use_instancing = false;
+    // Store the mesh normals, tangents and uvs quantized, on the CPU and on the OpenCL device
+    bool use_compact_vertices = false;
+    // Keep the built BVHs on disk and load them back when the same model is built with the same options
+    bool use_bvh_cache = true;
+    // Keep the imported meshes on disk and map them back instead of importing the same model file again
+    bool use_mesh_cache = true;
+    // Page the mesh normals, tangents and uvs in from a file on demand instead of keeping them in memory
+    // CPU renderer only, the OpenCL renderer still builds and uploads the whole attribute arrays
+    bool use_out_of_core = false;
+    // Memory the paged in attributes can take, the least recently used clusters are evicted above it
+    int geometry_budget_mb = 256;
+    InstanceSet* instance_set = nullptr;
     BVH bvh;
     std::vector<std::unique_ptr<Object3D>> objects;
     std::vector<std::shared_ptr<Object3D>> lights;
@@ -37,19 +69,69 @@ public:
     bool envmap_has_changed = false;
     bool emission_has_changed = false;
     bool model_has_changed = false;
+    bool bounds_have_changed = false;   // Objects moved or resized, the BVH topology and object order are unchanged
 
     Scene(std::string file = "");
     ~Scene();
 
     void LoadObjects(const std::string& file);
+    void BuildBVH();
+    void BuildWideBVH();
+    bool RefitBVH();
+
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit) const {
+        switch (cpu_traversal) {
+            case BVH4_TRAVERSAL:           return bvh4->FindNearestIntersection(ray, hit);
+            case BVH8_TRAVERSAL:           return bvh8->FindNearestIntersection(ray, hit);
+            case QUANTIZED_BVH2_TRAVERSAL: return quantized_bvh2->FindNearestIntersection(ray, hit);
+            case BVH2_TRAVERSAL:           return bvh2->FindNearestIntersection(ray, hit);
+            case BVH2_ORDERED_TRAVERSAL:
+            default:                       return bvh2->FindNearestIntersectionOpti(ray, hit);
+        }
+    }
+
+    // hit_instance is only set in an instanced scene, the hit primitive surface data is in its object space then
+    bool FindNearestIntersection(const Ray& ray, HitRecord& hit, const Instance*& hit_instance) const {
+        if (instance_set != nullptr)
+            return bvh2->FindNearestInstanceIntersection(ray, hit, hit_instance);
+
+        return FindNearestIntersection(ray, hit);
+    }
+
+    // Any-hit query of the current CPU traversal, for shadow and visibility rays
+    bool Occluded(const Ray& ray, float t_max) const {
+        if (instance_set != nullptr)
+            return bvh2->InstanceOccluded(ray, t_max);
+
+        switch (cpu_traversal) {
+            case BVH4_TRAVERSAL:           return bvh4->Occluded(ray, t_max);
+            case BVH8_TRAVERSAL:           return bvh8->Occluded(ray, t_max);
+            case QUANTIZED_BVH2_TRAVERSAL: return quantized_bvh2->Occluded(ray, t_max);
+            default:                       return bvh2->Occluded(ray, t_max);
+        }
+    }
+
+    // Primitives referenced by the BVH leaves, those of every bottom level in an instanced scene
+    const std::vector<Primitive>& GetBVHPrimitives() const {
+        if (instance_set != nullptr)
+            return instance_set->GetBottomLevelPrimitives();
+
+        return bvh2->GetPrimitives();
+    }
 //    void Clear();
 
     BoundingBox ComputeBBox() const;
 
     std::set<const TriMesh*> GetTriMeshes() const;
 
+    // An object with an emission, even a null one, ends the paths that hit it
+    bool HasEmissiveObjects() const;
+
+    // Applies to the streams of the loaded meshes right away
+    void SetGeometryBudget(int budget_mb);
+
     bool HasChanged() const {
-        return material_has_changed || envmap_has_changed || emission_has_changed || model_has_changed;
+        return material_has_changed || envmap_has_changed || emission_has_changed || model_has_changed || bounds_have_changed;
     }
 
     int GetTriangleCount() const {
@@ -74,6 +156,8 @@ private:
     void Load_TexturedSphere();
     void LoadSomeLights();
     void LoadModel(const std::string& file);
+    uint64_t ComputeModelHash(uint64_t file_hash, const TriMesh* trimesh) const;
+    void StreamGeometry();
 
     void CheckObjectsOrder();
 
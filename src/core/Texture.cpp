@@ -5,6 +5,7 @@
 #include "math/Vec3.h"
 #include <SDL_image.h>
 #include <iostream>
+#include <sstream>
 #include <cstdio>
 #include <cassert>
 #include "app/Chronometer.h"
@@ -18,8 +19,6 @@ Vec3 SphericalToCartesian(const Vec3& direction) ;
 template <typename T>
 ImageTexture<T>::ImageTexture(const std::string& path, bool store_in_linear) : path(path) {
 
-    cout << "Loading [" + path + "] ..." << endl;
-    
     Chronometer chrono;
 
     string ext = path.substr(path.find_last_of(".") + 1);
@@ -28,11 +27,23 @@ ImageTexture<T>::ImageTexture(const std::string& path, bool store_in_linear) : p
         Load_HDR();
     }
     else {
-        Load_Generic(store_in_linear);
+        Load_Generic(IMG_Load(path.c_str()), store_in_linear);
     }
 
-    cout << width << " x " << height << " x " << int(channel_count) << " = " << (width * height * sizeof(T) * channel_count) / 1024 << " Ko";
-    cout << ", " << chrono.GetSeconds() << " s" << endl;
+    PrintLoaded(chrono.GetSeconds());
+}
+
+/**
+ * Decode an image file held in memory, the path only names the texture
+ */
+template <typename T>
+ImageTexture<T>::ImageTexture(const std::string& path, const EncodedImage& image, bool store_in_linear) : path(path) {
+
+    Chronometer chrono;
+
+    Load_Generic(IMG_Load_RW(SDL_RWFromConstMem(image.data, (int) image.size), 1), store_in_linear);
+
+    PrintLoaded(chrono.GetSeconds());
 }
 
 template <typename T>
@@ -50,10 +61,11 @@ size_t ImageTexture<T>::GetSize() const {
     return sizeof(T) * channel_count * width * height;
 }
 
+/**
+ * Takes the ownership of the decoded surface, nullptr if the decoding failed
+ */
 template <typename T>
-void ImageTexture<T>::Load_Generic(bool store_in_linear) {
-
-    SDL_Surface* surface = IMG_Load(path.c_str());
+void ImageTexture<T>::Load_Generic(SDL_Surface* surface, bool store_in_linear) {
 
     if (surface == nullptr) {
         std::cerr << "Error loading [" << path << "]" << endl;
@@ -221,6 +233,21 @@ template<>
 void ImageTexture<float>::ConvertToLinear() {
 }
 
+// A single write, the textures of a model can be decoded in parallel
+template <typename T>
+void ImageTexture<T>::PrintLoaded(float seconds) const {
+
+    std::ostringstream line;
+    line << "Loaded [" << path << "] " << width << " x " << height << " x " << int(channel_count)
+         << " = " << (width * height * sizeof(T) * channel_count) / 1024 << " Ko, " << seconds << " s\n";
+
+    cout << line.str() << std::flush;
+}
+
+void LoadImageDecoders() {
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+}
+
 template <typename T>
 string ImageTexture<T>::GetName() {
     return path;
@@ -5,6 +5,8 @@
 #include <math/Vec3.h>
 #include <SDL_quit.h>
 
+struct SDL_Surface;
+
 struct alignas(4) CLTextureInfo {
     int width;
     int height;
@@ -26,6 +28,12 @@ public:
     }
 };
 
+// An image file held in memory, like one embedded in a model file, the memory is not owned
+struct EncodedImage {
+    const char* data;
+    size_t size;
+};
+
 template <typename T>
 class ImageTexture : public Texture {
 public:
@@ -38,6 +46,7 @@ public:
     size_t height = 0;
 
     ImageTexture(const std::string& path, bool store_in_linear = true);
+    ImageTexture(const std::string& path, const EncodedImage& image, bool store_in_linear = true);
     ~ImageTexture();
 
     Vec3 Evaluate(const Vec3& uv) override;
@@ -52,11 +61,13 @@ public:
 private:
     inline Vec3 Sample(float u, float v);
 
-    void Load_Generic(bool store_in_linear);
+    void Load_Generic(SDL_Surface* surface, bool store_in_linear);
     void Load_HDR();
 
     void ConvertToLinear();
 
+    void PrintLoaded(float seconds) const;
+
 };
 
 template <typename T>
@@ -77,6 +88,9 @@ public:
 typedef ValueTexture<Vec3> ValueTex3f;
 typedef ValueTexture<float> ValueTex1f;
 
+// Load the image decoders upfront, IMG_Load loads them on first use which is not thread safe
+void LoadImageDecoders();
+
 typedef ImageTexture<float> TextureFloat;
 typedef ImageTexture<uint8_t> TextureUbyte;
 
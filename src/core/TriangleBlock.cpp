@@ -0,0 +1,75 @@
+#include "TriangleBlock.h"
+
+#include "TriangleRecord.h"
+
+using std::vector;
+
+void TriangleBlocks::Create(const vector<TriangleRecord>& records, const vector<LinearNode2>& nodes) {
+
+    leaves.clear();
+    ranges.assign(records.size(), BlockRange());
+
+    int block_count = 0;
+
+    for (const LinearNode2& node : nodes) {
+
+        if (node.object_count == 0)
+            continue;
+
+        // The triangles lead the mixed leaves
+        int triangle_count = 0;
+        while (triangle_count < node.object_count && records[node.object_index + triangle_count].is_triangle)
+            ++triangle_count;
+
+        if (triangle_count % TRIANGLE_BLOCK_WIDTH < MIN_BLOCK_TRIANGLES)
+            triangle_count -= triangle_count % TRIANGLE_BLOCK_WIDTH;
+
+        if (triangle_count == 0)
+            continue;
+
+        BlockRange range;
+        range.first_block = block_count;
+        range.triangle_count = triangle_count;
+
+        leaves.push_back(LeafBlocks {node.object_index, range});
+        ranges[node.object_index] = range;
+        block_count += (triangle_count + TRIANGLE_BLOCK_WIDTH - 1) / TRIANGLE_BLOCK_WIDTH;
+    }
+
+    blocks.assign(block_count, TriangleBlock());
+    Refit(records);
+}
+
+void TriangleBlocks::Refit(const vector<TriangleRecord>& records) {
+
+#pragma omp parallel for
+    for (int i = 0; i < (int) leaves.size(); ++i) {
+        FillBlocks(records, leaves[i]);
+    }
+}
+
+/**
+ * Transpose the triangles of the leaf to its blocks, the lanes past them get null triangles
+ */
+void TriangleBlocks::FillBlocks(const vector<TriangleRecord>& records, const LeafBlocks& leaf) {
+
+    const BlockRange& range = leaf.range;
+
+    for (int i = 0; i < range.triangle_count; i += TRIANGLE_BLOCK_WIDTH) {
+
+        TriangleBlock& block = blocks[range.first_block + i / TRIANGLE_BLOCK_WIDTH];
+
+        for (int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; ++lane) {
+
+            TriangleRecord record;
+            if (i + lane < range.triangle_count)
+                record = records[leaf.first + i + lane];
+
+            for (int axis = 0; axis < 3; ++axis) {
+                block.vertex[axis][lane] = record.vertex[axis];
+                block.edge1[axis][lane] = record.edge1[axis];
+                block.edge2[axis][lane] = record.edge2[axis];
+            }
+        }
+    }
+}
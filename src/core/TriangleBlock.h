@@ -0,0 +1,239 @@
+#ifndef PATHTRACER_TRIANGLEBLOCK_H
+#define PATHTRACER_TRIANGLEBLOCK_H
+
+#include "Ray.h"
+#include "HitRecord.h"
+#include "BVHCommons.h"
+
+#include <immintrin.h>
+#include <vector>
+
+struct TriangleRecord;
+
+/**
+ * SIMD lanes of a block, AVX when the build enables it (-march=native on the AVX2 machines), SSE otherwise
+ * The operations of the block test are wrapped so it's written once for both widths
+ */
+#ifdef __AVX__
+static const int TRIANGLE_BLOCK_WIDTH = 8;
+
+typedef __m256 BlockFloat;
+
+static inline BlockFloat BlockLoad(const float* source) { return _mm256_loadu_ps(source); }
+static inline BlockFloat BlockSet(float value) { return _mm256_set1_ps(value); }
+static inline void BlockStore(float* destination, BlockFloat a) { _mm256_storeu_ps(destination, a); }
+static inline BlockFloat BlockAdd(BlockFloat a, BlockFloat b) { return _mm256_add_ps(a, b); }
+static inline BlockFloat BlockSub(BlockFloat a, BlockFloat b) { return _mm256_sub_ps(a, b); }
+static inline BlockFloat BlockMul(BlockFloat a, BlockFloat b) { return _mm256_mul_ps(a, b); }
+static inline BlockFloat BlockDiv(BlockFloat a, BlockFloat b) { return _mm256_div_ps(a, b); }
+static inline BlockFloat BlockAnd(BlockFloat a, BlockFloat b) { return _mm256_and_ps(a, b); }
+static inline BlockFloat BlockGreaterEqual(BlockFloat a, BlockFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline BlockFloat BlockGreater(BlockFloat a, BlockFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline BlockFloat BlockLess(BlockFloat a, BlockFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline BlockFloat BlockNotEqual(BlockFloat a, BlockFloat b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+static inline int BlockMask(BlockFloat a) { return _mm256_movemask_ps(a); }
+#else
+static const int TRIANGLE_BLOCK_WIDTH = 4;
+
+typedef __m128 BlockFloat;
+
+static inline BlockFloat BlockLoad(const float* source) { return _mm_loadu_ps(source); }
+static inline BlockFloat BlockSet(float value) { return _mm_set1_ps(value); }
+static inline void BlockStore(float* destination, BlockFloat a) { _mm_storeu_ps(destination, a); }
+static inline BlockFloat BlockAdd(BlockFloat a, BlockFloat b) { return _mm_add_ps(a, b); }
+static inline BlockFloat BlockSub(BlockFloat a, BlockFloat b) { return _mm_sub_ps(a, b); }
+static inline BlockFloat BlockMul(BlockFloat a, BlockFloat b) { return _mm_mul_ps(a, b); }
+static inline BlockFloat BlockDiv(BlockFloat a, BlockFloat b) { return _mm_div_ps(a, b); }
+static inline BlockFloat BlockAnd(BlockFloat a, BlockFloat b) { return _mm_and_ps(a, b); }
+static inline BlockFloat BlockGreaterEqual(BlockFloat a, BlockFloat b) { return _mm_cmpge_ps(a, b); }
+static inline BlockFloat BlockGreater(BlockFloat a, BlockFloat b) { return _mm_cmpgt_ps(a, b); }
+static inline BlockFloat BlockLess(BlockFloat a, BlockFloat b) { return _mm_cmplt_ps(a, b); }
+static inline BlockFloat BlockNotEqual(BlockFloat a, BlockFloat b) { return _mm_cmpneq_ps(a, b); }
+static inline int BlockMask(BlockFloat a) { return _mm_movemask_ps(a); }
+#endif
+
+struct BlockVec3 {
+
+    BlockFloat x, y, z;
+
+    BlockVec3() = default;
+
+    explicit BlockVec3(const Vec3& v)
+            : x{BlockSet(v.x)}, y{BlockSet(v.y)}, z{BlockSet(v.z)} {
+    }
+
+    explicit BlockVec3(const float (&soa)[3][TRIANGLE_BLOCK_WIDTH])
+            : x{BlockLoad(soa[0])}, y{BlockLoad(soa[1])}, z{BlockLoad(soa[2])} {
+    }
+
+    BlockVec3 operator-(const BlockVec3& v) const {
+        BlockVec3 result;
+        result.x = BlockSub(x, v.x);
+        result.y = BlockSub(y, v.y);
+        result.z = BlockSub(z, v.z);
+        return result;
+    }
+
+    BlockFloat dot(const BlockVec3& v) const {
+        return BlockAdd(BlockAdd(BlockMul(x, v.x), BlockMul(y, v.y)), BlockMul(z, v.z));
+    }
+
+    BlockVec3 cross(const BlockVec3& v) const {
+        BlockVec3 result;
+        result.x = BlockSub(BlockMul(y, v.z), BlockMul(z, v.y));
+        result.y = BlockSub(BlockMul(z, v.x), BlockMul(x, v.z));
+        result.z = BlockSub(BlockMul(x, v.y), BlockMul(y, v.x));
+        return result;
+    }
+};
+
+// Ray splatted once per leaf for its blocks
+struct BlockRay {
+
+    BlockVec3 origin;
+    BlockVec3 direction;
+
+    explicit BlockRay(const Ray& ray)
+            : origin{ray.origin}, direction{ray.direction} {
+    }
+};
+
+/**
+ * TRIANGLE_BLOCK_WIDTH triangles of a leaf as SoA, intersected at once by one SIMD Möller-Trumbore
+ * The unused lanes of the last block of a leaf hold null edges, their null determinant rejects them
+ */
+struct alignas(32) TriangleBlock {
+
+    float vertex[3][TRIANGLE_BLOCK_WIDTH];
+    float edge1[3][TRIANGLE_BLOCK_WIDTH];
+    float edge2[3][TRIANGLE_BLOCK_WIDTH];
+
+    /**
+     * Same test as TriangleRecord::Intersect on every lane
+     * @return The mask of the lanes hit in (0, t_max)
+     */
+    int Intersect(const BlockRay& ray, float t_max, BlockFloat& dist, BlockFloat& u, BlockFloat& v) const {
+
+        BlockVec3 p = ray.direction.cross(BlockVec3 {edge2});
+        BlockFloat determinant = BlockVec3 {edge1}.dot(p);
+        BlockFloat inv_determinant = BlockDiv(BlockSet(1.f), determinant);
+
+        BlockVec3 origin_to_vertex = ray.origin - BlockVec3 {vertex};
+        u = BlockMul(origin_to_vertex.dot(p), inv_determinant);
+
+        BlockVec3 q = origin_to_vertex.cross(BlockVec3 {edge1});
+        v = BlockMul(ray.direction.dot(q), inv_determinant);
+
+        dist = BlockMul(BlockVec3 {edge2}.dot(q), inv_determinant);
+
+        BlockFloat zero = BlockSet(0.f);
+        BlockFloat hit = BlockAnd(BlockNotEqual(determinant, zero), BlockGreaterEqual(BlockSet(1.f), BlockAdd(u, v)));
+        hit = BlockAnd(hit, BlockAnd(BlockGreaterEqual(u, zero), BlockGreaterEqual(v, zero)));
+        hit = BlockAnd(hit, BlockAnd(BlockGreater(dist, BlockSet(0.000001f)), BlockLess(dist, BlockSet(t_max))));
+
+        return BlockMask(hit);
+    }
+};
+
+/**
+ * Triangles of the BVH leaves repacked in blocks, next to their TriangleRecords
+ * The blocks of a leaf hold its leading triangles (all of them but in the mixed leaves), a full block each
+ * and a padded block for the remaining ones when they fill at least half of it, the triangles left out are tested one by one
+ * The block range of a leaf is looked up from its first primitive reference in a table of its own,
+ * so the records keep their size and a BVH built without blocks only pays for the empty table check
+ */
+class TriangleBlocks {
+
+public:
+
+    struct BlockRange {
+        int first_block = 0;
+        int triangle_count = 0;     // Number of leading triangles of the leaf held by its blocks
+    };
+
+private:
+
+    struct LeafBlocks {
+        int first;                  // First primitive reference of the leaf
+        BlockRange range;
+    };
+
+    std::vector<TriangleBlock> blocks;
+    std::vector<LeafBlocks> leaves;     // The leaves with blocks, kept to fill them again on a refit
+    std::vector<BlockRange> ranges;     // Indexed by primitive reference, only set for the first one of each leaf
+
+public:
+
+    static const int MIN_BLOCK_TRIANGLES = TRIANGLE_BLOCK_WIDTH / 2;
+
+    /**
+     * Blocks of the leaves of the nodes
+     * @param records In leaf order
+     */
+    void Create(const std::vector<TriangleRecord>& records, const std::vector<LinearNode2>& nodes);
+
+    // The triangles moved and the records were created again, the leaves and their blocks are kept
+    void Refit(const std::vector<TriangleRecord>& records);
+
+    // Empty when the BVH was built without blocks
+    BlockRange GetLeafRange(int first) const {
+        return ranges.empty() ? BlockRange() : ranges[first];
+    }
+
+    size_t GetMemory() const {
+        return blocks.size() * sizeof(TriangleBlock) + ranges.size() * sizeof(BlockRange);
+    }
+
+    int GetBlockCount() const {
+        return (int) blocks.size();
+    }
+
+    /**
+     * The hit is updated with the nearest block triangle of the leaf closer than it
+     * The lanes are visited in order so the ties are resolved as by the scalar loop
+     * @param first First primitive reference of the leaf
+     */
+    void FindNearest(const BlockRange& range, int first, const Ray& ray, const Primitive* primitives, HitRecord& hit) const {
+
+        BlockRay block_ray {ray};
+
+        for (int i = 0; i < range.triangle_count; i += TRIANGLE_BLOCK_WIDTH) {
+
+            BlockFloat dist, u, v;
+            int hit_mask = blocks[range.first_block + i / TRIANGLE_BLOCK_WIDTH].Intersect(block_ray, hit.dist, dist, u, v);
+            if (hit_mask == 0)
+                continue;
+
+            float dists[TRIANGLE_BLOCK_WIDTH], us[TRIANGLE_BLOCK_WIDTH], vs[TRIANGLE_BLOCK_WIDTH];
+            BlockStore(dists, dist);
+            BlockStore(us, u);
+            BlockStore(vs, v);
+
+            while (hit_mask) {
+                int lane = __builtin_ctz(hit_mask);
+                hit_mask &= hit_mask - 1;
+                if (dists[lane] < hit.dist)
+                    hit = HitRecord {dists[lane], primitives[first + i + lane], us[lane], vs[lane]};
+            }
+        }
+    }
+
+    bool Occluded(const BlockRange& range, const Ray& ray, float t_max) const {
+
+        BlockRay block_ray {ray};
+
+        for (int i = 0; i < range.triangle_count; i += TRIANGLE_BLOCK_WIDTH) {
+            BlockFloat dist, u, v;
+            if (blocks[range.first_block + i / TRIANGLE_BLOCK_WIDTH].Intersect(block_ray, t_max, dist, u, v))
+                return true;
+        }
+
+        return false;
+    }
+
+private:
+
+    void FillBlocks(const std::vector<TriangleRecord>& records, const LeafBlocks& leaf);
+};
+
+#endif //PATHTRACER_TRIANGLEBLOCK_H
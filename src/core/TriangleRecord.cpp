@@ -0,0 +1,56 @@
+#include "TriangleRecord.h"
+
+#include "objects/Triangle.h"
+#include "objects/Object3D.h"
+
+#include <typeinfo>
+
+using std::vector;
+
+vector<TriangleRecord> CreateTriangleRecords(const vector<Primitive>& primitives) {
+
+    vector<TriangleRecord> records(primitives.size());
+
+#pragma omp parallel for
+    for (int i = 0; i < (int) primitives.size(); ++i) {
+
+        if (primitives[i].IsTriangle()) {
+            Vec3 A, B, C;
+            primitives[i].GetTriangle().GetVertices(A, B, C);
+            records[i] = TriangleRecord {A, B, C};
+        }
+    }
+
+    return records;
+}
+
+// Qualified call, the compiler doesn't go through the vtable
+bool IntersectSpherePrimitive(const Primitive& primitive, const Ray& ray, float& dist_out) {
+    return static_cast<const Sphere*>(primitive.object->shape)->Sphere::Intersect(ray, dist_out);
+}
+
+/**
+ * The instances and the planes only have the mixed traversals
+ */
+PrimitiveSet ClassifyPrimitives(const vector<Primitive>& primitives) {
+
+    if (primitives.empty())
+        return MIXED_PRIMITIVES;
+
+    bool all_triangles = true;
+    bool all_spheres = true;
+
+    for (const Primitive& primitive : primitives) {
+        bool is_triangle = primitive.IsTriangle();
+        all_triangles &= is_triangle;
+        all_spheres &= !is_triangle && typeid(*primitive.object->shape) == typeid(Sphere);
+    }
+
+    if (all_triangles)
+        return TRIANGLE_PRIMITIVES;
+
+    if (all_spheres)
+        return SPHERE_PRIMITIVES;
+
+    return MIXED_PRIMITIVES;
+}
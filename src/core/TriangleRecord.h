@@ -0,0 +1,199 @@
+#ifndef PATHTRACER_TRIANGLERECORD_H
+#define PATHTRACER_TRIANGLERECORD_H
+
+#include "Ray.h"
+#include "HitRecord.h"
+#include "BVHCommons.h"
+#include "TriangleBlock.h"
+#include "math/Vec3.h"
+#include "objects/Primitive.h"
+
+#include <vector>
+
+/**
+ * Vertex and edges of a triangle, stored in the BVH leaf order next to the primitive references
+ * so the leaves test their triangles without going through the mesh index and vertex arrays
+ * The records of the other primitives (spheres, planes, instances) are only flagged, their own test is used
+ */
+struct TriangleRecord {
+
+    Vec3 vertex;
+    Vec3 edge1;
+    Vec3 edge2;
+    bool is_triangle = false;
+
+    TriangleRecord() = default;
+
+    TriangleRecord(const Vec3& A, const Vec3& B, const Vec3& C)
+            : vertex{A}, edge1{B - A}, edge2{C - A}, is_triangle{true} {
+    }
+
+    /**
+     * Möller-Trumbore, two-sided
+     * @param u, v Barycentric weights of the second and third vertex at the hit point
+     */
+    bool Intersect(const Ray& ray, float& dist_out, float& u, float& v) const {
+
+        Vec3 p = ray.direction.cross(edge2);
+        float determinant = edge1.dot(p);
+
+        // The ray is parallel to the triangle plane
+        if (determinant == 0)
+            return false;
+
+        float inv_determinant = 1 / determinant;
+
+        Vec3 origin_to_vertex = ray.origin - vertex;
+        u = origin_to_vertex.dot(p) * inv_determinant;
+
+        Vec3 q = origin_to_vertex.cross(edge1);
+        v = ray.direction.dot(q) * inv_determinant;
+
+        dist_out = edge2.dot(q) * inv_determinant;
+
+        return (u >= 0) & (v >= 0) & (u + v <= 1) & (dist_out > 0.000001f);
+    }
+};
+
+/**
+ * Test of a leaf primitive, through its record when it's a triangle
+ * @param u, v Barycentric weights of the hit, 0 for the other primitives
+ */
+inline bool IntersectLeafPrimitive(const TriangleRecord& record, const Primitive& primitive, const Ray& ray, float& dist_out, float& u, float& v) {
+
+    if (record.is_triangle)
+        return record.Intersect(ray, dist_out, u, v);
+
+    u = 0;
+    v = 0;
+    return primitive.Intersect(ray, dist_out);
+}
+
+// For the any-hit tests, the barycentrics are not needed
+inline bool IntersectLeafPrimitive(const TriangleRecord& record, const Primitive& primitive, const Ray& ray, float& dist_out) {
+    float u, v;
+    return IntersectLeafPrimitive(record, primitive, ray, dist_out, u, v);
+}
+
+// The sphere test called directly, for the leaves known to only hold spheres
+bool IntersectSpherePrimitive(const Primitive& primitive, const Ray& ray, float& dist_out);
+
+/**
+ * Tests of the primitives [first, end) of a leaf, specialized on the primitive set of the BVH
+ * Only the mixed set checks the type of each primitive, its leaves are sorted so the triangles are tested first without it
+ * The leading triangles held by the blocks of the leaf are tested by them, the remaining ones from their records
+ */
+template <int PRIMITIVE_SET>
+struct LeafIntersector {
+
+    // The hit is updated with each primitive hit closer than it
+    static void FindNearest(const TriangleBlocks& blocks, const TriangleRecord* records, const Primitive* primitives,
+                            int first, int end, const Ray& ray, HitRecord& hit) {
+
+        TriangleBlocks::BlockRange range = blocks.GetLeafRange(first);
+        int i = first + range.triangle_count;
+        if (i > first)
+            blocks.FindNearest(range, first, ray, primitives, hit);
+
+        for (; i < end && records[i].is_triangle; ++i) {
+            float dist, u, v;
+            if (records[i].Intersect(ray, dist, u, v) && (dist < hit.dist))
+                hit = HitRecord {dist, primitives[i], u, v};
+        }
+
+        for (; i < end; ++i) {
+            float dist, u, v;
+            if (IntersectLeafPrimitive(records[i], primitives[i], ray, dist, u, v) && (dist < hit.dist))
+                hit = HitRecord {dist, primitives[i], u, v};
+        }
+    }
+
+    static bool Occluded(const TriangleBlocks& blocks, const TriangleRecord* records, const Primitive* primitives,
+                         int first, int end, const Ray& ray, float t_max) {
+
+        TriangleBlocks::BlockRange range = blocks.GetLeafRange(first);
+        int i = first + range.triangle_count;
+        if (i > first && blocks.Occluded(range, ray, t_max))
+            return true;
+
+        for (; i < end; ++i) {
+            float dist;
+            if (IntersectLeafPrimitive(records[i], primitives[i], ray, dist) && (dist < t_max))
+                return true;
+        }
+
+        return false;
+    }
+};
+
+template <>
+struct LeafIntersector<TRIANGLE_PRIMITIVES> {
+
+    static void FindNearest(const TriangleBlocks& blocks, const TriangleRecord* records, const Primitive* primitives,
+                            int first, int end, const Ray& ray, HitRecord& hit) {
+
+        TriangleBlocks::BlockRange range = blocks.GetLeafRange(first);
+        int i = first + range.triangle_count;
+        if (i > first)
+            blocks.FindNearest(range, first, ray, primitives, hit);
+
+        for (; i < end; ++i) {
+            float dist, u, v;
+            if (records[i].Intersect(ray, dist, u, v) && (dist < hit.dist))
+                hit = HitRecord {dist, primitives[i], u, v};
+        }
+    }
+
+    static bool Occluded(const TriangleBlocks& blocks, const TriangleRecord* records, const Primitive*,
+                         int first, int end, const Ray& ray, float t_max) {
+
+        TriangleBlocks::BlockRange range = blocks.GetLeafRange(first);
+        int i = first + range.triangle_count;
+        if (i > first && blocks.Occluded(range, ray, t_max))
+            return true;
+
+        for (; i < end; ++i) {
+            float dist, u, v;
+            if (records[i].Intersect(ray, dist, u, v) && (dist < t_max))
+                return true;
+        }
+
+        return false;
+    }
+};
+
+template <>
+struct LeafIntersector<SPHERE_PRIMITIVES> {
+
+    static void FindNearest(const TriangleBlocks&, const TriangleRecord*, const Primitive* primitives,
+                            int first, int end, const Ray& ray, HitRecord& hit) {
+
+        for (int i = first; i < end; ++i) {
+            float dist;
+            if (IntersectSpherePrimitive(primitives[i], ray, dist) && (dist < hit.dist))
+                hit = HitRecord {dist, primitives[i]};
+        }
+    }
+
+    static bool Occluded(const TriangleBlocks&, const TriangleRecord*, const Primitive* primitives,
+                         int first, int end, const Ray& ray, float t_max) {
+
+        for (int i = first; i < end; ++i) {
+            float dist;
+            if (IntersectSpherePrimitive(primitives[i], ray, dist) && (dist < t_max))
+                return true;
+        }
+
+        return false;
+    }
+};
+
+/**
+ * One record per primitive, in the same order
+ */
+std::vector<TriangleRecord> CreateTriangleRecords(const std::vector<Primitive>& primitives);
+
+// The set the traversals of a BVH referencing these primitives are instantiated for
+PrimitiveSet ClassifyPrimitives(const std::vector<Primitive>& primitives);
+
+#endif //PATHTRACER_TRIANGLERECORD_H
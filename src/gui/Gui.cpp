@@ -3,6 +3,9 @@
 #include "renderers/OpenCLRenderer.h"
 #include "renderers/CppRenderer.h"
 #include "objects/Plane.h"
+#include "objects/TriMesh.h"
+#include "core/BVHLayout.h"
+#include "core/GeometryStream.h"
 
 #include "imgui/imgui.h"
 #include "imgui/imgui_internal.h"
@@ -81,6 +84,7 @@ void GUI::Draw() {
         ShowRendererSettings();
         ShowLightingSettings();
         ShowObjectSettings();
+        ShowBVHSettings();
 //        ShowBVHTree(scene->bvh);
 //        ShowBVHStatistics();
     ImGui::End();
@@ -210,6 +214,7 @@ void GUI::ShowLightingSettings() {
 
     scene->envmap_has_changed = false;
     scene->model_has_changed = false;
+    scene->bounds_have_changed = false;
 
     if (ImGui::CollapsingHeader("Render settings", nullptr, true, true))
     {
@@ -224,6 +229,24 @@ void GUI::ShowLightingSettings() {
                 controls->SetSpeed(scene->debug_scale);
                 scene->model_has_changed = true;
             }
+            // Applies to the next model loaded
+            ImGui::Checkbox("Mesh instancing", &scene->use_instancing);
+            ImGui::Checkbox("Compact vertices", &scene->use_compact_vertices);
+            ImGui::Checkbox("Mesh cache", &scene->use_mesh_cache);
+            ImGui::Checkbox("Out-of-core geometry", &scene->use_out_of_core);
+
+            int geometry_budget_mb = scene->geometry_budget_mb;
+            if (ImGui::SliderInt("Geometry budget (Mo)", &geometry_budget_mb, 16, 4096))
+                scene->SetGeometryBudget(geometry_budget_mb);
+
+            for (const TriMesh* trimesh : scene->GetTriMeshes()) {
+                if (trimesh->IsStreamed() == false)
+                    continue;
+                const GeometryStream* stream = trimesh->GetStream();
+                ImGui::Text("Resident clusters: %d / %d", stream->GetResidentCount(), stream->GetClusterCount());
+                ImGui::Text("Resident memory: %d Ko / %d Ko", int(stream->GetResidentMemory() / 1024), int(stream->GetFileSize() / 1024));
+                ImGui::Text("Page faults: %lld, evictions: %lld", (long long) stream->GetPageFaultCount(), (long long) stream->GetEvictionCount());
+            }
 
         int temp_envmap_index = envmap_index;
         ImGui::Combo("Environnement", &temp_envmap_index, item_getter, &envmap_array, (int) envmap_array.size());
@@ -296,16 +319,121 @@ void GUI::ShowObjectSettings() {
 
     if (ImGui::CollapsingHeader("Object settings", nullptr, true, true)) {
 
-        Object3D* object = renderer->GetSelectedObject();
+        const Primitive& primitive = renderer->GetSelectedPrimitive();
+        Object3D* object = primitive.object;
         ImGui::LabelText("Selected obj adress", "%p\n", object);
         if (object == nullptr)
             return;
+        if (primitive.IsTriangle())
+            ImGui::LabelText("Selected triangle", "%d\n", primitive.index);
+
+        // Moving or resizing a sphere only refits the BVH, unless it degraded enough to be rebuilt
+        Sphere* sphere = dynamic_cast<Sphere*>(object->shape);
+        if (sphere != nullptr) {
+            bool moved = ImGui::DragFloat3("Position", &sphere->origin.x, 0.01f * scene->debug_scale);
+            moved |= ImGui::DragFloat("Radius", &sphere->radius, 0.01f * scene->debug_scale, 0.001f, 1000.f);
+            if (moved) {
+                if (scene->RefitBVH())
+                    scene->model_has_changed = true;
+                else
+                    scene->bounds_have_changed = true;
+            }
+        }
 
-        ShowMaterialSettings(object);
+        ShowMaterialSettings(primitive);
     }
 }
 
-void GUI::ShowMaterialSettings(Object3D* object) {
+void GUI::ShowBVHSettings() {
+
+    if (ImGui::CollapsingHeader("BVH settings", nullptr, true, false)) {
+
+        BVHBuildOptions& build_options = scene->bvh_build_options;
+
+        ImGui::PushItemWidth(-140);
+        // Also used by the next model loaded from the Model combo
+        const char* builder_names[] = {"SAH", "LBVH (Morton)"};
+        ImGui::Combo("Builder", &build_options.builder, builder_names, 2);
+        if (ImGui::InputInt("Max leaf size", &build_options.max_leaf_size)) {
+            build_options.max_leaf_size = std::max(1, std::min(build_options.max_leaf_size, 255));
+        }
+        ImGui::SliderFloat("Traversal cost", &build_options.traversal_cost, 0.1f, 4.f);
+        ImGui::SliderFloat("Intersection cost", &build_options.intersection_cost, 0.1f, 4.f);
+        if (build_options.builder == SAH_BUILDER) {
+            ImGui::Checkbox("Spatial splits", &build_options.spatial_splits);
+            if (build_options.spatial_splits) {
+                ImGui::SliderFloat("Duplication budget", &build_options.spatial_split_budget, 0.f, 2.f);
+            }
+        }
+        else {
+            ImGui::Checkbox("63 bits Morton codes", &build_options.morton_63_bits);
+            ImGui::Checkbox("Treelet optimization", &build_options.treelet_optimization);
+        }
+        ImGui::SliderFloat("Refit rebuild ratio", &build_options.refit_rebuild_ratio, 1.f, 4.f);
+        const char* layout_names[] = {"Depth-first", "Treelets", "van Emde Boas"};
+        ImGui::Combo("Node layout", &build_options.node_layout, layout_names, 3);
+        ImGui::Checkbox("SIMD triangle blocks", &build_options.triangle_blocks);
+        ImGui::PopItemWidth();
+
+        ImGui::Checkbox("Disk cache", &scene->use_bvh_cache);
+
+        if (ImGui::Button("Rebuild BVH")) {
+            scene->BuildBVH();
+            scene->model_has_changed = true;
+        }
+
+        // Primary rays of every other pixel of the current view
+        ImGui::SameLine();
+        if (ImGui::Button("Benchmark node layouts")) {
+
+            int width = film->GetWidth();
+            int height = film->GetHeight();
+            float ratio = (float) width / height;
+            float fov_factor = tanf(DEG_TO_RAD(options->fov / 2.f));
+
+            vector<Ray> rays;
+            rays.reserve(size_t(width / 2 + 1) * (height / 2 + 1));
+            for (int y = 0; y < height; y += 2) {
+                for (int x = 0; x < width; x += 2) {
+                    Ray ray {controls->GetPosition(), x, y, width, height, ratio, fov_factor};
+                    ray.direction = controls->GetRotation() * ray.direction;
+                    rays.push_back(ray);
+                }
+            }
+
+            BenchmarkNodeLayouts(*scene->bvh2, rays);
+        }
+
+        const char* traversal_names[] = {"BVH2", "BVH2 ordered", "BVH4 (SSE)", "BVH8 (AVX)", "BVH2 quantized"};
+        if (ImGui::Combo("CPU traversal", &scene->cpu_traversal, traversal_names, 5)) {
+            scene->BuildWideBVH();
+        }
+        // Always traverse the BVH2, the camera rays of an instanced scene stay single
+        ImGui::Checkbox("Camera ray packets", &options->use_ray_packets);
+
+        if (ImGui::Checkbox("Quantized OpenCL nodes", &scene->use_quantized_bvh)) {
+            scene->BuildWideBVH();
+            scene->model_has_changed = true;
+        }
+
+        ImGui::Text("Nodes: %d", scene->bvh2->GetNodeCount());
+        ImGui::Text("SAH cost: %.2f", scene->bvh2->GetSAHCost());
+        ImGui::Text("Built in %.3f s", scene->bvh2->GetBuildTime());
+        ImGui::Text("Node memory: %d Ko", int(scene->bvh2->GetNodeCount() * sizeof(LinearNode2) / 1024));
+        if (scene->quantized_bvh2 != nullptr) {
+            ImGui::Text("Quantized nodes: %d, %d Ko", scene->quantized_bvh2->GetNodeCount(), int(scene->quantized_bvh2->GetNodeMemory() / 1024));
+            ImGui::Text("Quantized SAH cost: %.2f", scene->quantized_bvh2->GetSAHCost());
+        }
+        if (scene->instance_set != nullptr) {
+            ImGui::Text("Instances: %d", scene->instance_set->GetInstanceCount());
+        }
+    }
+}
+
+void GUI::ShowMaterialSettings(const Primitive& primitive) {
+
+    Object3D* object = primitive.object;
+    Material* material = primitive.GetMaterial();
 
     scene->material_has_changed = false;
     scene->emission_has_changed = false;
@@ -327,7 +455,7 @@ void GUI::ShowMaterialSettings(Object3D* object) {
         return;
     }
 
-    OldMaterial* standard = dynamic_cast<OldMaterial*>(object->material);
+    OldMaterial* standard = dynamic_cast<OldMaterial*>(material);
     if (standard != nullptr) {
         ShowTextureSettings(standard->GetAlbedo(), "Albedo");
         ShowTextureSettings(standard->GetRoughness(), "Roughness");
@@ -335,7 +463,7 @@ void GUI::ShowMaterialSettings(Object3D* object) {
         ShowTextureSettings(standard->GetNormal(), "Normal");
     }
     
-    MetallicWorkflow* metallic_workflow = dynamic_cast<MetallicWorkflow*>(object->material);
+    MetallicWorkflow* metallic_workflow = dynamic_cast<MetallicWorkflow*>(material);
     if (metallic_workflow != nullptr) {
         ShowTextureSettings(metallic_workflow->GetAlbedo(), "Albedo");
         ShowTextureSettings(metallic_workflow->GetRoughness(), "Roughness");
@@ -343,7 +471,7 @@ void GUI::ShowMaterialSettings(Object3D* object) {
         ShowTextureSettings(metallic_workflow->GetNormal(), "Normal");
     }
 
-    LambertianMaterial* lambertian = dynamic_cast<LambertianMaterial*>(object->material);
+    LambertianMaterial* lambertian = dynamic_cast<LambertianMaterial*>(material);
     if (lambertian != nullptr) {
         ShowTextureSettings(lambertian->GetAlbedo(), "Albedo");
     }
@@ -414,7 +542,7 @@ std::vector<std::string> GetModelArray(const string& model_dir_path) {
             const auto& sub_array = GetModelArray(string(file.path) + "/");
             model_array.insert(model_array.end(), sub_array.begin(), sub_array.end());
         }
-        else if (strcmp(file.extension, "gltf") == 0) {
+        else if (strcmp(file.extension, "gltf") == 0 || strcmp(file.extension, "glb") == 0) {
             model_array.push_back(model_dir_path + file.name);
         }
 
@@ -509,8 +637,8 @@ static void ShowBVHTree(const BVH& bvh)
                 if (node->children.empty() == true) {
 
                     char label[32];
-                    sprintf(label, "Obj*: %p", node->object);
-                    const auto& bbox = node->object->ComputeBBox();
+                    sprintf(label, "Obj*: %p #%d", node->primitive.object, node->primitive.index);
+                    const auto& bbox = node->primitive.ComputeBBox();
 
                     ImGui::AlignFirstTextHeightToWidgets();
                     ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1, 1, 1, 1));
@@ -520,19 +648,19 @@ static void ShowBVHTree(const BVH& bvh)
                     ImGui::NextColumn();
 
                     ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1, 0.25, 0.25, 1));
-                    ImGui::Text("%g", node->object->GetCenter().x);
+                    ImGui::Text("%g", node->primitive.GetCenter().x);
                     ImGui::Text("[%g, %g]", bbox.min.x, bbox.max.x);
                     ImGui::PopStyleColor();
                     ImGui::NextColumn();
 
                     ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.25, 1, 0.25, 1));
-                    ImGui::Text("%g", node->object->GetCenter().y);
+                    ImGui::Text("%g", node->primitive.GetCenter().y);
                     ImGui::Text("[%g, %g]", bbox.min.y, bbox.max.y);
                     ImGui::PopStyleColor();
                     ImGui::NextColumn();
 
                     ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.25, 0.25, 1, 1));
-                    ImGui::Text("%g", node->object->GetCenter().z);
+                    ImGui::Text("%g", node->primitive.GetCenter().z);
                     ImGui::Text("[%g, %g]", bbox.min.z, bbox.max.z);
                     ImGui::PopStyleColor();
                     ImGui::NextColumn();
@@ -9,7 +9,7 @@
 
 typedef struct SDL_Window SDL_Window;
 typedef struct BaseRenderer BaseRenderer;
-typedef struct Object3D Object3D;
+typedef struct Primitive Primitive;
 typedef struct Scene Scene;
 typedef int ImGuiWindowFlags;
 
@@ -47,7 +47,8 @@ class GUI {
     void ShowOpenCLSettings();
     void ShowLightingSettings();
     void ShowObjectSettings();
-    void ShowMaterialSettings(Object3D* object);
+    void ShowBVHSettings();
+    void ShowMaterialSettings(const Primitive& primitive);
     void ShowTextureSettings(std::shared_ptr<Texture> texture, const char* texture_name);
     void ShowAppMenuBar();
 
@@ -9,7 +9,6 @@ Matrix::Matrix() {
 }
 
 Matrix::Matrix(const Matrix& other) {
-    std::cout << "Matrix copy ctor\n";
     memcpy(values, other.values, 16 * sizeof(float));
 }
 
@@ -119,6 +118,50 @@ Vec3 Matrix::operator*(const Vec3& vec) const {
     return result;
 }
 
+/**
+ * Unlike the Vec3 product, the point is also translated
+ */
+Vec3 Matrix::TransformPoint(const Vec3& point) const {
+    Vec3 result = (*this) * point;
+    result.x += values[0][3];
+    result.y += values[1][3];
+    result.z += values[2][3];
+    return result;
+}
+
+/**
+ * Inverse of a matrix whose last row is (0, 0, 0, 1), the inverse of its 3x3 part is its adjugate over its determinant
+ */
+Matrix Matrix::AffineInverse() const {
+
+    const float (&m)[4][4] = values;
+
+    float determinant = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                      - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                      + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    float inv_det = 1 / determinant;
+
+    Matrix res;
+    res[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    res[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    res[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    res[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    res[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    res[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    res[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    res[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    res[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    // The inverse translation is the opposite translation, rotated and scaled by the inverse
+    Vec3 translation = res * Vec3 {m[0][3], m[1][3], m[2][3]};
+    res[0][3] = -translation.x;
+    res[1][3] = -translation.y;
+    res[2][3] = -translation.z;
+
+    return res;
+}
+
 Matrix Matrix::Transpose() const {
     Matrix res;
 
@@ -14,6 +14,8 @@ public:
 
     Matrix(const Matrix& other);
 
+    Matrix& operator=(const Matrix& other) = default;
+
     Matrix& translateBy(const Vec3& vec);
 
     friend std::ostream& operator<<(std::ostream& out, Matrix& matrix);
@@ -32,6 +34,10 @@ public:
 
     Vec3 operator*(const Vec3 &vec) const;
 
+    Vec3 TransformPoint(const Vec3& point) const;
+
+    Matrix AffineInverse() const;
+
     void setYZRotation(float angle);
 
     Matrix Transpose() const;
@@ -0,0 +1,147 @@
+#ifndef PATHTRACER_QUANTIZATION_H
+#define PATHTRACER_QUANTIZATION_H
+
+#include "Vec3.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Octahedral encoding of a unit vector in 32 bits
+ * The vector is projected on the octahedron |x| + |y| + |z| = 1 whose lower half is folded over the upper one,
+ * then x and y are stored as 16 bits signed normalized integers, x in the low bits
+ * The decoding error is below 0.0001 radian
+ * A null or invalid vector is encoded as +z
+ */
+inline uint32_t EncodeOctahedral(Vec3 vec) {
+
+    float l1_norm = std::abs(vec.x) + std::abs(vec.y) + std::abs(vec.z);
+
+    if (!(l1_norm > 0))
+        return 0;
+
+    float inv_l1_norm = 1.f / l1_norm;
+    float x = vec.x * inv_l1_norm;
+    float y = vec.y * inv_l1_norm;
+
+    if (vec.z < 0) {
+        float folded_x = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+        float folded_y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    int16_t quantized_x = (int16_t) std::lround(std::min(std::max(x, -1.f), 1.f) * 32767.f);
+    int16_t quantized_y = (int16_t) std::lround(std::min(std::max(y, -1.f), 1.f) * 32767.f);
+
+    return uint32_t(uint16_t(quantized_x)) | (uint32_t(uint16_t(quantized_y)) << 16);
+}
+
+inline Vec3 DecodeOctahedral(uint32_t packed) {
+
+    float x = int16_t(packed & 0xFFFF) * (1.f / 32767.f);
+    float y = int16_t(packed >> 16) * (1.f / 32767.f);
+    float z = 1 - std::abs(x) - std::abs(y);
+
+    // Unfold the lower half
+    float t = std::max(-z, 0.f);
+    x += (x >= 0) ? -t : t;
+    y += (y >= 0) ? -t : t;
+
+    return Vec3 {x, y, z}.normalize();
+}
+
+/**
+ * IEEE 754 half precision, rounded to the nearest even
+ * The exponents too large for a half give an infinity and those too small a signed zero
+ */
+inline uint16_t FloatToHalf(float value) {
+
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t float_exponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    int exponent = int(float_exponent) - 127 + 15;
+
+    // Infinity or NaN, which keeps a mantissa bit
+    if (float_exponent == 0xFF)
+        return uint16_t(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+
+    if (exponent >= 31)
+        return uint16_t(sign | 0x7C00);
+
+    // Denormal half, the implicit bit is shifted into the mantissa
+    if (exponent <= 0) {
+
+        if (exponent < -10)
+            return uint16_t(sign);
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1)))
+            half_mantissa++;
+
+        return uint16_t(sign | half_mantissa);
+    }
+
+    uint32_t half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+
+    // A carry out of the mantissa correctly increments the exponent
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+        half++;
+
+    return uint16_t(half);
+}
+
+inline float HalfToFloat(uint16_t half) {
+
+    uint32_t sign = uint32_t(half & 0x8000) << 16;
+    int exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        }
+        else {
+            // Denormal half, normalized for the float
+            exponent = 1;
+            while ((mantissa & 0x400) == 0) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            mantissa &= 0x3FF;
+            bits = sign | (uint32_t(exponent + 112) << 23) | (mantissa << 13);
+        }
+    }
+    else if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | (uint32_t(exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Two halfs, u in the low bits so the memory order is u then v like an OpenCL half2
+inline uint32_t EncodeHalfUV(const Vec3& uv) {
+    return uint32_t(FloatToHalf(uv.x)) | (uint32_t(FloatToHalf(uv.y)) << 16);
+}
+
+inline Vec3 DecodeHalfUV(uint32_t packed) {
+    return Vec3 {HalfToFloat(uint16_t(packed & 0xFFFF)), HalfToFloat(uint16_t(packed >> 16)), 0};
+}
+
+#endif //PATHTRACER_QUANTIZATION_H
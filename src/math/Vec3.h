@@ -133,6 +133,10 @@ public:
         return (&x)[dimension];
     }
 
+    float& operator[](int dimension) {
+        return (&x)[dimension];
+    }
+
     float dot(const Vec3& rhs) const {
         return (this->x * rhs.x) +
                (this->y * rhs.y) +
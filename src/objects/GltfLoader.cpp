@@ -0,0 +1,1182 @@
+#include "GltfLoader.h"
+
+#include "TriMesh.h"
+#include "core/MappedFile.h"
+#include "app/Chronometer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::cout;
+using std::endl;
+
+static const uint32_t GLB_MAGIC = 0x46546C67;        // "glTF"
+static const uint32_t GLB_JSON_CHUNK = 0x4E4F534A;   // "JSON"
+static const uint32_t GLB_BIN_CHUNK = 0x004E4942;    // "BIN\0"
+static const int MAX_JSON_DEPTH = 128;
+
+enum GltfComponentType {
+    BYTE_COMPONENT = 5120,
+    UNSIGNED_BYTE_COMPONENT = 5121,
+    SHORT_COMPONENT = 5122,
+    UNSIGNED_SHORT_COMPONENT = 5123,
+    UNSIGNED_INT_COMPONENT = 5125,
+    FLOAT_COMPONENT = 5126
+};
+
+// The points and lines modes are skipped
+enum GltfPrimitiveMode {
+    TRIANGLES_MODE = 4,
+    TRIANGLE_STRIP_MODE = 5,
+    TRIANGLE_FAN_MODE = 6
+};
+
+// Minimal JSON document, enough for the glTF one
+struct JsonValue {
+
+    enum Type {
+        NULL_VALUE,
+        BOOL_VALUE,
+        NUMBER_VALUE,
+        STRING_VALUE,
+        ARRAY_VALUE,
+        OBJECT_VALUE
+    };
+
+    Type type = NULL_VALUE;
+    double number = 0;              // Also the bool value
+    string text;
+    vector<JsonValue> elements;     // The array elements or the object values
+    vector<string> keys;            // The object keys, one per value
+
+    // A null value when absent, so the lookups can be chained
+    const JsonValue& Get(const char* key) const;
+    const JsonValue& At(size_t index) const;
+
+    size_t GetSize() const {
+        return (type == ARRAY_VALUE) ? elements.size() : 0;
+    }
+
+    double GetNumber(double default_value) const {
+        return (type == NUMBER_VALUE) ? number : default_value;
+    }
+
+    // default_value when absent, -1 when not a non-negative integer
+    int64_t GetIndex(int64_t default_value = -1) const;
+};
+
+// A byte range of a buffer, in a mapping or in a decoded data uri
+struct GltfBuffer {
+    const char* data;
+    size_t size;
+};
+
+// Where the elements of an accessor are and how to convert them, data is nullptr for an absent attribute
+struct GltfAccessor {
+    const char* data = nullptr;
+    size_t count = 0;
+    size_t stride = 0;
+    int component_type = 0;
+    int component_size = 0;
+    int component_count = 0;
+    bool normalized = false;
+};
+
+// A primitive of a mesh and where it goes in the TriMesh arrays
+struct GltfPrimitive {
+    int mesh;
+    int mode;
+    Matrix transform;
+    bool is_transformed;
+    GltfAccessor positions;
+    GltfAccessor normals;
+    GltfAccessor uvs;
+    GltfAccessor tangents;
+    GltfAccessor indices;
+    size_t vertex_count;
+    size_t triangle_count;
+    size_t first_vertex;
+    size_t first_triangle;
+    unsigned int material;
+};
+
+// Keeps the mappings and the decoded data uris alive while the arrays are filled and the images decoded
+struct GltfStorage {
+    vector<unique_ptr<MappedFile>> files;
+    vector<vector<char>> decoded_uris;
+};
+
+static bool ParseJson(const char* begin, const char* end, JsonValue& document);
+static bool ParseJsonValue(const char*& p, const char* end, int depth, JsonValue& value);
+static bool ParseJsonString(const char*& p, const char* end, string& text);
+static const char* SkipJsonSpaces(const char* p, const char* end);
+
+static bool ParseGlb(const MappedFile& file, GltfBuffer& json_chunk, GltfBuffer& bin_chunk);
+static bool LoadBuffers(const JsonValue& gltf, const string& gltf_directory, const GltfBuffer& bin_chunk,
+                        GltfStorage& storage, vector<GltfBuffer>& buffers);
+static bool GetUriData(const string& uri, const string& gltf_directory, GltfStorage& storage, GltfBuffer& data);
+static bool GetBufferView(const JsonValue& gltf, int64_t index, const vector<GltfBuffer>& buffers, GltfBuffer& view, size_t& stride);
+static bool GetAccessor(const JsonValue& gltf, int64_t index, const vector<GltfBuffer>& buffers, GltfAccessor& accessor);
+static bool PreparePrimitive(const JsonValue& gltf, const JsonValue& json, const vector<GltfBuffer>& buffers, GltfPrimitive& primitive);
+static bool CollectMeshNodes(const JsonValue& gltf, int64_t node, const Matrix& parent_transform, size_t depth,
+                             vector<std::pair<int, Matrix>>& mesh_nodes);
+static Matrix GetNodeTransform(const JsonValue& node);
+static MaterialDescriptor GetMaterialDescriptor(const JsonValue& gltf, const JsonValue& material);
+static string GetTexturePath(const JsonValue& gltf, const JsonValue& texture_info);
+static bool IsEmbeddedImage(const JsonValue& image);
+
+static Vec3 ReadVec3(const GltfAccessor& accessor, size_t element, float* w = nullptr);
+static unsigned int ReadIndex(const GltfAccessor& accessor, size_t element);
+static size_t GetCornerElement(int mode, size_t triangle, int corner);
+static uint32_t ReadUint32(const char* p);
+static bool DecodeBase64(const char* p, const char* end, vector<char>& bytes);
+static string DecodeUri(const string& uri);
+
+/**
+ * The primitives are placed in the arrays first, then each one is converted from its accessors in parallel
+ * Nothing is written to the TriMesh before the whole file is validated
+ */
+bool GltfLoader::Load(const string& filename, const string& directory, bool import_instances, TriMesh& trimesh) {
+
+    Chronometer chrono;
+
+    GltfStorage storage;
+    storage.files.emplace_back(new MappedFile {filename});
+    const MappedFile& file = *storage.files.back();
+
+    if (file.IsValid() == false)
+        return false;
+
+    // A .glb holds the JSON and the first buffer, a .gltf is the JSON alone
+    GltfBuffer json_chunk {file.GetData(), file.GetSize()};
+    GltfBuffer bin_chunk {nullptr, 0};
+
+    if (file.GetSize() >= 12 && ReadUint32(file.GetData()) == GLB_MAGIC) {
+        if (ParseGlb(file, json_chunk, bin_chunk) == false) {
+            cout << "Invalid GLB file" << endl;
+            return false;
+        }
+    }
+
+    JsonValue gltf;
+    if (ParseJson(json_chunk.data, json_chunk.data + json_chunk.size, gltf) == false) {
+        cout << "Invalid glTF JSON" << endl;
+        return false;
+    }
+
+    if (gltf.Get("asset").Get("version").text.compare(0, 2, "2.") != 0) {
+        cout << "Unsupported glTF version" << endl;
+        return false;
+    }
+
+    if (gltf.Get("extensionsRequired").GetSize() > 0) {
+        cout << "Unsupported glTF required extensions" << endl;
+        return false;
+    }
+
+    // The buffers are relative to the glTF file, the textures to the directory
+    string gltf_directory = filename.substr(0, filename.find_last_of('/') + 1);
+
+    vector<GltfBuffer> buffers;
+    if (LoadBuffers(gltf, gltf_directory, bin_chunk, storage, buffers) == false)
+        return false;
+
+    // The meshes placed by the nodes of the scene, with their transforms from the root
+    vector<std::pair<int, Matrix>> mesh_nodes;
+
+    const JsonValue& scenes = gltf.Get("scenes");
+    const JsonValue& scene_nodes = scenes.At((size_t) gltf.Get("scene").GetIndex(0)).Get("nodes");
+
+    for (size_t i = 0; i < scene_nodes.GetSize(); ++i) {
+        if (CollectMeshNodes(gltf, scene_nodes.At(i).GetIndex(), Matrix {}, 0, mesh_nodes) == false) {
+            cout << "Invalid glTF node graph" << endl;
+            return false;
+        }
+    }
+
+    const JsonValue& meshes = gltf.Get("meshes");
+    const JsonValue& materials = gltf.Get("materials");
+    unsigned int default_material = (unsigned int) materials.GetSize();
+
+    // With the instances, each primitive is imported once in the space of its mesh
+    // Without, once per node placing its mesh, pre-transformed
+    vector<std::pair<int, Matrix>> placed_meshes;
+    if (import_instances) {
+        for (size_t mesh = 0; mesh < meshes.GetSize(); ++mesh) {
+            placed_meshes.push_back({(int) mesh, Matrix {}});
+        }
+    }
+    else {
+        placed_meshes = mesh_nodes;
+    }
+
+    vector<GltfPrimitive> primitives;
+    vector<size_t> mesh_first_primitive(meshes.GetSize() + 1, 0);
+    size_t skipped_primitive_count = 0;
+    bool uses_default_material = false;
+    bool has_uv = false;
+    // The metallic workflow builds its normal map frame from the normal alone, so the missing tangents are not computed
+    bool has_tangents = true;
+
+    for (const std::pair<int, Matrix>& placed_mesh : placed_meshes) {
+
+        const JsonValue& json_primitives = meshes.At((size_t) placed_mesh.first).Get("primitives");
+
+        for (size_t i = 0; i < json_primitives.GetSize(); ++i) {
+
+            GltfPrimitive primitive;
+            primitive.mesh = placed_mesh.first;
+            primitive.transform = placed_mesh.second;
+            primitive.is_transformed = (import_instances == false);
+
+            if (PreparePrimitive(gltf, json_primitives.At(i), buffers, primitive) == false) {
+                cout << "Unsupported or invalid glTF primitive in mesh " << placed_mesh.first << endl;
+                return false;
+            }
+
+            if (primitive.triangle_count == 0) {
+                skipped_primitive_count++;
+                continue;
+            }
+
+            int64_t material = json_primitives.At(i).Get("material").GetIndex();
+            if (material < 0 || material >= (int64_t) default_material) {
+                primitive.material = default_material;
+                uses_default_material = true;
+            }
+            else {
+                primitive.material = (unsigned int) material;
+            }
+
+            has_uv |= (primitive.uvs.data != nullptr);
+            has_tangents &= (primitive.tangents.data != nullptr);
+
+            primitives.push_back(primitive);
+        }
+
+        if (import_instances)
+            mesh_first_primitive[placed_mesh.first + 1] = primitives.size();
+    }
+
+    size_t vertex_total = 0;
+    size_t triangle_total = 0;
+    for (GltfPrimitive& primitive : primitives) {
+        primitive.first_vertex = vertex_total;
+        primitive.first_triangle = triangle_total;
+        vertex_total += primitive.vertex_count;
+        triangle_total += primitive.triangle_count;
+    }
+
+    if (triangle_total == 0)
+        return false;
+
+    if (vertex_total > std::numeric_limits<unsigned int>::max() || triangle_total * 3 > std::numeric_limits<unsigned int>::max()) {
+        cout << "glTF file too large" << endl;
+        return false;
+    }
+
+    if (skipped_primitive_count > 0)
+        cout << skipped_primitive_count << " glTF primitives without triangles skipped" << endl;
+
+    cout << "glTF parsing: " << chrono.GetMilliseconds() << " ms, " << primitives.size() << " primitives" << endl;
+    chrono.Restart();
+
+    vector<Vec3> pos_array(vertex_total);
+    vector<Vec3> normal_array(vertex_total);
+    vector<Vec3> uv_array(has_uv ? vertex_total : 0);
+    vector<Vec3> tangent_array(has_tangents ? vertex_total : 0);
+    vector<Vec3> bitangent_array(has_tangents ? vertex_total : 0);
+    vector<unsigned int> index_array(triangle_total * 3);
+    vector<unsigned int> triangle_to_material(triangle_total);
+    int invalid_index_count = 0;
+
+    for (const GltfPrimitive& primitive : primitives) {
+
+        const Matrix& transform = primitive.transform;
+        Matrix normal_transform = transform.AffineInverse().Transpose();
+
+#pragma omp parallel for
+        for (int i = 0; i < int(primitive.vertex_count); ++i) {
+
+            size_t vertex = primitive.first_vertex + i;
+            Vec3 position = ReadVec3(primitive.positions, i);
+            Vec3 normal = ReadVec3(primitive.normals, i);
+
+            if (primitive.is_transformed) {
+                position = transform.TransformPoint(position);
+                normal = (normal_transform * normal).normalize();
+            }
+
+            pos_array[vertex] = position;
+            normal_array[vertex] = normal;
+
+            if (primitive.uvs.data != nullptr)
+                uv_array[vertex] = ReadVec3(primitive.uvs, i);
+
+            // The w component is the handedness of the bitangent
+            if (has_tangents) {
+                float handedness = 1;
+                Vec3 tangent = ReadVec3(primitive.tangents, i, &handedness);
+                if (primitive.is_transformed)
+                    tangent = (transform * tangent).normalize();
+                tangent_array[vertex] = tangent;
+                bitangent_array[vertex] = normal.cross(tangent) * (handedness < 0 ? -1.f : 1.f);
+            }
+        }
+
+        unsigned int first_vertex = (unsigned int) primitive.first_vertex;
+        unsigned int vertex_count = (unsigned int) primitive.vertex_count;
+
+#pragma omp parallel for reduction(+: invalid_index_count)
+        for (int i = 0; i < int(primitive.triangle_count); ++i) {
+
+            size_t triangle = primitive.first_triangle + i;
+
+            for (int corner = 0; corner < 3; ++corner) {
+
+                size_t element = GetCornerElement(primitive.mode, (size_t) i, corner);
+                unsigned int vertex = (primitive.indices.data != nullptr) ? ReadIndex(primitive.indices, element) : (unsigned int) element;
+
+                if (vertex >= vertex_count) {
+                    invalid_index_count++;
+                    vertex = 0;
+                }
+
+                index_array[triangle * 3 + corner] = first_vertex + vertex;
+            }
+
+            triangle_to_material[triangle] = primitive.material;
+        }
+    }
+
+    if (invalid_index_count > 0) {
+        cout << "Invalid glTF vertex index" << endl;
+        return false;
+    }
+
+    cout << "glTF arrays: " << chrono.GetMilliseconds() << " ms, " << vertex_total << " vertices" << endl;
+
+    vector<MaterialDescriptor> descriptors;
+    for (size_t i = 0; i < materials.GetSize(); ++i) {
+        descriptors.push_back(GetMaterialDescriptor(gltf, materials.At(i)));
+    }
+
+    // The glTF default material, white with the metallic and roughness factors at 1
+    if (uses_default_material) {
+        MaterialDescriptor default_descriptor;
+        default_descriptor.workflow = MaterialDescriptor::METALLIC_WORKFLOW;
+        default_descriptor.name = "DefaultMaterial";
+        descriptors.push_back(default_descriptor);
+    }
+
+    // Decoded with the other textures when the materials are created, the data stays in the mappings until then
+    const JsonValue& images = gltf.Get("images");
+    vector<EncodedImage> embedded_images(images.GetSize(), EncodedImage {nullptr, 0});
+
+    for (size_t i = 0; i < images.GetSize(); ++i) {
+
+        const JsonValue& image = images.At(i);
+        GltfBuffer data {nullptr, 0};
+        size_t stride;
+
+        bool is_valid = true;
+        if (image.Get("bufferView").type != JsonValue::NULL_VALUE)
+            is_valid = GetBufferView(gltf, image.Get("bufferView").GetIndex(), buffers, data, stride);
+        else if (IsEmbeddedImage(image))
+            is_valid = GetUriData(image.Get("uri").text, gltf_directory, storage, data);
+
+        if (is_valid == false)
+            cout << "Invalid glTF embedded image " << i << endl;
+
+        embedded_images[i] = EncodedImage {data.data, data.size};
+    }
+
+    for (const GltfPrimitive& primitive : primitives) {
+        trimesh.submeshes.push_back(SubMesh {(unsigned int) primitive.first_triangle, (unsigned int) primitive.triangle_count});
+    }
+
+    // The primitives of a mesh are consecutive submeshes
+    if (import_instances) {
+        for (const std::pair<int, Matrix>& mesh_node : mesh_nodes) {
+            for (size_t i = mesh_first_primitive[mesh_node.first]; i < mesh_first_primitive[mesh_node.first + 1]; ++i) {
+                trimesh.instances.push_back(SubMeshInstance {(unsigned int) i, mesh_node.second});
+            }
+        }
+    }
+
+    trimesh.pos_array.swap(pos_array);
+    trimesh.normal_array.swap(normal_array);
+    trimesh.uv_array.swap(uv_array);
+    trimesh.tangent_array.swap(tangent_array);
+    trimesh.bitangent_array.swap(bitangent_array);
+    trimesh.index_array.swap(index_array);
+    trimesh.triangle_to_material.swap(triangle_to_material);
+    trimesh.vertex_count = (unsigned int) vertex_total;
+    trimesh.material_descriptors.swap(descriptors);
+    trimesh.CreateMaterials(directory, embedded_images);
+
+    return true;
+}
+
+static bool ParseGlb(const MappedFile& file, GltfBuffer& json_chunk, GltfBuffer& bin_chunk) {
+
+    const char* data = file.GetData();
+    uint32_t version = ReadUint32(data + 4);
+    uint32_t length = ReadUint32(data + 8);
+
+    // The length covers the 12 bytes header
+    if (version != 2 || length < 12 || length > file.GetSize())
+        return false;
+
+    json_chunk = GltfBuffer {nullptr, 0};
+    bin_chunk = GltfBuffer {nullptr, 0};
+
+    size_t offset = 12;
+    while (offset + 8 <= length) {
+
+        uint32_t chunk_length = ReadUint32(data + offset);
+        uint32_t chunk_type = ReadUint32(data + offset + 4);
+        offset += 8;
+
+        if (chunk_length > length - offset)
+            return false;
+
+        if (chunk_type == GLB_JSON_CHUNK && json_chunk.data == nullptr)
+            json_chunk = GltfBuffer {data + offset, chunk_length};
+        else if (chunk_type == GLB_BIN_CHUNK && bin_chunk.data == nullptr)
+            bin_chunk = GltfBuffer {data + offset, chunk_length};
+
+        offset += chunk_length;
+    }
+
+    return json_chunk.data != nullptr;
+}
+
+/**
+ * The external buffers are mapped, only the data uris are decoded
+ * The buffer without uri is the binary chunk of a .glb
+ */
+static bool LoadBuffers(const JsonValue& gltf, const string& gltf_directory, const GltfBuffer& bin_chunk,
+                        GltfStorage& storage, vector<GltfBuffer>& buffers) {
+
+    const JsonValue& json_buffers = gltf.Get("buffers");
+
+    for (size_t i = 0; i < json_buffers.GetSize(); ++i) {
+
+        const JsonValue& json = json_buffers.At(i);
+        const JsonValue& uri = json.Get("uri");
+        GltfBuffer buffer {nullptr, 0};
+
+        if (uri.type == JsonValue::STRING_VALUE) {
+            if (GetUriData(uri.text, gltf_directory, storage, buffer) == false) {
+                cout << "Could not read the glTF buffer [" << uri.text.substr(0, 64) << "]" << endl;
+                return false;
+            }
+        }
+        else if (i == 0 && bin_chunk.data != nullptr) {
+            buffer = bin_chunk;
+        }
+        else {
+            cout << "glTF buffer " << i << " without data" << endl;
+            return false;
+        }
+
+        // The binary chunk can be padded
+        int64_t length = json.Get("byteLength").GetIndex();
+        if (length < 0 || uint64_t(length) > buffer.size) {
+            cout << "glTF buffer " << i << " shorter than its length" << endl;
+            return false;
+        }
+
+        buffer.size = size_t(length);
+        buffers.push_back(buffer);
+    }
+
+    return true;
+}
+
+static bool GetUriData(const string& uri, const string& gltf_directory, GltfStorage& storage, GltfBuffer& data) {
+
+    if (uri.compare(0, 5, "data:") == 0) {
+
+        size_t comma = uri.find(',');
+        if (comma == string::npos || comma < 7 || uri.compare(comma - 7, 7, ";base64") != 0)
+            return false;
+
+        storage.decoded_uris.emplace_back();
+        vector<char>& bytes = storage.decoded_uris.back();
+
+        if (DecodeBase64(uri.data() + comma + 1, uri.data() + uri.size(), bytes) == false)
+            return false;
+
+        data = GltfBuffer {bytes.data(), bytes.size()};
+        return true;
+    }
+
+    storage.files.emplace_back(new MappedFile {gltf_directory + DecodeUri(uri)});
+    const MappedFile& file = *storage.files.back();
+
+    data = GltfBuffer {file.GetData(), file.GetSize()};
+
+    return file.IsValid();
+}
+
+static bool GetBufferView(const JsonValue& gltf, int64_t index, const vector<GltfBuffer>& buffers, GltfBuffer& view, size_t& stride) {
+
+    const JsonValue& json = gltf.Get("bufferViews").At((size_t) index);
+
+    int64_t buffer = json.Get("buffer").GetIndex();
+    int64_t offset = json.Get("byteOffset").GetIndex(0);
+    int64_t length = json.Get("byteLength").GetIndex();
+    int64_t byte_stride = json.Get("byteStride").GetIndex(0);
+
+    if (buffer < 0 || buffer >= (int64_t) buffers.size() || offset < 0 || length < 0)
+        return false;
+
+    // 0 when the elements are tightly packed, the spec bounds it otherwise
+    if (byte_stride != 0 && (byte_stride < 4 || byte_stride > 252 || byte_stride % 4 != 0))
+        return false;
+
+    const GltfBuffer& data = buffers[buffer];
+    if (uint64_t(offset) > data.size || uint64_t(length) > data.size - offset)
+        return false;
+
+    view = GltfBuffer {data.data + offset, size_t(length)};
+    stride = size_t(byte_stride);
+
+    return true;
+}
+
+/**
+ * Only the accessors stored in a buffer view are read, without sparse values or matrix types
+ */
+static bool GetAccessor(const JsonValue& gltf, int64_t index, const vector<GltfBuffer>& buffers, GltfAccessor& accessor) {
+
+    const JsonValue& json = gltf.Get("accessors").At((size_t) index);
+
+    if (json.type != JsonValue::OBJECT_VALUE || json.Get("sparse").type != JsonValue::NULL_VALUE)
+        return false;
+
+    const string& type = json.Get("type").text;
+    if (type == "SCALAR")
+        accessor.component_count = 1;
+    else if (type == "VEC2")
+        accessor.component_count = 2;
+    else if (type == "VEC3")
+        accessor.component_count = 3;
+    else if (type == "VEC4")
+        accessor.component_count = 4;
+    else
+        return false;
+
+    accessor.component_type = (int) json.Get("componentType").GetIndex();
+    switch (accessor.component_type) {
+        case BYTE_COMPONENT:
+        case UNSIGNED_BYTE_COMPONENT:
+            accessor.component_size = 1;
+            break;
+        case SHORT_COMPONENT:
+        case UNSIGNED_SHORT_COMPONENT:
+            accessor.component_size = 2;
+            break;
+        case UNSIGNED_INT_COMPONENT:
+        case FLOAT_COMPONENT:
+            accessor.component_size = 4;
+            break;
+        default:
+            return false;
+    }
+
+    const JsonValue& normalized = json.Get("normalized");
+    accessor.normalized = (normalized.type == JsonValue::BOOL_VALUE && normalized.number != 0);
+
+    int64_t count = json.Get("count").GetIndex();
+    int64_t offset = json.Get("byteOffset").GetIndex(0);
+
+    GltfBuffer view;
+    if (count < 0 || offset < 0 || GetBufferView(gltf, json.Get("bufferView").GetIndex(), buffers, view, accessor.stride) == false)
+        return false;
+
+    size_t element_size = size_t(accessor.component_size) * accessor.component_count;
+    if (accessor.stride == 0)
+        accessor.stride = element_size;
+    else if (accessor.stride < element_size)
+        return false;
+
+    // Divided rather than multiplied by the stride, so a huge count can't wrap around
+    if (count > 0) {
+        if (uint64_t(offset) > view.size || element_size > view.size - offset)
+            return false;
+        if (uint64_t(count) - 1 > (view.size - offset - element_size) / accessor.stride)
+            return false;
+    }
+
+    accessor.data = view.data + offset;
+    accessor.count = size_t(count);
+
+    return true;
+}
+
+/**
+ * The positions and normals are required, the normals Assimp would generate are left to it
+ */
+static bool PreparePrimitive(const JsonValue& gltf, const JsonValue& json, const vector<GltfBuffer>& buffers, GltfPrimitive& primitive) {
+
+    const JsonValue& attributes = json.Get("attributes");
+
+    primitive.mode = (int) json.Get("mode").GetIndex(TRIANGLES_MODE);
+    primitive.vertex_count = 0;
+    primitive.triangle_count = 0;
+
+    if (primitive.mode != TRIANGLES_MODE && primitive.mode != TRIANGLE_STRIP_MODE && primitive.mode != TRIANGLE_FAN_MODE)
+        return primitive.mode >= 0;
+
+    if (GetAccessor(gltf, attributes.Get("POSITION").GetIndex(), buffers, primitive.positions) == false
+        || primitive.positions.component_type != FLOAT_COMPONENT || primitive.positions.component_count != 3)
+        return false;
+
+    size_t vertex_count = primitive.positions.count;
+
+    if (GetAccessor(gltf, attributes.Get("NORMAL").GetIndex(), buffers, primitive.normals) == false
+        || primitive.normals.component_type != FLOAT_COMPONENT || primitive.normals.component_count != 3
+        || primitive.normals.count != vertex_count)
+        return false;
+
+    if (attributes.Get("TEXCOORD_0").type != JsonValue::NULL_VALUE) {
+
+        GltfAccessor& uvs = primitive.uvs;
+        if (GetAccessor(gltf, attributes.Get("TEXCOORD_0").GetIndex(), buffers, uvs) == false
+            || uvs.component_count != 2 || uvs.count != vertex_count
+            || (uvs.component_type != FLOAT_COMPONENT && uvs.normalized == false))
+            return false;
+    }
+
+    if (attributes.Get("TANGENT").type != JsonValue::NULL_VALUE) {
+
+        GltfAccessor& tangents = primitive.tangents;
+        if (GetAccessor(gltf, attributes.Get("TANGENT").GetIndex(), buffers, tangents) == false
+            || tangents.component_type != FLOAT_COMPONENT || tangents.component_count != 4 || tangents.count != vertex_count)
+            return false;
+    }
+
+    size_t corner_count = vertex_count;
+
+    if (json.Get("indices").type != JsonValue::NULL_VALUE) {
+
+        GltfAccessor& indices = primitive.indices;
+        if (GetAccessor(gltf, json.Get("indices").GetIndex(), buffers, indices) == false || indices.component_count != 1
+            || (indices.component_type != UNSIGNED_BYTE_COMPONENT && indices.component_type != UNSIGNED_SHORT_COMPONENT
+                && indices.component_type != UNSIGNED_INT_COMPONENT))
+            return false;
+
+        corner_count = indices.count;
+    }
+
+    primitive.vertex_count = vertex_count;
+
+    if (primitive.mode == TRIANGLES_MODE)
+        primitive.triangle_count = corner_count / 3;
+    else
+        primitive.triangle_count = (corner_count >= 3) ? corner_count - 2 : 0;
+
+    return true;
+}
+
+/**
+ * Walk the node graph to place each mesh referenced by a node with the transforms accumulated from the root
+ * A node graph deeper than its node count has a cycle
+ */
+static bool CollectMeshNodes(const JsonValue& gltf, int64_t node, const Matrix& parent_transform, size_t depth,
+                             vector<std::pair<int, Matrix>>& mesh_nodes) {
+
+    const JsonValue& nodes = gltf.Get("nodes");
+    const JsonValue& json = nodes.At((size_t) node);
+
+    if (json.type != JsonValue::OBJECT_VALUE || depth > nodes.GetSize())
+        return false;
+
+    Matrix transform = Matrix {parent_transform} * GetNodeTransform(json);
+
+    int64_t mesh = json.Get("mesh").GetIndex();
+    if (mesh >= 0) {
+        if (mesh >= (int64_t) gltf.Get("meshes").GetSize())
+            return false;
+        mesh_nodes.push_back({(int) mesh, transform});
+    }
+
+    const JsonValue& children = json.Get("children");
+    for (size_t i = 0; i < children.GetSize(); ++i) {
+        if (CollectMeshNodes(gltf, children.At(i).GetIndex(), transform, depth + 1, mesh_nodes) == false)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * The matrix is column-major, otherwise it is the translation * rotation * scale product
+ */
+static Matrix GetNodeTransform(const JsonValue& node) {
+
+    Matrix transform;
+
+    const JsonValue& matrix = node.Get("matrix");
+    if (matrix.GetSize() == 16) {
+        for (int row = 0; row < 4; ++row) {
+            for (int column = 0; column < 4; ++column) {
+                transform[row][column] = (float) matrix.At(size_t(column * 4 + row)).GetNumber(0);
+            }
+        }
+        return transform;
+    }
+
+    const JsonValue& translation = node.Get("translation");
+    const JsonValue& rotation = node.Get("rotation");
+    const JsonValue& scale = node.Get("scale");
+
+    float x = (float) rotation.At(0).GetNumber(0);
+    float y = (float) rotation.At(1).GetNumber(0);
+    float z = (float) rotation.At(2).GetNumber(0);
+    float w = (float) rotation.At(3).GetNumber(1);
+
+    float rotation_matrix[3][3] = {
+        {1 - 2 * (y * y + z * z),     2 * (x * y - z * w),     2 * (x * z + y * w)},
+        {    2 * (x * y + z * w), 1 - 2 * (x * x + z * z),     2 * (y * z - x * w)},
+        {    2 * (x * z - y * w),     2 * (y * z + x * w), 1 - 2 * (x * x + y * y)}
+    };
+
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) {
+            transform[row][column] = rotation_matrix[row][column] * (float) scale.At(size_t(column)).GetNumber(1);
+        }
+        transform[row][3] = (float) translation.At(size_t(row)).GetNumber(0);
+    }
+
+    return transform;
+}
+
+static MaterialDescriptor GetMaterialDescriptor(const JsonValue& gltf, const JsonValue& material) {
+
+    const JsonValue& pbr = material.Get("pbrMetallicRoughness");
+    const JsonValue& base_color = pbr.Get("baseColorFactor");
+
+    MaterialDescriptor descriptor;
+    descriptor.workflow = MaterialDescriptor::METALLIC_WORKFLOW;
+    descriptor.name = material.Get("name").text;
+    descriptor.albedo_path = GetTexturePath(gltf, pbr.Get("baseColorTexture"));
+    descriptor.specular_path = GetTexturePath(gltf, pbr.Get("metallicRoughnessTexture"));
+    descriptor.normal_path = GetTexturePath(gltf, material.Get("normalTexture"));
+    descriptor.albedo_value = Vec3 {(float) base_color.At(0).GetNumber(1), (float) base_color.At(1).GetNumber(1), (float) base_color.At(2).GetNumber(1)};
+    descriptor.metallic_factor = (float) pbr.Get("metallicFactor").GetNumber(1);
+    descriptor.roughness_factor = (float) pbr.Get("roughnessFactor").GetNumber(1);
+
+    return descriptor;
+}
+
+// The path of the image of the texture, "*<image index>" for an embedded one
+static string GetTexturePath(const JsonValue& gltf, const JsonValue& texture_info) {
+
+    if (texture_info.type == JsonValue::NULL_VALUE)
+        return "";
+
+    const JsonValue& texture = gltf.Get("textures").At((size_t) texture_info.Get("index").GetIndex());
+    int64_t source = texture.Get("source").GetIndex();
+    const JsonValue& image = gltf.Get("images").At((size_t) source);
+
+    if (image.type != JsonValue::OBJECT_VALUE) {
+        cout << "glTF texture without a supported image" << endl;
+        return "";
+    }
+
+    if (image.Get("bufferView").type != JsonValue::NULL_VALUE || IsEmbeddedImage(image))
+        return "*" + std::to_string(source);
+
+    return DecodeUri(image.Get("uri").text);
+}
+
+static bool IsEmbeddedImage(const JsonValue& image) {
+    return image.Get("uri").text.compare(0, 5, "data:") == 0;
+}
+
+/**
+ * @param w Receives the fourth component if not null
+ */
+static Vec3 ReadVec3(const GltfAccessor& accessor, size_t element, float* w) {
+
+    const char* data = accessor.data + element * accessor.stride;
+    float components[4] = {0, 0, 0, 1};
+
+    if (accessor.component_type == FLOAT_COMPONENT) {
+        memcpy(components, data, accessor.component_count * sizeof(float));
+    }
+    else {
+        for (int i = 0; i < accessor.component_count; ++i) {
+
+            const char* component = data + i * accessor.component_size;
+
+            switch (accessor.component_type) {
+                case BYTE_COMPONENT: {
+                    int8_t value = *reinterpret_cast<const int8_t*>(component);
+                    components[i] = accessor.normalized ? std::max(value / 127.f, -1.f) : value;
+                    break;
+                }
+                case UNSIGNED_BYTE_COMPONENT: {
+                    uint8_t value = *reinterpret_cast<const uint8_t*>(component);
+                    components[i] = accessor.normalized ? value / 255.f : value;
+                    break;
+                }
+                case SHORT_COMPONENT: {
+                    int16_t value;
+                    memcpy(&value, component, sizeof(value));
+                    components[i] = accessor.normalized ? std::max(value / 32767.f, -1.f) : value;
+                    break;
+                }
+                case UNSIGNED_SHORT_COMPONENT: {
+                    uint16_t value;
+                    memcpy(&value, component, sizeof(value));
+                    components[i] = accessor.normalized ? value / 65535.f : value;
+                    break;
+                }
+                default: {
+                    uint32_t value;
+                    memcpy(&value, component, sizeof(value));
+                    components[i] = accessor.normalized ? value / 4294967295.f : value;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (w != nullptr)
+        *w = components[3];
+
+    return Vec3 {components[0], components[1], components[2]};
+}
+
+static unsigned int ReadIndex(const GltfAccessor& accessor, size_t element) {
+
+    const char* data = accessor.data + element * accessor.stride;
+
+    switch (accessor.component_type) {
+        case UNSIGNED_BYTE_COMPONENT:
+            return *reinterpret_cast<const uint8_t*>(data);
+        case UNSIGNED_SHORT_COMPONENT: {
+            uint16_t index;
+            memcpy(&index, data, sizeof(index));
+            return index;
+        }
+        default:
+            return ReadUint32(data);
+    }
+}
+
+// The element of the index accessor, or the vertex without one, of a corner of a triangle
+static size_t GetCornerElement(int mode, size_t triangle, int corner) {
+
+    switch (mode) {
+        // Every other triangle of a strip has its first two corners swapped to keep the winding
+        case TRIANGLE_STRIP_MODE:
+            if (triangle % 2 == 1 && corner < 2)
+                return triangle + 1 - corner;
+            return triangle + corner;
+        case TRIANGLE_FAN_MODE:
+            return (corner == 0) ? 0 : triangle + corner;
+        default:
+            return triangle * 3 + corner;
+    }
+}
+
+static uint32_t ReadUint32(const char* p) {
+
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Both the standard and the url-safe alphabets, the padding ends the data
+static bool DecodeBase64(const char* p, const char* end, vector<char>& bytes) {
+
+    bytes.reserve(size_t(end - p) / 4 * 3);
+
+    uint32_t bits = 0;
+    int bit_count = 0;
+
+    for (; p < end; ++p) {
+
+        char c = *p;
+        uint32_t value;
+
+        if (c >= 'A' && c <= 'Z')
+            value = uint32_t(c - 'A');
+        else if (c >= 'a' && c <= 'z')
+            value = uint32_t(c - 'a') + 26;
+        else if (c >= '0' && c <= '9')
+            value = uint32_t(c - '0') + 52;
+        else if (c == '+' || c == '-')
+            value = 62;
+        else if (c == '/' || c == '_')
+            value = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+
+        bits = (bits << 6) | value;
+        bit_count += 6;
+
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            bytes.push_back(char((bits >> bit_count) & 0xFF));
+        }
+    }
+
+    return true;
+}
+
+// The uris are percent-encoded, like the spaces in the file names
+static string DecodeUri(const string& uri) {
+
+    string decoded;
+    decoded.reserve(uri.size());
+
+    for (size_t i = 0; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size() && isxdigit((unsigned char) uri[i + 1]) && isxdigit((unsigned char) uri[i + 2])) {
+            decoded += char(std::strtol(uri.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        }
+        else {
+            decoded += uri[i];
+        }
+    }
+
+    return decoded;
+}
+
+const JsonValue& JsonValue::Get(const char* key) const {
+
+    static const JsonValue null_value;
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (keys[i] == key)
+            return elements[i];
+    }
+
+    return null_value;
+}
+
+const JsonValue& JsonValue::At(size_t index) const {
+
+    static const JsonValue null_value;
+
+    if (type != ARRAY_VALUE || index >= elements.size())
+        return null_value;
+
+    return elements[index];
+}
+
+int64_t JsonValue::GetIndex(int64_t default_value) const {
+
+    if (type == NULL_VALUE)
+        return default_value;
+
+    if (type != NUMBER_VALUE || number < 0 || number > 9e15 || number != std::floor(number))
+        return -1;
+
+    return (int64_t) number;
+}
+
+static bool ParseJson(const char* begin, const char* end, JsonValue& document) {
+
+    const char* p = begin;
+
+    // UTF-8 byte order mark
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+        p += 3;
+
+    if (ParseJsonValue(p, end, 0, document) == false)
+        return false;
+
+    // The JSON chunk of a .glb is padded with spaces
+    p = SkipJsonSpaces(p, end);
+    while (p < end && *p == '\0') {
+        ++p;
+    }
+
+    return p == end;
+}
+
+static bool ParseJsonValue(const char*& p, const char* end, int depth, JsonValue& value) {
+
+    p = SkipJsonSpaces(p, end);
+
+    if (p == end || depth > MAX_JSON_DEPTH)
+        return false;
+
+    if (*p == '{' || *p == '[') {
+
+        bool is_object = (*p == '{');
+        char closing = is_object ? '}' : ']';
+        value.type = is_object ? JsonValue::OBJECT_VALUE : JsonValue::ARRAY_VALUE;
+
+        p = SkipJsonSpaces(p + 1, end);
+        if (p < end && *p == closing) {
+            ++p;
+            return true;
+        }
+
+        while (true) {
+
+            if (is_object) {
+                value.keys.emplace_back();
+                p = SkipJsonSpaces(p, end);
+                if (ParseJsonString(p, end, value.keys.back()) == false)
+                    return false;
+                p = SkipJsonSpaces(p, end);
+                if (p == end || *p != ':')
+                    return false;
+                ++p;
+            }
+
+            value.elements.emplace_back();
+            if (ParseJsonValue(p, end, depth + 1, value.elements.back()) == false)
+                return false;
+
+            p = SkipJsonSpaces(p, end);
+            if (p == end)
+                return false;
+            if (*p == closing) {
+                ++p;
+                return true;
+            }
+            if (*p != ',')
+                return false;
+            ++p;
+        }
+    }
+
+    if (*p == '"') {
+        value.type = JsonValue::STRING_VALUE;
+        return ParseJsonString(p, end, value.text);
+    }
+
+    static const char* const literals[] = {"true", "false", "null"};
+    for (int i = 0; i < 3; ++i) {
+        size_t length = strlen(literals[i]);
+        if (size_t(end - p) >= length && memcmp(p, literals[i], length) == 0) {
+            value.type = (i < 2) ? JsonValue::BOOL_VALUE : JsonValue::NULL_VALUE;
+            value.number = (i == 0) ? 1 : 0;
+            p += length;
+            return true;
+        }
+    }
+
+    // Copied out as the mapping is not null-terminated
+    char number[64];
+    size_t length = 0;
+    while (p + length < end && length < sizeof(number) - 1 && strchr("+-.eE0123456789", p[length]) != nullptr && p[length] != '\0') {
+        number[length] = p[length];
+        length++;
+    }
+    number[length] = '\0';
+
+    char* number_end;
+    value.type = JsonValue::NUMBER_VALUE;
+    value.number = std::strtod(number, &number_end);
+
+    if (length == 0 || number_end != number + length)
+        return false;
+
+    p += length;
+    return true;
+}
+
+static bool ParseJsonString(const char*& p, const char* end, string& text) {
+
+    if (p == end || *p != '"')
+        return false;
+    ++p;
+
+    while (p < end && *p != '"') {
+
+        if (*p != '\\') {
+            text += *p++;
+            continue;
+        }
+
+        if (end - p < 2)
+            return false;
+
+        char escaped = p[1];
+        p += 2;
+
+        switch (escaped) {
+            case 'b': text += '\b'; break;
+            case 'f': text += '\f'; break;
+            case 'n': text += '\n'; break;
+            case 'r': text += '\r'; break;
+            case 't': text += '\t'; break;
+            case 'u': {
+                if (end - p < 4)
+                    return false;
+                uint32_t code = (uint32_t) std::strtoul(string(p, 4).c_str(), nullptr, 16);
+                p += 4;
+
+                // Surrogate pair
+                if (code >= 0xD800 && code < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    uint32_t low = (uint32_t) std::strtoul(string(p + 2, 4).c_str(), nullptr, 16);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+
+                // UTF-8
+                if (code < 0x80) {
+                    text += char(code);
+                }
+                else if (code < 0x800) {
+                    text += char(0xC0 | (code >> 6));
+                    text += char(0x80 | (code & 0x3F));
+                }
+                else if (code < 0x10000) {
+                    text += char(0xE0 | (code >> 12));
+                    text += char(0x80 | ((code >> 6) & 0x3F));
+                    text += char(0x80 | (code & 0x3F));
+                }
+                else {
+                    text += char(0xF0 | (code >> 18));
+                    text += char(0x80 | ((code >> 12) & 0x3F));
+                    text += char(0x80 | ((code >> 6) & 0x3F));
+                    text += char(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default:
+                text += escaped;
+                break;
+        }
+    }
+
+    if (p == end)
+        return false;
+
+    ++p;
+    return true;
+}
+
+static const char* SkipJsonSpaces(const char* p, const char* end) {
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        ++p;
+    }
+
+    return p;
+}
@@ -0,0 +1,27 @@
+#ifndef PATHTRACER_GLTFLOADER_H
+#define PATHTRACER_GLTFLOADER_H
+
+#include <string>
+
+class TriMesh;
+
+/**
+ * Native glTF 2.0 importer, for the .gltf files with their external or embedded buffers and the binary .glb files
+ * The file and its buffers are memory-mapped and the accessors are converted straight from the mapping into the TriMesh arrays
+ * The images embedded in the file are decoded from the mapping too, in parallel with the other textures
+ * Like the Assimp import, the meshes are pre-transformed by their nodes unless the instances are imported,
+ * each primitive of a mesh becoming a submesh
+ * A file it can't read (sparse accessors, required extensions, missing normals) makes it return false, the caller falls back to Assimp then
+ */
+class GltfLoader {
+
+public:
+
+    /**
+     * @param directory Directory the texture paths of the materials are relative to
+     * @param import_instances Keeps the meshes in their space and places them with the node transforms
+     */
+    static bool Load(const std::string& filename, const std::string& directory, bool import_instances, TriMesh& trimesh);
+};
+
+#endif //PATHTRACER_GLTFLOADER_H
@@ -6,3 +6,15 @@ Vec3 Intersectable::GetCenter() const {
     return ComputeBBox().GetCenter();
 }
 
+/**
+ * Conservative default, the shape bbox clamped to the slab
+ */
+BoundingBox Intersectable::ComputeClippedBBox(char axis, float min, float max) const {
+
+    BoundingBox bbox = ComputeBBox();
+    bbox.min[axis] = std::max(bbox.min[axis], min);
+    bbox.max[axis] = std::min(bbox.max[axis], max);
+
+    return bbox;
+}
+
@@ -18,6 +18,9 @@ public:
     virtual BoundingBox ComputeBBox() const = 0;
 
     virtual Vec3 GetCenter() const;
+
+    // Bounds of the part of the shape between min and max along the axis, for the BVH spatial splits
+    virtual BoundingBox ComputeClippedBBox(char axis, float min, float max) const;
 };
 
 #endif //PATHTRACER_INTERSECTABLE_H
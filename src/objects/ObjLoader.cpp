@@ -0,0 +1,842 @@
+#include "ObjLoader.h"
+
+#include "TriMesh.h"
+#include "core/MappedFile.h"
+#include "app/Chronometer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::map;
+using std::cout;
+using std::endl;
+
+static const int NO_INDEX = -1;
+static const int INHERITED_MATERIAL = -1;
+static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+enum ObjAttribute {
+    NO_ATTRIBUTE,
+    POSITION_ATTRIBUTE,
+    UV_ATTRIBUTE,
+    NORMAL_ATTRIBUTE
+};
+
+// Indices in the whole file of the attributes of a face corner, NO_INDEX when absent
+struct ObjCorner {
+    int pos;
+    int uv;
+    int normal;
+};
+
+// A line-aligned range of the file and what was parsed from it
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+    // Counted by the first pass, their prefix sums give where the second pass writes the attributes
+    int pos_count = 0;
+    int uv_count = 0;
+    int normal_count = 0;
+    int first_pos = 0;
+    int first_uv = 0;
+    int first_normal = 0;
+    vector<string> material_libraries;
+    vector<ObjCorner> corners;          // 3 per triangle
+    vector<int> triangle_materials;     // INHERITED_MATERIAL until the first usemtl of the chunk
+    int last_material = INHERITED_MATERIAL;
+    bool has_uv = false;
+    bool has_missing_normal = false;
+    bool has_error = false;
+};
+
+static vector<ObjChunk> SplitChunks(const char* data, size_t size);
+static void CountAttributes(ObjChunk& chunk);
+static void ParseChunk(ObjChunk& chunk, const map<string, int>& material_indices, int default_material,
+                       int pos_total, int uv_total, int normal_total,
+                       vector<Vec3>& positions, vector<Vec3>& uvs, vector<Vec3>& normals);
+static bool ParseMaterialLibrary(const string& filename, vector<MaterialDescriptor>& descriptors, map<string, int>& material_indices);
+static void ComputeSmoothNormals(const vector<Vec3>& pos_array, const vector<unsigned int>& index_array,
+                                 const vector<int>& vertex_positions, int position_count, vector<Vec3>& smooth_normals);
+static void ComputeTangents(const vector<Vec3>& pos_array, const vector<Vec3>& normal_array, const vector<Vec3>& uv_array,
+                            const vector<unsigned int>& index_array, vector<Vec3>& tangent_array, vector<Vec3>& bitangent_array);
+
+static ObjAttribute GetAttribute(const char* p, const char* end);
+static const char* SkipSpaces(const char* p, const char* end);
+static const char* FindLineEnd(const char* p, const char* end);
+static const char* ParseFloat(const char* p, const char* end, float& value);
+static const char* ParseIndex(const char* p, const char* end, int& value);
+static bool StartsWithKeyword(const char* p, const char* end, const char* keyword);
+static string GetLineArgument(const char* p, const char* end);
+
+/**
+ * The attributes are written at the offsets given by a first counting pass, so the chunks only keep their faces
+ * The faces are then sorted by material and their corners joined into vertices in that order
+ */
+bool ObjLoader::Load(const string& filename, const string& directory, bool import_instances, TriMesh& trimesh) {
+
+    Chronometer chrono;
+
+    MappedFile file {filename};
+
+    if (file.IsValid() == false)
+        return false;
+
+    vector<ObjChunk> chunks = SplitChunks(file.GetData(), file.GetSize());
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        CountAttributes(chunks[i]);
+    }
+
+    int pos_total = 0;
+    int uv_total = 0;
+    int normal_total = 0;
+    for (ObjChunk& chunk : chunks) {
+        chunk.first_pos = pos_total;
+        chunk.first_uv = uv_total;
+        chunk.first_normal = normal_total;
+        pos_total += chunk.pos_count;
+        uv_total += chunk.uv_count;
+        normal_total += chunk.normal_count;
+    }
+
+    // The material libraries are relative to the OBJ file, unlike the textures
+    string obj_directory = filename.substr(0, filename.find_last_of('/') + 1);
+    vector<MaterialDescriptor> descriptors;
+    map<string, int> material_indices;
+    for (const ObjChunk& chunk : chunks) {
+        for (const string& library : chunk.material_libraries) {
+            if (ParseMaterialLibrary(obj_directory + library, descriptors, material_indices) == false)
+                cout << "Could not read the material library [" << library << "]" << endl;
+        }
+    }
+
+    // The faces without a known material get a default one, only kept if used
+    int default_material = (int) descriptors.size();
+
+    vector<Vec3> positions((size_t) pos_total);
+    vector<Vec3> uvs((size_t) uv_total);
+    vector<Vec3> normals((size_t) normal_total);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        ParseChunk(chunks[i], material_indices, default_material, pos_total, uv_total, normal_total, positions, uvs, normals);
+    }
+
+    bool has_uv = false;
+    bool has_missing_normal = false;
+    size_t triangle_count = 0;
+    for (const ObjChunk& chunk : chunks) {
+        if (chunk.has_error) {
+            cout << "Invalid OBJ face or attribute index" << endl;
+            return false;
+        }
+        has_uv |= chunk.has_uv;
+        has_missing_normal |= chunk.has_missing_normal;
+        triangle_count += chunk.triangle_materials.size();
+    }
+
+    if (triangle_count == 0)
+        return false;
+
+    cout << "OBJ parsing: " << chrono.GetMilliseconds() << " ms, " << chunks.size() << " chunks" << endl;
+    chrono.Restart();
+
+    // The faces before the first usemtl of a chunk continue the material of the previous chunks
+    int current_material = default_material;
+    for (ObjChunk& chunk : chunks) {
+        for (int& material : chunk.triangle_materials) {
+            if (material != INHERITED_MATERIAL)
+                break;
+            material = current_material;
+        }
+        if (chunk.last_material != INHERITED_MATERIAL)
+            current_material = chunk.last_material;
+    }
+
+    int material_count = default_material + 1;
+
+    // Counting sort of the triangles by material, the chunks scatter theirs in parallel
+    vector<vector<size_t>> offsets(chunks.size(), vector<size_t>((size_t) material_count, 0));
+
+#pragma omp parallel for
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        for (int material : chunks[i].triangle_materials) {
+            offsets[i][material]++;
+        }
+    }
+
+    vector<unsigned int> material_triangle_counts((size_t) material_count, 0);
+    size_t offset = 0;
+    for (int material = 0; material < material_count; ++material) {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            size_t count = offsets[i][material];
+            offsets[i][material] = offset;
+            offset += count;
+            material_triangle_counts[material] += (unsigned int) count;
+        }
+    }
+
+    vector<ObjCorner> sorted_corners(triangle_count * 3);
+    vector<unsigned int> triangle_to_material(triangle_count);
+
+#pragma omp parallel for
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        ObjChunk& chunk = chunks[i];
+        for (size_t triangle = 0; triangle < chunk.triangle_materials.size(); ++triangle) {
+            int material = chunk.triangle_materials[triangle];
+            size_t sorted_triangle = offsets[i][material]++;
+            triangle_to_material[sorted_triangle] = (unsigned int) material;
+            std::copy_n(&chunk.corners[triangle * 3], 3, &sorted_corners[sorted_triangle * 3]);
+        }
+        vector<ObjCorner>().swap(chunk.corners);
+    }
+
+    // Join the identical corners, those of a position are chained from it as there are only a few
+    vector<int> position_first_vertex((size_t) pos_total, NO_INDEX);
+    vector<int> next_vertex;
+    vector<ObjCorner> vertices;
+    vector<unsigned int> index_array(sorted_corners.size());
+
+    for (size_t i = 0; i < sorted_corners.size(); ++i) {
+
+        const ObjCorner& corner = sorted_corners[i];
+
+        int vertex = position_first_vertex[corner.pos];
+        while (vertex != NO_INDEX && (vertices[vertex].uv != corner.uv || vertices[vertex].normal != corner.normal)) {
+            vertex = next_vertex[vertex];
+        }
+
+        if (vertex == NO_INDEX) {
+            vertex = (int) vertices.size();
+            vertices.push_back(corner);
+            next_vertex.push_back(position_first_vertex[corner.pos]);
+            position_first_vertex[corner.pos] = vertex;
+        }
+
+        index_array[i] = (unsigned int) vertex;
+    }
+
+    vector<ObjCorner>().swap(sorted_corners);
+
+    cout << "OBJ vertex joining: " << chrono.GetMilliseconds() << " ms, " << vertices.size() << " vertices" << endl;
+    chrono.Restart();
+
+    int vertex_count = (int) vertices.size();
+
+    trimesh.pos_array.resize(vertices.size());
+    trimesh.normal_array.resize(vertices.size());
+    if (has_uv)
+        trimesh.uv_array.resize(vertices.size());
+
+#pragma omp parallel for
+    for (int i = 0; i < vertex_count; ++i) {
+        const ObjCorner& vertex = vertices[i];
+        trimesh.pos_array[i] = positions[vertex.pos];
+        if (vertex.normal != NO_INDEX)
+            trimesh.normal_array[i] = normals[vertex.normal];
+        if (has_uv && vertex.uv != NO_INDEX)
+            trimesh.uv_array[i] = uvs[vertex.uv];
+    }
+
+    // Smoothed over the faces sharing a position, like the Assimp normals, so the uv seams don't show
+    if (has_missing_normal) {
+
+        vector<int> vertex_positions(vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            vertex_positions[i] = vertices[i].pos;
+        }
+
+        vector<Vec3> smooth_normals;
+        ComputeSmoothNormals(trimesh.pos_array, index_array, vertex_positions, pos_total, smooth_normals);
+
+#pragma omp parallel for
+        for (int i = 0; i < vertex_count; ++i) {
+            if (vertices[i].normal == NO_INDEX)
+                trimesh.normal_array[i] = smooth_normals[vertices[i].pos];
+        }
+    }
+
+    if (has_uv)
+        ComputeTangents(trimesh.pos_array, trimesh.normal_array, trimesh.uv_array, index_array, trimesh.tangent_array, trimesh.bitangent_array);
+
+    cout << "OBJ normals and tangents: " << chrono.GetMilliseconds() << " ms" << endl;
+
+    if (material_triangle_counts[default_material] > 0) {
+        MaterialDescriptor default_descriptor;
+        default_descriptor.name = "DefaultMaterial";
+        default_descriptor.albedo_value = 0.6f;
+        default_descriptor.reflectance_value = 0;
+        descriptors.push_back(default_descriptor);
+    }
+
+    unsigned int first_triangle = 0;
+    for (int material = 0; material < material_count; ++material) {
+        if (material_triangle_counts[material] == 0)
+            continue;
+        trimesh.submeshes.push_back(SubMesh {first_triangle, material_triangle_counts[material]});
+        first_triangle += material_triangle_counts[material];
+    }
+
+    if (import_instances) {
+        for (unsigned int i = 0; i < trimesh.submeshes.size(); ++i) {
+            trimesh.instances.push_back(SubMeshInstance {i, Matrix {}});
+        }
+    }
+
+    trimesh.index_array.swap(index_array);
+    trimesh.triangle_to_material.swap(triangle_to_material);
+    trimesh.vertex_count = (unsigned int) vertex_count;
+    trimesh.material_descriptors.swap(descriptors);
+    trimesh.CreateMaterials(directory);
+
+    return true;
+}
+
+/**
+ * About a chunk per MIN_CHUNK_SIZE bytes, with enough chunks to balance the threads, each ending after a new line
+ */
+static vector<ObjChunk> SplitChunks(const char* data, size_t size) {
+
+    size_t chunk_count = 1;
+#ifdef USE_OPENMP
+    chunk_count = (size_t) omp_get_max_threads() * 4;
+#endif
+    chunk_count = std::max(size_t(1), std::min(chunk_count, size / MIN_CHUNK_SIZE));
+
+    vector<ObjChunk> chunks;
+    const char* end = data + size;
+    const char* begin = data;
+
+    for (size_t i = 1; i <= chunk_count && begin < end; ++i) {
+
+        const char* chunk_end = (i == chunk_count) ? end : FindLineEnd(std::max(begin, data + size * i / chunk_count), end);
+        if (chunk_end < end)
+            chunk_end++;
+
+        ObjChunk chunk;
+        chunk.begin = begin;
+        chunk.end = chunk_end;
+        chunks.push_back(chunk);
+
+        begin = chunk_end;
+    }
+
+    return chunks;
+}
+
+static void CountAttributes(ObjChunk& chunk) {
+
+    const char* p = chunk.begin;
+
+    while (p < chunk.end) {
+
+        const char* line_end = FindLineEnd(p, chunk.end);
+        p = SkipSpaces(p, line_end);
+
+        ObjAttribute attribute = GetAttribute(p, line_end);
+
+        if (attribute == POSITION_ATTRIBUTE)
+            chunk.pos_count++;
+        else if (attribute == UV_ATTRIBUTE)
+            chunk.uv_count++;
+        else if (attribute == NORMAL_ATTRIBUTE)
+            chunk.normal_count++;
+        else if (StartsWithKeyword(p, line_end, "mtllib")) {
+            chunk.material_libraries.push_back(GetLineArgument(p + 6, line_end));
+        }
+
+        p = line_end + 1;
+    }
+}
+
+/**
+ * The polygons are triangulated as fans, the negative indices are relative to the attributes read before them
+ */
+static void ParseChunk(ObjChunk& chunk, const map<string, int>& material_indices, int default_material,
+                       int pos_total, int uv_total, int normal_total,
+                       vector<Vec3>& positions, vector<Vec3>& uvs, vector<Vec3>& normals) {
+
+    int pos_index = chunk.first_pos;
+    int uv_index = chunk.first_uv;
+    int normal_index = chunk.first_normal;
+    int current_material = INHERITED_MATERIAL;
+    vector<ObjCorner> polygon;
+
+    const char* p = chunk.begin;
+
+    while (p < chunk.end && chunk.has_error == false) {
+
+        const char* line_end = FindLineEnd(p, chunk.end);
+        p = SkipSpaces(p, line_end);
+
+        // The attribute lines must be recognized exactly like CountAttributes does, their counts size the arrays
+        ObjAttribute attribute = GetAttribute(p, line_end);
+
+        if (attribute == POSITION_ATTRIBUTE) {
+            Vec3& position = positions[pos_index++];
+            p = ParseFloat(p + 1, line_end, position.x);
+            p = ParseFloat(p, line_end, position.y);
+            p = ParseFloat(p, line_end, position.z);
+        }
+        else if (attribute == UV_ATTRIBUTE) {
+            // Flipped like the aiProcess_FlipUVs of the Assimp import
+            float u = 0;
+            float v = 0;
+            p = ParseFloat(p + 2, line_end, u);
+            p = ParseFloat(p, line_end, v);
+            uvs[uv_index++] = Vec3 {u, 1 - v, 0};
+        }
+        else if (attribute == NORMAL_ATTRIBUTE) {
+            Vec3& normal = normals[normal_index++];
+            p = ParseFloat(p + 2, line_end, normal.x);
+            p = ParseFloat(p, line_end, normal.y);
+            p = ParseFloat(p, line_end, normal.z);
+        }
+        else if (StartsWithKeyword(p, line_end, "f")) {
+
+            polygon.clear();
+            p = SkipSpaces(p + 1, line_end);
+
+            while (p < line_end && *p != '#' && chunk.has_error == false) {
+
+                int indices[3] = {0, 0, 0};
+                const int counts[3] = {pos_index, uv_index, normal_index};
+                const int totals[3] = {pos_total, uv_total, normal_total};
+
+                p = ParseIndex(p, line_end, indices[0]);
+                for (int attribute = 1; attribute < 3 && p < line_end && *p == '/'; ++attribute) {
+                    p++;
+                    if (p < line_end && *p != '/')
+                        p = ParseIndex(p, line_end, indices[attribute]);
+                }
+
+                ObjCorner corner;
+                int* resolved[3] = {&corner.pos, &corner.uv, &corner.normal};
+                for (int attribute = 0; attribute < 3; ++attribute) {
+                    int index = indices[attribute];
+                    *resolved[attribute] = (index > 0) ? index - 1 : (index < 0) ? counts[attribute] + index : NO_INDEX;
+                    if (*resolved[attribute] >= totals[attribute] || (index != 0 && *resolved[attribute] < 0))
+                        chunk.has_error = true;
+                }
+                if (indices[0] == 0)
+                    chunk.has_error = true;
+
+                polygon.push_back(corner);
+                p = SkipSpaces(p, line_end);
+            }
+
+            for (size_t i = 2; i < polygon.size() && chunk.has_error == false; ++i) {
+                chunk.corners.push_back(polygon[0]);
+                chunk.corners.push_back(polygon[i - 1]);
+                chunk.corners.push_back(polygon[i]);
+                chunk.triangle_materials.push_back(current_material);
+            }
+
+            if (polygon.size() > 2) {
+                for (const ObjCorner& corner : polygon) {
+                    chunk.has_uv |= corner.uv != NO_INDEX;
+                    chunk.has_missing_normal |= corner.normal == NO_INDEX;
+                }
+            }
+        }
+        else if (StartsWithKeyword(p, line_end, "usemtl")) {
+            auto material = material_indices.find(GetLineArgument(p + 6, line_end));
+            current_material = (material != material_indices.end()) ? material->second : default_material;
+            chunk.last_material = current_material;
+        }
+
+        p = line_end + 1;
+    }
+}
+
+/**
+ * Only what the legacy material reads is kept: the diffuse and specular colors and maps, and the bump map as its normal map
+ */
+static bool ParseMaterialLibrary(const string& filename, vector<MaterialDescriptor>& descriptors, map<string, int>& material_indices) {
+
+    MappedFile file {filename};
+
+    if (file.IsValid() == false)
+        return false;
+
+    const char* p = file.GetData();
+    const char* end = p + file.GetSize();
+    MaterialDescriptor* descriptor = nullptr;
+
+    while (p < end) {
+
+        const char* line_end = FindLineEnd(p, end);
+        p = SkipSpaces(p, line_end);
+
+        if (StartsWithKeyword(p, line_end, "newmtl")) {
+            string name = GetLineArgument(p + 6, line_end);
+            if (material_indices.count(name) == 0) {
+                material_indices[name] = (int) descriptors.size();
+                descriptors.push_back(MaterialDescriptor {});
+            }
+            descriptor = &descriptors[material_indices[name]];
+            // The defaults of the Assimp OBJ materials
+            descriptor->name = name;
+            descriptor->albedo_value = 0.6f;
+            descriptor->reflectance_value = 0;
+        }
+        else if (descriptor == nullptr) {
+        }
+        else if (StartsWithKeyword(p, line_end, "Kd")) {
+            p = ParseFloat(p + 2, line_end, descriptor->albedo_value.x);
+            p = ParseFloat(p, line_end, descriptor->albedo_value.y);
+            p = ParseFloat(p, line_end, descriptor->albedo_value.z);
+        }
+        else if (StartsWithKeyword(p, line_end, "Ks")) {
+            p = ParseFloat(p + 2, line_end, descriptor->reflectance_value.x);
+            p = ParseFloat(p, line_end, descriptor->reflectance_value.y);
+            p = ParseFloat(p, line_end, descriptor->reflectance_value.z);
+        }
+        else if (StartsWithKeyword(p, line_end, "map_Kd")) {
+            descriptor->albedo_path = GetLineArgument(p + 6, line_end);
+        }
+        else if (StartsWithKeyword(p, line_end, "map_Ks")) {
+            descriptor->specular_path = GetLineArgument(p + 6, line_end);
+        }
+        else if (StartsWithKeyword(p, line_end, "map_bump") || StartsWithKeyword(p, line_end, "map_Bump")) {
+            descriptor->normal_path = GetLineArgument(p + 8, line_end);
+        }
+        else if (StartsWithKeyword(p, line_end, "bump")) {
+            descriptor->normal_path = GetLineArgument(p + 4, line_end);
+        }
+
+        p = line_end + 1;
+    }
+
+    return true;
+}
+
+/**
+ * Sum of the face normals around each position, the cross products weighting them by the face area
+ * The faces of each position are listed first so the positions are summed in parallel without contention
+ */
+static void ComputeSmoothNormals(const vector<Vec3>& pos_array, const vector<unsigned int>& index_array,
+                                 const vector<int>& vertex_positions, int position_count, vector<Vec3>& smooth_normals) {
+
+    int triangle_count = (int) (index_array.size() / 3);
+
+    vector<Vec3> face_normals((size_t) triangle_count);
+
+#pragma omp parallel for
+    for (int i = 0; i < triangle_count; ++i) {
+        const Vec3& A = pos_array[index_array[i * 3 + 0]];
+        const Vec3& B = pos_array[index_array[i * 3 + 1]];
+        const Vec3& C = pos_array[index_array[i * 3 + 2]];
+        face_normals[i] = (B - A).cross(C - A);
+    }
+
+    vector<int> first_face((size_t) position_count + 1, 0);
+    for (unsigned int index : index_array) {
+        first_face[vertex_positions[index] + 1]++;
+    }
+    for (int i = 0; i < position_count; ++i) {
+        first_face[i + 1] += first_face[i];
+    }
+
+    vector<int> faces(index_array.size());
+    vector<int> fill_offsets(first_face.begin(), first_face.end() - 1);
+    for (size_t i = 0; i < index_array.size(); ++i) {
+        faces[fill_offsets[vertex_positions[index_array[i]]]++] = (int) (i / 3);
+    }
+
+    smooth_normals.resize((size_t) position_count);
+
+#pragma omp parallel for
+    for (int i = 0; i < position_count; ++i) {
+
+        Vec3 normal;
+        for (int face = first_face[i]; face < first_face[i + 1]; ++face) {
+            normal += face_normals[faces[face]];
+        }
+
+        // A position of degenerate faces only
+        smooth_normals[i] = (normal.lengthSquared() > 0) ? normal.normalize() : Vec3 {0, 0, 1};
+    }
+}
+
+/**
+ * Per vertex sum of the uv derivatives of its faces, then made orthogonal to the normal
+ * The frame follows the uvs of the file, as Assimp computes it before flipping them
+ */
+static void ComputeTangents(const vector<Vec3>& pos_array, const vector<Vec3>& normal_array, const vector<Vec3>& uv_array,
+                            const vector<unsigned int>& index_array, vector<Vec3>& tangent_array, vector<Vec3>& bitangent_array) {
+
+    int triangle_count = (int) (index_array.size() / 3);
+    int vertex_count = (int) pos_array.size();
+
+    vector<Vec3> face_tangents((size_t) triangle_count);
+    vector<Vec3> face_bitangents((size_t) triangle_count);
+
+#pragma omp parallel for
+    for (int i = 0; i < triangle_count; ++i) {
+
+        unsigned int a = index_array[i * 3 + 0];
+        unsigned int b = index_array[i * 3 + 1];
+        unsigned int c = index_array[i * 3 + 2];
+
+        Vec3 edge1 = pos_array[b] - pos_array[a];
+        Vec3 edge2 = pos_array[c] - pos_array[a];
+        float du1 = uv_array[b].x - uv_array[a].x;
+        float du2 = uv_array[c].x - uv_array[a].x;
+        float dv1 = uv_array[a].y - uv_array[b].y;
+        float dv2 = uv_array[a].y - uv_array[c].y;
+
+        // Only the orientation of the uv mapping is kept, tiny uv triangles would dominate the sums otherwise
+        float direction = (du1 * dv2 - du2 * dv1 < 0) ? -1.f : 1.f;
+
+        face_tangents[i] = (edge1 * dv2 - edge2 * dv1) * direction;
+        face_bitangents[i] = (edge2 * du1 - edge1 * du2) * direction;
+    }
+
+    vector<int> first_face((size_t) vertex_count + 1, 0);
+    for (unsigned int index : index_array) {
+        first_face[index + 1]++;
+    }
+    for (int i = 0; i < vertex_count; ++i) {
+        first_face[i + 1] += first_face[i];
+    }
+
+    vector<int> faces(index_array.size());
+    vector<int> fill_offsets(first_face.begin(), first_face.end() - 1);
+    for (size_t i = 0; i < index_array.size(); ++i) {
+        faces[fill_offsets[index_array[i]]++] = (int) (i / 3);
+    }
+
+    tangent_array.resize((size_t) vertex_count);
+    bitangent_array.resize((size_t) vertex_count);
+
+#pragma omp parallel for
+    for (int i = 0; i < vertex_count; ++i) {
+
+        Vec3 tangent;
+        Vec3 bitangent;
+        for (int face = first_face[i]; face < first_face[i + 1]; ++face) {
+            tangent += face_tangents[faces[face]];
+            bitangent += face_bitangents[faces[face]];
+        }
+
+        const Vec3& normal = normal_array[i];
+        tangent = tangent - normal * normal.dot(tangent);
+        bitangent = bitangent - normal * normal.dot(bitangent);
+
+        // Any frame around the normal when the uvs are degenerate
+        if (tangent.lengthSquared() > 0) {
+            tangent.normalize();
+        }
+        else {
+            tangent = normal.cross(std::abs(normal.x) < 0.9f ? Vec3 {1, 0, 0} : Vec3 {0, 1, 0}).normalize();
+        }
+
+        if (bitangent.lengthSquared() > 0) {
+            bitangent.normalize();
+        }
+        else {
+            bitangent = normal.cross(tangent);
+        }
+
+        tangent_array[i] = tangent;
+        bitangent_array[i] = bitangent;
+    }
+}
+
+static ObjAttribute GetAttribute(const char* p, const char* end) {
+
+    if (p == end || *p != 'v')
+        return NO_ATTRIBUTE;
+
+    if (StartsWithKeyword(p, end, "v"))
+        return POSITION_ATTRIBUTE;
+    if (StartsWithKeyword(p, end, "vt"))
+        return UV_ATTRIBUTE;
+    if (StartsWithKeyword(p, end, "vn"))
+        return NORMAL_ATTRIBUTE;
+
+    return NO_ATTRIBUTE;
+}
+
+static const char* SkipSpaces(const char* p, const char* end) {
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+
+    return p;
+}
+
+static const char* FindLineEnd(const char* p, const char* end) {
+
+    const char* line_end = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+
+    return (line_end != nullptr) ? line_end : end;
+}
+
+/**
+ * Decimal and scientific notations, the mantissa is accumulated as an integer and scaled once
+ * The value is left unchanged when there is no number
+ */
+static const char* ParseFloat(const char* p, const char* end, float& value) {
+
+    p = SkipSpaces(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digit_count = 0;
+
+    const char* start = p;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digit_count) {
+        if (mantissa < 1000000000000000000ULL)
+            mantissa = mantissa * 10 + (*p - '0');
+        else
+            exponent++;
+    }
+
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digit_count) {
+            if (mantissa < 1000000000000000000ULL) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+
+    if (digit_count == 0) {
+        // Not a number, or one of the rare nan and inf
+        if (p == start) {
+            char* number_end = nullptr;
+            string token(p, std::min(end, p + 32));
+            float parsed = std::strtof(token.c_str(), &number_end);
+            if (number_end != token.c_str()) {
+                value = negative ? -parsed : parsed;
+                return p + (number_end - token.c_str());
+            }
+        }
+        return p;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* exponent_start = p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            p++;
+        }
+        if (p < end && *p >= '0' && *p <= '9') {
+            int explicit_exponent = 0;
+            for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+                if (explicit_exponent < 10000)
+                    explicit_exponent = explicit_exponent * 10 + (*p - '0');
+            }
+            exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+        }
+        else {
+            p = exponent_start;
+        }
+    }
+
+    // The powers of 10 up to 1e22 are exact doubles
+    static const double POWERS_OF_10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    double result = double(mantissa);
+    if (exponent < 0 && exponent >= -22)
+        result /= POWERS_OF_10[-exponent];
+    else if (exponent > 0 && exponent <= 22)
+        result *= POWERS_OF_10[exponent];
+    else if (exponent != 0)
+        result *= std::pow(10.0, exponent);
+
+    value = float(negative ? -result : result);
+
+    return p;
+}
+
+static const char* ParseIndex(const char* p, const char* end, int& value) {
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    int64_t index = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+        if (index <= INT32_MAX)
+            index = index * 10 + (*p - '0');
+    }
+
+    // Out of range indices are made invalid rather than wrapped
+    index = std::min(index, int64_t(INT32_MAX));
+    value = int(negative ? -index : index);
+
+    return p;
+}
+
+// The keyword must be followed by a space, "f" must not match "foo"
+static bool StartsWithKeyword(const char* p, const char* end, const char* keyword) {
+
+    size_t length = strlen(keyword);
+
+    if (size_t(end - p) < length + 1 || memcmp(p, keyword, length) != 0)
+        return false;
+
+    return p[length] == ' ' || p[length] == '\t';
+}
+
+/**
+ * The rest of the line without the surrounding spaces, the names and paths can contain spaces
+ * The options of the texture maps are skipped, each option taking its numbers or on/off values
+ */
+static string GetLineArgument(const char* p, const char* end) {
+
+    p = SkipSpaces(p, end);
+
+    while (p < end && *p == '-') {
+
+        const char* option_end = p;
+        while (option_end < end && *option_end != ' ' && *option_end != '\t')
+            option_end++;
+
+        p = SkipSpaces(option_end, end);
+
+        while (p < end) {
+            const char* value_end = p;
+            while (value_end < end && *value_end != ' ' && *value_end != '\t')
+                value_end++;
+
+            string token(p, value_end);
+            float number = 0;
+            bool is_value = token == "on" || token == "off" || ParseFloat(p, value_end, number) == value_end;
+            if (is_value == false || value_end == end)
+                break;
+
+            p = SkipSpaces(value_end, end);
+        }
+    }
+
+    const char* last = end;
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+        last--;
+
+    return string(p, last);
+}
@@ -0,0 +1,26 @@
+#ifndef PATHTRACER_OBJLOADER_H
+#define PATHTRACER_OBJLOADER_H
+
+#include <string>
+
+class TriMesh;
+
+/**
+ * Native Wavefront OBJ/MTL importer
+ * The file is memory-mapped and split into line-aligned chunks parsed in parallel, straight into the TriMesh arrays
+ * It gives what the Assimp import gives: identical vertices joined, flipped uvs, smooth normals and tangents computed
+ * when the file has none, and the triangles grouped by material with one submesh per material
+ * A file it can't read makes it return false, the caller falls back to Assimp then
+ */
+class ObjLoader {
+
+public:
+
+    /**
+     * @param directory Directory the texture paths of the materials are relative to
+     * @param import_instances Adds an identity instance of each submesh, OBJ files having no node graph
+     */
+    static bool Load(const std::string& filename, const std::string& directory, bool import_instances, TriMesh& trimesh);
+};
+
+#endif //PATHTRACER_OBJLOADER_H
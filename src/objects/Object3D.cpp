@@ -1,6 +1,6 @@
 #include "Object3D.h"
 
-#include "Triangle.h"
+#include "TriMesh.h"
 
 Object3D::Object3D() {
 //    Vec3 albedo = Vec3{(std::rand() % 1000) / 1000.f, (std::rand() % 1000) / 1000.f, (std::rand() % 1000) / 1000.f};
@@ -16,19 +16,46 @@ Object3D::Object3D(const Vec3& origin) {
 //    material = new LambertianMaterial(albedo);
 }
 
-std::vector<std::unique_ptr<Object3D>> Object3D::CreateTriMesh(std::string filename, std::string directory) {
+Object3D* Object3D::CreateTriMesh(std::string filename, std::string directory, bool import_instances) {
 
-    TriMesh* mesh = new TriMesh{filename, directory};
-    std::vector<Triangle>& triangles = mesh->GetTriangles();
+    Object3D* obj = new Object3D;
+    obj->trimesh = new TriMesh{filename, directory, import_instances};
 
-    std::vector<std::unique_ptr<Object3D>> objects;
+    return obj;
+}
+
+int Object3D::GetPrimitiveCount() const {
+
+    if (trimesh != nullptr)
+        return trimesh->GetTriangleCount();
+
+    return 1;
+}
+
+void Object3D::AppendPrimitives(std::vector<Primitive>& primitives) {
+
+    if (trimesh == nullptr) {
+        primitives.push_back(Primitive {this});
+        return;
+    }
 
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        Object3D* obj = new Object3D;
-        obj->shape = &triangles[i];
-        obj->material = mesh->GetTriangleMaterial(i);
-        objects.push_back(std::unique_ptr<Object3D>(obj));
+    for (int i = 0; i < trimesh->GetTriangleCount(); ++i) {
+        primitives.push_back(Primitive {this, i});
     }
+}
+
+BoundingBox Object3D::ComputeBBox() const {
+
+    if (trimesh != nullptr)
+        return trimesh->ComputeBBox();
+
+    return shape->ComputeBBox();
+}
+
+Vec3 Object3D::GetCenter() const {
+
+    if (trimesh != nullptr)
+        return trimesh->ComputeBBox().GetCenter();
 
-    return objects;
+    return shape->GetCenter();
 }
@@ -10,6 +10,9 @@
 #include "Sphere.h"
 #include "Plane.h"
 #include "BoundingBox.h"
+#include "Primitive.h"
+
+typedef struct TriMesh TriMesh;
 
 class Object3D {
 
@@ -21,8 +24,9 @@ protected:
 
 public:
 
-    Intersectable* shape = nullptr;
-    Material* material = nullptr;
+    Intersectable* shape = nullptr;     // nullptr for a mesh
+    Material* material = nullptr;       // The triangles of a mesh have their own
+    TriMesh* trimesh = nullptr;         // Set for a mesh, its triangles are the primitives of the object
     //TODO: Remove these
     Brdf* brdf;
     Brdf* spec;
@@ -41,7 +45,13 @@ public:
         return obj;
     }
 
-    static std::vector<std::unique_ptr<Object3D>> CreateTriMesh(std::string filename, std::string directory = "");
+    // A single object for the whole mesh, the BVHs reference its triangles by their index
+    static Object3D* CreateTriMesh(std::string filename, std::string directory = "", bool import_instances = false);
+
+    int GetPrimitiveCount() const;
+
+    // The triangles of a mesh, the object itself for the other shapes
+    void AppendPrimitives(std::vector<Primitive>& primitives);
 
     bool Intersect(const Ray& ray, float& dist_out) {
         return shape->Intersect(ray, dist_out);
@@ -53,15 +63,14 @@ public:
         return surface_data;
     }
 
-    virtual BoundingBox ComputeBBox() const {
-        return shape->ComputeBBox();
-    }
+    virtual BoundingBox ComputeBBox() const;
 
-    virtual Vec3 GetCenter() const {
-//        return shape->ComputeBBox().GetCenter();
-        return shape->GetCenter();
+    BoundingBox ComputeClippedBBox(char axis, float min, float max) const {
+        return shape->ComputeClippedBBox(axis, min, max);
     }
 
+    virtual Vec3 GetCenter() const;
+
     //TODO: Clean this in an EmissiveMaterial ?
     void setEmission(const Vec3& color, float intensity = 1) {
         float max = color.max();
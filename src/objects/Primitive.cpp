@@ -0,0 +1,75 @@
+#include "Primitive.h"
+
+#include "Object3D.h"
+#include "Triangle.h"
+#include "TriMesh.h"
+#include "core/Material.h"
+
+Triangle Primitive::GetTriangle() const {
+    return object->trimesh->GetTriangle(index);
+}
+
+bool Primitive::Intersect(const Ray& ray, float& dist_out) const {
+
+    if (IsTriangle())
+        return GetTriangle().Intersect(ray, dist_out);
+
+    return object->Intersect(ray, dist_out);
+}
+
+SurfaceData Primitive::GetSurfaceData(Vec3 pos, Vec3 ray_direction) const {
+
+    if (IsTriangle()) {
+        SurfaceData surface_data = GetTriangle().GetSurfaceData(pos, ray_direction);
+        surface_data.material = GetMaterial();
+        return surface_data;
+    }
+
+    return object->GetSurfaceData(pos, ray_direction);
+}
+
+SurfaceData Primitive::GetSurfaceData(float u, float v, Vec3 pos, Vec3 ray_direction) const {
+
+    if (IsTriangle()) {
+        Material* material = GetMaterial();
+        int attributes = (material != nullptr) ? material->GetSurfaceAttributes() : ALL_SURFACE_ATTRIBUTES;
+
+        SurfaceData surface_data = GetTriangle().GetSurfaceData(u, v, attributes);
+        surface_data.material = material;
+        return surface_data;
+    }
+
+    return object->GetSurfaceData(pos, ray_direction);
+}
+
+BoundingBox Primitive::ComputeBBox() const {
+
+    if (IsTriangle())
+        return GetTriangle().ComputeBBox();
+
+    return object->ComputeBBox();
+}
+
+BoundingBox Primitive::ComputeClippedBBox(char axis, float min, float max) const {
+
+    if (IsTriangle())
+        return GetTriangle().ComputeClippedBBox(axis, min, max);
+
+    return object->ComputeClippedBBox(axis, min, max);
+}
+
+Vec3 Primitive::GetCenter() const {
+
+    if (IsTriangle())
+        return GetTriangle().GetCenter();
+
+    return object->GetCenter();
+}
+
+Material* Primitive::GetMaterial() const {
+
+    if (IsTriangle())
+        return object->trimesh->GetTriangleMaterial(index);
+
+    return object->material;
+}
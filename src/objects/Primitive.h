@@ -0,0 +1,59 @@
+#ifndef PATHTRACER_PRIMITIVE_H
+#define PATHTRACER_PRIMITIVE_H
+
+#include "BoundingBox.h"
+
+#include <vector>
+
+typedef struct Object3D Object3D;
+class Material;
+class Triangle;
+
+/**
+ * What the BVH leaves reference, a triangle of a mesh object addressed by its index in the mesh,
+ * or a whole object for the other shapes
+ * The triangles of a mesh have no object of their own, so the scene memory only grows with the mesh arrays
+ */
+struct Primitive {
+
+    Object3D* object = nullptr;
+    int index = -1;     // Triangle of the object mesh, -1 when the object isn't a mesh
+
+    Primitive() = default;
+
+    Primitive(Object3D* object, int index = -1)
+            : object(object), index(index) {
+    }
+
+    bool operator==(const Primitive& rhs) const {
+        return object == rhs.object && index == rhs.index;
+    }
+
+    bool operator!=(const Primitive& rhs) const {
+        return !(*this == rhs);
+    }
+
+    bool IsTriangle() const {
+        return index != -1;
+    }
+
+    // Only for a triangle
+    Triangle GetTriangle() const;
+
+    bool Intersect(const Ray& ray, float& dist_out) const;
+
+    SurfaceData GetSurfaceData(Vec3 pos, Vec3 ray_direction) const;
+
+    // A triangle interpolates from the barycentric weights of the hit only the attributes its material reads
+    SurfaceData GetSurfaceData(float u, float v, Vec3 pos, Vec3 ray_direction) const;
+
+    BoundingBox ComputeBBox() const;
+
+    BoundingBox ComputeClippedBBox(char axis, float min, float max) const;
+
+    Vec3 GetCenter() const;
+
+    Material* GetMaterial() const;
+};
+
+#endif //PATHTRACER_PRIMITIVE_H
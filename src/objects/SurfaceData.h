@@ -5,6 +5,13 @@
 
 typedef struct Material Material;
 
+// Vertex attributes a material reads from the surface data, the normal is always interpolated
+enum SurfaceAttributes : int {
+    SURFACE_UV              = 1 << 0,
+    SURFACE_TANGENT_FRAME   = 1 << 1,   // Tangent and bitangent, for the normal maps applied in the mesh tangent space
+    ALL_SURFACE_ATTRIBUTES  = SURFACE_UV | SURFACE_TANGENT_FRAME
+};
+
 struct SurfaceData {
     Material* material;
     Vec3 normal;
@@ -1,12 +1,16 @@
 #include "TriMesh.h"
 
 #include "Triangle.h"
+#include "ObjLoader.h"
+#include "GltfLoader.h"
+#include "core/GeometryStream.h"
 
 #include "assimp/scene.h"
 #include "assimp/Importer.hpp"
 #include "assimp/postprocess.h"
 
 #include <chrono>
+#include <cstdlib>
 #include "app/Chronometer.h"
 
 using std::string;
@@ -22,11 +26,62 @@ float FindSphereBoundRadius(const vector<Vec3>& pos_array);
 // We flatten it to an array of unsigned int for OpenGL consumption
 vector<unsigned int> CreateFlattenIndexArray(const aiFace* face_array, const unsigned int face_count) ;
 
-TriMesh::TriMesh(const string& filename, string directory) {
+TriMesh::TriMesh(const string& filename, string directory, bool import_instances) {
 
-    Assimp::Importer Importer;
     cout << "Loading [" + filename + "] mesh..." << endl;
 
+    // Use the file directory to search for materials if no directory was passed in argument
+    if (directory.empty()) {
+        directory = filename.substr(0, filename.find_last_of('/')) + "/";
+    }
+    
+    string ext = filename.substr(filename.find_last_of('.'));
+    
+    
+    Chronometer chrono;
+
+    // The native importers read the OBJ and glTF files in parallel, Assimp imports the other formats and the files they reject
+    bool imported = false;
+    if (ext == ".obj") {
+        imported = ObjLoader::Load(filename, directory, import_instances, *this);
+        if (imported)
+            cout << "OBJ import: " << chrono.GetSeconds() << " s" << endl;
+        else
+            cout << "Native OBJ import failed, using Assimp" << endl;
+    }
+    else if (ext == ".gltf" || ext == ".glb") {
+        imported = GltfLoader::Load(filename, directory, import_instances, *this);
+        if (imported)
+            cout << "glTF import: " << chrono.GetSeconds() << " s" << endl;
+        else
+            cout << "Native glTF import failed, using Assimp" << endl;
+    }
+
+    if (imported == false)
+        ImportAssimp(filename, directory, ext, import_instances);
+
+    if (import_instances) {
+        cout << instances.size() << " instances of " << submeshes.size() << " meshes" << endl;
+    }
+    
+    
+    chrono.Restart();
+
+    float radius = FindSphereBoundRadius(pos_array);
+
+    cout << "Bounds scan: " << chrono.GetSeconds() << " s" << endl;
+
+
+    sphere_bounds = Sphere {0, 0, 0, radius};
+}
+
+/**
+ * Without import_instances, the meshes are pre-transformed so every instance of a mesh becomes unique triangles
+ */
+void TriMesh::ImportAssimp(const string& filename, const string& directory, const string& ext, bool import_instances) {
+
+    Assimp::Importer Importer;
+
     unsigned int flags = 0
                          | aiProcess_Triangulate
                          | aiProcess_FindInvalidData
@@ -41,14 +96,12 @@ TriMesh::TriMesh(const string& filename, string directory) {
                          | aiProcess_PreTransformVertices
 
     ;
-    
-    // Use the file directory to search for materials if no directory was passed in argument
-    if (directory.empty()) {
-        directory = filename.substr(0, filename.find_last_of('/')) + "/";
+
+    // Keep the node graph which places the instances of each mesh
+    if (import_instances) {
+        flags &= ~(aiProcess_PreTransformVertices | aiProcess_OptimizeGraph | aiProcess_OptimizeMeshes);
     }
     
-    string ext = filename.substr(filename.find_last_of('.'));
-    
     
     Chronometer chrono;
 
@@ -66,17 +119,11 @@ TriMesh::TriMesh(const string& filename, string directory) {
 
     ImportAssimpMesh(pScene, directory, ext);
 
-    cout << "Import: " << chrono.GetSeconds() << " s" << endl;
-    
-    
-    chrono.Restart();
-
-    float radius = FindSphereBoundRadius(pos_array);
-
-    cout << "Bounds scan: " << chrono.GetSeconds() << " s" << endl;
-
+    if (import_instances) {
+        ImportAssimpInstances(pScene->mRootNode, Matrix {});
+    }
 
-    sphere_bounds = Sphere {0, 0, 0, radius};
+    cout << "Import: " << chrono.GetSeconds() << " s" << endl;
 }
 
 void TriMesh::ImportAssimpMesh(const aiScene *ai_scene, std::string directory, std::string ext) {
@@ -118,6 +165,9 @@ void TriMesh::ImportAssimpMesh(const aiScene *ai_scene, std::string directory, s
             index += vertex_total;
         }
 
+        unsigned int first_triangle = (unsigned int) (index_array.size() / 3);
+        submeshes.push_back(SubMesh {first_triangle, (unsigned int) (mesh_index_array.size() / 3)});
+
         index_array.insert(index_array.end(), mesh_index_array.begin(), mesh_index_array.end());
 
         for (size_t tri = 0; tri < mesh_index_array.size(); tri += 3) {
@@ -129,19 +179,230 @@ void TriMesh::ImportAssimpMesh(const aiScene *ai_scene, std::string directory, s
 
     vertex_count = vertex_total;
 
-    for (size_t tri = 0; tri < index_array.size(); tri += 3) {
-        triangles.emplace_back(Triangle {&index_array[tri], this});
+    int32_t workflow = (ext == ".gltf" || ext == ".glb") ? MaterialDescriptor::METALLIC_WORKFLOW : MaterialDescriptor::LEGACY_WORKFLOW;
+
+    material_descriptors.clear();
+    for (size_t i = 0; i < ai_scene->mNumMaterials; ++i) {
+        material_descriptors.push_back(MaterialDescriptor::FromAssimp(ai_scene->mMaterials[i], workflow));
+    }
+
+    CreateMaterials(directory);
+}
+
+/**
+ * The textures are decoded in parallel first, once each even when several materials share one
+ * @param embedded_images The images embedded in the model file, by image index
+ */
+void TriMesh::CreateMaterials(const std::string& directory, const vector<EncodedImage>& embedded_images) {
+
+    std::set<std::pair<string, bool>> key_set;
+    for (const MaterialDescriptor& descriptor : material_descriptors) {
+        descriptor.GetTextureKeys(directory, key_set);
     }
 
-    materials = vector<unique_ptr<Material>>(ai_scene->mNumMaterials);
+    vector<std::pair<string, bool>> keys {key_set.begin(), key_set.end()};
+    vector<std::shared_ptr<Texture>> textures(keys.size());
+    std::atomic_bool has_failed {false};
+
+    if (keys.empty() == false)
+        LoadImageDecoders();
+
+    Chronometer chrono;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < int(keys.size()); ++i) {
+
+        const string& path = keys[i].first;
+        bool store_in_linear = keys[i].second;
+
+        // An exception can't leave the parallel region, it is thrown again after it
+        try {
+            if (MaterialDescriptor::IsEmbedded(path)) {
+                size_t image = std::strtoul(path.c_str() + 1, nullptr, 10);
+                if (image >= embedded_images.size() || embedded_images[image].data == nullptr) {
+                    std::cerr << "Embedded image [" << path << "] not found" << endl;
+                    throw std::bad_exception();
+                }
+                textures[i] = std::make_shared<TextureUbyte>(path, embedded_images[image], store_in_linear);
+            }
+            else {
+                textures[i] = std::make_shared<TextureUbyte>(path, store_in_linear);
+            }
+        }
+        catch (...) {
+            has_failed = true;
+        }
+    }
+
+    if (has_failed)
+        throw std::bad_exception();
+
+    if (keys.empty() == false)
+        cout << keys.size() << " textures decoded in " << chrono.GetSeconds() << " s" << endl;
+
+    TextureMap texture_map;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        texture_map[keys[i]] = textures[i];
+    }
+
+    materials = vector<unique_ptr<Material>>(material_descriptors.size());
 
     for (size_t i = 0; i < materials.size(); ++i) {
-        if (ext == ".gltf")
-            materials[i] = unique_ptr<Material>(new MetallicWorkflow(ai_scene->mMaterials[i], directory));
-        else
-            materials[i] = unique_ptr<Material>(new OldMaterial(ai_scene->mMaterials[i], directory));
+        materials[i] = unique_ptr<Material>(material_descriptors[i].CreateMaterial(directory, texture_map));
+    }
+}
+
+/**
+ * Walk the node graph to place each mesh referenced by a node with the transforms accumulated from the root
+ */
+void TriMesh::ImportAssimpInstances(const aiNode* ai_node, const Matrix& parent_transform) {
+
+    // Both are row-major, a1..a4 being the first row
+    const aiMatrix4x4& node_transform = ai_node->mTransformation;
+    Matrix transform;
+    for (int row = 0; row < 4; ++row) {
+        for (int column = 0; column < 4; ++column) {
+            transform[row][column] = node_transform[row][column];
+        }
+    }
+    transform = Matrix {parent_transform} * transform;
+
+    for (unsigned int i = 0; i < ai_node->mNumMeshes; ++i) {
+        instances.push_back(SubMeshInstance {ai_node->mMeshes[i], transform});
+    }
+
+    for (unsigned int i = 0; i < ai_node->mNumChildren; ++i) {
+        ImportAssimpInstances(ai_node->mChildren[i], transform);
+    }
+}
+
+// Out of line for the unique_ptr of the incomplete GeometryStream
+TriMesh::TriMesh() = default;
+
+TriMesh::TriMesh(vector<Vec3> positions, vector<Vec3> normals, vector<unsigned int> indices)
+        : pos_array{std::move(positions)}, normal_array{std::move(normals)}, index_array{std::move(indices)} {
+
+    vertex_count = (unsigned int) pos_array.size();
+
+    material_descriptors.emplace_back();
+    triangle_to_material.assign(GetTriangleCount(), 0);
+    CreateMaterials("");
+
+    sphere_bounds = Sphere {0, 0, 0, FindSphereBoundRadius(pos_array)};
+}
+
+TriMesh::~TriMesh() = default;
+
+Triangle TriMesh::GetTriangle(int i) const {
+    return Triangle {&index_array[3 * i], this, i};
+}
+
+vector<Material*> TriMesh::GetMaterials() const {
+
+    vector<Material*> material_pointers;
+    material_pointers.reserve(materials.size());
+    for (const auto& material : materials) {
+        material_pointers.push_back(material.get());
+    }
+
+    return material_pointers;
+}
+
+BoundingBox TriMesh::ComputeBBox() const {
+
+    BoundingBox bbox;
+
+    for (const Vec3& position : pos_array) {
+        bbox.ExtendsBy(position);
     }
 
+    return bbox;
+}
+
+/**
+ * The bitangent sign tells whether the uv mapping is mirrored, the bitangent direction is then normal x tangent
+ */
+void TriMesh::CompressVertexAttributes() {
+
+    if (compact_attributes)
+        return;
+
+    Chronometer chrono;
+    size_t full_memory = GetVertexAttributeMemory();
+
+    packed_normal_array.reserve(normal_array.size());
+    for (const Vec3& normal : normal_array) {
+        packed_normal_array.push_back(EncodeOctahedral(normal));
+    }
+
+    packed_uv_array.reserve(uv_array.size());
+    for (const Vec3& uv : uv_array) {
+        packed_uv_array.push_back(EncodeHalfUV(uv));
+    }
+
+    packed_tangent_array.reserve(tangent_array.size());
+    bitangent_sign_array.reserve(tangent_array.size());
+    for (size_t i = 0; i < tangent_array.size(); ++i) {
+        packed_tangent_array.push_back(EncodeOctahedral(tangent_array[i]));
+        bitangent_sign_array.push_back(int8_t((normal_array[i].cross(tangent_array[i]).dot(bitangent_array[i]) < 0) ? -1 : 1));
+    }
+
+    // Swapped with empty vectors to release their memory
+    vector<Vec3>().swap(normal_array);
+    vector<Vec3>().swap(uv_array);
+    vector<Vec3>().swap(tangent_array);
+    vector<Vec3>().swap(bitangent_array);
+
+    compact_attributes = true;
+
+    cout << "Vertex attributes compressed in " << chrono.GetMilliseconds() << " ms: "
+         << GetVertexAttributeMemory() / 1024 << " Ko instead of " << full_memory / 1024 << " Ko" << endl;
+}
+
+size_t TriMesh::GetVertexAttributeMemory() const {
+
+    if (compact_attributes) {
+        return (packed_normal_array.size() + packed_uv_array.size() + packed_tangent_array.size()) * sizeof(uint32_t)
+               + bitangent_sign_array.size() * sizeof(int8_t);
+    }
+
+    return (normal_array.size() + uv_array.size() + tangent_array.size() + bitangent_array.size()) * sizeof(Vec3);
+}
+
+void TriMesh::StreamVertexAttributes(unique_ptr<GeometryStream> geometry_stream) {
+
+    size_t released_memory = GetVertexAttributeMemory();
+
+    // Swapped with empty vectors to release their memory
+    vector<Vec3>().swap(normal_array);
+    vector<Vec3>().swap(uv_array);
+    vector<Vec3>().swap(tangent_array);
+    vector<Vec3>().swap(bitangent_array);
+    vector<uint32_t>().swap(packed_normal_array);
+    vector<uint32_t>().swap(packed_tangent_array);
+    vector<int8_t>().swap(bitangent_sign_array);
+    vector<uint32_t>().swap(packed_uv_array);
+
+    stream = std::move(geometry_stream);
+
+    cout << "Vertex attributes streamed from " << stream->GetClusterCount() << " clusters: "
+         << released_memory / 1024 << " Ko released" << endl;
+}
+
+bool TriMesh::HasUV() const {
+
+    if (stream != nullptr)
+        return stream->HasUV();
+
+    return compact_attributes ? !packed_uv_array.empty() : !uv_array.empty();
+}
+
+bool TriMesh::HasTangents() const {
+
+    if (stream != nullptr)
+        return stream->HasTangents();
+
+    return compact_attributes ? !packed_tangent_array.empty() : !tangent_array.empty();
 }
 
 /**
@@ -5,9 +5,24 @@
 #include <set>
 #include "Object3D.h"
 #include "Sphere.h"
+#include "math/Quantization.h"
 
 class Triangle;
+class GeometryStream;
 typedef struct aiScene aiScene;
+typedef struct aiNode aiNode;
+
+// Triangles of one of the meshes of the imported file
+struct SubMesh {
+    unsigned int first_triangle;
+    unsigned int triangle_count;
+};
+
+// Placement of a submesh in the scene
+struct SubMeshInstance {
+    unsigned int submesh;
+    Matrix transform;
+};
 
 class TriMesh {
 
@@ -19,9 +34,24 @@ class TriMesh {
     std::vector<unsigned int> index_array;
     unsigned int vertex_count = 0;
 
+    // Compact layout of the attributes, replaces the arrays above once CompressVertexAttributes is called
+    // 13 bytes per vertex instead of 48, the positions are kept at full precision for the intersection tests
+    bool compact_attributes = false;
+    std::vector<uint32_t> packed_normal_array;      // Octahedral
+    std::vector<uint32_t> packed_tangent_array;     // Octahedral
+    std::vector<int8_t> bitangent_sign_array;       // The bitangent is rebuilt as sign * normal x tangent
+    std::vector<uint32_t> packed_uv_array;          // Two halfs
+
+    // Set by StreamVertexAttributes, the attribute arrays above are empty then and the attributes are read through it
+    std::unique_ptr<GeometryStream> stream;
+
     std::vector<std::unique_ptr<Material>> materials;
-    std::vector<Triangle> triangles;
+    // What each material was created from, kept for the mesh cache
+    std::vector<MaterialDescriptor> material_descriptors;
     std::vector<unsigned int> triangle_to_material;
+    std::vector<SubMesh> submeshes;
+    // Only filled when importing the instances, the vertices are in the space of their submesh then
+    std::vector<SubMeshInstance> instances;
 
     static std::atomic_int triangle_test_count;
     static std::atomic_int triangle_hit_count;
@@ -31,28 +61,122 @@ class TriMesh {
 public:
 
     friend class OpenCLRenderer;
+    friend class GeometryStream;
+    friend class GltfLoader;
+    friend class MeshCache;
+    friend class ObjLoader;
     friend class SceneAdapter;
     friend class Triangle;
-    friend CLObject3D GetCLObject3D(const Object3D& object);
+    friend CLObject3D GetCLObject3D(const Primitive& primitive);
     friend std::ostream& operator<< (std::ostream& out, const Triangle& tri);
     
-    TriMesh() = default;
-    TriMesh(const std::string& filename, std::string directory = "");
+    TriMesh();
+    TriMesh(const std::string& filename, std::string directory = "", bool import_instances = false);
+    // Generated geometry, a default material for all the triangles
+    TriMesh(std::vector<Vec3> positions, std::vector<Vec3> normals, std::vector<unsigned int> indices);
+    ~TriMesh();
     
+    void ImportAssimp(const std::string& filename, const std::string& directory, const std::string& ext, bool import_instances);
+
     void ImportAssimpMesh(const aiScene *ai_scene, std::string directory, std::string ext);
+
+    void ImportAssimpInstances(const aiNode* ai_node, const Matrix& parent_transform);
+
+    // Create the materials of the material descriptors, their texture paths are relative to the directory
+    void CreateMaterials(const std::string& directory, const std::vector<EncodedImage>& embedded_images = {});
     
-    std::vector<Triangle>& GetTriangles() {
-        return triangles;
+    int GetTriangleCount() const {
+        return (int) (index_array.size() / 3);
     }
 
-    Material* GetTriangleMaterial(int i) {
+    Triangle GetTriangle(int i) const;
+
+    Material* GetTriangleMaterial(int i) const {
         return materials[triangle_to_material[i]].get();
     }
 
+    std::vector<Material*> GetMaterials() const;
+
+    BoundingBox ComputeBBox() const;
+
+    /**
+     * Replace the normals, tangents, bitangents and uvs by their compact encodings
+     * The getters below decode them on the fly
+     */
+    void CompressVertexAttributes();
+
+    // Memory of the normals, tangents, bitangents and uvs in their current layout
+    size_t GetVertexAttributeMemory() const;
+
+    /**
+     * Release the normals, tangents, bitangents and uvs, the stream holding them is read instead
+     * The getters below are only valid while the attributes are resident, the triangles acquire their cluster from the stream
+     */
+    void StreamVertexAttributes(std::unique_ptr<GeometryStream> geometry_stream);
+
+    bool IsStreamed() const {
+        return stream != nullptr;
+    }
+
+    GeometryStream* GetStream() const {
+        return stream.get();
+    }
+
+    bool HasCompactAttributes() const {
+        return compact_attributes;
+    }
+
+    bool HasUV() const;
+
+    bool HasTangents() const;
+
+    Vec3 GetNormal(unsigned int vertex) const {
+        return compact_attributes ? DecodeOctahedral(packed_normal_array[vertex]) : normal_array[vertex];
+    }
+
+    Vec3 GetUV(unsigned int vertex) const {
+        return compact_attributes ? DecodeHalfUV(packed_uv_array[vertex]) : uv_array[vertex];
+    }
+
+    void GetTangentFrame(unsigned int vertex, Vec3& tangent, Vec3& bitangent) const {
+        if (compact_attributes) {
+            tangent = DecodeOctahedral(packed_tangent_array[vertex]);
+            bitangent = GetNormal(vertex).cross(tangent) * bitangent_sign_array[vertex];
+        }
+        else {
+            tangent = tangent_array[vertex];
+            bitangent = bitangent_array[vertex];
+        }
+    }
+
+    const std::vector<uint32_t>& GetPackedNormalArray() const {
+        return packed_normal_array;
+    }
+
+    const std::vector<uint32_t>& GetPackedUVArray() const {
+        return packed_uv_array;
+    }
+
+    const std::vector<Vec3>& GetPosArray() const {
+        return pos_array;
+    }
+
+    const std::vector<unsigned int>& GetIndexArray() const {
+        return index_array;
+    }
+
     unsigned int GetVertexCount() const {
         return vertex_count;
     }
 
+    const std::vector<SubMesh>& GetSubMeshes() const {
+        return submeshes;
+    }
+
+    const std::vector<SubMeshInstance>& GetInstances() const {
+        return instances;
+    }
+
     static void ClearCounters() {
         triangle_test_count = 0;
         triangle_hit_count = 0;
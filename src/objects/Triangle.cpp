@@ -2,40 +2,21 @@
 
 #include "TriMesh.h"
 #include "BoundingBox.h"
+#include "core/TriangleRecord.h"
+#include "core/GeometryStream.h"
 
-bool Triangle::Intersect(const Ray& ray, float& dist_out) const {
-
-    Vec3 A = trimesh_ptr->pos_array[A_index];
-    Vec3 B = trimesh_ptr->pos_array[B_index];
-    Vec3 C = trimesh_ptr->pos_array[C_index];
-
-    Vec3 normal = (B - A).cross(C - A).normalize();
-    Vec3 _origin = A;
-
-    // Using the opposite of the plane normal
-    float denominator = 1 / -normal.dot(ray.direction);
+template <typename Attributes>
+static SurfaceData InterpolateSurfaceData(const Attributes& vertices, unsigned int A, unsigned int B, unsigned int C, float U, float V, int attributes);
 
-    // Single-sided intersection: don't intersect if normal is pointing away from the ray
-//    if (denominator <= 0)
-//        return false;
-
-    dist_out = -normal.dot(_origin - ray.origin) * denominator;
-
-    if (dist_out <= 0.000001f)
-        return false;
-
-    Vec3 hit_pos = ray.origin + ray.direction * dist_out;
-
-    bool is_left_of_AB = (B - A).cross(hit_pos - A).dot(normal) > 0;
-    bool is_left_of_BC = (C - B).cross(hit_pos - B).dot(normal) > 0;
-    bool is_left_of_CA = (A - C).cross(hit_pos - C).dot(normal) > 0;
+bool Triangle::Intersect(const Ray& ray, float& dist_out) const {
 
-    bool is_inside = is_left_of_AB && is_left_of_BC && is_left_of_CA;
+    Vec3 A, B, C;
+    GetVertices(A, B, C);
 
-    return is_inside;
+    float u, v;
+    return TriangleRecord {A, B, C}.Intersect(ray, dist_out, u, v);
 }
 
-
 /*
  * Compute U, V, W, which are the barycentric coordinates of the point P in the triangle
  * U = Aire[ACP] / Aire[ABC]    U * B
@@ -43,12 +24,12 @@ bool Triangle::Intersect(const Ray& ray, float& dist_out) const {
  * W = Aire[BCP] / Aire[ABC]    W * A
  *
  * P = (U * B) + (V * C) + (W * A)
+ *
+ * Only for the callers without a hit record, the traversals already give U and V
  */
 
 SurfaceData Triangle::GetSurfaceData(Vec3 pos, Vec3 ray_direction) const {
 
-    SurfaceData surface_data;
-
     Vec3 A = trimesh_ptr->pos_array[A_index];
     Vec3 B = trimesh_ptr->pos_array[B_index];
     Vec3 C = trimesh_ptr->pos_array[C_index];
@@ -59,36 +40,41 @@ SurfaceData Triangle::GetSurfaceData(Vec3 pos, Vec3 ray_direction) const {
 
     float ABC_area = AB.cross(-CA).length() / 2;
     float ABP_area = AB.cross(pos - A).length() / 2;
-    float BCP_area = BC.cross(pos - B).length() / 2;
     float CAP_area = CA.cross(pos - C).length() / 2;
 
     float U = CAP_area / ABC_area; // B
     float V = ABP_area / ABC_area; // C
-    float W = BCP_area / ABC_area; // A
 
-//    if ((U + V + W) - 1 > 0.001) {
-//        cout << "U+V+W = " << U + V + W << " (> 1 !)   U: " << U << " V: " << V << " W: " << W << endl;
-//    }
+    return GetSurfaceData(U, V, ALL_SURFACE_ATTRIBUTES);
+}
 
-    if (trimesh_ptr->uv_array.empty())
-        surface_data.uv = 0;
-    else
-        surface_data.uv =  (U * trimesh_ptr->uv_array[B_index]) + (V * trimesh_ptr->uv_array[C_index]) + (W * trimesh_ptr->uv_array[A_index]);
+/**
+ * The attributes of a streamed mesh are read from the cluster of the triangle, paged in if needed
+ * A corrupted cluster leaves its triangles flat shaded, without uv
+ */
+SurfaceData Triangle::GetSurfaceData(float U, float V, int attributes) const {
 
-    surface_data.normal = (U * trimesh_ptr->normal_array[B_index]) + (V * trimesh_ptr->normal_array[C_index]) + (W * trimesh_ptr->normal_array[A_index]);
+    if (trimesh_ptr->IsStreamed()) {
+        unsigned int slot;
+        std::shared_ptr<const GeometryCluster> cluster = trimesh_ptr->GetStream()->Acquire(triangle_index, slot);
 
-    //FIXME Take a look at the handling of models without tangents
-    if (trimesh_ptr->tangent_array.size() > 0)
-        surface_data.tangent = (U * trimesh_ptr->tangent_array[B_index]) + (V * trimesh_ptr->tangent_array[C_index]) + (W * trimesh_ptr->tangent_array[A_index]);
+        if (cluster == nullptr) {
+            Vec3 A, B, C;
+            GetVertices(A, B, C);
 
-    if (trimesh_ptr->bitangent_array.size() > 0)
-        surface_data.bitangent = (U * trimesh_ptr->bitangent_array[B_index]) + (V * trimesh_ptr->bitangent_array[C_index]) + (W * trimesh_ptr->bitangent_array[A_index]);
+            SurfaceData surface_data;
+            surface_data.normal = (B - A).cross(C - A);
+            surface_data.normal.normalize();
+            surface_data.uv = 0;
+            return surface_data;
+        }
 
-    surface_data.normal.normalize();
-    surface_data.tangent.normalize();
-    surface_data.bitangent.normalize();
+        const uint16_t* corners = &cluster->corner_array[3 * slot];
 
-    return surface_data;
+        return InterpolateSurfaceData(*cluster, corners[0], corners[1], corners[2], U, V, attributes);
+    }
+
+    return InterpolateSurfaceData(*trimesh_ptr, A_index, B_index, C_index, U, V, attributes);
 }
 
 BoundingBox Triangle::ComputeBBox() const {
@@ -112,6 +98,42 @@ Vec3 Triangle::GetCenter() const {
     return center;
 }
 
+/**
+ * The part of the triangle inside the slab is a polygon made of the vertices inside the slab
+ * and of the points where the edges cross the slab planes
+ */
+BoundingBox Triangle::ComputeClippedBBox(char axis, float min, float max) const {
+
+    BoundingBox bbox;
+
+    Vec3 vertices[3] = {
+            trimesh_ptr->pos_array[A_index],
+            trimesh_ptr->pos_array[B_index],
+            trimesh_ptr->pos_array[C_index]
+    };
+
+    for (int i = 0; i < 3; ++i) {
+
+        const Vec3& start = vertices[i];
+        const Vec3& end = vertices[(i + 1) % 3];
+
+        if (start[axis] >= min && start[axis] <= max)
+            bbox.ExtendsBy(start);
+
+        float planes[2] = {min, max};
+        for (float plane : planes) {
+            if ((start[axis] < plane && end[axis] > plane) || (start[axis] > plane && end[axis] < plane)) {
+                float t = (plane - start[axis]) / (end[axis] - start[axis]);
+                Vec3 point = start + (end - start) * t;
+                point[axis] = plane;
+                bbox.ExtendsBy(point);
+            }
+        }
+    }
+
+    return bbox;
+}
+
 std::ostream& operator<< (std::ostream& out, const Triangle& tri) {
     
     out << tri.A_index << " / " << tri.B_index << " / " << tri.C_index << "    " << endl;
@@ -124,3 +146,42 @@ std::ostream& operator<< (std::ostream& out, const Triangle& tri) {
     
     return out;
 }
+
+/**
+ * W = 1 - U - V is the weight of A
+ * @param vertices The mesh or the cluster the vertex indices are in
+ */
+template <typename Attributes>
+static SurfaceData InterpolateSurfaceData(const Attributes& vertices, unsigned int A, unsigned int B, unsigned int C, float U, float V, int attributes) {
+
+    SurfaceData surface_data;
+
+    float W = 1 - U - V;
+
+    surface_data.normal = (U * vertices.GetNormal(B)) + (V * vertices.GetNormal(C)) + (W * vertices.GetNormal(A));
+    surface_data.normal.normalize();
+
+    if (attributes & SURFACE_UV) {
+        if (vertices.HasUV() == false)
+            surface_data.uv = 0;
+        else
+            surface_data.uv = (U * vertices.GetUV(B)) + (V * vertices.GetUV(C)) + (W * vertices.GetUV(A));
+    }
+
+    //FIXME Take a look at the handling of models without tangents
+    if ((attributes & SURFACE_TANGENT_FRAME) && vertices.HasTangents()) {
+
+        Vec3 tangents[3], bitangents[3];
+        vertices.GetTangentFrame(A, tangents[0], bitangents[0]);
+        vertices.GetTangentFrame(B, tangents[1], bitangents[1]);
+        vertices.GetTangentFrame(C, tangents[2], bitangents[2]);
+
+        surface_data.tangent = (U * tangents[1]) + (V * tangents[2]) + (W * tangents[0]);
+        surface_data.bitangent = (U * bitangents[1]) + (V * bitangents[2]) + (W * bitangents[0]);
+
+        surface_data.tangent.normalize();
+        surface_data.bitangent.normalize();
+    }
+
+    return surface_data;
+}
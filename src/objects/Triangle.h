@@ -12,21 +12,22 @@ class Triangle : public Intersectable {
     unsigned int A_index;
     unsigned int B_index;
     unsigned int C_index;
+    int triangle_index;     // In the mesh, to find the cluster of a streamed mesh
 
 public:
 
     const TriMesh* trimesh_ptr;
 
-    Triangle(const unsigned int* index_pointer, const TriMesh* triMesh)
-            : trimesh_ptr{triMesh}
+    Triangle(const unsigned int* index_pointer, const TriMesh* triMesh, int triangle_index = -1)
+            : triangle_index{triangle_index}, trimesh_ptr{triMesh}
     {
         A_index = index_pointer[0];
         B_index = index_pointer[1];
         C_index = index_pointer[2];
     }
     
-    Triangle(const int* index_pointer, const TriMesh* triMesh)
-            : trimesh_ptr{triMesh}
+    Triangle(const int* index_pointer, const TriMesh* triMesh, int triangle_index = -1)
+            : triangle_index{triangle_index}, trimesh_ptr{triMesh}
     {
         A_index = (unsigned int) index_pointer[0];
         B_index = (unsigned int) index_pointer[1];
@@ -35,15 +36,29 @@ public:
 
     bool Intersect(const Ray& ray, float& dist_out) const override;
 
+    void GetVertices(Vec3& A, Vec3& B, Vec3& C) const {
+        A = trimesh_ptr->pos_array[A_index];
+        B = trimesh_ptr->pos_array[B_index];
+        C = trimesh_ptr->pos_array[C_index];
+    }
+
     SurfaceData GetSurfaceData(Vec3 pos, Vec3 ray_direction) const override;
 
+    /**
+     * @param U, V Barycentric weights of the second and third vertex, as given by the intersection test
+     * @param attributes The SurfaceAttributes to interpolate besides the normal
+     */
+    SurfaceData GetSurfaceData(float U, float V, int attributes) const;
+
 	BoundingBox ComputeBBox() const override;
 
 	Vec3 GetCenter() const override;
 
+    BoundingBox ComputeClippedBBox(char axis, float min, float max) const override;
+
     friend class OpenCLRenderer;
 
-    friend CLObject3D GetCLObject3D(const Object3D& object);
+    friend CLObject3D GetCLObject3D(const Primitive& primitive);
 
     friend std::ostream& operator<< (std::ostream& out, const Triangle& tri);
 };
@@ -2,6 +2,7 @@
 
 #include "core/Scene.h"
 #include "objects/Triangle.h"
+#include "core/GeometryStream.h"
 
 using std::vector;
 using std::map;
@@ -9,10 +10,9 @@ using std::set;
 using std::unique_ptr;
 using std::shared_ptr;
 
-static int SerializeBVH2(const Node2* node, vector<CLNode2>& bvh_node_array, vector<CLObject3D>& object_array, map<Object3D*, int>& obj_map);
-static int FindObject(Object3D* obj, map<Object3D*, int>& obj_map);
+static void SerializeBVH2(const BVH2* bvh, vector<CLNode2>& bvh_node_array);
 static void SetSkipPointers2(vector<CLNode2>& bvh_node_array);
-static int SetLastChildPointers2(CLNode2& node, vector<CLNode2>& node_array, int& node_count) ;
+static void SetSkipPointers2(vector<CLNode2>& bvh_node_array, int node_index, int skip_index);
 
 static char RegisterTexture(TextureUbyte* texture, map<TextureUbyte*, char>& texture_index_map);
 
@@ -20,13 +20,14 @@ template <typename T = float>
 static void SetTextureParameter(map<TextureUbyte*, char>& texture_index_map, const shared_ptr<Texture>& tex, char& tex_index, T* scalar = nullptr);
 
 CLBrdf GetCLBrdf(const Material* material, map<TextureUbyte*, char>& texture_index_map) ;
-CLObject3D GetCLObject3D(const Object3D& object);
+CLObject3D GetCLObject3D(const Primitive& primitive);
 
 SceneAdapter::SceneAdapter(const Scene* scene) {
 
-    map<Object3D*, int> obj_map = CreateCLObjectArray(object_array, scene->objects, scene->GetMaterialSet());
+    CreateCLObjectArray(object_array, scene->GetBVHPrimitives(), scene->GetMaterialSet());
     CreateTriangleDataArrays(scene->GetTriMeshes());
-    CreateBvhNodeArray(scene->bvh2, obj_map);
+    CreateBvhNodeArray(scene->bvh2);
+    CreateInstanceArray(scene);
 
     map<TextureUbyte*, char> texture_index_map = CreateBrdfArray(brdf_array, scene->GetMaterialSet());
     CreateTextureArray(texture_index_map);
@@ -38,40 +39,52 @@ SceneAdapter::SceneAdapter(const std::set<Material*>& material_set) {
     CreateBrdfArray(brdf_array, material_set);
 }
 
-SceneAdapter::SceneAdapter(vector<unique_ptr<Object3D>>& objects, const set<Material*>& material_set) {
+SceneAdapter::SceneAdapter(const vector<Primitive>& primitives, const set<Material*>& material_set) {
 
-    CreateCLObjectArray(object_array, objects, material_set);
+    CreateCLObjectArray(object_array, primitives, material_set);
 }
 
-map<Object3D*, int> SceneAdapter::CreateCLObjectArray(vector<CLObject3D>& object_array, const vector<unique_ptr<Object3D>>& objects, const set<Material*>& material_set) {
+/**
+ * The primitives are expected in the BVH reference order, a primitive referenced by several leaves is duplicated
+ * Each triangle of a mesh gets its own CLObject3D, the kernel has no notion of mesh objects
+ */
+void SceneAdapter::CreateCLObjectArray(vector<CLObject3D>& object_array, const vector<Primitive>& primitives, const set<Material*>& material_set) {
 
-    map<Object3D*, int> obj_map;
+    object_array.reserve(primitives.size());
 
-    for (int i = 0; i < int(objects.size()); ++i) {
+    for (int i = 0; i < int(primitives.size()); ++i) {
         
-        Object3D* object = objects[i].get();
+        const Primitive& primitive = primitives[i];
+        const Object3D* object = primitive.object;
         
-        CLObject3D cl_obj = GetCLObject3D(*object);
+        CLObject3D cl_obj = GetCLObject3D(primitive);
 
         cl_obj.emission = object->getEmissionIntensity() != -1 ? object->getEmission() : -1;
 
         // The index of the Material* in the MaterialSet should be the same as the index of
         // its CL counterpart in the cl_brdf array (because std::set is ordered)
-        const auto& it = material_set.find(object->material);
+        const auto& it = material_set.find(primitive.GetMaterial());
         cl_obj.material_index = short(distance(material_set.begin(), it));
 
         object_array.push_back(cl_obj);
-        obj_map.emplace(object, i);
     }
-
-    return obj_map;
 }
 
-CLObject3D GetCLObject3D(const Object3D& object) {
+CLObject3D GetCLObject3D(const Primitive& primitive) {
 
     CLObject3D cl_obj {};
 
-    Intersectable* shape = object.shape;
+    if (primitive.IsTriangle()) {
+        Triangle triangle = primitive.GetTriangle();
+        cl_obj.type = 3;
+        cl_obj.A_index = triangle.A_index;
+        cl_obj.B_index = triangle.B_index;
+        cl_obj.C_index = triangle.C_index;
+        cl_obj.has_uv  = triangle.trimesh_ptr->HasUV();
+        return cl_obj;
+    }
+
+    Intersectable* shape = primitive.object->shape;
 
     if (typeid(*shape) == typeid(Sphere)) {
         Sphere* sphere = static_cast<Sphere*>(shape);
@@ -85,14 +98,6 @@ CLObject3D GetCLObject3D(const Object3D& object) {
         cl_obj.pos = plane->origin;
         cl_obj.normal = plane->normal;
     }
-    else if (typeid(*shape) == typeid(Triangle)) {
-        Triangle* triangle = static_cast<Triangle*>(shape);
-        cl_obj.type = 3;
-        cl_obj.A_index = triangle->A_index;
-        cl_obj.B_index = triangle->B_index;
-        cl_obj.C_index = triangle->C_index;
-        cl_obj.has_uv  = triangle->trimesh_ptr->uv_array.empty() == false;
-    }
 
     return cl_obj;
 }
@@ -223,15 +228,33 @@ void SceneAdapter::CreateTextureInfoArray(map<TextureUbyte*, char>& texture_inde
 
 void SceneAdapter::CreateTriangleDataArrays(const set<const TriMesh*> trimeshes) {
 
+    bool compact_vertices = UsesCompactVertices(trimeshes);
+
     for (const auto& trimesh : trimeshes) {
 
         const auto& tri_pos_array = trimesh->pos_array;
+
+        for (size_t i = 0; i < tri_pos_array.size(); ++i) {
+            pos_array.push_back(CLVec4{tri_pos_array[i].x, tri_pos_array[i].y, tri_pos_array[i].z, 0});
+        }
+
+        if (trimesh->IsStreamed()) {
+            AppendStreamedAttributes(trimesh, compact_vertices);
+            continue;
+        }
+
+        // The encoded attributes are copied as is, the kernel decodes them
+        if (compact_vertices) {
+            packed_normal_array.insert(packed_normal_array.end(), trimesh->GetPackedNormalArray().begin(), trimesh->GetPackedNormalArray().end());
+            packed_uv_array.insert(packed_uv_array.end(), trimesh->GetPackedUVArray().begin(), trimesh->GetPackedUVArray().end());
+            continue;
+        }
+
         const auto& tri_normal_array = trimesh->normal_array;
         const auto& tri_uv_array = trimesh->uv_array;
 
-        for (size_t i = 0; i < tri_pos_array.size(); ++i) {
-            pos_array.   push_back(CLVec4{tri_pos_array[i].x   , tri_pos_array[i].y   , tri_pos_array[i].z   , 0});
-            normal_array.push_back(CLVec4{tri_normal_array[i].x, tri_normal_array[i].y, tri_normal_array[i].z, 1});
+        for (const auto& normal : tri_normal_array) {
+            normal_array.push_back(CLVec4{normal.x, normal.y, normal.z, 1});
         }
         for (const auto& uv : tri_uv_array) {
             uv_array.push_back(CLVec2{uv.x, uv.y});
@@ -239,98 +262,208 @@ void SceneAdapter::CreateTriangleDataArrays(const set<const TriMesh*> trimeshes)
     }
 }
 
-void SceneAdapter::CreateBvhNodeArray(BVH2* bvh_root, map<Object3D*, int>& obj_map) {
+/**
+ * The device arrays are indexed by the mesh vertices, so the clusters are read one at a time and scattered to them
+ * The clusters don't go through the stream residency, but the host arrays are whole until they are uploaded,
+ * out-of-core doesn't lower the memory of the OpenCL renderer
+ */
+void SceneAdapter::AppendStreamedAttributes(const TriMesh* trimesh, bool compact_vertices) {
+
+    const GeometryStream* stream = trimesh->GetStream();
+    size_t first_vertex = compact_vertices ? packed_normal_array.size() : normal_array.size();
+    size_t vertex_count = trimesh->GetVertexCount();
+
+    if (compact_vertices) {
+        packed_normal_array.resize(first_vertex + vertex_count);
+        if (stream->HasUV())
+            packed_uv_array.resize(first_vertex + vertex_count);
+    }
+    else {
+        normal_array.resize(first_vertex + vertex_count);
+        if (stream->HasUV())
+            uv_array.resize(first_vertex + vertex_count);
+    }
+
+    for (int i = 0; i < stream->GetClusterCount(); ++i) {
+
+        // The vertices of a corrupted cluster keep null attributes
+        std::unique_ptr<GeometryCluster> cluster = stream->ReadCluster(i);
+        if (cluster == nullptr)
+            continue;
+
+        for (size_t j = 0; j < cluster->vertex_indices.size(); ++j) {
+
+            size_t vertex = first_vertex + cluster->vertex_indices[j];
+
+            if (compact_vertices) {
+                packed_normal_array[vertex] = cluster->packed_normal_array[j];
+                if (stream->HasUV())
+                    packed_uv_array[vertex] = cluster->packed_uv_array[j];
+            }
+            else {
+                Vec3 normal = cluster->normal_array[j];
+                normal_array[vertex] = CLVec4{normal.x, normal.y, normal.z, 1};
+                if (stream->HasUV())
+                    uv_array[vertex] = CLVec2{cluster->uv_array[j].x, cluster->uv_array[j].y};
+            }
+        }
+    }
+}
+
+bool SceneAdapter::UsesCompactVertices(const set<const TriMesh*>& trimeshes) {
+
+    if (trimeshes.empty())
+        return false;
+
+    for (const auto& trimesh : trimeshes) {
+        if (trimesh->HasCompactAttributes() == false)
+            return false;
+    }
+
+    return true;
+}
+
+void SceneAdapter::CreateBvhNodeArray(BVH2* bvh_root) {
 
     bvh_node_array.reserve((size_t)bvh_root->GetNodeCount());
 
-    SerializeBVH2(bvh_root->GetRoot(), bvh_node_array, object_array, obj_map);
+    SerializeBVH2(bvh_root, bvh_node_array);
 
     SetSkipPointers2(bvh_node_array);
 }
 
-int SerializeBVH2(const Node2* node, vector<CLNode2>& bvh_node_array, vector<CLObject3D>& object_array, map<Object3D*, int>& obj_map) {
+/**
+ * The bottom levels are appended after the top level nodes, their indices shifted to their place in the node array
+ * and their leaves to the place of their objects in the object array
+ * The top level leaves reference instances, in the top level object order
+ * A scene without instances gets a single unused instance as the kernel argument can't be an empty buffer
+ */
+void SceneAdapter::CreateInstanceArray(const Scene* scene) {
 
-    CLNode2 cl_node;
-    cl_node.bbox.max = node->bbox.max;
-    cl_node.bbox.min = node->bbox.min;
-    cl_node.obj_index = FindObject(node->object, obj_map);
-    cl_node.left_child = -1;
-    cl_node.right_child = -1;
+    if (scene->instance_set == nullptr) {
+        instance_array.push_back(CLInstance {});
+        return;
+    }
 
-    bvh_node_array.push_back(cl_node);
+    const InstanceSet* instance_set = scene->instance_set;
+    const vector<unique_ptr<BVH2>>& bottom_levels = instance_set->GetBottomLevels();
 
-    int index = (int) (bvh_node_array.size() - 1);
+    vector<int> root_nodes(bottom_levels.size(), -1);
 
-    if (node->left_child)
-        bvh_node_array[index].left_child = SerializeBVH2(node->left_child.get(), bvh_node_array, object_array, obj_map);
+    for (size_t i = 0; i < bottom_levels.size(); ++i) {
 
-    if (node->right_child)
-        bvh_node_array[index].right_child = SerializeBVH2(node->right_child.get(), bvh_node_array, object_array, obj_map);
+        if (bottom_levels[i] == nullptr)
+            continue;
 
-    return index;
-}
+        vector<CLNode2> nodes;
+        nodes.reserve((size_t) bottom_levels[i]->GetNodeCount());
+        SerializeBVH2(bottom_levels[i].get(), nodes);
+        SetSkipPointers2(nodes);
 
-int FindObject(Object3D* obj, map<Object3D*, int>& obj_map) {
+        int node_offset = (int) bvh_node_array.size();
+        int object_offset = instance_set->GetBottomLevelObjectOffset((int) i);
 
-    if (obj == nullptr)
-        return -1;
+        // The skip pointers are stored as floats in the bbox padding, -1 ends the traversal
+        for (CLNode2& node : nodes) {
+            if (node.obj_index != -1) {
+                node.obj_index += object_offset;
+            }
+            else {
+                node.left_child += node_offset;
+                node.right_child += node_offset;
+            }
+            if (node.bbox.pad2 != -1.f)
+                node.bbox.pad2 += node_offset;
+        }
 
-    auto it = obj_map.find(obj);
-    if (it != obj_map.end()) {
-        return it->second;
+        root_nodes[i] = node_offset;
+        bvh_node_array.insert(bvh_node_array.end(), nodes.begin(), nodes.end());
     }
 
-    return -1;
-}
+    for (const Primitive& primitive : scene->bvh2->GetPrimitives()) {
 
-void SetSkipPointers2(vector<CLNode2>& bvh_node_array) {
+        const Instance* instance = static_cast<const Instance*>(primitive.object->shape);
+        const Matrix& world_to_object = instance->GetWorldToObject();
+
+        CLInstance cl_instance {};
+        for (int row = 0; row < 3; ++row) {
+            cl_instance.world_to_object[row] = {world_to_object[row][0], world_to_object[row][1], world_to_object[row][2], world_to_object[row][3]};
+        }
+        cl_instance.root_node = root_nodes[instance->GetSubMesh()];
 
-    int tmp = 0;
-    SetLastChildPointers2(bvh_node_array[0], bvh_node_array, tmp);
+        instance_array.push_back(cl_instance);
+    }
+}
 
-    bvh_node_array[0].bbox.pad2 = -1;
+/**
+ * Each BVH2 node maps to the CLNode2 of same index, so the device nodes keep the layout chosen for the CPU tree,
+ * and the cl object array is in the BVH reference order so the leaf object ranges are the same too
+ */
+void SerializeBVH2(const BVH2* bvh, vector<CLNode2>& bvh_node_array) {
 
-    for (size_t i = 0; i < bvh_node_array.size(); ++i) {
+    const vector<LinearNode2>& nodes = bvh->GetNodes();
 
-        CLNode2& node = bvh_node_array[i];
+    for (int i = 0; i < int(nodes.size()); ++i) {
 
-        // Only internal nodes
-        if (node.bbox.pad != -1.f)
-        {
-            // Keep last child index of this node
-            int temp = (int) node.bbox.pad;
+        const LinearNode2& node = nodes[i];
 
-            if (node.left_child >= 0 && node.right_child >= 0)
-                bvh_node_array[node.left_child].bbox.pad2 = node.right_child;
+        CLNode2 cl_node;
+        cl_node.bbox.max = node.max;
+        cl_node.bbox.min = node.min;
 
-            // Make the last child of this node point to this node sucessor (ths sibling of this node or -1 if root)
-            bvh_node_array[temp].bbox.pad2 = node.bbox.pad2;
+        if (node.object_count == 0) {
+            cl_node.obj_index = -1;
+            cl_node.obj_count = 0;
+            cl_node.left_child = node.first_child;
+            cl_node.right_child = node.first_child + 1;
+        }
+        else {
+            cl_node.obj_index = node.object_index;
+            cl_node.obj_count = node.object_count;
+            cl_node.left_child = -1;
+            cl_node.right_child = -1;
         }
+
+        bvh_node_array.push_back(cl_node);
     }
 }
 
-int SetLastChildPointers2(CLNode2& node, vector<CLNode2>& node_array, int& node_count) {
+/**
+ * Copy the bounds of a refitted BVH2 into its already serialized nodes
+ * The topology didn't change so the child indices and skip pointers are kept
+ */
+void SceneAdapter::UpdateBvhNodeBounds(const BVH2* bvh, vector<CLNode2>& bvh_node_array) {
 
-    int node_index = node_count;
-    node_count++;
+    const vector<LinearNode2>& nodes = bvh->GetNodes();
 
-    // Leaf node
-    if (node.obj_index != -1) {
-        node.bbox.pad = -1;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        bvh_node_array[i].bbox.min = nodes[i].min;
+        bvh_node_array[i].bbox.max = nodes[i].max;
     }
-    else {
+}
+
+void SetSkipPointers2(vector<CLNode2>& bvh_node_array) {
+    SetSkipPointers2(bvh_node_array, 0, -1);
+}
 
-        int last_child_index = -1;
-        if (node.left_child != -1)
-            last_child_index = SetLastChildPointers2(node_array[node.left_child], node_array, node_count);
+/**
+ * The skip pointer of a node is where the stackless traversal goes once done with its subtree:
+ * the right sibling for a left child, the skip pointer of the parent for a right child, -1 for the root
+ * They follow the tree rather than the memory order so they stay valid whatever the node layout
+ */
+void SetSkipPointers2(vector<CLNode2>& bvh_node_array, int node_index, int skip_index) {
 
-        if (node.right_child != -1)
-            last_child_index = SetLastChildPointers2(node_array[node.right_child], node_array, node_count);
+    CLNode2& node = bvh_node_array[node_index];
 
-        // This internal node point to its last child
-        node.bbox.pad = last_child_index;
-    }
+    node.bbox.pad = -1;
+    node.bbox.pad2 = skip_index;
+
+    if (node.obj_index != -1)
+        return;
 
-    return node_index;
+    int left_child = node.left_child;
+    int right_child = node.right_child;
 
+    SetSkipPointers2(bvh_node_array, left_child, right_child);
+    SetSkipPointers2(bvh_node_array, right_child, skip_index);
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "math/Vec3.h"
 #include "objects/Object3D.h"
 #include "core/BVHCommons.h"
+#include "core/Instance.h"
 
 typedef struct Scene Scene;
 typedef struct TriMesh TriMesh;
@@ -19,9 +20,13 @@ class SceneAdapter {
     std::vector<CLVec4> pos_array;
     std::vector<CLVec4> normal_array;
     std::vector<CLVec2> uv_array;
+    // Filled instead of normal_array and uv_array when the meshes have compact attributes
+    std::vector<uint32_t> packed_normal_array;
+    std::vector<uint32_t> packed_uv_array;
     std::vector<CLBrdf> brdf_array;
     std::vector<CLTextureInfo> info_array;
     std::vector<CLNode2> bvh_node_array;
+    std::vector<CLInstance> instance_array;
     std::vector<TextureUbyte*> texture_array;
     int texture_array_size = 0;
 
@@ -30,10 +35,14 @@ public:
     SceneAdapter() = default;
     SceneAdapter(const Scene* scene);
     SceneAdapter(const std::set<Material*>& material_set);
-    SceneAdapter(std::vector<std::unique_ptr<Object3D>>& objects, const std::set<Material*>& material_set);
+    SceneAdapter(const std::vector<Primitive>& primitives, const std::set<Material*>& material_set);
 
     static std::map<TextureUbyte*, char> CreateBrdfArray(std::vector<CLBrdf>& brdf_array, const std::set<Material*>& material_set);
-    static std::map<Object3D*, int> CreateCLObjectArray(std::vector<CLObject3D>& object_array, const std::vector<std::unique_ptr<Object3D>>& objects, const std::set<Material*>& material_set);
+    static void CreateCLObjectArray(std::vector<CLObject3D>& object_array, const std::vector<Primitive>& primitives, const std::set<Material*>& material_set);
+    static void UpdateBvhNodeBounds(const BVH2* bvh, std::vector<CLNode2>& bvh_node_array);
+
+    // The device gets the compact vertex layout when every mesh has it
+    static bool UsesCompactVertices(const std::set<const TriMesh*>& trimeshes);
 
     const std::vector<CLObject3D>& GetObjectArray() const {
         return object_array;
@@ -55,6 +64,14 @@ public:
         return uv_array;
     }
 
+    const std::vector<uint32_t>& GetPackedNormalArray() const {
+        return packed_normal_array;
+    }
+
+    const std::vector<uint32_t>& GetPackedUVArray() const {
+        return packed_uv_array;
+    }
+
     const std::vector<CLTextureInfo>& GetTextureInfoArray() const {
         return info_array;
     }
@@ -63,6 +80,10 @@ public:
         return bvh_node_array;
     }
 
+    const std::vector<CLInstance>& GetInstanceArray() const {
+        return instance_array;
+    }
+
     const std::vector<TextureUbyte*>& GetTextureArray() const {
         return texture_array;
     }
@@ -75,7 +96,11 @@ private:
 
     void CreateTriangleDataArrays(const std::set<const TriMesh*> trimeshes);
 
-    void CreateBvhNodeArray(BVH2* bvh_root, std::map<Object3D*, int>& obj_map);
+    void AppendStreamedAttributes(const TriMesh* trimesh, bool compact_vertices);
+
+    void CreateBvhNodeArray(BVH2* bvh_root);
+
+    void CreateInstanceArray(const Scene* scene);
 
     void CreateTextureInfoArray(std::map<TextureUbyte*, char>& texture_index_map);
 
@@ -33,7 +33,7 @@ protected:
     bool CLEAR_ACCUM_BIT = false;
     short frame_number = 0;
     Chronometer render_chrono;
-    Object3D* selected_object = nullptr;
+    Primitive selected_primitive;
     bool reset_camera = false;
     bool dump_screenshot = false;
 
@@ -52,8 +52,8 @@ public:
 
     virtual void Update();
 
-    Object3D* GetSelectedObject() {
-        return selected_object;
+    const Primitive& GetSelectedPrimitive() const {
+        return selected_primitive;
     }
 
     unsigned int GetFilmTexture() const {
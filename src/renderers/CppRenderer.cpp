@@ -6,10 +6,14 @@
 #include "objects/Plane.h"
 #include "objects/Sphere.h"
 #include "BaseRenderer.h"
+#include "core/RayPacket.h"
 
 using std::cout;
 using std::endl;
 
+// Rays traced at most by a path, camera ray included
+static const int PATH_MAX_RAY_COUNT = 8;
+
 #define sRGB_LUT_LENGTH (2 << 15)
 unsigned char sRGB_table[sRGB_LUT_LENGTH];
 
@@ -47,65 +51,113 @@ void CppRenderer::Render() {
     float fov_factor = tanf(DEG_TO_RAD(options->fov / 2.f));
 
     bool debug_pixel = false;
-    
+
+    // The packets hold the BVH2 hits only, an instanced scene also needs the instance hit
+    bool use_ray_packets = options->use_ray_packets && scene->instance_set == nullptr;
+
+    // Without emitted light, the last ray of a path can only bring the environment light, whatever it hits first
+    trace_last_ray_as_occlusion = options->use_emissive_lighting == false || scene->HasEmissiveObjects() == false;
+
     #if defined(USE_OPENMP) && not defined(DEBUG_BUILD)
         #pragma message "OpenMP Enabled for C++"
     #pragma omp parallel for schedule(dynamic, 1)
     #else
         #pragma message "OpenMP Disabled for C++"
     #endif
-    for (int y = 0; y < film_height; ++y) {
+    for (int tile_y = 0; tile_y < film_height; tile_y += RayPacket::HEIGHT) {
+
+        for (int tile_x = 0; tile_x < film_width; tile_x += RayPacket::WIDTH) {
+
+            // The camera rays of a tile, traced together
+            RayPacket packet;
+            for (int lane = 0; lane < RayPacket::SIZE; ++lane) {
+                int x = tile_x + lane % RayPacket::WIDTH;
+                int y = tile_y + lane / RayPacket::WIDTH;
+                if (x < film_width && y < film_height) {
+                    Ray ray{camera_controls->GetPosition(), x, y, film_width, film_height, ratio, fov_factor};
+                    ray.direction = camera_controls->GetRotation() * ray.direction;
+                    packet.SetRay(lane, ray, 99999999.f);
+                }
+            }
 
-        for (int x = 0; x < film_width; ++x) {
+            if (use_ray_packets)
+                scene->bvh2->FindNearestIntersection(packet);
 
-            Ray ray{camera_controls->GetPosition(), x, y, film_width, film_height, ratio, fov_factor};
-            ray.direction = camera_controls->GetRotation() * ray.direction;
-            Vec3 pixel;
-            for (int i = 0; i < options->sample_count; ++i) {
-                pixel += Raytrace(ray, debug_pixel) * (1.f / options->sample_count);
-//                pixel += Raytrace_Recursive(ray) * (1.f / options->sample_count);
-            }
+            for (int lane = 0; lane < RayPacket::SIZE; ++lane) {
 
-            accum_texture[y * film_width + x] *= CLEAR_ACCUM_BIT;
-            accum_texture[y * film_width + x] += pixel;
+                if ((packet.active_mask & (1 << lane)) == 0)
+                    continue;
 
-            pixel = accum_texture[y * film_width + x] / frame_number;
+                int x = tile_x + lane % RayPacket::WIDTH;
+                int y = tile_y + lane / RayPacket::WIDTH;
+                Ray ray = packet.GetRay(lane);
 
-//            pixel = env_map->Sample(float(x) / width, float(y) / height);
+                Vec3 pixel;
+                for (int i = 0; i < options->sample_count; ++i) {
+                    if (use_ray_packets)
+                        pixel += Raytrace(ray, packet.GetHit(lane), debug_pixel) * (1.f / options->sample_count);
+                    else
+                        pixel += Raytrace(ray, debug_pixel) * (1.f / options->sample_count);
+//                    pixel += Raytrace_Recursive(ray) * (1.f / options->sample_count);
+                }
 
-            pixel = pixel.clamp(0, 1);
-//            pixel = linear_to_sRGB(pixel); // CL uses 1/2.2
-            pixel = pixel.pow(1.f / 2.2f);
-            pixel *= 255;
+                accum_texture[y * film_width + x] *= CLEAR_ACCUM_BIT;
+                accum_texture[y * film_width + x] += pixel;
 
-            pixels[y * film_width + x] = (0xFF000000 | (Uint8(pixel.x) << 16) | (Uint8(pixel.y) << 8) | (Uint8(pixel.z) << 0));
+                pixel = accum_texture[y * film_width + x] / frame_number;
+
+//                pixel = env_map->Sample(float(x) / width, float(y) / height);
+
+                pixel = pixel.clamp(0, 1);
+//                pixel = linear_to_sRGB(pixel); // CL uses 1/2.2
+                pixel = pixel.pow(1.f / 2.2f);
+                pixel *= 255;
+
+                pixels[y * film_width + x] = (0xFF000000 | (Uint8(pixel.x) << 16) | (Uint8(pixel.y) << 8) | (Uint8(pixel.z) << 0));
+            }
         }
     }
 
 }
 
 Vec3 CppRenderer::Raytrace(Ray ray, bool debug_pixel) {
+    return Raytrace(ray, HitRecord {-1.f, Primitive {}}, debug_pixel);
+}
+
+/**
+ * @param primary_hit Hit of the camera ray when it was already traced, a negative distance to trace it here
+ */
+Vec3 CppRenderer::Raytrace(Ray ray, const HitRecord& primary_hit, bool debug_pixel) {
 
     Vec3 material {1};
 
 //    for (int i = 0; i < 4; ++i) {
-    for (int i = 0; i < 8; ++i) {
+    for (int i = 0; i < PATH_MAX_RAY_COUNT; ++i) {
 //    for (int i = 0; i < options->bounce_cout + 1; ++i) {
 
-        float dist = 99999999.f;
-        Object3D* hit_object = nullptr;
+        HitRecord hit;
+        const Instance* hit_instance = nullptr;
 
-//        FindNearestObject(ray, dist, hit_object, false);
-//        scene->bvh.FindNearestIntersection(ray, dist, hit_object);
-//        if (options->debug)
-            scene->bvh2->FindNearestIntersectionOpti(ray, dist, hit_object);
-//        else
-//            scene->bvh2->FindNearestIntersection(ray, dist, hit_object);
+//        FindNearestObject(ray, dist, hit, false);
+//        scene->bvh.FindNearestIntersection(ray, dist, hit);
+        if (i == 0 && primary_hit.dist >= 0) {
+            hit = primary_hit;
+        }
+        else if (i == PATH_MAX_RAY_COUNT - 1 && trace_last_ray_as_occlusion) {
+            // Any-hit query, a blocked environment ends the path as a non emissive hit would
+            if (options->use_distant_env_lighting == false || scene->Occluded(ray, hit.dist))
+                return 0;
 
-//        bvh.DebugIntersection(ray, dist, hit_object, options->depth_target);
+            return material * scene->env_map->SampleEnvmap(ray.direction);
+        }
+        else {
+            scene->FindNearestIntersection(ray, hit, hit_instance);
+        }
+
+//        bvh.DebugIntersection(ray, dist, hit, options->depth_target);
 
         // The current ray didn't hit any objects, return a "sky" color
-        if (hit_object == nullptr) {
+        if (hit.primitive.object == nullptr) {
 
             if (options->use_distant_env_lighting) {
 //                return material * Vec3{0.18, 0.18, 0.18};
@@ -117,8 +169,8 @@ Vec3 CppRenderer::Raytrace(Ray ray, bool debug_pixel) {
         }
 
         // The current ray hit an emissive material, return its emitted light
-        if (hit_object->getEmissionIntensity() != -1) {
-            return material * hit_object->getEmission() * options->use_emissive_lighting;
+        if (hit.primitive.object->getEmissionIntensity() != -1) {
+            return material * hit.primitive.object->getEmission() * options->use_emissive_lighting;
         }
 
         // Optim if no shading
@@ -127,21 +179,23 @@ Vec3 CppRenderer::Raytrace(Ray ray, bool debug_pixel) {
 
 
         // Get information about the surface hit by the current ray
-        Vec3 pos = ray.origin + ray.direction * dist;
+        Vec3 pos = ray.origin + ray.direction * hit.dist;
 
-        SurfaceData surface_data = hit_object->GetSurfaceData(pos, ray.direction);
+        // Only the attributes read by the hit material are interpolated
+        SurfaceData surface_data = (hit_instance != nullptr) ? hit_instance->GetSurfaceData(hit, ray)
+                                                             : hit.GetSurfaceData(ray);
 
         if (options->depth_target) {
-            return ((hit_object->GetCenter() + scene->debug_scale) / (scene->debug_scale * 2));
+            return ((hit.primitive.GetCenter() + scene->debug_scale) / (scene->debug_scale * 2));
         }
-//        return ((hit_object->GetCenter() + 7) / 14) * cos(normal.dot(ray.direction));
+//        return ((hit.GetCenter() + 7) / 14) * cos(normal.dot(ray.direction));
 
         Vec3 outgoing_dir = -ray.direction;
         float pdf = 1;
 
         Vec3 shading_normal = surface_data.normal;
 
-        BrdfStack* stack = hit_object->material->CreateBSDF(surface_data, shading_normal);
+        BrdfStack* stack = surface_data.material->CreateBSDF(surface_data, shading_normal);
         Vec3 f = stack->Sample_f(outgoing_dir, shading_normal, ray.direction, pdf, options->brdf_bitfield);
         delete stack;
 
@@ -181,9 +235,10 @@ Vec3 CppRenderer::Raytrace(Ray ray, bool debug_pixel) {
 Vec3 CppRenderer::Raytrace_Recursive(Ray ray, const int bounce_depth) {
 
     float dist = 99999999.f;
-    Object3D* hit_object = nullptr;
+    Primitive hit;
 
-    FindNearestObject(ray, dist, hit_object, false);
+    FindNearestObject(ray, dist, hit, false);
+    Object3D* hit_object = hit.object;
 
     // No intersection
     if (hit_object == nullptr) {
@@ -204,7 +259,7 @@ Vec3 CppRenderer::Raytrace_Recursive(Ray ray, const int bounce_depth) {
     Vec3 pos = ray.origin + ray.direction * dist;
     SurfaceData surface_data;
 //    Vec3 normal, uv, tangent, bitangent;
-    surface_data = hit_object->GetSurfaceData(pos, ray.direction);
+    surface_data = hit.GetSurfaceData(pos, ray.direction);
 
     //region [DEACTIVATED] Explicit light sampling
 #if 0
@@ -217,7 +272,7 @@ Vec3 CppRenderer::Raytrace_Recursive(Ray ray, const int bounce_depth) {
 
         Ray shadow_ray {pos, hit_to_light};
 
-        bool visible = !FindNearestObject(shadow_ray, light_dist, hit_object, true);
+        bool visible = !FindNearestObject(shadow_ray, light_dist, hit, true);
         direct_light += visible * intensity * std::max(normal.dot(hit_to_light), 0.f);
     }
 #endif
@@ -275,23 +330,30 @@ Vec3 CppRenderer::Raytrace_Recursive(Ray ray, const int bounce_depth) {
 }
 //endregion
 
-bool CppRenderer::FindNearestObject(const Ray& ray, float& nearest_dist, Object3D*& hit_object, bool is_occlusion_test) const {
+bool CppRenderer::FindNearestObject(const Ray& ray, float& nearest_dist, Primitive& hit_primitive, bool is_occlusion_test) const {
 
-    hit_object = nullptr;
+    hit_primitive = Primitive {};
 
+    // No object to return, any hit closer than nearest_dist will do
+    if (is_occlusion_test)
+        return scene->Occluded(ray, nearest_dist);
+
+    std::vector<Primitive> primitives;
     for (const auto& item: scene->objects) {
-        float dist = 99999999;
+        primitives.clear();
+        item->AppendPrimitives(primitives);
 
-        if (item->Intersect(ray, dist) && (dist < nearest_dist)) {
-            hit_object = item.get();
-            nearest_dist = dist;
+        for (const Primitive& primitive : primitives) {
+            float dist = 99999999;
 
-            if (is_occlusion_test)
-                return true;
+            if (primitive.Intersect(ray, dist) && (dist < nearest_dist)) {
+                hit_primitive = primitive;
+                nearest_dist = dist;
+            }
         }
     }
 
-    return (hit_object != nullptr);
+    return (hit_primitive.object != nullptr);
 }
 
 void CppRenderer::TracePixel(Vec3 pixel, bool picking) {
@@ -306,23 +368,22 @@ void CppRenderer::TracePixel(Vec3 pixel, bool picking) {
     ray.direction = camera_controls->GetRotation() * ray.direction;
 
     if (picking) {
-        Object3D* hit_object = nullptr;
-        float dist = 999999999.f;
+        HitRecord hit;
         int triangle_index = -1;
         int submesh_index = -1;
         cout << "Trace Pixel: " << int(pixel.x) << ", " << int(pixel.y) << endl;
         cout << "Film size: " << width << " x " << height << endl;
 //        cout << "Ray origin: " << ray.origin << " direction: " << ray.direction << endl;
-//        if (FindNearestObject(ray, dist, hit_object, triangle_index, submesh_index) == true) {
-//        if (scene->bvh.FindNearestIntersection(ray, dist, hit_object) == true && hit_object) {
-        if (scene->bvh2->FindNearestIntersectionOpti(ray, dist, hit_object) == true && hit_object) {
-            selected_object = hit_object;
-//            cout << "Hit object: " << typeid(*hit_object->shape).name() << endl;
+//        if (FindNearestObject(ray, dist, hit, triangle_index, submesh_index) == true) {
+//        if (scene->bvh.FindNearestIntersection(ray, dist, hit) == true && hit.object) {
+        if (scene->FindNearestIntersection(ray, hit) == true && hit.primitive.object) {
+            selected_primitive = hit.primitive;
+//            cout << "Hit object: " << typeid(*hit.object->shape).name() << endl;
 //            cout << "Hitpos: " << (ray.origin + ray.direction * dist) << endl;
-//            if (typeid(*hit_object->shape) == typeid(Triangle))
-//                cout << "Triangle center: " << hit_object->GetCenter() << endl;
+//            if (hit.IsTriangle())
+//                cout << "Triangle center: " << hit.GetCenter() << endl;
         } else {
-            selected_object = nullptr;
+            selected_primitive = Primitive {};
         }
     }
     else {
@@ -7,6 +7,9 @@ class CppRenderer : public BaseRenderer {
 
     std::vector<Vec3> accum_texture;
 
+    // Set for each frame, the last ray of a path then only tests if the environment is visible
+    bool trace_last_ray_as_occlusion = false;
+
 public:
 
     CppRenderer() = default;
@@ -22,7 +25,10 @@ public:
 
     Vec3 Raytrace(Ray ray, bool debug_pixel = false);
 
-    bool FindNearestObject(const Ray& ray, float& nearest_dist, Object3D*& hit_object, bool is_occlusion_test) const;
+    // Path starting with an already traced camera ray
+    Vec3 Raytrace(Ray ray, const HitRecord& primary_hit, bool debug_pixel = false);
+
+    bool FindNearestObject(const Ray& ray, float& nearest_dist, Primitive& hit_primitive, bool is_occlusion_test) const;
 
     Vec3 Raytrace_Recursive(Ray ray, const int bounce_depth = 0);
 
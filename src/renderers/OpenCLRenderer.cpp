@@ -25,7 +25,9 @@ using std::vector;
 using std::set;
 using std::map;
 
-Program CreateProgram(cl::Context& context, cl::CommandQueue& queue, cl::Device& device, const Options* options) ;
+Program CreateProgram(cl::Context& context, cl::CommandQueue& queue, cl::Device& device, const Options* options, bool use_instancing, bool use_quantized_bvh, int quantized_stack_size, bool use_compact_vertices) ;
+
+static string GetQuantizedStackSizeOption(int stack_size);
 
 OpenCLRenderer::OpenCLRenderer(Scene* scene, SDL_Window* pWindow, Film* film, CameraControls* pControls, Options* options,
                                int platform_index, int device_index)
@@ -65,7 +67,11 @@ OpenCLRenderer::OpenCLRenderer(Scene* scene, SDL_Window* pWindow, Film* film, Ca
     context = cl::Context {device, nullptr, debugCallback};
     queue = cl::CommandQueue {context, device};
 
-    program = CreateProgram(context, queue, device, options);
+    use_instancing = scene->instance_set != nullptr;
+    use_quantized_bvh = SceneUsesQuantizedBVH();
+    quantized_stack_size = GetSceneQuantizedStackSize();
+    use_compact_vertices = SceneUsesCompactVertices();
+    program = CreateProgram(context, queue, device, options, use_instancing, use_quantized_bvh, quantized_stack_size, use_compact_vertices);
 
     size_t object_count = scene->objects.size();
 
@@ -117,16 +123,16 @@ void OpenCLRenderer::TracePixel(Vec3 pixel, bool picking) {
 
     queue.enqueueWriteBuffer(coord_input_buffer, CL_TRUE, 0, sizeof(float) * 2, &pixel);
 
-    cl::make_kernel<cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&> kernel(program.prog, "Intersect");
+    cl::make_kernel<cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&, cl::Buffer&> kernel(program.prog, "Intersect");
     cl::EnqueueArgs enqueueArgs(queue, cl::NDRange(width, height));
-    kernel(enqueueArgs, hit_object_output_buffer, coord_input_buffer, bvh_node_buffer, object_buffer, pos_buffer, normal_buffer, options_buffer).wait();
+    kernel(enqueueArgs, hit_object_output_buffer, coord_input_buffer, bvh_node_buffer, instance_buffer, object_buffer, pos_buffer, normal_buffer, options_buffer).wait();
 
     queue.enqueueReadBuffer(hit_object_output_buffer, CL_TRUE, 0, sizeof(int), &hit_object_index);
 
     if (hit_object_index == -1) {
-        selected_object = nullptr;
-    } else if (hit_object_index < int(scene->objects.size())) {
-        selected_object = scene->objects[hit_object_index].get();
+        selected_primitive = Primitive {};
+    } else if (hit_object_index < (int) scene->GetBVHPrimitives().size()) {
+        selected_primitive = scene->GetBVHPrimitives()[hit_object_index];
     }
 }
 
@@ -157,6 +163,9 @@ void OpenCLRenderer::Update() {
     if (scene->model_has_changed) {
         UpdateSceneBuffers();
     }
+    else if (scene->bounds_have_changed) {
+        UpdateSceneBounds();
+    }
 
     // TODO: Send an SDL_Event containing the changed object to avoid reloading the full arrays ?
     if (scene->material_has_changed) {
@@ -174,7 +183,7 @@ void OpenCLRenderer::Update() {
     UpdateOptionsBuffer();
 }
 
-Program CreateProgram(cl::Context& context, cl::CommandQueue& queue, cl::Device& device, const Options* options) {
+Program CreateProgram(cl::Context& context, cl::CommandQueue& queue, cl::Device& device, const Options* options, bool use_instancing, bool use_quantized_bvh, int quantized_stack_size, bool use_compact_vertices) {
 
     set<string> build_options = {
             "-cl-std=CL1.2",
@@ -187,6 +196,14 @@ Program CreateProgram(cl::Context& context, cl::CommandQueue& queue, cl::Device&
 
     if (options->use_bvh)
         build_options.insert("-D USE_BVH");
+    if (use_instancing)
+        build_options.insert("-D USE_INSTANCING");
+    if (use_quantized_bvh) {
+        build_options.insert("-D USE_QUANTIZED_BVH");
+        build_options.insert(GetQuantizedStackSizeOption(quantized_stack_size));
+    }
+    if (use_compact_vertices)
+        build_options.insert("-D USE_COMPACT_VERTICES");
 //    build_options.insert("-cl-opt-disable");
 //    build_options.insert("-src-in-ptx");
 //    build_options.insert("-cl-nv-opt-level=0");
@@ -244,6 +261,7 @@ void OpenCLRenderer::SetKernelArguments(cl::Kernel& kernel) const {
     kernel.setArg(9, env_map_image);
     kernel.setArg(10, image_buffer);
     kernel.setArg(11, image_info_buffer);
+    kernel.setArg(12, instance_buffer);
 }
 
 void OpenCLRenderer::CreateEnvMapImage(unique_ptr<TextureFloat>& env_map) {
@@ -271,19 +289,64 @@ void OpenCLRenderer::UpdateFilmBuffers() {
     render_kernel.setArg(1, accum_buffer);
 }
 
+/**
+ * The instanced traversal only knows the full precision nodes
+ */
+bool OpenCLRenderer::SceneUsesQuantizedBVH() const {
+    return scene->use_quantized_bvh && scene->quantized_bvh2 != nullptr && scene->instance_set == nullptr;
+}
+
+/**
+ * The quantized traversal stacks are sized for the encoded tree, 0 when the scene doesn't use it
+ */
+int OpenCLRenderer::GetSceneQuantizedStackSize() const {
+    return SceneUsesQuantizedBVH() ? scene->quantized_bvh2->GetTraversalStackSize() : 0;
+}
+
+string GetQuantizedStackSizeOption(int stack_size) {
+    return "-D QUANTIZED_STACK_SIZE=" + std::to_string(stack_size);
+}
+
+/**
+ * The device vertex layout follows the loaded meshes, the scene option only applies to the next model loaded
+ */
+bool OpenCLRenderer::SceneUsesCompactVertices() const {
+    return SceneAdapter::UsesCompactVertices(scene->GetTriMeshes());
+}
+
 void OpenCLRenderer::CreateSceneBuffers(const Scene* scene) {
 
     SceneAdapter adapter = SceneAdapter {scene};
 
     object_buffer = CreateBuffer(adapter.GetObjectArray(), COPY_TO_DEVICE_FLAGS);
-    bvh_node_buffer = CreateBuffer(adapter.GetBvhNodeArray(), COPY_TO_DEVICE_FLAGS);
+    bvh_node_array = adapter.GetBvhNodeArray();
+
+    // The quantized nodes have the same layout on both sides and reference the same object array
+    if (SceneUsesQuantizedBVH()) {
+        bvh_node_buffer = CreateBuffer(scene->quantized_bvh2->GetNodes(), COPY_TO_DEVICE_FLAGS);
+        cout << scene->quantized_bvh2->GetNodeMemory() / 1024 << " Ko of quantized nodes written to CL device instead of "
+             << bvh_node_array.size() * sizeof(CLNode2) / 1024 << " Ko" << endl;
+    }
+    else {
+        bvh_node_buffer = CreateBuffer(bvh_node_array, COPY_TO_DEVICE_FLAGS);
+    }
+    instance_buffer = CreateBuffer(adapter.GetInstanceArray(), COPY_TO_DEVICE_FLAGS);
 
     if (scene->GetVertexCount() > 0) {
         pos_buffer = CreateBuffer(adapter.GetPosArray(), COPY_TO_DEVICE_FLAGS);
-        normal_buffer = CreateBuffer(adapter.GetNormalArray(), COPY_TO_DEVICE_FLAGS);
+        if (SceneUsesCompactVertices())
+            normal_buffer = CreateBuffer(adapter.GetPackedNormalArray(), COPY_TO_DEVICE_FLAGS);
+        else
+            normal_buffer = CreateBuffer(adapter.GetNormalArray(), COPY_TO_DEVICE_FLAGS);
     }
 
-    if (adapter.GetUvArray().size() > 0) {
+    // Two halfs per vertex, read as a half2 by the kernel
+    if (adapter.GetPackedUVArray().size() > 0) {
+        uv_buffer = CreateBuffer(adapter.GetPackedUVArray(), COPY_TO_DEVICE_FLAGS);
+        cout << (adapter.GetPackedNormalArray().size() + adapter.GetPackedUVArray().size()) * sizeof(uint32_t) / 1024
+             << " Ko of compact normals and uvs written to CL device" << endl;
+    }
+    else if (adapter.GetUvArray().size() > 0) {
         uv_buffer = CreateBuffer(adapter.GetUvArray(), COPY_TO_DEVICE_FLAGS);
     }
 
@@ -323,6 +386,25 @@ void OpenCLRenderer::UpdateSceneBuffers() {
 
     cout << "SceneBuffers created in " << chrono.GetSeconds() << " s" << endl;
 
+    // The instanced and quantized traversals and the compact vertex decoding are compiled in only for the scenes that need them
+    bool scene_uses_instancing = scene->instance_set != nullptr;
+    bool scene_uses_quantized_bvh = SceneUsesQuantizedBVH();
+    int scene_quantized_stack_size = GetSceneQuantizedStackSize();
+    bool scene_uses_compact_vertices = SceneUsesCompactVertices();
+    if (scene_uses_instancing != use_instancing || scene_uses_quantized_bvh != use_quantized_bvh ||
+        scene_quantized_stack_size != quantized_stack_size || scene_uses_compact_vertices != use_compact_vertices) {
+        program.SetBuildOption(GetQuantizedStackSizeOption(quantized_stack_size).c_str(), false);
+        use_instancing = scene_uses_instancing;
+        use_quantized_bvh = scene_uses_quantized_bvh;
+        quantized_stack_size = scene_quantized_stack_size;
+        use_compact_vertices = scene_uses_compact_vertices;
+        program.SetBuildOption("-D USE_INSTANCING", use_instancing);
+        program.SetBuildOption("-D USE_QUANTIZED_BVH", use_quantized_bvh);
+        program.SetBuildOption(GetQuantizedStackSizeOption(quantized_stack_size).c_str(), use_quantized_bvh);
+        program.SetBuildOption("-D USE_COMPACT_VERTICES", use_compact_vertices);
+        UpdateRenderKernel();
+    }
+
     SetKernelArguments(render_kernel);
 
     clOptions.sphere_count = 0;
@@ -331,6 +413,31 @@ void OpenCLRenderer::UpdateSceneBuffers() {
     last_check = SDL_GetTicks();
 }
 
+/**
+ * Objects moved or resized without changing the BVH topology, so the existing buffers keep their size
+ * Only the node bounds and the object array, which holds the sphere and plane positions, are written again
+ */
+void OpenCLRenderer::UpdateSceneBounds() {
+
+    Chronometer chrono;
+
+    if (use_quantized_bvh) {
+        // Encoded again by the refit, with the same node count
+        const vector<QuantizedNode2>& nodes = scene->quantized_bvh2->GetNodes();
+        queue.enqueueWriteBuffer(bvh_node_buffer, CL_TRUE, 0, sizeof(QuantizedNode2) * nodes.size(), nodes.data());
+    }
+    else {
+        SceneAdapter::UpdateBvhNodeBounds(scene->bvh2, bvh_node_array);
+        queue.enqueueWriteBuffer(bvh_node_buffer, CL_TRUE, 0, sizeof(CLNode2) * bvh_node_array.size(), bvh_node_array.data());
+    }
+
+    vector<CLObject3D> object_array;
+    SceneAdapter::CreateCLObjectArray(object_array, scene->GetBVHPrimitives(), scene->GetMaterialSet());
+    queue.enqueueWriteBuffer(object_buffer, CL_TRUE, 0, sizeof(CLObject3D) * object_array.size(), object_array.data());
+
+    cout << "Node bounds and objects written in " << chrono.GetMilliseconds() << " ms" << endl;
+}
+
 void OpenCLRenderer::UpdateObjectBuffer() {
 
     static uint32_t last_check = 0;
@@ -343,7 +450,7 @@ void OpenCLRenderer::UpdateObjectBuffer() {
     
     Chronometer chrono;
 
-    SceneAdapter adapter {scene->objects, scene->GetMaterialSet()};
+    SceneAdapter adapter {scene->GetBVHPrimitives(), scene->GetMaterialSet()};
 
     cout << "SceneAdapter created in " << chrono.GetSeconds() << " s" << endl;
 
@@ -389,10 +496,12 @@ void OpenCLRenderer::UpdateOptionsBuffer() {
     clOptions.brdf_bitfield            = options->brdf_bitfield;
     clOptions.use_tonemapping          = options->use_tonemapping;
 //    clOptions.triangle_count           = std::min(100, scene->GetTriangleCount());
-    clOptions.object_count             = int(scene->objects.size());
+    clOptions.object_count             = (int) scene->GetBVHPrimitives().size();
     clOptions.sample_count             = options->sample_count;
     clOptions.bounce_count             = options->bounce_cout;
     clOptions.debug                    = debug;
+    // The kernel then traces the last ray of a path as an any-hit query, like the C++ renderer
+    clOptions.trace_last_ray_as_occlusion = options->use_emissive_lighting == false || scene->HasEmissiveObjects() == false;
     clOptions.accum_clear_bit          = CLEAR_ACCUM_BIT;
     clOptions.frame_number             = frame_number;
     clOptions.fov                      = tanf(DEG_TO_RAD(options->fov / 2.f));
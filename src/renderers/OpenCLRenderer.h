@@ -28,6 +28,7 @@ struct CLOptions {
     char sphere_count;
     char plane_count;
     char debug;
+    char trace_last_ray_as_occlusion;
 };
 
 class OpenCLRenderer : public BaseRenderer {
@@ -44,6 +45,7 @@ private:
     cl::Buffer accum_buffer;
     cl::Buffer object_buffer;
     cl::Buffer bvh_node_buffer;
+    cl::Buffer instance_buffer;
     cl::Buffer pos_buffer;
     cl::Buffer normal_buffer;
     cl::Buffer uv_buffer;
@@ -54,9 +56,16 @@ private:
     cl::Image2D env_map_image;
     CLOptions clOptions;
 
+    // Host copy of the node buffer, a refit only rewrites the bounds and keeps the skip pointers stored in their padding
+    std::vector<CLNode2> bvh_node_array;
+
     bool reload_kernel = false;
     bool update_option = false;
     bool use_fast_math = true;
+    bool use_instancing = false;
+    bool use_quantized_bvh = false;
+    int quantized_stack_size = 0;
+    bool use_compact_vertices = false;
 
     const int MAX_IMAGE_COUNT = 200;
     unsigned char image_count = 0;
@@ -96,8 +105,15 @@ private:
     void CreateEnvMapImage(std::unique_ptr<TextureFloat>& env_map);
     void UpdateEnvMap();
 
+    bool SceneUsesQuantizedBVH() const;
+
+    int GetSceneQuantizedStackSize() const;
+
+    bool SceneUsesCompactVertices() const;
+
     void CreateSceneBuffers(const Scene* scene);
     void UpdateSceneBuffers();
+    void UpdateSceneBounds();
 
     void CreateFilmBuffers();
     void UpdateFilmBuffers();